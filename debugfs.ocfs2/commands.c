@@ -171,7 +171,7 @@ static struct command commands[] = {
 	},
 	{ "findpath",
 		do_locate,
-		"findpath <block#>",
+		"findpath [-r] <block#> ...",
 		"List one pathname of the inode/lockname",
 	},
 	{ "frag",
@@ -211,7 +211,7 @@ static struct command commands[] = {
 	},
 	{ "icheck",
 		do_icheck,
-		"icheck block# ...",
+		"icheck [-r] [-f blockfile] block# ...",
 		"List inode# that is using the block#",
 	},
 	{ "lcd",
@@ -221,7 +221,7 @@ static struct command commands[] = {
 	},
 	{ "locate",
 		do_locate,
-		"locate <block#> ...",
+		"locate [-r] <block#> ...",
 		"List all pathnames of the inode(s)/lockname(s)",
 	},
 	{ "logdump",
@@ -241,7 +241,7 @@ static struct command commands[] = {
 	},
 	{ "ncheck",
 		do_locate,
-		"ncheck <block#> ...",
+		"ncheck [-r] <block#> ...",
 		"List all pathnames of the inode(s)/lockname(s)",
 	},
 	{ "open",
@@ -261,7 +261,7 @@ static struct command commands[] = {
 	},
 	{ "rdump",
 		do_rdump,
-		"rdump [-v] <filespec> <outdir>",
+		"rdump [-v] [-j jobs] <filespec> <outdir>",
 		"Recursively dumps from src to a dir on a mounted filesystem",
 	},
 	{ "refcount",
@@ -504,6 +504,11 @@ static errcode_t get_blocksize(char* dev, uint64_t offset, uint64_t *blocksize,
 			ret = OCFS2_ET_IO;
 			goto bail;
 		}
+		/* v2 images are compressed, so trust the header */
+		if (hdr->hdr_version >= 2) {
+			*blocksize = hdr->hdr_fsblksz;
+			goto bail;
+		}
 		offset = hdr->hdr_superblocks[super_no-1] * hdr->hdr_fsblksz;
 	}
 
@@ -753,6 +758,9 @@ static void do_close(char **args)
 	if (check_device_open())
 		return ;
 
+	find_block_inode_release();
+	find_inode_paths_release();
+
 	ret = ocfs2_close(gbls.fs);
 	if (ret)
 		com_err(args[0], ret, "while closing context");
@@ -1552,24 +1560,39 @@ static void do_rdump(char **args)
 	uint64_t blkno;
 	struct stat st;
 	char *p;
-	char *usage = "usage: rdump [-v] <srcdir> <dstdir>";
+	char *usage = "usage: rdump [-v] [-j jobs] <srcdir> <dstdir>";
 	errcode_t ret;
-	int ind = 1;
+	int ind;
 	int verbose = 0;
+	int jobs = 1;
 	char tmp_str[40];
+	char *endptr;
+	int c, argc;
 
 	if (check_device_open())
 		return ;
 
-	if (!args[1]) {
-		fprintf(stderr, "%s\n", usage);
-		return ;
-	}
+	for (argc = 0; (args[argc]); ++argc);
+	optind = 0;
 
-	if (!strcmp(args[1], "-v")) {
-		++ind;
-		++verbose;
+	while ((c = getopt(argc, args, "vj:")) != -1) {
+		switch (c) {
+		case 'v':
+			++verbose;
+			break;
+		case 'j':
+			jobs = strtol(optarg, &endptr, 0);
+			if (*endptr || (jobs < 1)) {
+				fprintf(stderr, "%s\n", usage);
+				return ;
+			}
+			break;
+		default:
+			fprintf(stderr, "%s\n", usage);
+			return ;
+		}
 	}
+	ind = optind;
 
 	if (!args[ind] || !args[ind+1]) {
 		fprintf(stderr, "%s\n", usage);
@@ -1626,7 +1649,7 @@ static void do_rdump(char **args)
 
 	fprintf(stdout, "Copying to %s/%s\n", args[ind+1], p);
 
-	ret = rdump_inode(gbls.fs, blkno, p, args[ind+1], verbose);
+	ret = rdump_inode(gbls.fs, blkno, p, args[ind+1], verbose, jobs);
 	if (ret)
 		com_err(args[0], ret, "while recursively dumping "
 			"inode %"PRIu64, blkno);
@@ -1691,18 +1714,69 @@ static void do_decode_lockres(char **args)
 
 static void do_locate(char **args)
 {
-	uint64_t blkno[MAX_BLOCKS];
-	int count = 0;
+	uint64_t *blkno = NULL;
+	int count = 0, max = 0;
 	int findall = 1;
-	
-	count = process_inodestr_args(args, MAX_BLOCKS, blkno);
-	if (count < 1)
-		return ;
+	int rebuild = 0;
+	int c, argc;
+	errcode_t ret;
+
+	if (check_device_open())
+		return;
+
+	for (argc = 0; (args[argc]); ++argc);
+	optind = 0;
+
+	while ((c = getopt(argc, args, "r")) != -1) {
+		switch (c) {
+		case 'r':
+			rebuild = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r] <inode#> ...\n",
+				args[0]);
+			return;
+		}
+	}
+
+	for (; args[optind] && *args[optind]; optind++) {
+		if (count == max) {
+			max = max ? max * 2 : MAX_BLOCKS;
+			ret = ocfs2_realloc(sizeof(uint64_t) * max, &blkno);
+			if (ret) {
+				com_err(args[0], ret,
+					"while allocating memory");
+				goto bail;
+			}
+		}
+
+		ret = inodestr_to_inode(args[optind], &blkno[count]);
+		if (ret) {
+			com_err(args[0], ret, "- %s", args[optind]);
+			goto bail;
+		}
+		if (blkno[count] >= gbls.max_blocks) {
+			com_err(args[0], OCFS2_ET_BAD_BLKNO, "- %"PRIu64"",
+				blkno[count]);
+			goto bail;
+		}
+		count++;
+	}
+
+	if (!count) {
+		fprintf(stderr, "usage: %s [-r] <inode#> ...\n", args[0]);
+		goto bail;
+	}
 
 	if (!strncasecmp(args[0], "findpath", 8))
 		findall = 0;
 
-	find_inode_paths(gbls.fs, args, findall, count, blkno, stdout);
+	find_inode_paths(gbls.fs, args, findall, rebuild, count, blkno,
+			 stdout);
+
+bail:
+	if (blkno)
+		ocfs2_free(&blkno);
 }
 
 static void do_dlm_locks(char **args)
@@ -1884,43 +1958,118 @@ bail:
 	return;
 }
 
-static void do_icheck(char **args)
+static errcode_t icheck_add_block(char *str, uint64_t **blkno, int *count,
+				  int *max)
 {
-	const char *testb_usage = "usage: icheck block# ...";
+	errcode_t ret;
 	char *endptr;
-	uint64_t blkno[MAX_BLOCKS];
-	int i;
+	uint64_t blk;
+
+	blk = strtoull(str, &endptr, 0);
+	if (*endptr || (endptr == str)) {
+		com_err(gbls.cmd, OCFS2_ET_BAD_BLKNO, "- %s", str);
+		return OCFS2_ET_BAD_BLKNO;
+	}
+
+	if (blk >= gbls.max_blocks) {
+		com_err(gbls.cmd, OCFS2_ET_BAD_BLKNO, "- %"PRIu64"", blk);
+		return OCFS2_ET_BAD_BLKNO;
+	}
+
+	if (*count == *max) {
+		*max = *max ? *max * 2 : MAX_BLOCKS;
+		ret = ocfs2_realloc(sizeof(uint64_t) * *max, blkno);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while allocating memory");
+			return ret;
+		}
+	}
+
+	(*blkno)[(*count)++] = blk;
+	return 0;
+}
+
+/* One block number per line; blank lines and #comments are skipped */
+static errcode_t icheck_read_blocks(char *path, uint64_t **blkno,
+				    int *count, int *max)
+{
+	errcode_t ret = 0;
+	FILE *file;
+	char line[256], *p;
+
+	file = fopen(path, "r");
+	if (!file) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while opening \"%s\"", path);
+		return ret;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		for (p = line; isspace(*p); p++)
+			;
+		if (!*p || (*p == '#'))
+			continue;
+		p[strcspn(p, " \t\r\n#")] = '\0';
+
+		ret = icheck_add_block(p, blkno, count, max);
+		if (ret)
+			break;
+	}
+
+	fclose(file);
+	return ret;
+}
+
+static void do_icheck(char **args)
+{
+	const char *testb_usage =
+		"usage: icheck [-r] [-f blockfile] [block# ...]";
+	uint64_t *blkno = NULL;
+	int count = 0, max = 0;
+	int rebuild = 0;
+	int c, argc;
 	FILE *out;
 
 	if (check_device_open())
 		return;
 
-	if (!args[1]) {
-		fprintf(stderr, "%s\n", testb_usage);
-		return;
-	}
+	for (argc = 0; (args[argc]); ++argc);
+	optind = 0;
 
-	for (i = 0; i < MAX_BLOCKS && args[i + 1]; ++i) {
-		blkno[i] = strtoull(args[i + 1], &endptr, 0);
-		if (*endptr) {
-			com_err(args[0], OCFS2_ET_BAD_BLKNO, "- %s",
-				args[i + 1]);
-			return;
+	while ((c = getopt(argc, args, "rf:")) != -1) {
+		switch (c) {
+		case 'r':
+			rebuild = 1;
+			break;
+		case 'f':
+			if (icheck_read_blocks(optarg, &blkno, &count, &max))
+				goto bail;
+			break;
+		default:
+			fprintf(stderr, "%s\n", testb_usage);
+			goto bail;
 		}
+	}
 
-		if (blkno[i] >= gbls.max_blocks) {
-			com_err(args[0], OCFS2_ET_BAD_BLKNO, "- %"PRIu64"",
-				blkno[i]);
-			return;
-		}
+	for (; args[optind] && *args[optind]; optind++) {
+		if (icheck_add_block(args[optind], &blkno, &count, &max))
+			goto bail;
+	}
+
+	if (!count) {
+		fprintf(stderr, "%s\n", testb_usage);
+		goto bail;
 	}
 
 	out = open_pager(gbls.interactive);
 
-	find_block_inode(gbls.fs, blkno, i, out);
+	find_block_inode(gbls.fs, blkno, count, rebuild, out);
 
 	close_pager(out);
 
+bail:
+	if (blkno)
+		ocfs2_free(&blkno);
 	return;
 }
 
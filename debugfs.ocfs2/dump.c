@@ -1059,9 +1059,13 @@ void dump_hb(FILE *out, char *buf, uint32_t len)
 	return ;
 }
 
-void dump_inode_path(FILE *out, uint64_t blkno, char *path)
+void dump_inode_path(FILE *out, uint64_t blkno, char *path, int dir)
 {
-	fprintf(out, "\t%"PRIu64"\t%s\n", blkno, path);
+	int len = strlen(path);
+
+	/* Directories end in a slash, and "/" and "//" already do */
+	fprintf(out, "\t%"PRIu64"\t%s%s\n", blkno, path,
+		(dir && len && path[len - 1] != '/') ? "/" : "");
 }
 
 /*
@@ -25,11 +25,13 @@
 
 #include "main.h"
 
+#include <pthread.h>
+
 extern struct dbgfs_gbls gbls;
 
 struct block_array {
 	uint64_t blkno;
-	uint32_t inode;		/* Backing inode# */
+	uint64_t inode;		/* Backing inode# */
 	uint64_t offset;
 	int data;		/* offset is valid if this is set */
 #define STATUS_UNKNOWN	0
@@ -38,166 +40,345 @@ struct block_array {
 	int status;
 };
 
-static errcode_t lookup_regular(ocfs2_filesys *fs, uint64_t inode,
-				struct ocfs2_extent_list *el,
-				struct block_array *ba, int count, int *found)
+/*
+ * The reverse map lists the blocks each inode owns, sorted by block
+ * number.  The first icheck that gets past the bitmap builds it with one
+ * walk of every inode, split across threads.  Later queries are binary
+ * searches.  The map is kept until the device is closed, or until
+ * "icheck -r" rebuilds it after the volume has changed.
+ */
+#define RMAP_MAX_THREADS	8
+
+struct rmap_extent {
+	uint64_t	rx_blkno;
+	uint64_t	rx_end;		/* Highest end up to this entry */
+	uint64_t	rx_inode;
+	uint64_t	rx_offset;	/* Logical block of rx_blkno */
+	uint32_t	rx_blocks;
+	int		rx_data;	/* rx_offset is valid */
+};
+
+struct block_rmap {
+	ocfs2_filesys		*br_fs;
+	uint64_t		br_gb_blkno;
+	ocfs2_cached_inode	*br_gb_ci;	/* Global bitmap, loaded */
+	struct rmap_extent	*br_extents;
+	uint64_t		br_nr;
+	int			br_built;
+};
+
+static struct block_rmap *rmap;
+
+struct rmap_shard {
+	ocfs2_filesys		*rs_fs;
+	ocfs2_inode_scan	*rs_scan;
+	uint64_t		rs_gb_blkno;
+	uint64_t		rs_inode;	/* Being walked */
+	char			*rs_buf;
+	struct rmap_extent	*rs_extents;
+	uint64_t		rs_nr;
+	uint64_t		rs_max;
+	errcode_t		rs_ret;
+	pthread_t		rs_thread;
+};
+
+static errcode_t rmap_add(struct rmap_shard *rs, uint64_t blkno,
+			  uint32_t blocks, int data, uint64_t offset)
 {
-	struct ocfs2_extent_block *eb;
-	struct ocfs2_extent_rec *rec;
-	errcode_t ret = 0;
-	char *buf = NULL;
-	int i;
-	int j;
-	uint64_t numblks;
-	uint32_t clusters;
+	errcode_t ret;
+	uint64_t max;
+	struct rmap_extent *rx;
 
-	if (*found >= count)
+	if (rs->rs_nr == rs->rs_max) {
+		max = rs->rs_max ? rs->rs_max * 2 : 1024;
+		ret = ocfs2_realloc(sizeof(struct rmap_extent) * max,
+				    &rs->rs_extents);
+		if (ret)
+			return ret;
+		rs->rs_max = max;
+	}
+
+	rx = &rs->rs_extents[rs->rs_nr++];
+	rx->rx_blkno = blkno;
+	rx->rx_blocks = blocks;
+	rx->rx_inode = rs->rs_inode;
+	rx->rx_data = data;
+	rx->rx_offset = offset;
+
+	return 0;
+}
+
+static int rmap_extent_func(ocfs2_filesys *fs, struct ocfs2_extent_rec *rec,
+			    int tree_depth, uint32_t ccount,
+			    uint64_t ref_blkno, int ref_recno,
+			    void *priv_data)
+{
+	struct rmap_shard *rs = priv_data;
+	uint32_t clusters = ocfs2_rec_clusters(tree_depth, rec);
+
+	/* For a sparse file, we may find an empty record */
+	if (!clusters)
 		return 0;
 
-	ret = ocfs2_malloc_block(gbls.fs->fs_io, &buf);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating a block");
-		goto bail;
-	}
+	if (tree_depth)
+		rs->rs_ret = rmap_add(rs, rec->e_blkno, 1, 0, 0);
+	else
+		rs->rs_ret = rmap_add(rs, rec->e_blkno,
+				      ocfs2_clusters_to_blocks(fs, clusters),
+				      1,
+				      ocfs2_clusters_to_blocks(fs,
+							       rec->e_cpos));
 
-	eb = (struct ocfs2_extent_block *)buf;
+	return rs->rs_ret ? OCFS2_EXTENT_ABORT : 0;
+}
 
-	for (i = 0; i < el->l_next_free_rec; ++i) {
-		rec = &(el->l_recs[i]);
-		clusters = ocfs2_rec_clusters(el->l_tree_depth, rec);
+static int rmap_chain_func(ocfs2_filesys *fs, uint64_t blkno, int chain,
+			   void *priv_data)
+{
+	struct rmap_shard *rs = priv_data;
 
-		/*
-		 * For a sparse file, we may find an empty record.
-		 * Just skip it.
-		 */
-		if (!clusters)
-			continue;
+	rs->rs_ret = rmap_add(rs, blkno, 1, 0, 0);
 
-		if (el->l_tree_depth) {
-			ret = ocfs2_read_extent_block(fs, rec->e_blkno, buf);
-			if (ret) {
-				com_err(gbls.cmd, ret, "while reading extent "
-					"block %"PRIu64, (uint64_t)rec->e_blkno);
-				goto bail;
-			}
+	return rs->rs_ret ? OCFS2_CHAIN_ABORT : 0;
+}
 
-			for (j = 0; j < count; ++j) {
-				if (ba[j].status != STATUS_UNKNOWN)
-					continue;
-				if (ba[j].blkno == rec->e_blkno) {
-					ba[j].status = STATUS_USED;
-					ba[j].inode = inode;
-					(*found)++;
-				}
-			}
+/* Errors in one inode are reported and the walk goes on */
+static void rmap_walk_inode(struct rmap_shard *rs, struct ocfs2_dinode *di)
+{
+	errcode_t ret;
 
-			lookup_regular(fs, inode, &(eb->h_list), ba, count,
-				       found);
+	rs->rs_inode = di->i_blkno;
+	rs->rs_ret = rmap_add(rs, di->i_blkno, 1, 0, 0);
+	if (rs->rs_ret)
+		return;
 
-			continue;
-		}
+	if (S_ISLNK(di->i_mode) && !di->i_clusters)
+		return;
 
-		for (j = 0; j < count; ++j) {
-			if (ba[j].status != STATUS_UNKNOWN)
-				continue;
+	if (di->i_flags & (OCFS2_LOCAL_ALLOC_FL | OCFS2_DEALLOC_FL))
+		return;
 
-			numblks = ocfs2_clusters_to_blocks(fs, clusters);
+	if (di->i_dyn_features & OCFS2_INLINE_DATA_FL)
+		return;
 
-			if (ba[j].blkno >= rec->e_blkno &&
-			    ba[j].blkno < rec->e_blkno + numblks) {
-				ba[j].status = STATUS_USED;
-				ba[j].inode = inode;
-				ba[j].data = 1;
-				ba[j].offset = ocfs2_clusters_to_blocks(fs, rec->e_cpos);
-				ba[j].offset += ba[j].blkno - rec->e_blkno;
-				(*found)++;
-			}
+	if (di->i_blkno == rs->rs_gb_blkno)
+		return;
+
+	if (di->i_flags & OCFS2_CHAIN_FL)
+		ret = ocfs2_chain_iterate(rs->rs_fs, di->i_blkno,
+					  rmap_chain_func, rs);
+	else
+		ret = ocfs2_extent_iterate_inode(rs->rs_fs, di, 0, NULL,
+						 rmap_extent_func, rs);
+	if (ret && !rs->rs_ret)
+		com_err(gbls.cmd, ret, "while walking the extents of inode "
+			"%"PRIu64, (uint64_t)di->i_blkno);
+}
+
+static void *rmap_scan(void *arg)
+{
+	struct rmap_shard *rs = arg;
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)rs->rs_buf;
+	uint64_t inode_num;
+	errcode_t ret;
+
+	for (;;) {
+		ret = ocfs2_get_next_inode(rs->rs_scan, &inode_num,
+					   rs->rs_buf);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while scanning next inode");
+			rs->rs_ret = ret;
+			break;
 		}
 
-		if (*found >= count)
-			return 0;
+		if (!inode_num)
+			break;
+
+		if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
+			   strlen(OCFS2_INODE_SIGNATURE)))
+			continue;
+
+		ocfs2_swap_inode_to_cpu(rs->rs_fs, di);
+
+		if (di->i_fs_generation !=
+		    rs->rs_fs->fs_super->i_fs_generation)
+			continue;
+
+		if (!(di->i_flags & OCFS2_VALID_FL))
+			continue;
+
+		rmap_walk_inode(rs, di);
+		if (rs->rs_ret) {
+			com_err(gbls.cmd, rs->rs_ret, "while recording the "
+				"blocks of inode %"PRIu64, inode_num);
+			break;
+		}
 	}
-bail:
-	if (buf)
-		ocfs2_free(&buf);
-	return ret;
+
+	return NULL;
 }
 
-struct walk_it {
-	char *buf;
-	struct block_array *ba;
-	uint64_t inode;
-	int count;
-	int found;
-};
+static int rmap_extent_cmp(const void *a, const void *b)
+{
+	const struct rmap_extent *l = a;
+	const struct rmap_extent *r = b;
+
+	if (l->rx_blkno < r->rx_blkno)
+		return -1;
+	if (l->rx_blkno > r->rx_blkno)
+		return 1;
+	if (l->rx_inode < r->rx_inode)
+		return -1;
+	return l->rx_inode > r->rx_inode;
+}
 
-static int walk_chain_func(ocfs2_filesys *fs, uint64_t blkno, int chain,
-			   void *priv_data)
+static errcode_t rmap_merge(struct rmap_shard *shards, int nr)
 {
-	struct walk_it *wi = (struct walk_it *)priv_data;
-	struct ocfs2_group_desc *gd;
-	int i;
 	errcode_t ret;
+	uint64_t i, total = 0, end = 0;
+	struct rmap_extent *rx;
+	int j;
 
-	ret = ocfs2_read_group_desc(fs, blkno, wi->buf);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while reading group %"PRIu64, blkno);
-		return ret;
-	}
+	for (j = 0; j < nr; j++)
+		total += shards[j].rs_nr;
 
-	gd = (struct ocfs2_group_desc *)wi->buf;
+	ret = ocfs2_malloc(sizeof(struct rmap_extent) * (total ? total : 1),
+			   &rmap->br_extents);
+	if (ret)
+		return ret;
 
-	for (i = 0; i < wi->count; ++i)
-	{
-		if (wi->ba[i].status != STATUS_UNKNOWN)
-			continue;
+	for (j = 0, i = 0; j < nr; j++) {
+		memcpy(rmap->br_extents + i, shards[j].rs_extents,
+		       sizeof(struct rmap_extent) * shards[j].rs_nr);
+		i += shards[j].rs_nr;
+	}
+	rmap->br_nr = total;
 
-		if (wi->ba[i].blkno == gd->bg_blkno) {
-			wi->ba[i].status = STATUS_USED;
-			wi->ba[i].inode = wi->inode;
-			wi->found++;
-		}
+	qsort(rmap->br_extents, total, sizeof(struct rmap_extent),
+	      rmap_extent_cmp);
 
-		if (wi->found >= wi->count)
-			break;
+	/* Cross-linked extents can overlap; lookups walk back over them */
+	for (i = 0; i < total; i++) {
+		rx = &rmap->br_extents[i];
+		if (rx->rx_blkno + rx->rx_blocks > end)
+			end = rx->rx_blkno + rx->rx_blocks;
+		rx->rx_end = end;
 	}
 
 	return 0;
 }
 
-static errcode_t lookup_chain(ocfs2_filesys *fs, struct ocfs2_dinode *di,
-			      struct block_array *ba, int count, int *found)
+static errcode_t rmap_build(ocfs2_filesys *fs)
 {
-	struct walk_it wi;
-	errcode_t ret = 0;
+	errcode_t ret;
+	int i, nr = 1, started = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ocfs2_inode_scan *scans[RMAP_MAX_THREADS];
+	struct rmap_shard shards[RMAP_MAX_THREADS];
+
+	if (cpus > 1)
+		nr = cpus < RMAP_MAX_THREADS ? cpus : RMAP_MAX_THREADS;
+
+	memset(shards, 0, sizeof(shards));
+	memset(scans, 0, sizeof(scans));
+
+	/* A single scan can read ahead; partitions can't */
+	if (nr == 1)
+		ret = ocfs2_open_inode_scan(fs, &scans[0]);
+	else
+		ret = ocfs2_open_inode_scan_partitioned(fs, nr, scans);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while opening inode scan");
+		goto out;
+	}
 
-	memset(&wi, 0, sizeof(wi));
-	wi.ba = ba;
-	wi.inode = di->i_blkno;
-	wi.count = count;
-	wi.found = *found;
+	for (i = 0; i < nr; i++) {
+		shards[i].rs_fs = fs;
+		shards[i].rs_scan = scans[i];
+		shards[i].rs_gb_blkno = rmap->br_gb_blkno;
+		ret = ocfs2_malloc_block(fs->fs_io, &shards[i].rs_buf);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while allocating a block");
+			goto out;
+		}
+	}
 
-	ret = ocfs2_malloc_block(fs->fs_io, &wi.buf);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating a block");
-		goto bail;
+	/* Shards whose thread didn't start are walked here */
+	for (i = 0; i < nr; i++) {
+		if (nr == 1 || pthread_create(&shards[i].rs_thread, NULL,
+					      rmap_scan, &shards[i]))
+			break;
+		started++;
 	}
+	for (i = started; i < nr; i++)
+		rmap_scan(&shards[i]);
+	for (i = 0; i < started; i++)
+		pthread_join(shards[i].rs_thread, NULL);
 
-	ret = ocfs2_chain_iterate(fs, di->i_blkno, walk_chain_func, &wi);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while walking extents");
-		goto bail;
+	for (i = 0; i < nr; i++) {
+		ret = shards[i].rs_ret;
+		if (ret)
+			goto out;
 	}
 
-	*found = wi.found;
+	ret = rmap_merge(shards, nr);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while sorting the block map");
+		goto out;
+	}
+	rmap->br_built = 1;
 
-bail:
-	if (wi.buf)
-		ocfs2_free(&wi.buf);
+out:
+	for (i = 0; i < nr; i++) {
+		if (scans[i])
+			ocfs2_close_inode_scan(scans[i]);
+		if (shards[i].rs_buf)
+			ocfs2_free(&shards[i].rs_buf);
+		if (shards[i].rs_extents)
+			ocfs2_free(&shards[i].rs_extents);
+	}
 
 	return ret;
 }
 
+/* The extent holding blkno, or NULL */
+static struct rmap_extent *rmap_lookup(uint64_t blkno)
+{
+	uint64_t lo = 0, hi = rmap->br_nr, mid;
+	struct rmap_extent *rx;
+
+	/* Find the first extent that starts past blkno */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rmap->br_extents[mid].rx_blkno <= blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	while (lo--) {
+		rx = &rmap->br_extents[lo];
+		if (rx->rx_end <= blkno)
+			break;
+		if (rx->rx_blkno + rx->rx_blocks > blkno)
+			return rx;
+	}
+
+	return NULL;
+}
+
+void find_block_inode_release(void)
+{
+	if (!rmap)
+		return;
+
+	if (rmap->br_gb_ci)
+		ocfs2_free_cached_inode(rmap->br_fs, rmap->br_gb_ci);
+	if (rmap->br_extents)
+		ocfs2_free(&rmap->br_extents);
+	ocfs2_free(&rmap);
+}
+
 static errcode_t lookup_global_bitmap(ocfs2_filesys *fs, uint64_t *blkno)
 {
 	char sysfile[50];
@@ -214,27 +395,14 @@ static errcode_t lookup_global_bitmap(ocfs2_filesys *fs, uint64_t *blkno)
 	return ret;
 }
 
-static errcode_t scan_bitmap(ocfs2_filesys *fs, uint64_t bm_blkno,
+static errcode_t scan_bitmap(ocfs2_filesys *fs, ocfs2_cached_inode *ci,
 			     struct block_array *ba, int count, int *found)
 {
-	ocfs2_cached_inode *ci = NULL;
 	uint32_t num_cluster;
 	errcode_t ret = 0;
 	int set;
 	int i;
 
-	ret = ocfs2_read_cached_inode(fs, bm_blkno, &ci);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while reading inode %"PRIu64, bm_blkno);
-		goto bail;
-	}
-
-	ret = ocfs2_load_chain_allocator(fs, ci);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while loading chain allocator");
-		goto bail;
-	}
-
 	for (i = 0; i < count; ++i) {
 		if (ba[i].status != STATUS_UNKNOWN)
 			continue;
@@ -245,7 +413,7 @@ static errcode_t scan_bitmap(ocfs2_filesys *fs, uint64_t bm_blkno,
 					&set);
 		if (ret) {
 			com_err(gbls.cmd, ret, "while looking up global bitmap");
-			goto bail;
+			break;
 		}
 
 		if (!set) {
@@ -254,10 +422,44 @@ static errcode_t scan_bitmap(ocfs2_filesys *fs, uint64_t bm_blkno,
 		}
 	}
 
-bail:
-	if (ci)
-		ocfs2_free_cached_inode(fs, ci);
+	return ret;
+}
+
+/* The global bitmap is looked up and loaded once per device */
+static errcode_t rmap_get(ocfs2_filesys *fs, int rebuild)
+{
+	errcode_t ret;
+
+	if (rmap && (rebuild || rmap->br_fs != fs))
+		find_block_inode_release();
+	if (rmap)
+		return 0;
+
+	ret = ocfs2_malloc0(sizeof(struct block_rmap), &rmap);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while allocating memory");
+		return ret;
+	}
+	rmap->br_fs = fs;
+
+	ret = lookup_global_bitmap(fs, &rmap->br_gb_blkno);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_read_cached_inode(fs, rmap->br_gb_blkno, &rmap->br_gb_ci);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while reading inode %"PRIu64,
+			rmap->br_gb_blkno);
+		goto out;
+	}
 
+	ret = ocfs2_load_chain_allocator(fs, rmap->br_gb_ci);
+	if (ret)
+		com_err(gbls.cmd, ret, "while loading chain allocator");
+
+out:
+	if (ret)
+		find_block_inode_release();
 	return ret;
 }
 
@@ -313,24 +515,13 @@ static void check_computed_blocks(ocfs2_filesys *fs, uint64_t gb_blkno,
 }
 
 errcode_t find_block_inode(ocfs2_filesys *fs, uint64_t *blkno, int count,
-			   FILE *out)
+			   int rebuild, FILE *out)
 {
 	errcode_t ret = 0;
-	uint64_t inode_num;
 	struct block_array *ba = NULL;
-	char *buf = NULL;
-	struct ocfs2_dinode *di;
-	ocfs2_inode_scan *scan = NULL;
+	struct rmap_extent *rx;
 	int i;
 	int found = 0;
-	uint64_t gb_blkno;
-
-	ret = ocfs2_malloc_block(fs->fs_io, &buf);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating a block");
-		goto out;
-	}
-	di = (struct ocfs2_dinode *)buf;
 
 	ba = calloc(count, sizeof(struct block_array));
 	if (!ba) {
@@ -341,84 +532,41 @@ errcode_t find_block_inode(ocfs2_filesys *fs, uint64_t *blkno, int count,
 	for (i = 0; i < count; ++i)
 		ba[i].blkno = blkno[i];
 
-	if (found >= count)
-		goto output;
-
-	ret = lookup_global_bitmap(fs, &gb_blkno);
+	ret = rmap_get(fs, rebuild);
 	if (ret)
 		goto out_free;
 
-	check_computed_blocks(fs, gb_blkno, ba, count, &found);
+	check_computed_blocks(fs, rmap->br_gb_blkno, ba, count, &found);
 	if (found >= count)
 		goto output;
 
-	ret = scan_bitmap(fs, gb_blkno, ba, count, &found);
+	ret = scan_bitmap(fs, rmap->br_gb_ci, ba, count, &found);
 	if (ret)
 		goto out_free;
 
 	if (found >= count)
 		goto output;
 
-	ret = ocfs2_open_inode_scan(fs, &scan);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while opening inode scan");
-		goto out_free;
+	if (!rmap->br_built) {
+		ret = rmap_build(fs);
+		if (ret)
+			goto out_free;
 	}
 
-	for (;;) {
-		ret = ocfs2_get_next_inode(scan, &inode_num, (char *)di);
-		if (ret) {
-			com_err(gbls.cmd, ret, "while scanning next inode");
-			goto out_close_scan;
-		}
-
-		if (!inode_num)
-			break;
-
-		if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
-			   strlen(OCFS2_INODE_SIGNATURE)))
-			continue;
-
-		ocfs2_swap_inode_to_cpu(fs, di);
-
-		if (di->i_fs_generation != fs->fs_super->i_fs_generation)
-			continue;
-
-		if (!(di->i_flags & OCFS2_VALID_FL))
-			continue;
-
-		for (i = 0; i < count; ++i) {
-			if (ba[i].status != STATUS_UNKNOWN)
-				continue;
-			if (ba[i].blkno == di->i_blkno) {
-				ba[i].status = STATUS_USED;
-				ba[i].inode = di->i_blkno;
-				found++;
-			}
-		}
-
-		if (found >= count)
-			break;
-
-		if (S_ISLNK(di->i_mode) && !di->i_clusters)
-			continue;
-
-		if (di->i_flags & (OCFS2_LOCAL_ALLOC_FL | OCFS2_DEALLOC_FL))
+	for (i = 0; i < count; ++i) {
+		if (ba[i].status != STATUS_UNKNOWN)
 			continue;
 
-		if (di->i_blkno == gb_blkno)
+		rx = rmap_lookup(ba[i].blkno);
+		if (!rx)
 			continue;
 
-		if (di->i_flags & OCFS2_CHAIN_FL)
-			ret = lookup_chain(fs, di, ba, count, &found);
-		else
-			ret = lookup_regular(fs, di->i_blkno, &(di->id2.i_list),
-					     ba, count, &found);
-		if (ret)
-			goto out_close_scan;
-
-		if (found >= count)
-			break;
+		ba[i].status = STATUS_USED;
+		ba[i].inode = rx->rx_inode;
+		ba[i].data = rx->rx_data;
+		if (rx->rx_data)
+			ba[i].offset = rx->rx_offset +
+				(ba[i].blkno - rx->rx_blkno);
 	}
 
 output:
@@ -426,13 +574,7 @@ output:
 		dump_icheck(out, (i == 0), ba[i].blkno, ba[i].inode,
 			    ba[i].data, ba[i].offset, ba[i].status);
 
-out_close_scan:
-	if (scan)
-		ocfs2_close_inode_scan(scan);
-
 out_free:
-	if (buf)
-		ocfs2_free(&buf);
 	if (ba)
 		free(ba);
 out:
@@ -27,143 +27,72 @@
 
 #include "main.h"
 
+/*
+ * The names of the volume open in the session.  They are indexed by the
+ * first lookup and kept until the device is closed or a rebuild is
+ * asked for.
+ */
+static ocfs2_name_index *names;
+static ocfs2_filesys *names_fs;
+
 struct walk_path {
-	char *argv0;
 	FILE *out;
-	ocfs2_filesys *fs;
-	char *path;
-	uint32_t found;
-	uint32_t count;
 	int findall;
-	uint64_t *inode;
+	int found;
 };
 
-static int walk_tree_func(struct ocfs2_dir_entry *dentry,
-			  uint64_t blocknr, int offset,
-			  int blocksize, char *buf, void *priv_data)
+void find_inode_paths_release(void)
 {
-	errcode_t ret;
-	int len;
-	int reti = 0;
-	int i = 0;
-	int print = 0;
-	char *old_path, *path;
-	struct walk_path *wp = priv_data;
-
-	if (!strncmp(dentry->name, ".", dentry->name_len) ||
-	    !strncmp(dentry->name, "..", dentry->name_len))
-		return 0;
-
-	len = strlen(wp->path);
-
-	if (len + dentry->name_len > 4095) {
-		com_err(wp->argv0, OCFS2_ET_NO_SPACE,
-			"name is too long in %s\n", wp->path);
-		return OCFS2_DIRENT_ABORT;
-	}
-
-	ret = ocfs2_malloc0(4096, &path);
-	if (ret) {
-		com_err(wp->argv0, ret,
-			"while allocating path memory in %s\n", wp->path);
-		return OCFS2_DIRENT_ABORT;
-	}
-	
-	memcpy(path, wp->path, len);
-	memcpy(path + len, dentry->name, dentry->name_len);
-	if (dentry->file_type == OCFS2_FT_DIR)
-		path[len + dentry->name_len] = '/';
-
-	for (i = 0; i < wp->count; ++i) {
-		if (dentry->inode == wp->inode[i]) {
-			if (!print)
-				dump_inode_path(wp->out, dentry->inode, path);
-			++wp->found;
-			++print;
-		}
-	}
-
-	if (!wp->findall) {
-		if (wp->found >= wp->count) {
-			ocfs2_free(&path);	
-			return OCFS2_DIRENT_ABORT;
-		}
-	}
+	if (names)
+		ocfs2_name_index_free(names);
+	names = NULL;
+	names_fs = NULL;
+}
 
-	if (dentry->file_type == OCFS2_FT_DIR) {
-		old_path = wp->path;
-		wp->path = path;
-		ret = ocfs2_dir_iterate(wp->fs, dentry->inode, 0, NULL,
-					walk_tree_func, wp);
-		if (ret) {
-			com_err(wp->argv0, ret, "while walking %s", wp->path);
-			reti = OCFS2_DIRENT_ABORT;
-		}
-		wp->path = old_path;
-	}
+static int walk_path_func(uint64_t ino, char *path, int file_type,
+			  void *priv_data)
+{
+	struct walk_path *wp = priv_data;
 
-	ocfs2_free(&path);
+	dump_inode_path(wp->out, ino, path, file_type == OCFS2_FT_DIR);
+	++wp->found;
 
-	return reti;
+	return wp->findall ? 0 : OCFS2_NAME_ABORT;
 }
 
 errcode_t find_inode_paths(ocfs2_filesys *fs, char **args, int findall,
-			   uint32_t count, uint64_t *blknos, FILE *out)
+			   int rebuild, uint32_t count, uint64_t *blknos,
+			   FILE *out)
 {
 	errcode_t ret = 0;
 	struct walk_path wp;
 	int i;
-	int printroot = 0;
-	int printsysd = 0;
 
-	wp.argv0 = args[0];
+	if (rebuild || (names_fs != fs))
+		find_inode_paths_release();
+
+	if (!names) {
+		ret = ocfs2_name_index_build(fs, &names);
+		if (ret) {
+			com_err(args[0], ret, "while walking the directories");
+			goto bail;
+		}
+		names_fs = fs;
+	}
+
 	wp.out = out;
-	wp.count = count;
-	wp.inode = blknos;
 	wp.findall = findall;
 	wp.found = 0;
-	wp.fs = fs;
 
-	/* Compare with root and sysdir */
 	for (i = 0; i < count; ++i) {
-		if (blknos[i] == fs->fs_root_blkno) {
-			if (!printroot)
-				dump_inode_path(out, blknos[i], "/");
-			++wp.found;
-			++printroot;
-		}
-		if (blknos[i] == fs->fs_sysdir_blkno) {
-			if (!printsysd)
-				dump_inode_path(out, blknos[i], "//");
-			++wp.found;
-			++printsysd;
-		}
-	}
-
-	if (!findall) {
-		if (wp.found >= wp.count)
+		ret = ocfs2_name_index_iterate(names, blknos[i],
+					       walk_path_func, &wp);
+		if (ret && (ret != OCFS2_ET_FILE_NOT_FOUND)) {
+			com_err(args[0], ret, "while naming inode %"PRIu64,
+				blknos[i]);
 			goto bail;
-	}
-
-
-	/* Walk system dir */
-	wp.path = "//";
-	ret = ocfs2_dir_iterate(fs,
-				OCFS2_RAW_SB(fs->fs_super)->s_system_dir_blkno,
-				0, NULL, walk_tree_func, &wp);
-	if (ret) {
-		com_err(args[0], ret, "while walking system dir");
-		goto bail;
-	}
-
-	/* Walk root dir */
-	wp.path = "/";
-	ret = ocfs2_dir_iterate(fs,
-				OCFS2_RAW_SB(fs->fs_super)->s_root_blkno,
-				0, NULL, walk_tree_func, &wp);
-	if (ret) {
-		com_err(args[0], ret, "while walking root dir");
-		goto bail;
+		}
+		ret = 0;
 	}
 
 	if (!wp.found)
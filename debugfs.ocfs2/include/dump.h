@@ -62,7 +62,7 @@ void dump_slots (FILE *out, struct ocfs2_slot_map_extended *se,
                  struct ocfs2_slot_map *sm, int num_slots);
 void dump_fast_symlink (FILE *out, char *link);
 void dump_hb (FILE *out, char *buf, uint32_t len);
-void dump_inode_path (FILE *out, uint64_t blkno, char *path);
+void dump_inode_path (FILE *out, uint64_t blkno, char *path, int dir);
 void dump_logical_blkno(FILE *out, uint64_t blkno);
 void dump_icheck(FILE *out, int hdr, uint64_t blkno, uint64_t inode,
 		 int validoffset, uint64_t offset, int status);
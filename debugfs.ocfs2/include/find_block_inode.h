@@ -26,6 +26,7 @@
 #define _FIND_BLOCK_INODE_H_
 
 errcode_t find_block_inode(ocfs2_filesys *fs, uint64_t *blkno, int count,
-			   FILE *out);
+			   int rebuild, FILE *out);
+void find_block_inode_release(void);
 
 #endif		/* _FIND_BLOCK_INODE_ */
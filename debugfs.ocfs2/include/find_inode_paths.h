@@ -26,6 +26,8 @@
 #define _FIND_INODE_PATH_H_
 
 errcode_t find_inode_paths(ocfs2_filesys *fs, char **args, int findall,
-			   uint32_t count, uint64_t *blkno, FILE *out);
+			   int rebuild, uint32_t count, uint64_t *blkno,
+			   FILE *out);
+void find_inode_paths_release(void);
 
 #endif		/* _FIND_INODE_PATH_H_ */
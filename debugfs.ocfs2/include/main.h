@@ -37,6 +37,7 @@
 #include <sys/statfs.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
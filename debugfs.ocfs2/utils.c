@@ -26,6 +26,10 @@
 
 #include "main.h"
 #include "ocfs2/bitops.h"
+#include "tools-internal/progress.h"
+
+#include <pthread.h>
+#include <sys/time.h>
 
 extern struct dbgfs_gbls gbls;
 
@@ -376,16 +380,84 @@ bail:
 static errcode_t dump_symlink(ocfs2_filesys *fs, uint64_t blkno, char *name,
 			      struct ocfs2_dinode *inode);
 
+#define DUMP_ZEROS_BYTES	(1024 * 1024)
+
+struct dump_context {
+	int		fd;
+	int		sparse;	/* Holes are left as holes */
+	char		*zeros;
+};
+
+static errcode_t dump_write(struct dump_context *ctxt, char *buf,
+			    uint64_t len, uint64_t offset)
+{
+	ssize_t wrote;
+
+	while (len) {
+		if (ctxt->sparse)
+			wrote = pwrite64(ctxt->fd, buf, len, offset);
+		else
+			wrote = write(ctxt->fd, buf, len);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (!wrote)
+			return OCFS2_ET_SHORT_WRITE;
+
+		buf += wrote;
+		len -= wrote;
+		offset += wrote;
+	}
+
+	return 0;
+}
+
+static errcode_t dump_func(ocfs2_filesys *fs, uint64_t offset, char *buf,
+			   uint64_t len, void *priv_data)
+{
+	errcode_t ret;
+	uint64_t chunk;
+	struct dump_context *ctxt = priv_data;
+
+	if (buf)
+		return dump_write(ctxt, buf, len, offset);
+
+	if (ctxt->sparse)
+		return 0;
+
+	if (!ctxt->zeros) {
+		ret = ocfs2_malloc0(DUMP_ZEROS_BYTES, &ctxt->zeros);
+		if (ret)
+			return ret;
+	}
+
+	while (len) {
+		chunk = ocfs2_min(len, (uint64_t)DUMP_ZEROS_BYTES);
+		ret = dump_write(ctxt, ctxt->zeros, chunk, offset);
+		if (ret)
+			return ret;
+		len -= chunk;
+		offset += chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * The file is streamed straight from the read buffers to fd.  When
+ * dumping to a regular file, which the callers have just truncated,
+ * holes and unwritten extents are skipped so that they stay holes in
+ * the copy.  Pipes and terminals get zeros.
+ */
 errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 		    int preserve)
 {
 	errcode_t ret;
-	char *buf = NULL;
-	int buflen;
-	uint32_t got;
-	uint32_t wrote;
+	struct stat64 st;
 	ocfs2_cached_inode *ci = NULL;
-	uint64_t offset = 0;
+	struct dump_context ctxt = { .fd = fd, };
 
 	ret = ocfs2_read_cached_inode(fs, ino, &ci);
 	if (ret) {
@@ -403,39 +475,22 @@ errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 		goto bail;
 	}
 
-	buflen = 1024 * 1024;
+	if (out_file && !fstat64(fd, &st) && S_ISREG(st.st_mode))
+		ctxt.sparse = 1;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io,
-				  (buflen >>
-				   OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits),
-				  &buf);
+	ret = ocfs2_file_stream(ci, dump_func, &ctxt);
 	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating %u bytes", buflen);
+		com_err(gbls.cmd, ret, "while dumping file %"PRIu64,
+			ci->ci_blkno);
 		goto bail;
 	}
 
-	while (1) {
-		ret = ocfs2_file_read(ci, buf, buflen, offset, &got);
-		if (ret) {
-			com_err(gbls.cmd, ret, "while reading file %"PRIu64" "
-				"at offset %"PRIu64, ci->ci_blkno, offset);
-			goto bail;
-		}
-
-		if (!got)
-			break;
-
-		wrote = write(fd, buf, got);
-		if (wrote != got) {
-			com_err(gbls.cmd, errno, "while writing file");
-			ret = errno;
-			goto bail;
-		}
-
-		if (got < buflen)
-			break;
-		else
-			offset += got;
+	/* A trailing hole was never written */
+	if (ctxt.sparse && ftruncate64(fd, ci->ci_inode->i_size)) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while setting the size of \"%s\"",
+			out_file);
+		goto bail;
 	}
 
 	if (preserve)
@@ -444,8 +499,8 @@ errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 bail:
 	if (fd > 0 && fd != fileno(stdout))
 		close(fd);
-	if (buf)
-		ocfs2_free(&buf);
+	if (ctxt.zeros)
+		ocfs2_free(&ctxt.zeros);
 	if (ci)
 		ocfs2_free_cached_inode(fs, ci);
 	return ret;
@@ -617,144 +672,404 @@ bail:
 }
 
 /*
- * rdump_dirent()
+ * rdump walks the tree breadth first on the calling thread, making
+ * directories and symlinks as it finds them.  Regular files go to a
+ * queue that rdump_jobs worker threads dump from, sharing the channel
+ * and its cache.  With one job the walker dumps them itself.
  *
- * Code based on similar function in e2fsprogs-1.32/debugfs/dump.c
+ * Directory permissions are set after everything has been written,
+ * deepest directory first, so that read-only directories can still be
+ * filled.  An inode that can't be dumped is reported and skipped.
+ *
+ * Code based on similar functions in e2fsprogs-1.32/debugfs/dump.c
  *
  * Copyright (C) 1994 Theodore Ts'o.  This file may be redistributed
  * under the terms of the GNU Public License.
  */
-static int rdump_dirent(struct ocfs2_dir_entry *rec, uint64_t blocknr,
-			int offset, int blocksize, char *buf, void *priv_data)
+#define RDUMP_MAX_QUEUED	1024
+
+struct rdump_item {
+	struct list_head	ri_list;
+	uint64_t		ri_blkno;
+	uint64_t		ri_size;
+	char			*ri_path;
+};
+
+struct rdump_context {
+	ocfs2_filesys		*rc_fs;
+	int			rc_verbose;
+	int			rc_nr_workers;
+	char			*rc_buf;	/* Inode buffer for the walk */
+	struct list_head	rc_dirs;	/* Waiting to be walked */
+	struct list_head	rc_walked;	/* Deepest first */
+	struct rdump_item	*rc_dir;	/* Being walked */
+
+	/* Shared with the workers under rc_lock */
+	pthread_mutex_t		rc_lock;
+	pthread_cond_t		rc_work_cond;
+	pthread_cond_t		rc_space_cond;
+	struct list_head	rc_files;
+	int			rc_nr_files;
+	int			rc_walk_done;
+	errcode_t		rc_ret;		/* The first error */
+	uint64_t		rc_errors;
+	uint64_t		rc_files_done;
+	uint64_t		rc_dirs_done;
+	uint64_t		rc_bytes;
+	struct tools_progress	*rc_prog;
+};
+
+static errcode_t rdump_item_new(uint64_t blkno, const char *dir,
+				const char *name, int namelen,
+				struct rdump_item **ret_item)
 {
-	struct rdump_opts *rd = (struct rdump_opts *)priv_data;
-	char tmp = rec->name[rec->name_len];
-	errcode_t ret = 0;
+	errcode_t ret;
+	int len = strlen(dir) + namelen + 2;
+	struct rdump_item *ri;
 
-	rec->name[rec->name_len] = '\0';
+	ret = ocfs2_malloc0(sizeof(struct rdump_item), &ri);
+	if (ret)
+		return ret;
 
-	if (!strcmp(rec->name, ".") || !strcmp(rec->name, ".."))
-		goto bail;
+	ret = ocfs2_malloc(len, &ri->ri_path);
+	if (ret) {
+		ocfs2_free(&ri);
+		return ret;
+	}
 
-	ret = rdump_inode(rd->fs, rec->inode, rec->name, rd->fullname,
-			  rd->verbose);
+	snprintf(ri->ri_path, len, "%s/%.*s", dir, namelen, name);
+	ri->ri_blkno = blkno;
+	*ret_item = ri;
 
-bail:
-	rec->name[rec->name_len] = tmp;
+	return 0;
+}
 
-	return ret;
+static void rdump_item_free(struct rdump_item *ri)
+{
+	ocfs2_free(&ri->ri_path);
+	ocfs2_free(&ri);
 }
 
-/*
- * rdump_inode()
- *
- * Code based on similar function in e2fsprogs-1.32/debugfs/dump.c
- *
- * Copyright (C) 1994 Theodore Ts'o.  This file may be redistributed
- * under the terms of the GNU Public License.
- */
-errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
-		      const char *dumproot, int verbose)
+/* Called with rc_lock held */
+static void rdump_account(struct rdump_context *rc, int is_dir,
+			  uint64_t bytes, errcode_t ret)
+{
+	if (ret) {
+		if (!rc->rc_ret)
+			rc->rc_ret = ret;
+		rc->rc_errors++;
+		return;
+	}
+
+	if (is_dir)
+		rc->rc_dirs_done++;
+	else
+		rc->rc_files_done++;
+	rc->rc_bytes += bytes;
+	tools_progress_step(rc->rc_prog, 1);
+}
+
+static void rdump_error(struct rdump_context *rc, errcode_t ret)
+{
+	pthread_mutex_lock(&rc->rc_lock);
+	rdump_account(rc, 0, 0, ret);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
+static errcode_t rdump_file(struct rdump_context *rc, struct rdump_item *ri)
 {
-	char *fullname = NULL;
-	int len;
-	errcode_t ret;
-	char *buf = NULL;
-	char *dirbuf = NULL;
-	struct ocfs2_dinode *di;
 	int fd;
-	struct rdump_opts rd_opts = { NULL, NULL, NULL, 0 };
+	errcode_t ret;
 
-	len = strlen(dumproot) + strlen(name) + 2;
-	ret = ocfs2_malloc(len, &fullname);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating %u bytes", len);
-		goto bail;
+	if (rc->rc_verbose)
+		fprintf(stdout, "%s\n", ri->ri_path);
+
+	fd = open64(ri->ri_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+	if (fd == -1) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while opening file %s", ri->ri_path);
+		return ret;
 	}
 
-	snprintf(fullname, len, "%s/%s", dumproot, name);
+	/* dump_file() reports its own errors */
+	return dump_file(rc->rc_fs, ri->ri_blkno, fd, ri->ri_path, 1);
+}
 
-	ret = ocfs2_malloc_block(fs->fs_io, &buf);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating a block");
-		goto bail;
+static void *rdump_worker(void *arg)
+{
+	errcode_t ret;
+	struct rdump_context *rc = arg;
+	struct rdump_item *ri;
+
+	pthread_mutex_lock(&rc->rc_lock);
+	for (;;) {
+		while (list_empty(&rc->rc_files) && !rc->rc_walk_done)
+			pthread_cond_wait(&rc->rc_work_cond, &rc->rc_lock);
+		if (list_empty(&rc->rc_files))
+			break;
+
+		ri = list_entry(rc->rc_files.next, struct rdump_item,
+				ri_list);
+		list_del(&ri->ri_list);
+		rc->rc_nr_files--;
+		pthread_cond_signal(&rc->rc_space_cond);
+		pthread_mutex_unlock(&rc->rc_lock);
+
+		ret = rdump_file(rc, ri);
+
+		pthread_mutex_lock(&rc->rc_lock);
+		rdump_account(rc, 0, ri->ri_size, ret);
+		rdump_item_free(ri);
+	}
+	pthread_mutex_unlock(&rc->rc_lock);
+
+	return NULL;
+}
+
+/* Dump the file now, or queue it for a worker.  Takes ownership of ri */
+static void rdump_queue_file(struct rdump_context *rc, struct rdump_item *ri)
+{
+	errcode_t ret;
+
+	if (!rc->rc_nr_workers) {
+		ret = rdump_file(rc, ri);
+		pthread_mutex_lock(&rc->rc_lock);
+		rdump_account(rc, 0, ri->ri_size, ret);
+		pthread_mutex_unlock(&rc->rc_lock);
+		rdump_item_free(ri);
+		return;
 	}
 
-	ret = ocfs2_read_inode(fs, blkno, buf);
+	pthread_mutex_lock(&rc->rc_lock);
+	while (rc->rc_nr_files >= RDUMP_MAX_QUEUED)
+		pthread_cond_wait(&rc->rc_space_cond, &rc->rc_lock);
+	list_add_tail(&ri->ri_list, &rc->rc_files);
+	rc->rc_nr_files++;
+	pthread_cond_signal(&rc->rc_work_cond);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
+/* Found by the walk.  Takes ownership of ri */
+static void rdump_one(struct rdump_context *rc, struct rdump_item *ri)
+{
+	errcode_t ret;
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)rc->rc_buf;
+
+	ret = ocfs2_read_inode(rc->rc_fs, ri->ri_blkno, rc->rc_buf);
 	if (ret) {
 		com_err(gbls.cmd, ret, "while reading inode %"PRIu64,
-		       	blkno);
+			ri->ri_blkno);
 		goto bail;
 	}
 
-	di = (struct ocfs2_dinode *)buf;
+	if (S_ISREG(di->i_mode)) {
+		ri->ri_size = di->i_size;
+		rdump_queue_file(rc, ri);
+		return;
+	}
 
 	if (S_ISLNK(di->i_mode)) {
-		ret = dump_symlink(fs, blkno, fullname, di);
+		ret = dump_symlink(rc->rc_fs, ri->ri_blkno, ri->ri_path, di);
 		if (ret)
-			goto bail;
-	} else if (S_ISREG(di->i_mode)) {
-		if (verbose)
-			fprintf(stdout, "%s\n", fullname);
-		fd = open64(fullname, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-		if (fd == -1) {
-			com_err(gbls.cmd, errno, "while opening file %s",
-				fullname);
-			ret = errno;
-			goto bail;
-		}
+			com_err(gbls.cmd, ret, "while making symlink %s",
+				ri->ri_path);
+		goto bail;
+	}
 
-		ret = dump_file(fs, blkno, fd, fullname, 1);
-		if (ret)
-			goto bail;
-	} else if (S_ISDIR(di->i_mode) && strcmp(name, ".") &&
-		   strcmp(name, "..")) {
-
-		if (verbose)
-			fprintf(stdout, "%s\n", fullname);
-		/* Create the directory with 0700 permissions, because we
-		 * expect to have to create entries it.  Then fix its perms
-		 * once we've done the traversal. */
-		if (mkdir(fullname, S_IRWXU) == -1) {
-			com_err(gbls.cmd, errno, "while making directory %s",
-				fullname);
-			ret = errno;
-			goto bail;
-		}
+	/* Don't dump device files, sockets, fifos, etc. */
+	if (!S_ISDIR(di->i_mode))
+		goto bail;
+
+	if (rc->rc_verbose)
+		fprintf(stdout, "%s\n", ri->ri_path);
+
+	/* Writable until its permissions are fixed at the end */
+	if (mkdir(ri->ri_path, S_IRWXU) == -1) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while making directory %s",
+			ri->ri_path);
+		goto bail;
+	}
+
+	list_add_tail(&ri->ri_list, &rc->rc_dirs);
+	return;
+
+bail:
+	if (ret)
+		rdump_error(rc, ret);
+	rdump_item_free(ri);
+}
+
+static int rdump_dirent(struct ocfs2_dir_entry *rec, uint64_t blocknr,
+			int offset, int blocksize, char *buf, void *priv_data)
+{
+	errcode_t ret;
+	struct rdump_context *rc = priv_data;
+	struct rdump_item *ri;
 
-		ret = ocfs2_malloc_block(fs->fs_io, &dirbuf);
+	if (((rec->name_len == 1) && (rec->name[0] == '.')) ||
+	    ((rec->name_len == 2) && !strncmp(rec->name, "..", 2)))
+		return 0;
+
+	ret = rdump_item_new(rec->inode, rc->rc_dir->ri_path, rec->name,
+			     rec->name_len, &ri);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while allocating a dump entry");
+		rdump_error(rc, ret);
+		return OCFS2_DIRENT_ABORT;
+	}
+
+	rdump_one(rc, ri);
+
+	return 0;
+}
+
+static void rdump_fix_dir_perms(struct rdump_context *rc,
+				struct rdump_item *ri)
+{
+	int fd = -1;
+	errcode_t ret;
+
+	ret = ocfs2_read_inode(rc->rc_fs, ri->ri_blkno, rc->rc_buf);
+	if (!ret)
+		ret = fix_perms((struct ocfs2_dinode *)rc->rc_buf, &fd,
+				ri->ri_path);
+	if (ret)
+		com_err(gbls.cmd, ret, "while setting permissions on %s",
+			ri->ri_path);
+
+	pthread_mutex_lock(&rc->rc_lock);
+	rdump_account(rc, 1, 0, ret);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
+static void rdump_print_summary(struct rdump_context *rc,
+				struct timeval *start)
+{
+	struct timeval now;
+	double secs, mb;
+
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - start->tv_sec) +
+		((double)now.tv_usec - start->tv_usec) / 1000000;
+	mb = (double)rc->rc_bytes / (1024 * 1024);
+
+	fprintf(stdout, "Dumped %"PRIu64" files and %"PRIu64" directories, "
+		"%.1f MB in %.2f seconds (%.1f MB/s)\n", rc->rc_files_done,
+		rc->rc_dirs_done, mb, secs, secs > 0 ? mb / secs : 0);
+	if (rc->rc_errors)
+		fprintf(stdout, "%"PRIu64" inodes could not be dumped\n",
+			rc->rc_errors);
+}
+
+errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
+		      const char *dumproot, int verbose, int jobs)
+{
+	int i, progress = 0;
+	errcode_t ret;
+	pthread_t *threads = NULL;
+	struct rdump_item *ri;
+	struct list_head *pos, *next;
+	struct timeval start;
+	struct rdump_context rc = {
+		.rc_fs = fs,
+		.rc_verbose = verbose,
+	};
+
+	INIT_LIST_HEAD(&rc.rc_dirs);
+	INIT_LIST_HEAD(&rc.rc_walked);
+	INIT_LIST_HEAD(&rc.rc_files);
+	pthread_mutex_init(&rc.rc_lock, NULL);
+	pthread_cond_init(&rc.rc_work_cond, NULL);
+	pthread_cond_init(&rc.rc_space_cond, NULL);
+	gettimeofday(&start, NULL);
+
+	ret = ocfs2_malloc_block(fs->fs_io, &rc.rc_buf);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while allocating a block");
+		goto bail;
+	}
+
+	if (!verbose && isatty(STDOUT_FILENO)) {
+		tools_progress_enable();
+		progress = 1;
+	}
+	rc.rc_prog = tools_progress_start("Dumping files", "rdump", 0);
+	if (!rc.rc_prog) {
+		ret = OCFS2_ET_NO_MEMORY;
+		com_err(gbls.cmd, ret, "while initializing progress display");
+		goto bail;
+	}
+
+	if (jobs > 1) {
+		ret = ocfs2_malloc0(sizeof(pthread_t) * jobs, &threads);
 		if (ret) {
-			com_err(gbls.cmd, ret, "while allocating a block");
+			com_err(gbls.cmd, ret, "while allocating threads");
 			goto bail;
 		}
+	}
 
-		rd_opts.fs = fs;
-		rd_opts.buf = dirbuf;
-		rd_opts.fullname = fullname;
-		rd_opts.verbose = verbose;
+	/* If no worker starts, the walk dumps the files itself */
+	for (i = 0; threads && (i < jobs); i++) {
+		if (pthread_create(&threads[i], NULL, rdump_worker, &rc))
+			break;
+		rc.rc_nr_workers++;
+	}
 
-		ret = ocfs2_dir_iterate(fs, blkno, 0, NULL,
-					rdump_dirent, (void *)&rd_opts);
+	ret = rdump_item_new(blkno, dumproot, name, strlen(name), &ri);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while allocating a dump entry");
+		rdump_error(&rc, ret);
+	} else
+		rdump_one(&rc, ri);
+
+	while (!list_empty(&rc.rc_dirs)) {
+		rc.rc_dir = list_entry(rc.rc_dirs.next, struct rdump_item,
+				       ri_list);
+		list_del(&rc.rc_dir->ri_list);
+		list_add(&rc.rc_dir->ri_list, &rc.rc_walked);
+
+		ret = ocfs2_dir_iterate(fs, rc.rc_dir->ri_blkno, 0, NULL,
+					rdump_dirent, &rc);
 		if (ret) {
 			com_err(gbls.cmd, ret, "while iterating directory at "
-				"block %"PRIu64, blkno);
-			goto bail;
+				"block %"PRIu64, rc.rc_dir->ri_blkno);
+			rdump_error(&rc, ret);
 		}
+	}
 
-		fd = -1;
-		ret = fix_perms(di, &fd, fullname);
-		if (ret)
-			goto bail;
+	pthread_mutex_lock(&rc.rc_lock);
+	rc.rc_walk_done = 1;
+	pthread_cond_broadcast(&rc.rc_work_cond);
+	pthread_mutex_unlock(&rc.rc_lock);
+
+	for (i = 0; i < rc.rc_nr_workers; i++)
+		pthread_join(threads[i], NULL);
+
+	list_for_each_safe(pos, next, &rc.rc_walked) {
+		ri = list_entry(pos, struct rdump_item, ri_list);
+		rdump_fix_dir_perms(&rc, ri);
+		list_del(&ri->ri_list);
+		rdump_item_free(ri);
 	}
-	/* else do nothing (don't dump device files, sockets, fifos, etc.) */
+
+	tools_progress_stop(rc.rc_prog);
+	rc.rc_prog = NULL;
+	rdump_print_summary(&rc, &start);
+	ret = rc.rc_ret;
 
 bail:
-	if (fullname)
-		ocfs2_free(&fullname);
-	if (buf)
-		ocfs2_free(&buf);
-	if (dirbuf)
-		ocfs2_free(&dirbuf);
+	if (rc.rc_prog)
+		tools_progress_stop(rc.rc_prog);
+	if (progress)
+		tools_progress_disable();
+	if (threads)
+		ocfs2_free(&threads);
+	if (rc.rc_buf)
+		ocfs2_free(&rc.rc_buf);
+	pthread_cond_destroy(&rc.rc_space_cond);
+	pthread_cond_destroy(&rc.rc_work_cond);
+	pthread_mutex_destroy(&rc.rc_lock);
 
 	return ret;
 }
@@ -19,7 +19,7 @@
  *
  * --
  *
- * Just a simple rbtree wrapper to record directory blocks and the inodes
+ * Just a simple chunked array to record directory blocks and the inodes
  * that own them.
  */
 #include <unistd.h>
@@ -36,101 +36,303 @@
 #include "util.h"
 #include "extent.h"
 
-#define NUM_RA_BLOCKS		1024
-static void o2fsck_readahead_dirblocks(o2fsck_state *ost, struct rb_node *node,
-				       struct rb_node **last_read_node)
+#define DIRBLOCKS_MIN_CHUNKS	16
+
+static inline o2fsck_dirblock_entry *dirblock_entry(o2fsck_dirblocks *db,
+						    uint64_t i)
 {
-	ocfs2_filesys *fs = ost->ost_fs;
-	o2fsck_dirblock_entry *dbe;
-	struct io_vec_unit *ivus = NULL;
-	char *buf = NULL;
-	int buflen =  NUM_RA_BLOCKS * fs->fs_blocksize;
-	uint32_t offset = 0;
-	int i;
+	return &db->db_chunks[i / DIRBLOCKS_CHUNK][i % DIRBLOCKS_CHUNK];
+}
+
+/*
+ * Pass 2 readahead.  Directory blocks are read in runs of adjacent
+ * blocks, up to DIRBLOCK_RUN_BLOCKS a run, and DIRBLOCK_RA_RUNS runs
+ * are kept in flight ahead of the iterator.  The iterator hands each
+ * block's buffer straight to the caller.
+ */
+#define DIRBLOCK_RA_RUNS	32
+#define DIRBLOCK_RUN_BLOCKS	32
+
+enum dirblock_run_state {
+	RUN_NONE = 0,		/* No buffer; the caller reads the block */
+	RUN_READING,
+	RUN_READY,
+};
+
+struct dirblock_run {
+	uint64_t		r_first;	/* Index of the first entry */
+	int			r_nr;		/* Entries in the run */
+	char			*r_buf;
+	struct io_vec_unit	r_ivu;
+	enum dirblock_run_state	r_state;
+	errcode_t		r_errs[DIRBLOCK_RUN_BLOCKS];
+};
+
+struct dirblock_readahead {
+	o2fsck_state		*ra_ost;
+	struct dirblock_run	ra_runs[DIRBLOCK_RA_RUNS];
+	int			ra_head;
+	int			ra_queued;
+	uint64_t		ra_next;	/* Next entry to queue */
+};
+
+/*
+ * How many entries from i on can be read as one run.  A block that is
+ * listed twice, or an inline dir whose "block" is its inode, is left
+ * to the caller so it sees any changes made before it gets there.
+ */
+static int dirblock_run_length(o2fsck_dirblocks *db, uint64_t i)
+{
+	o2fsck_dirblock_entry *dbe = dirblock_entry(db, i);
+	int nr;
+
+	if ((dbe->e_blkno == dbe->e_ino) ||
+	    (i && (dbe->e_blkno == dirblock_entry(db, i - 1)->e_blkno)))
+		return 0;
+
+	for (nr = 1; (nr < DIRBLOCK_RUN_BLOCKS) &&
+		     (i + nr < db->db_numblocks); nr++) {
+		if (dirblock_entry(db, i + nr)->e_blkno != dbe->e_blkno + nr)
+			break;
+	}
+
+	return nr;
+}
+
+static void dirblock_queue_runs(struct dirblock_readahead *ra)
+{
+	ocfs2_filesys *fs = ra->ra_ost->ost_fs;
+	o2fsck_dirblocks *db = &ra->ra_ost->ost_dirblocks;
+	struct dirblock_run *run;
+	errcode_t ret;
+
+	while ((ra->ra_queued < DIRBLOCK_RA_RUNS) &&
+	       (ra->ra_next < db->db_numblocks)) {
+		run = &ra->ra_runs[(ra->ra_head + ra->ra_queued) %
+				   DIRBLOCK_RA_RUNS];
+		run->r_first = ra->ra_next;
+		run->r_nr = dirblock_run_length(db, ra->ra_next);
+		run->r_state = RUN_NONE;
+
+		if (run->r_nr && run->r_buf) {
+			run->r_ivu.ivu_blkno =
+				dirblock_entry(db, ra->ra_next)->e_blkno;
+			run->r_ivu.ivu_buf = run->r_buf;
+			run->r_ivu.ivu_buflen = run->r_nr * fs->fs_blocksize;
+			ret = io_vec_submit(fs->fs_io, &run->r_ivu, 1);
+			if (!ret)
+				run->r_state = RUN_READING;
+		}
+
+		if (!run->r_nr)
+			run->r_nr = 1;
+		ra->ra_next += run->r_nr;
+		ra->ra_queued++;
+	}
+}
+
+/* The buffer holding entry i, or NULL if the caller must read it */
+static char *dirblock_ra_get(struct dirblock_readahead *ra, uint64_t i)
+{
+	ocfs2_filesys *fs = ra->ra_ost->ost_fs;
+	struct dirblock_run *run;
 	errcode_t ret;
 
-	*last_read_node = NULL;
+	run = &ra->ra_runs[ra->ra_head];
+	if (ra->ra_queued && (i >= run->r_first + run->r_nr)) {
+		ra->ra_head = (ra->ra_head + 1) % DIRBLOCK_RA_RUNS;
+		ra->ra_queued--;
+		run = &ra->ra_runs[ra->ra_head];
+	}
 
-	if (!fs->fs_io)
-		return;
+	dirblock_queue_runs(ra);
+
+	if (run->r_state == RUN_READING) {
+		ret = io_vec_wait(fs->fs_io, &run->r_ivu);
+		run->r_state = ret ? RUN_NONE : RUN_READY;
+
+		/*
+		 * Check the whole run's trailers at once.  Directories
+		 * with blocks have trailers whenever metaecc is on.
+		 */
+		if (!ret)
+			ocfs2_validate_meta_ecc_blocks(fs, run->r_buf,
+				run->r_nr,
+				ocfs2_dir_trailer_blk_off(fs) +
+				offsetof(struct ocfs2_dir_block_trailer,
+					 db_check),
+				run->r_errs);
+	}
 
-	if (buflen > io_get_cache_size(fs->fs_io))
-		return;
+	if (run->r_state != RUN_READY)
+		return NULL;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, NUM_RA_BLOCKS, &buf);
-	if (ret)
-		goto out;
-	 memset(buf, 0, buflen);
+	/* The caller reads a bad block itself, and reports it */
+	if (run->r_errs[i - run->r_first])
+		return NULL;
 
-	ret = ocfs2_malloc(sizeof(struct io_vec_unit) * NUM_RA_BLOCKS, &ivus);
-	if (ret)
-		goto out;
+	return run->r_buf + ((i - run->r_first) * fs->fs_blocksize);
+}
 
-	for (i = 0; node && (i < NUM_RA_BLOCKS); ++i, node = rb_next(node)) {
-		dbe = rb_entry(node, o2fsck_dirblock_entry, e_node);
-		ivus[i].ivu_blkno = dbe->e_blkno;
-		ivus[i].ivu_buf = buf + offset;
-		ivus[i].ivu_buflen = fs->fs_blocksize;
-		offset += fs->fs_blocksize;
-		*last_read_node = node;
+static void dirblock_ra_init(struct dirblock_readahead *ra,
+			     o2fsck_state *ost)
+{
+	int i;
+
+	memset(ra, 0, sizeof(struct dirblock_readahead));
+	ra->ra_ost = ost;
+
+	/* Without buffers every run is left to the caller */
+	for (i = 0; i < DIRBLOCK_RA_RUNS; i++) {
+		if (ocfs2_malloc_blocks(ost->ost_fs->fs_io,
+					DIRBLOCK_RUN_BLOCKS,
+					&ra->ra_runs[i].r_buf))
+			break;
 	}
+}
 
-	ret = io_vec_read_blocks(fs->fs_io, ivus, i);
+static void dirblock_ra_free(struct dirblock_readahead *ra)
+{
+	struct dirblock_run *run;
+	int i;
 
-out:
-	ocfs2_free(&ivus);
-	ocfs2_free(&buf);
+	/* The reads have to land before their buffers go away */
+	for (i = 0; i < ra->ra_queued; i++) {
+		run = &ra->ra_runs[(ra->ra_head + i) % DIRBLOCK_RA_RUNS];
+		if (run->r_state == RUN_READING)
+			io_vec_wait(ra->ra_ost->ost_fs->fs_io, &run->r_ivu);
+	}
+
+	for (i = 0; i < DIRBLOCK_RA_RUNS; i++) {
+		if (ra->ra_runs[i].r_buf)
+			ocfs2_free(&ra->ra_runs[i].r_buf);
+	}
 }
 
 errcode_t o2fsck_add_dir_block(o2fsck_dirblocks *db, uint64_t ino,
 			       uint64_t blkno, uint64_t blkcount)
 {
-	struct rb_node ** p = &db->db_root.rb_node;
-	struct rb_node * parent = NULL;
-	o2fsck_dirblock_entry *dbe, *tmp_dbe;
+	o2fsck_dirblock_entry *dbe;
+	uint64_t max;
 	errcode_t ret = 0;
 
-	ret = ocfs2_malloc0(sizeof(o2fsck_dirblock_entry), &dbe);
-	if (ret)
-		goto out;
+	if (db->db_numblocks == db->db_numchunks * DIRBLOCKS_CHUNK) {
+		if (db->db_numchunks == db->db_maxchunks) {
+			max = db->db_maxchunks ? db->db_maxchunks * 2 :
+						 DIRBLOCKS_MIN_CHUNKS;
+			ret = ocfs2_realloc(sizeof(o2fsck_dirblock_entry *) *
+					    max, &db->db_chunks);
+			if (ret)
+				goto out;
+			db->db_maxchunks = max;
+		}
 
+		ret = ocfs2_malloc(sizeof(o2fsck_dirblock_entry) *
+				   DIRBLOCKS_CHUNK,
+				   &db->db_chunks[db->db_numchunks]);
+		if (ret)
+			goto out;
+		db->db_numchunks++;
+	}
+
+	if (db->db_numblocks &&
+	    (blkno < dirblock_entry(db, db->db_numblocks - 1)->e_blkno))
+		db->db_unsorted = 1;
+
+	dbe = dirblock_entry(db, db->db_numblocks++);
 	dbe->e_ino = ino;
 	dbe->e_blkno = blkno;
 	dbe->e_blkcount = blkcount;
 
-	while (*p)
-	{
-		parent = *p;
-		tmp_dbe = rb_entry(parent, o2fsck_dirblock_entry, e_node);
+out:
+	return ret;
+}
 
-		if (dbe->e_blkno < tmp_dbe->e_blkno)
-			p = &(*p)->rb_left;
-		else if (dbe->e_blkno > tmp_dbe->e_blkno)
-			p = &(*p)->rb_right;
-	}
+void o2fsck_free_dir_blocks(o2fsck_dirblocks *db)
+{
+	uint64_t i;
+
+	for (i = 0; i < db->db_numchunks; i++)
+		ocfs2_free(&db->db_chunks[i]);
+	if (db->db_chunks)
+		ocfs2_free(&db->db_chunks);
+	db->db_numchunks = 0;
+	db->db_maxchunks = 0;
+	db->db_numblocks = 0;
+	db->db_unsorted = 0;
+}
 
-	rb_link_node(&dbe->e_node, parent, p);
-	rb_insert_color(&dbe->e_node, &db->db_root);
-	db->db_numblocks++;
+static int dirblock_cmp(const o2fsck_dirblock_entry *l,
+			const o2fsck_dirblock_entry *r)
+{
+	if (l->e_blkno < r->e_blkno)
+		return -1;
+	if (l->e_blkno > r->e_blkno)
+		return 1;
+	if (l->e_ino < r->e_ino)
+		return -1;
+	if (l->e_ino > r->e_ino)
+		return 1;
+	return 0;
+}
 
-out:
-	return ret;
+static void dirblock_sift_down(o2fsck_dirblocks *db, uint64_t root,
+			       uint64_t nr)
+{
+	uint64_t child;
+	o2fsck_dirblock_entry tmp, *parent, *big;
+
+	while ((child = root * 2 + 1) < nr) {
+		if ((child + 1 < nr) &&
+		    (dirblock_cmp(dirblock_entry(db, child),
+				  dirblock_entry(db, child + 1)) < 0))
+			child++;
+
+		parent = dirblock_entry(db, root);
+		big = dirblock_entry(db, child);
+		if (dirblock_cmp(parent, big) >= 0)
+			break;
+
+		tmp = *parent;
+		*parent = *big;
+		*big = tmp;
+		root = child;
+	}
+}
+
+/* The chunks aren't one array, so qsort() can't have them */
+static void dirblock_sort(o2fsck_dirblocks *db)
+{
+	uint64_t i, nr = db->db_numblocks;
+	o2fsck_dirblock_entry tmp, *first, *last;
+
+	for (i = nr / 2; i > 0; i--)
+		dirblock_sift_down(db, i - 1, nr);
+
+	for (i = nr; i > 1; i--) {
+		first = dirblock_entry(db, 0);
+		last = dirblock_entry(db, i - 1);
+		tmp = *first;
+		*first = *last;
+		*last = tmp;
+		dirblock_sift_down(db, 0, i - 1);
+	}
 }
 
 uint64_t o2fsck_search_reidx_dir(struct rb_root *root, uint64_t dino)
 {
 	struct rb_node *node = root->rb_node;
-	o2fsck_dirblock_entry *dbe;
+	o2fsck_reidx_dir *dp;
 
 	while (node) {
-		dbe = rb_entry(node, o2fsck_dirblock_entry, e_node);
+		dp = rb_entry(node, o2fsck_reidx_dir, rd_node);
 
-		if (dino < dbe->e_ino)
+		if (dino < dp->rd_ino)
 			node = node->rb_left;
-		else if (dino > dbe->e_ino)
+		else if (dino > dp->rd_ino)
 			node = node->rb_right;
 		else
-			return dbe->e_ino;
+			return dp->rd_ino;
 	}
 	return 0;
 }
@@ -139,23 +341,23 @@ static errcode_t o2fsck_add_reidx_dir_ino(struct rb_root *root, uint64_t dino)
 {
 	struct rb_node **p = &root->rb_node;
 	struct rb_node *parent = NULL;
-	o2fsck_dirblock_entry *dp, *tmp_dp;
+	o2fsck_reidx_dir *dp, *tmp_dp;
 	errcode_t ret = 0;
 
-	ret = ocfs2_malloc0(sizeof (o2fsck_dirblock_entry), &dp);
+	ret = ocfs2_malloc0(sizeof (o2fsck_reidx_dir), &dp);
 	if (ret)
 		goto out;
 
-	dp->e_ino = dino;
+	dp->rd_ino = dino;
 
 	while(*p)
 	{
 		parent = *p;
-		tmp_dp = rb_entry(parent, o2fsck_dirblock_entry, e_node);
+		tmp_dp = rb_entry(parent, o2fsck_reidx_dir, rd_node);
 
-		if (dp->e_ino < tmp_dp->e_ino)
+		if (dp->rd_ino < tmp_dp->rd_ino)
 			p = &(*p)->rb_left;
-		else if (dp->e_ino > tmp_dp->e_ino)
+		else if (dp->rd_ino > tmp_dp->rd_ino)
 			p = &(*p)->rb_right;
 		else {
 			ret = OCFS2_ET_INTERNAL_FAILURE;
@@ -164,8 +366,8 @@ static errcode_t o2fsck_add_reidx_dir_ino(struct rb_root *root, uint64_t dino)
 		}
 	}
 
-	rb_link_node(&dp->e_node, parent, p);
-	rb_insert_color(&dp->e_node, root);
+	rb_link_node(&dp->rd_node, parent, p);
+	rb_insert_color(&dp->rd_node, root);
 
 out:
 	return ret;
@@ -188,24 +390,27 @@ void o2fsck_dir_block_iterate(o2fsck_state *ost, dirblock_iterator func,
 			      void *priv_data)
 {
 	o2fsck_dirblocks *db = &ost->ost_dirblocks;
-	o2fsck_dirblock_entry *dbe;
-	struct rb_node *node, *last_read_node = NULL;
+	struct dirblock_readahead ra;
+	uint64_t i;
 	unsigned ret;
-	int readahead = 1;
-
-	for (node = rb_first(&db->db_root); node; node = rb_next(node)) {
-		dbe = rb_entry(node, o2fsck_dirblock_entry, e_node);
-		if (readahead)
-			o2fsck_readahead_dirblocks(ost, node, &last_read_node);
-		readahead = 0;
-		ret = func(dbe, priv_data);
+
+	if (db->db_unsorted) {
+		dirblock_sort(db);
+		db->db_unsorted = 0;
+	}
+
+	dirblock_ra_init(&ra, ost);
+
+	for (i = 0; i < db->db_numblocks; i++) {
+		ret = func(dirblock_entry(db, i), dirblock_ra_get(&ra, i),
+			   priv_data);
 		if (ret & OCFS2_DIRENT_ABORT)
 			break;
 		if (ost->ost_prog)
 			tools_progress_step(ost->ost_prog, 1);
-		if (last_read_node == node)
-			readahead = 1;
 	}
+
+	dirblock_ra_free(&ra);
 }
 
 static errcode_t ocfs2_rebuild_indexed_dir(ocfs2_filesys *fs, uint64_t ino)
@@ -243,13 +448,13 @@ out:
 errcode_t o2fsck_rebuild_indexed_dirs(ocfs2_filesys *fs, struct rb_root *root)
 {
 	struct rb_node *node;
-	o2fsck_dirblock_entry *dbe;
+	o2fsck_reidx_dir *dp;
 	uint64_t ino;
 	errcode_t ret = 0;
 
 	for (node = rb_first(root); node; node = rb_next(node)) {
-		dbe = rb_entry(node, o2fsck_dirblock_entry, e_node);
-		ino = dbe->e_ino;
+		dp = rb_entry(node, o2fsck_reidx_dir, rd_node);
+		ino = dp->rd_ino;
 		ret = ocfs2_rebuild_indexed_dir(fs, ino);
 		if (ret)
 			goto out;
@@ -119,7 +119,7 @@ static void print_usage(void)
 {
 	fprintf(stderr,
 		"Usage: fsck.ocfs2 {-y|-n|-p} [ -fGnuvVy ] [ -b superblock block ]\n"
-		"		    [ -B block size ] [-r num] device\n"
+		"		    [ -B block size ] [-j threads] [-r num] device\n"
 		"\n"
 		"Critical flags for emergency repair:\n" 
 		" -n		Check but don't change the file system\n"
@@ -133,6 +133,7 @@ static void print_usage(void)
 		" -b superblock	Treat given block as the super block\n"
 		" -B blocksize	Force the given block size\n"
 		" -G		Ask to fix mismatched inode generations\n"
+		" -j threads	Check inodes on this many threads\n"
 		" -P		Show progress\n"
 		" -t		Show I/O statistics\n"
 		" -tt		Show I/O statistics per pass\n"
@@ -505,10 +506,10 @@ static errcode_t maybe_replay_journals(o2fsck_state *ost, char *filename,
 	       "replay the journals for nodes that didn't unmount cleanly\n",
 	       filename);
 
-	/* journal replay is careful not to use ost as we only really
-	 * build it up after spraying the journal all over the disk
-	 * and reopening */
-	ret = o2fsck_replay_journals(ost->ost_fs, &replayed);
+	/* journal replay is careful to only use ost's options as we
+	 * only really build it up after spraying the journal all over
+	 * the disk and reopening */
+	ret = o2fsck_replay_journals(ost, &replayed);
 	if (ret)
 		goto out;
 
@@ -679,8 +680,10 @@ int main(int argc, char **argv)
 {
 	char *filename;
 	int64_t blkno, blksize;
+	uint64_t threads;
 	o2fsck_state *ost = &_ost;
-	int c, open_flags = OCFS2_FLAG_RW | OCFS2_FLAG_STRICT_COMPAT_CHECK;
+	int c, open_flags = OCFS2_FLAG_RW | OCFS2_FLAG_STRICT_COMPAT_CHECK |
+		OCFS2_FLAG_IO_URING;
 	int sb_num = 0;
 	int fsck_mask = FSCK_OK;
 	int slot_recover_err = 0;
@@ -690,7 +693,7 @@ int main(int argc, char **argv)
 
 	memset(ost, 0, sizeof(o2fsck_state));
 	ost->ost_ask = 1;
-	ost->ost_dirblocks.db_root = RB_ROOT;
+	ost->ost_threads = 1;
 	ost->ost_dir_parents = RB_ROOT;
 	ost->ost_refcount_trees = RB_ROOT;
 
@@ -706,7 +709,7 @@ int main(int argc, char **argv)
 
 	tools_progress_disable();
 
-	while ((c = getopt(argc, argv, "b:B:DfFGnupavVytPr:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:B:DfFGj:nupavVytPr:")) != EOF) {
 		switch (c) {
 			case 'b':
 				blkno = read_number(optarg);
@@ -747,6 +750,19 @@ int main(int argc, char **argv)
 				ost->ost_fix_fs_gen = 1;
 				break;
 
+			case 'j':
+				threads = read_number(optarg);
+				if (!threads || threads > O2FSCK_MAX_THREADS) {
+					fprintf(stderr,
+						"Invalid thread count: %s\n",
+						optarg);
+					fsck_mask |= FSCK_USAGE;
+					print_usage();
+					goto out;
+				}
+				ost->ost_threads = threads;
+				break;
+
 			case 'n':
 				open_flags &= ~OCFS2_FLAG_RW;
 				open_flags |= OCFS2_FLAG_RO;
@@ -20,8 +20,12 @@
  *
  * --
  *
- * A trivial rbtree that stores a u16 icount indexed by an inode's block
- * number.
+ * Stores a u16 icount indexed by an inode's block number.  Inodes with
+ * one link, by far the most common, are a bit in a bitmap.  The rest live
+ * in sorted arrays.  Inserts land in a small sorted run, ic_new, that is
+ * merged into the big one, ic_multiple, in batches.  Entries that drop
+ * below two links are marked dead in place and swept out by the next
+ * merge.
  */
 #include <unistd.h>
 #include <stdlib.h>
@@ -35,63 +39,181 @@
 #include "icount.h"
 #include "util.h"
 
-typedef struct _icount_node {
-	struct rb_node	in_node;
-	uint64_t	in_blkno;
-	uint16_t	in_icount;
-} icount_node;
-
-/* XXX this is currently fragile in that it requires that the caller make
- * sure that the node doesn't already exist in the tree.
+/*
+ * ic_new is kept at about the square root of ic_multiple.  Each insert
+ * moves half of ic_new, each merge moves all of ic_multiple, and this
+ * balances the two.
  */
-static void icount_insert(o2fsck_icount *icount, icount_node *in)
+#define ICOUNT_NEW_MIN		1024
+#define ICOUNT_NEW_MAX		(1 << 16)
+
+/* Index of the first entry at or after blkno */
+static uint64_t run_search(struct icount_run *run, uint64_t blkno)
 {
-	struct rb_node ** p = &icount->ic_multiple_tree.rb_node;
-	struct rb_node * parent = NULL;
-	icount_node *tmp_in;
+	uint64_t lo = 0, hi = run->ir_nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (run->ir_blknos[mid] < blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	while (*p)
-	{
-		parent = *p;
-		tmp_in = rb_entry(parent, icount_node, in_node);
+	return lo;
+}
+
+static uint16_t *run_lookup(struct icount_run *run, uint64_t blkno)
+{
+	uint64_t i = run_search(run, blkno);
+
+	if (i < run->ir_nr && run->ir_blknos[i] == blkno)
+		return &run->ir_counts[i];
+	return NULL;
+}
+
+static errcode_t run_resize(struct icount_run *run, uint64_t max)
+{
+	errcode_t ret;
+
+	ret = ocfs2_realloc(max * sizeof(uint64_t), &run->ir_blknos);
+	if (ret)
+		return ret;
+
+	ret = ocfs2_realloc(max * sizeof(uint16_t), &run->ir_counts);
+	if (ret)
+		return ret;
+
+	run->ir_max = max;
+	return 0;
+}
+
+static void run_insert(struct icount_run *run, uint64_t i, uint64_t blkno,
+		       uint16_t count)
+{
+	memmove(run->ir_blknos + i + 1, run->ir_blknos + i,
+		(run->ir_nr - i) * sizeof(uint64_t));
+	memmove(run->ir_counts + i + 1, run->ir_counts + i,
+		(run->ir_nr - i) * sizeof(uint16_t));
+	run->ir_blknos[i] = blkno;
+	run->ir_counts[i] = count;
+	run->ir_nr++;
+}
 
-		if (in->in_blkno < tmp_in->in_blkno)
-			p = &(*p)->rb_left;
-		else if (in->in_blkno > tmp_in->in_blkno)
-			p = &(*p)->rb_right;
+/* Squeeze out the dead entries */
+static void run_compact(struct icount_run *run)
+{
+	uint64_t i, j;
+
+	for (i = 0, j = 0; i < run->ir_nr; i++) {
+		if (!run->ir_counts[i])
+			continue;
+		run->ir_blknos[j] = run->ir_blknos[i];
+		run->ir_counts[j] = run->ir_counts[i];
+		j++;
 	}
+	run->ir_nr = j;
+}
 
-	rb_link_node(&in->in_node, parent, p);
-	rb_insert_color(&in->in_node, &icount->ic_multiple_tree);
+static uint16_t *icount_lookup(o2fsck_icount *icount, uint64_t blkno)
+{
+	uint16_t *count;
+
+	count = run_lookup(&icount->ic_multiple, blkno);
+	if (!count)
+		count = run_lookup(&icount->ic_new, blkno);
+	return count;
 }
 
-static icount_node *icount_search(o2fsck_icount *icount, uint64_t blkno,
-				  icount_node **next)
+/*
+ * Fold ic_new into ic_multiple.  Both are compacted first, then merged
+ * from the back so that ic_multiple can be merged in place.
+ */
+static errcode_t icount_merge(o2fsck_icount *icount)
 {
-	struct rb_node *node = icount->ic_multiple_tree.rb_node;
-	icount_node *in, *last_left = NULL;
+	errcode_t ret;
+	struct icount_run *big = &icount->ic_multiple;
+	struct icount_run *new = &icount->ic_new;
+	uint64_t i, j, k, want;
 
-	while (node) {
-		in = rb_entry(node, icount_node, in_node);
+	if (icount->ic_dead) {
+		run_compact(big);
+		icount->ic_dead = 0;
+	}
+	run_compact(new);
+
+	if (big->ir_nr + new->ir_nr > big->ir_max) {
+		want = big->ir_max ? big->ir_max : ICOUNT_NEW_MIN;
+		while (want < big->ir_nr + new->ir_nr)
+			want *= 2;
+		ret = run_resize(big, want);
+		if (ret)
+			return ret;
+	}
 
-		if (blkno < in->in_blkno) {
-			last_left = in;
-			node = node->rb_left;
-		} else if (blkno > in->in_blkno)
-			node = node->rb_right;
-		else
-			return in;
+	i = big->ir_nr;
+	j = new->ir_nr;
+	k = i + j;
+	while (j) {
+		k--;
+		if (i && big->ir_blknos[i - 1] > new->ir_blknos[j - 1]) {
+			i--;
+			big->ir_blknos[k] = big->ir_blknos[i];
+			big->ir_counts[k] = big->ir_counts[i];
+		} else {
+			j--;
+			big->ir_blknos[k] = new->ir_blknos[j];
+			big->ir_counts[k] = new->ir_counts[j];
+		}
 	}
-	if (next && last_left)
-		*next = last_left;
-	return NULL;
+	big->ir_nr += new->ir_nr;
+	new->ir_nr = 0;
+
+	for (want = ICOUNT_NEW_MIN;
+	     want < ICOUNT_NEW_MAX && (want * want) < big->ir_nr;
+	     want *= 2)
+		;
+	if (want > new->ir_max)
+		return run_resize(new, want);
+
+	return 0;
+}
+
+static errcode_t icount_insert(o2fsck_icount *icount, uint64_t blkno,
+			       uint16_t count)
+{
+	errcode_t ret;
+	struct icount_run *big = &icount->ic_multiple;
+	struct icount_run *new = &icount->ic_new;
+
+	/* Pass 1 sets icounts in disk order, which can simply append */
+	if (!new->ir_nr &&
+	    (!big->ir_nr || big->ir_blknos[big->ir_nr - 1] < blkno)) {
+		if (big->ir_nr == big->ir_max) {
+			ret = run_resize(big, big->ir_max ?
+					 big->ir_max * 2 : ICOUNT_NEW_MIN);
+			if (ret)
+				return ret;
+		}
+		run_insert(big, big->ir_nr, blkno, count);
+		return 0;
+	}
+
+	if (new->ir_nr == new->ir_max) {
+		ret = icount_merge(icount);
+		if (ret)
+			return ret;
+	}
+
+	run_insert(new, run_search(new, blkno), blkno, count);
+	return 0;
 }
 
 /* keep it simple for now by always updating both data structures */
 errcode_t o2fsck_icount_set(o2fsck_icount *icount, uint64_t blkno, 
 			    uint16_t count)
 {
-	icount_node *in;
+	uint16_t *in;
 	errcode_t ret = 0;
 
 	if (count == 1)
@@ -99,33 +221,32 @@ errcode_t o2fsck_icount_set(o2fsck_icount *icount, uint64_t blkno,
 	else
 		o2fsck_bitmap_clear(icount->ic_single_bm, blkno, NULL);
 
-	in = icount_search(icount, blkno, NULL);
-	if (in) {
-		if (count < 2) {
-			rb_erase(&in->in_node, &icount->ic_multiple_tree);
-			free(in);
-		} else {
-			in->in_icount = count;
-		}
-	} else if (count > 1) {
-		in = calloc(1, sizeof(*in));
-		if (in == NULL) {
-			ret = OCFS2_ET_NO_MEMORY;
-			goto out;
-		}
+	if (count < 2)
+		count = 0;
 
-		in->in_blkno = blkno;
-		in->in_icount = count;
-		icount_insert(icount, in);
+	in = run_lookup(&icount->ic_multiple, blkno);
+	if (in) {
+		if (*in && !count)
+			icount->ic_dead++;
+		else if (!*in && count)
+			icount->ic_dead--;
+		*in = count;
+		goto out;
 	}
 
+	in = run_lookup(&icount->ic_new, blkno);
+	if (in)
+		*in = count;
+	else if (count)
+		ret = icount_insert(icount, blkno, count);
+
 out:
 	return ret;
 }
 
 uint16_t o2fsck_icount_get(o2fsck_icount *icount, uint64_t blkno)
 {
-	icount_node *in;
+	uint16_t *in;
 	int was_set;
 	uint16_t ret = 0;
 
@@ -135,9 +256,9 @@ uint16_t o2fsck_icount_get(o2fsck_icount *icount, uint64_t blkno)
 		goto out;
 	}
 
-	in = icount_search(icount, blkno, NULL);
+	in = icount_lookup(icount, blkno);
 	if (in)
-		ret = in->in_icount;
+		ret = *in;
 
 out:
 	return ret;
@@ -145,27 +266,16 @@ out:
 
 /* again, simple before efficient.  We just find the old value and
  * use _set to make sure that the new value updates both the bitmap
- * and the tree */
+ * and the arrays */
 void o2fsck_icount_delta(o2fsck_icount *icount, uint64_t blkno, 
 			 int delta)
 {
-	int was_set;
 	uint16_t prev_count;
-	icount_node *in;
 
 	if (delta == 0)
 		return;
 
-	ocfs2_bitmap_test(icount->ic_single_bm, blkno, &was_set);
-	if (was_set) {
-		prev_count = 1;
-	} else {
-		in = icount_search(icount, blkno, NULL);
-		if (in == NULL)
-			prev_count = 0;
-		else
-			prev_count = in->in_icount;
-	}
+	prev_count = o2fsck_icount_get(icount, blkno);
 
 	if (prev_count + delta < 0) 
 		com_err(__FUNCTION__, OCFS2_ET_INTERNAL_FAILURE,
@@ -192,32 +302,51 @@ errcode_t o2fsck_icount_new(ocfs2_filesys *fs, o2fsck_icount **ret)
 		return err;
 	}
 
-	icount->ic_multiple_tree = RB_ROOT;
+	err = run_resize(&icount->ic_new, ICOUNT_NEW_MIN);
+	if (err) {
+		o2fsck_icount_free(icount);
+		com_err("icount", err, "while allocating multiple link_count "
+			"array");
+		return err;
+	}
 
 	*ret = icount;
 	return 0;
 }
 
+/* The first live entry at or after start */
+static uint64_t *run_next(struct icount_run *run, uint64_t start)
+{
+	uint64_t i;
+
+	for (i = run_search(run, start); i < run->ir_nr; i++) {
+		if (run->ir_counts[i])
+			return &run->ir_blknos[i];
+	}
+
+	return NULL;
+}
+
 errcode_t o2fsck_icount_next_blkno(o2fsck_icount *icount, uint64_t start,
 				   uint64_t *found)
 {
 	uint64_t next_bit;
 	errcode_t ret;
-	icount_node *in, *next = NULL;
+	uint64_t *in, *next;
 
 	ret = ocfs2_bitmap_find_next_set(icount->ic_single_bm, start,
 						  &next_bit);
 
-	in = icount_search(icount, start, &next);
-	if (in == NULL)
+	in = run_next(&icount->ic_multiple, start);
+	next = run_next(&icount->ic_new, start);
+	if (!in || (next && *next < *in))
 		in = next;
 
 	if (in) {
 		if (ret == OCFS2_ET_BIT_NOT_FOUND)
-			*found = in->in_blkno;
+			*found = *in;
 		else
-			*found = next_bit < in->in_blkno ? next_bit :
-							   in->in_blkno;
+			*found = next_bit < *in ? next_bit : *in;
 		ret = 0;
 	}
 	else {
@@ -227,16 +356,38 @@ errcode_t o2fsck_icount_next_blkno(o2fsck_icount *icount, uint64_t start,
 	return ret;
 }
 
-void o2fsck_icount_free(o2fsck_icount *icount)
+/* How many inodes have more than one link */
+uint64_t o2fsck_icount_multiple(o2fsck_icount *icount)
 {
-	struct rb_node *node;
-	icount_node *in; 
+	uint64_t i, nr = icount->ic_multiple.ir_nr - icount->ic_dead;
 
-	ocfs2_bitmap_free(icount->ic_single_bm);
-	while((node = rb_first(&icount->ic_multiple_tree)) != NULL) {
-		in = rb_entry(node, icount_node, in_node);
-		rb_erase(node, &icount->ic_multiple_tree);
-		free(in);
+	for (i = 0; i < icount->ic_new.ir_nr; i++) {
+		if (icount->ic_new.ir_counts[i])
+			nr++;
 	}
+
+	return nr;
+}
+
+/* Bytes held for inodes with more than one link */
+size_t o2fsck_icount_memory(o2fsck_icount *icount)
+{
+	return (icount->ic_multiple.ir_max + icount->ic_new.ir_max) *
+		(sizeof(uint64_t) + sizeof(uint16_t));
+}
+
+static void run_free(struct icount_run *run)
+{
+	if (run->ir_blknos)
+		ocfs2_free(&run->ir_blknos);
+	if (run->ir_counts)
+		ocfs2_free(&run->ir_counts);
+}
+
+void o2fsck_icount_free(o2fsck_icount *icount)
+{
+	ocfs2_bitmap_free(icount->ic_single_bm);
+	run_free(&icount->ic_multiple);
+	run_free(&icount->ic_new);
 	free(icount);
 }
@@ -27,23 +27,45 @@
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/kernel-rbtree.h"
 
-typedef struct _o2fsck_dirblocks {
-	struct rb_root	db_root;
-	uint64_t	db_numblocks;
-} o2fsck_dirblocks;
-
 typedef struct _o2fsck_dirblock_entry {
-	struct rb_node	e_node;
 	uint64_t	e_ino;
 	uint64_t	e_blkno;
 	uint64_t	e_blkcount;
 } o2fsck_dirblock_entry;
 
-typedef unsigned (*dirblock_iterator)(o2fsck_dirblock_entry *,
-					void *priv_data);
+/*
+ * Pass 1 appends directory blocks mostly in disk order.  They are kept
+ * in fixed-size chunks, so growing never copies what is already there.
+ * The entries are sorted by block number once, the first time they are
+ * iterated, and only if an append came out of order.
+ */
+#define DIRBLOCKS_CHUNK		4096
+
+typedef struct _o2fsck_dirblocks {
+	o2fsck_dirblock_entry	**db_chunks;
+	uint64_t		db_numchunks;
+	uint64_t		db_maxchunks;
+	uint64_t		db_numblocks;
+	int			db_unsorted;
+} o2fsck_dirblocks;
+
+/* Directories whose indexes pass 2 will rebuild */
+typedef struct _o2fsck_reidx_dir {
+	struct rb_node	rd_node;
+	uint64_t	rd_ino;
+} o2fsck_reidx_dir;
+
+/*
+ * buf is the block as read from disk, or NULL if the iterator couldn't
+ * read it ahead.  Its metaecc check has been validated, but nothing
+ * else has.
+ */
+typedef unsigned (*dirblock_iterator)(o2fsck_dirblock_entry *, char *buf,
+				      void *priv_data);
 
 errcode_t o2fsck_add_dir_block(o2fsck_dirblocks *db, uint64_t ino,
 			       uint64_t blkno, uint64_t blkcount);
+void o2fsck_free_dir_blocks(o2fsck_dirblocks *db);
 
 struct _o2fsck_state;
 void o2fsck_dir_block_iterate(struct _o2fsck_state *ost, dirblock_iterator func,
@@ -31,6 +31,7 @@
 #include "tools-internal/progress.h"
 
 struct refcount_file;
+struct o2fsck_pass1_shard;
 
 /*
  * This structure is used for keeping track of how much resources have
@@ -99,7 +100,13 @@ typedef struct _o2fsck_state {
 	struct o2fsck_resource_track	ost_rt;
 	struct tools_progress		*ost_prog;
 
-	/* counters */
+	/* -j: how many threads pass 1 may use */
+#define O2FSCK_MAX_THREADS	64
+	int		ost_threads;
+	/* Set in the private state that a pass 1 thread checks with */
+	struct o2fsck_pass1_shard	*ost_shard;
+
+	/* counters; keep them last, pass 1 threads save them as a block */
 	uint32_t	ost_file_count;
 	uint32_t	ost_inline_file_count;
 	uint32_t	ost_dir_count;
@@ -25,11 +25,24 @@
 #define __O2FSCK_ICOUNT_H__
 
 #include "ocfs2/ocfs2.h"
-#include "ocfs2/kernel-rbtree.h"
+
+/*
+ * A run of inodes with more than one link, sorted by block number.  The
+ * block numbers and counts are kept in separate arrays so that a search
+ * only walks the block numbers.  A count of zero marks a dead entry.
+ */
+struct icount_run {
+	uint64_t	*ir_blknos;
+	uint16_t	*ir_counts;
+	uint64_t	ir_nr;
+	uint64_t	ir_max;
+};
 
 typedef struct _o2fsck_icount {
-	ocfs2_bitmap	*ic_single_bm;
-	struct rb_root	ic_multiple_tree;
+	ocfs2_bitmap		*ic_single_bm;
+	struct icount_run	ic_multiple;	/* The bulk of the entries */
+	struct icount_run	ic_new;		/* Inserts waiting to merge */
+	uint64_t		ic_dead;	/* Dead entries in ic_multiple */
 } o2fsck_icount;
 
 errcode_t o2fsck_icount_set(o2fsck_icount *icount, uint64_t blkno, 
@@ -41,6 +54,8 @@ void o2fsck_icount_delta(o2fsck_icount *icount, uint64_t blkno,
 			 int delta);
 errcode_t o2fsck_icount_next_blkno(o2fsck_icount *icount, uint64_t start,
 				   uint64_t *found);
+uint64_t o2fsck_icount_multiple(o2fsck_icount *icount);
+size_t o2fsck_icount_memory(o2fsck_icount *icount);
 
 #endif /* __O2FSCK_ICOUNT_H__ */
 
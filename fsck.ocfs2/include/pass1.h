@@ -29,5 +29,24 @@
 errcode_t o2fsck_pass1(o2fsck_state *ost);
 void o2fsck_free_inode_allocs(o2fsck_state *ost);
 
+/*
+ * A pass 1 thread can't touch the shared state or ask questions.  It
+ * stages its changes, and an inode that needs a question answered is
+ * deferred to be checked again, serially, once the threads are done.
+ */
+enum o2fsck_pass1_op {
+	P1_DIR_INODE,		/* a: dir inode, b: orphaned */
+	P1_REG_INODE,		/* a: inode */
+	P1_ICOUNT,		/* a: inode, b: i_links_count */
+	P1_DIR_BLOCK,		/* a: dir inode, b: blkno, c: blkcount */
+	P1_CLUSTERS_USED,	/* a: cluster, b: count */
+	P1_CLUSTER_FREE,	/* a: cluster */
+	P1_INODE_ALLOC,		/* a: inode, b: in use, c: suballoc slot */
+};
+
+void o2fsck_pass1_stage(o2fsck_state *ost, enum o2fsck_pass1_op op,
+			uint64_t a, uint64_t b, uint64_t c);
+void o2fsck_pass1_defer(o2fsck_state *ost);
+
 #endif /* __O2FSCK_PASS1_H__ */
 
@@ -33,8 +33,11 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "ocfs2/byteorder.h"
 #include "ocfs2/ocfs2.h"
@@ -62,8 +65,55 @@ struct journal_info {
 
 	/* we keep our own bitmap for detecting overlapping journal blocks */
 	ocfs2_bitmap		*ji_used_blocks;
+
+	/*
+	 * The journal blocks the scan read.  The scans run in parallel,
+	 * so they're only marked in ji_used_blocks afterwards, slot by
+	 * slot.
+	 */
+	struct journal_block	*ji_walked;
+	uint64_t		ji_nr_walked;
+	uint64_t		ji_max_walked;
+
+	/* every block the first scan saw logged, in journal order */
+	struct replay_block	*ji_blocks;
+	uint64_t		ji_nr_blocks;
+	uint64_t		ji_max_blocks;
+	uint64_t		ji_elided;	/* Overwritten in this journal */
+	uint64_t		ji_conflicts;	/* Overwritten by later slots */
+
+	/* The slot's scan and replay each run on their own thread */
+	ocfs2_filesys		*ji_fs;
+	pthread_t		ji_thread;
+	unsigned		ji_threaded:1;
+	errcode_t		ji_scan_ret;
+	errcode_t		ji_replay_ret;
+	struct timeval		ji_scan_time;
+	struct timeval		ji_replay_time;
+};
+
+struct journal_block {
+	uint64_t	jb_blkoff;	/* Logical block in the journal */
+	uint64_t	jb_blkno;
+};
+
+/*
+ * A block logged in the journal.  Replay only writes the last logged
+ * copy of each home block, so the copies are sorted by home block and
+ * then by their order in the journal.
+ */
+struct replay_block {
+	uint64_t	rb_home;	/* Where the block goes */
+	uint64_t	rb_jblock;	/* Logical block of the copy */
+	uint64_t	rb_blkno;	/* The copy on disk */
+	uint64_t	rb_order;
+	uint32_t	rb_seq;
+	uint32_t	rb_flags;	/* JBD2_FLAG_* from the tag */
 };
 
+/* How many home blocks replay writes with one I/O */
+#define REPLAY_BATCH_BLOCKS	256
+
 struct revoke_entry {
 	struct rb_node	r_node;
 	uint64_t	r_block;
@@ -138,6 +188,7 @@ static int revoke_this_block(struct rb_root *root, uint64_t block,
 				verbosef("%"PRIu64" is revoked\n", block);
 				return 1;
 			}
+			break;
 		}
 	}
 
@@ -197,13 +248,58 @@ static uint64_t jwrap(journal_superblock_t *jsb, uint64_t block)
 	return block;
 }
 
-static errcode_t count_tags(ocfs2_filesys *fs, journal_superblock_t *jsb,
-			    char *buf, uint64_t *nr_ret)
+/* Make room for one more entry at the end of *array */
+static errcode_t grow_array(void *array, size_t size, uint64_t nr,
+			    uint64_t *max)
+{
+	errcode_t ret;
+	uint64_t want;
+
+	if (nr < *max)
+		return 0;
+
+	want = *max ? *max * 2 : 1024;
+	ret = ocfs2_realloc(size * want, array);
+	if (!ret)
+		*max = want;
+	return ret;
+}
+
+static errcode_t add_replay_block(struct journal_info *ji, uint64_t home,
+				  uint64_t jblock, uint32_t seq,
+				  uint32_t flags)
+{
+	errcode_t ret;
+	struct replay_block *rb;
+
+	ret = grow_array(&ji->ji_blocks, sizeof(struct replay_block),
+			 ji->ji_nr_blocks, &ji->ji_max_blocks);
+	if (ret)
+		return ret;
+
+	rb = &ji->ji_blocks[ji->ji_nr_blocks];
+	rb->rb_home = home;
+	rb->rb_jblock = jblock;
+	rb->rb_blkno = 0;
+	rb->rb_order = ji->ji_nr_blocks++;
+	rb->rb_seq = seq;
+	rb->rb_flags = flags;
+
+	return 0;
+}
+
+/* Check the tags in a descriptor block and remember the blocks they log */
+static errcode_t record_tags(ocfs2_filesys *fs, struct journal_info *ji,
+			     char *buf, uint32_t seq, uint64_t next_block,
+			     uint64_t *nr_ret)
 {
 	char *tagp, *last;
 	journal_block_tag_t *tag;
+	journal_superblock_t *jsb = ji->ji_jsb;
 	int tag_bytes = ocfs2_journal_tag_bytes(jsb);
-	uint64_t nr = 0;
+	uint64_t nr = 0, block64;
+	uint32_t t_flags;
+	errcode_t ret;
 
 	if (jsb->s_blocksize < sizeof(journal_header_t) + tag_bytes)
 		return OCFS2_ET_BAD_JOURNAL_TAG;
@@ -213,14 +309,21 @@ static errcode_t count_tags(ocfs2_filesys *fs, journal_superblock_t *jsb,
 
 	for(; tagp <= last; tagp += tag_bytes) {
 		tag = (journal_block_tag_t *)tagp;
-		nr++;
-		if (ocfs2_block_out_of_range(fs, 
-					     ocfs2_journal_tag_block(tag, tag_bytes)))
+		t_flags = be32_to_cpu(tag->t_flags);
+		block64 = ocfs2_journal_tag_block(tag, tag_bytes);
+		if (ocfs2_block_out_of_range(fs, block64))
 			return OCFS2_ET_BAD_JOURNAL_TAG;
 
-		if (tag->t_flags & cpu_to_be32(JBD2_FLAG_LAST_TAG))
+		ret = add_replay_block(ji, block64,
+				       jwrap(jsb, next_block + nr), seq,
+				       t_flags);
+		if (ret)
+			return ret;
+		nr++;
+
+		if (t_flags & JBD2_FLAG_LAST_TAG)
 			break;
-		if (!(tag->t_flags & cpu_to_be32(JBD2_FLAG_SAME_UUID)))
+		if (!(t_flags & JBD2_FLAG_SAME_UUID))
 			tagp += 16;
 	}
 
@@ -231,46 +334,72 @@ static errcode_t count_tags(ocfs2_filesys *fs, journal_superblock_t *jsb,
 static errcode_t lookup_journal_block(ocfs2_filesys *fs, 
 				      struct journal_info *ji, 
 				      uint64_t blkoff,
-				      uint64_t *blkno,
-				      int check_dup)
+				      uint64_t *blkno)
 {
 	errcode_t ret;
 	uint64_t contig;
-	int was_set;
 
 	ret = ocfs2_extent_map_get_blocks(ji->ji_cinode, blkoff, 1, blkno,
 					  &contig, NULL);
-	if (ret) {
+	if (ret)
 		com_err(whoami, ret, "while looking up logical block "
 			"%"PRIu64" in slot %d's journal", blkoff, ji->ji_slot);
-		goto out;
-	}
 
-	if (check_dup) {
-		o2fsck_bitmap_set(ji->ji_used_blocks, *blkno, &was_set);
-		if (was_set)  {
-			printf("Logical block %"PRIu64" in slot %d's journal "
-			       "maps to block %"PRIu64" which has already "
-			       "been used in another journal.\n", blkoff,
-			       ji->ji_slot, *blkno);
-			ret = OCFS2_ET_DUPLICATE_BLOCK;
-		}
+	return ret;
+}
+
+/* Mark a journal block used, complaining if another journal has it */
+static errcode_t claim_journal_block(struct journal_info *ji,
+				     uint64_t blkoff, uint64_t blkno)
+{
+	int was_set;
+
+	o2fsck_bitmap_set(ji->ji_used_blocks, blkno, &was_set);
+	if (was_set)  {
+		printf("Logical block %"PRIu64" in slot %d's journal "
+		       "maps to block %"PRIu64" which has already "
+		       "been used in another journal.\n", blkoff,
+		       ji->ji_slot, blkno);
+		return OCFS2_ET_DUPLICATE_BLOCK;
 	}
 
-out:
-	return ret;
+	return 0;
+}
+
+/* Look up a journal block the scan reads and remember it for claiming */
+static errcode_t walk_journal_block(ocfs2_filesys *fs,
+				    struct journal_info *ji,
+				    uint64_t blkoff,
+				    uint64_t *blkno)
+{
+	errcode_t err;
+	struct journal_block *jb;
+
+	err = grow_array(&ji->ji_walked, sizeof(struct journal_block),
+			 ji->ji_nr_walked, &ji->ji_max_walked);
+	if (err)
+		return err;
+
+	err = lookup_journal_block(fs, ji, blkoff, blkno);
+	if (err)
+		return err;
+
+	jb = &ji->ji_walked[ji->ji_nr_walked++];
+	jb->jb_blkoff = blkoff;
+	jb->jb_blkno = *blkno;
+
+	return 0;
 }
 
 static errcode_t read_journal_block(ocfs2_filesys *fs, 
 				    struct journal_info *ji, 
 				    uint64_t blkoff, 
-				    char *buf,
-				    int check_dup)
+				    char *buf)
 {
 	errcode_t err;
 	uint64_t	blkno;
 
-	err = lookup_journal_block(fs, ji, blkoff, &blkno, check_dup);
+	err = walk_journal_block(fs, ji, blkoff, &blkno);
 	if (err)
 		return err;
 
@@ -282,71 +411,272 @@ static errcode_t read_journal_block(ocfs2_filesys *fs,
 	return err;
 }
 
-static errcode_t replay_blocks(ocfs2_filesys *fs, struct journal_info *ji,
-			       char *buf, uint64_t seq, uint64_t *next_block)
+static int replay_block_cmp(const void *a, const void *b)
 {
-	char *tagp;
-	journal_block_tag_t *tag;
-	size_t i, num;
-	char *io_buf = NULL;
+	const struct replay_block *l = a, *r = b;
+
+	if (l->rb_home < r->rb_home)
+		return -1;
+	if (l->rb_home > r->rb_home)
+		return 1;
+	if (l->rb_order < r->rb_order)
+		return -1;
+	if (l->rb_order > r->rb_order)
+		return 1;
+	return 0;
+}
+
+/*
+ * Drop the logged blocks that replay mustn't write: those of the last,
+ * uncommitted, transaction and those that were revoked.  The rest learn
+ * where their copy lives on disk.
+ */
+static errcode_t gather_replay_blocks(ocfs2_filesys *fs,
+				      struct journal_info *ji)
+{
+	uint64_t i, nr = 0;
+	struct replay_block *rb;
 	errcode_t err, ret = 0;
-	int tag_bytes = ocfs2_journal_tag_bytes(ji->ji_jsb);
-	uint32_t t_flags;
-	uint64_t block64;
-		
-	tagp = buf + sizeof(journal_header_t);
-	num = (ji->ji_jsb->s_blocksize - sizeof(journal_header_t)) / 
-		tag_bytes;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, 1, &io_buf);
+	for (i = 0; i < ji->ji_nr_blocks; i++) {
+		rb = &ji->ji_blocks[i];
+
+		/* the last transaction the first scan found wasn't committed */
+		if (seq_geq(rb->rb_seq, ji->ji_final_seq))
+			continue;
+
+		verbosef("recovering journal block %"PRIu64" to disk block "
+			 "%"PRIu64"\n", rb->rb_jblock, rb->rb_home);
+
+		if (revoke_this_block(&ji->ji_revoke, rb->rb_home,
+				      rb->rb_seq))
+			continue;
+
+		err = lookup_journal_block(fs, ji, rb->rb_jblock,
+					   &rb->rb_blkno);
+		if (err) {
+			ret = err;
+			continue;
+		}
+
+		ji->ji_blocks[nr++] = *rb;
+	}
+	ji->ji_nr_blocks = nr;
+
+	return ret;
+}
+
+/*
+ * Mark the journal blocks the slot uses.  A logged copy that another
+ * journal claimed isn't replayed.  If the descriptors, commits, or
+ * revokes the scan read are shared, the error is returned and the
+ * caller doesn't trust the journal at all.
+ */
+static errcode_t claim_replay_blocks(struct journal_info *ji)
+{
+	uint64_t i, nr = 0;
+	struct journal_block *jb;
+	struct replay_block *rb;
+	errcode_t err, ret = 0;
+
+	for (i = 0; i < ji->ji_nr_walked; i++) {
+		jb = &ji->ji_walked[i];
+		err = claim_journal_block(ji, jb->jb_blkoff, jb->jb_blkno);
+		if (err)
+			ret = err;
+	}
+
+	for (i = 0; i < ji->ji_nr_blocks; i++) {
+		rb = &ji->ji_blocks[i];
+		err = claim_journal_block(ji, rb->rb_jblock, rb->rb_blkno);
+		if (err) {
+			ji->ji_replay_ret = err;
+			continue;
+		}
+		ji->ji_blocks[nr++] = *rb;
+	}
+	ji->ji_nr_blocks = nr;
+
+	return ret;
+}
+
+/* Keep only the last copy of each home block, sorted by home block */
+static void pick_replay_blocks(struct journal_info *ji)
+{
+	uint64_t i, nr = ji->ji_nr_blocks;
+
+	qsort(ji->ji_blocks, nr, sizeof(struct replay_block),
+	      replay_block_cmp);
+
+	ji->ji_elided = 0;
+	ji->ji_nr_blocks = 0;
+	for (i = 0; i < nr; i++) {
+		if ((i + 1 < nr) &&
+		    (ji->ji_blocks[i + 1].rb_home == ji->ji_blocks[i].rb_home)) {
+			ji->ji_elided++;
+			continue;
+		}
+		ji->ji_blocks[ji->ji_nr_blocks++] = ji->ji_blocks[i];
+	}
+}
+
+/*
+ * When two slots logged the same home block, replay used to go slot by
+ * slot and the higher slot's copy was written last.  jbd2 sequence
+ * numbers are private to each journal and can't order copies from
+ * different slots, so the higher slot still wins.  Walking the slots
+ * from the top down, a slot drops the blocks a later slot has claimed.
+ */
+static errcode_t resolve_replay_conflicts(ocfs2_filesys *fs,
+					  struct journal_info *jis,
+					  int max_slots)
+{
+	int i, was_set;
+	uint64_t j, nr;
+	errcode_t ret;
+	ocfs2_bitmap *homes;
+	struct journal_info *ji;
+
+	ret = ocfs2_block_bitmap_new(fs, "replayed blocks", &homes);
 	if (ret) {
-		com_err(whoami, ret, "while allocating a block buffer");
-		goto out;
+		com_err(whoami, ret, "while allocating replayed block bitmap");
+		return ret;
 	}
 
-	for(i = 0; i < num; i++, tagp += tag_bytes, (*next_block)++) {
-		tag = (journal_block_tag_t *)tagp;
-		t_flags = be32_to_cpu(tag->t_flags);
-		block64 = ocfs2_journal_tag_block(tag, tag_bytes);
+	for (i = max_slots - 1; i >= 0; i--) {
+		ji = &jis[i];
+		if (!ji->ji_replay)
+			continue;
 
-		*next_block = jwrap(ji->ji_jsb, *next_block);
+		ji->ji_conflicts = 0;
+		for (j = 0, nr = 0; j < ji->ji_nr_blocks; j++) {
+			o2fsck_bitmap_set(homes, ji->ji_blocks[j].rb_home,
+					  &was_set);
+			if (was_set) {
+				ji->ji_conflicts++;
+				continue;
+			}
+			ji->ji_blocks[nr++] = ji->ji_blocks[j];
+		}
+		ji->ji_nr_blocks = nr;
+	}
 
-		verbosef("recovering journal block %"PRIu64" to disk block "
-			 "%"PRIu64"\n", *next_block, block64);
+	ocfs2_bitmap_free(homes);
+	return 0;
+}
 
-		if (revoke_this_block(&ji->ji_revoke, block64, seq))
-			goto skip_io;
+/* Read the journal copies of a batch into buf, one by one if need be */
+static errcode_t read_replay_batch(ocfs2_filesys *fs, struct journal_info *ji,
+				   struct replay_block *rbs, int count,
+				   char *buf, struct io_vec_unit *ivus)
+{
+	int i;
+	errcode_t err, ret = 0;
 
-		err = read_journal_block(fs, ji, *next_block, io_buf, 1);
+	for (i = 0; i < count; i++) {
+		ivus[i].ivu_blkno = rbs[i].rb_blkno;
+		ivus[i].ivu_buf = buf + ((size_t)i * fs->fs_blocksize);
+		ivus[i].ivu_buflen = fs->fs_blocksize;
+	}
+
+	if (!io_vec_read_blocks(fs->fs_io, ivus, count))
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		err = ocfs2_read_blocks(fs, rbs[i].rb_blkno, 1,
+					ivus[i].ivu_buf);
 		if (err) {
+			com_err(whoami, err, "while reading block %"PRIu64" "
+				"of slot %d's journal", rbs[i].rb_blkno,
+				ji->ji_slot);
+			/* partial replay, like jbd2 */
+			rbs[i].rb_home = 0;
 			ret = err;
-			goto skip_io;
 		}
+	}
+
+	return ret;
+}
+
+/*
+ * Write the blocks pick_replay_blocks() chose, batching runs of
+ * adjacent home blocks into single writes.
+ */
+static errcode_t replay_blocks(ocfs2_filesys *fs, struct journal_info *ji)
+{
+	uint64_t i;
+	int j, count;
+	char *io_buf = NULL;
+	struct io_vec_unit *ivus = NULL;
+	struct replay_block *rbs;
+	uint32_t magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+	errcode_t err, ret = 0;
 
-		if (t_flags & JBD2_FLAG_ESCAPE) {
-			uint32_t magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
-			memcpy(io_buf, &magic, sizeof(magic));
+	verbosef("slot %d: replaying %"PRIu64" blocks, %"PRIu64" overwritten "
+		 "copies elided, %"PRIu64" left to later slots\n", ji->ji_slot,
+		 ji->ji_nr_blocks, ji->ji_elided, ji->ji_conflicts);
+
+	err = ocfs2_malloc_blocks(fs->fs_io, REPLAY_BATCH_BLOCKS, &io_buf);
+	if (!err)
+		err = ocfs2_malloc(sizeof(struct io_vec_unit) *
+				   REPLAY_BATCH_BLOCKS, &ivus);
+	if (err) {
+		com_err(whoami, err, "while allocating replay buffers");
+		ret = err;
+		goto out;
+	}
+
+	for (i = 0; i < ji->ji_nr_blocks; i += count) {
+		rbs = &ji->ji_blocks[i];
+		for (count = 1; (count < REPLAY_BATCH_BLOCKS) &&
+				(i + count < ji->ji_nr_blocks); count++) {
+			if (rbs[count].rb_home != rbs[0].rb_home + count)
+				break;
 		}
 
-		err = io_write_block(fs->fs_io, block64, 1, io_buf);
+		err = read_replay_batch(fs, ji, rbs, count, io_buf, ivus);
 		if (err)
 			ret = err;
 
-	skip_io:
-		if (t_flags & JBD2_FLAG_LAST_TAG)
-			i = num; /* be sure to increment next_block */
-		if (!(t_flags & JBD2_FLAG_SAME_UUID))
-			tagp += 16;
+		for (j = 0; j < count; j++) {
+			if (rbs[j].rb_flags & JBD2_FLAG_ESCAPE)
+				memcpy(ivus[j].ivu_buf, &magic, sizeof(magic));
+		}
+
+		if (!err) {
+			err = io_write_block(fs->fs_io, rbs[0].rb_home, count,
+					     io_buf);
+			if (err)
+				ret = err;
+			continue;
+		}
+
+		/* skip the blocks that couldn't be read */
+		for (j = 0; j < count; j++) {
+			if (!rbs[j].rb_home)
+				continue;
+			err = io_write_block(fs->fs_io, rbs[j].rb_home, 1,
+					     ivus[j].ivu_buf);
+			if (err)
+				ret = err;
+		}
 	}
-	
+
 out:
+	if (ivus)
+		ocfs2_free(&ivus);
 	if (io_buf)
 		ocfs2_free(&io_buf);
 	return ret;
 }
 
+/*
+ * Scan the journal, gathering the revoke records and the blocks logged
+ * by each transaction, and find the first transaction that wasn't
+ * committed.
+ */
 static errcode_t walk_journal(ocfs2_filesys *fs, int slot, 
-			      struct journal_info *ji, char *buf, int recover)
+			      struct journal_info *ji, char *buf)
 {
 	errcode_t err, ret = 0;
 	uint32_t next_seq;
@@ -361,19 +691,12 @@ static errcode_t walk_journal(ocfs2_filesys *fs, int slot,
 	if (next_block == 0)
 		return 0;
 
-	/* ret is set when bad tags are seen in the first scan and when there
-	 * are io errors in the recovery scan.  Only stop walking the journal
-	 * when bad tags are seen in the first scan. */
-	while(recover || !ret) {
-		verbosef("next_seq %"PRIu32" final_seq %"PRIu32" next_block "
-			 "%"PRIu64"\n", next_seq, ji->ji_final_seq,
-			 next_block);
-
-		if (recover && seq_geq(next_seq, ji->ji_final_seq))
-			break;
+	/* ret is set when bad tags are seen, and we stop walking there */
+	while(!ret) {
+		verbosef("next_seq %"PRIu32" next_block %"PRIu64"\n",
+			 next_seq, next_block);
 
-		/* only mark the blocks used on the first pass */
-		err = read_journal_block(fs, ji, next_block, buf, !recover);
+		err = read_journal_block(fs, ji, next_block, buf);
 		if (err) {
 			ret = err;
 			break;
@@ -400,17 +723,9 @@ static errcode_t walk_journal(ocfs2_filesys *fs, int slot,
 		switch(jh.h_blocktype) {
 		case JBD2_DESCRIPTOR_BLOCK:
 			verbosef("found a desc type %x\n", jh.h_blocktype);
-			/* replay the blocks described in the desc block */
-			if (recover) {
-				err = replay_blocks(fs, ji, buf, next_seq, 
-						    &next_block);
-				if (err)
-					ret = err;
-				continue;
-			}
-
-			/* just record the blocks as used and carry on */ 
-			err = count_tags(fs, jsb, buf, &nr);
+			/* remember the blocks for replay and carry on */
+			err = record_tags(fs, ji, buf, next_seq, next_block,
+					  &nr);
 			if (err)
 				ret = err;
 			else
@@ -436,17 +751,8 @@ static errcode_t walk_journal(ocfs2_filesys *fs, int slot,
 
 	verbosef("done scanning with seq %"PRIu32"\n", next_seq);
 
-	if (!recover) {
-		ji->ji_set_final_seq = 1;
-		ji->ji_final_seq = next_seq;
-	} else if (ji->ji_final_seq != next_seq) {
-		printf("Replaying slot %d's journal stopped at seq %"PRIu32" "
-		       "but an initial scan indicated that it should have "
-		       "stopped at seq %"PRIu32"\n", ji->ji_slot, next_seq,
-		       ji->ji_final_seq);
-		if (ret == 0)
-			err = OCFS2_ET_IO;
-	}
+	ji->ji_set_final_seq = 1;
+	ji->ji_final_seq = next_seq;
 
 	return ret;
 }
@@ -481,7 +787,7 @@ static errcode_t prep_journal_info(ocfs2_filesys *fs, int slot,
 	      OCFS2_JOURNAL_DIRTY_FL))
 		goto out;
 
-	err = lookup_journal_block(fs, ji, 0, &ji->ji_jsb_block, 1);
+	err = walk_journal_block(fs, ji, 0, &ji->ji_jsb_block);
 	if (err)
 		goto out;
 
@@ -597,17 +903,136 @@ out:
 	
 }
 
-/* Try and replay the slots journals if they're dirty.  This only returns
- * a non-zero error if the caller should not continue. */
-errcode_t o2fsck_replay_journals(ocfs2_filesys *fs, int *replayed)
+/* Set *tv to the time elapsed since *tv */
+static void time_since(struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	tv->tv_sec = now.tv_sec - tv->tv_sec;
+	tv->tv_usec = now.tv_usec - tv->tv_usec;
+	if (tv->tv_usec < 0) {
+		tv->tv_usec += 1000000;
+		tv->tv_sec--;
+	}
+}
+
+static void *scan_journal_thread(void *arg)
+{
+	struct journal_info *ji = arg;
+	ocfs2_filesys *fs = ji->ji_fs;
+	char *buf = NULL;
+
+	gettimeofday(&ji->ji_scan_time, NULL);
+
+	ji->ji_scan_ret = ocfs2_malloc_blocks(fs->fs_io, 1, &buf);
+	if (ji->ji_scan_ret) {
+		com_err(whoami, ji->ji_scan_ret, "while allocating room to "
+			"read slot %d's journal blocks", ji->ji_slot);
+		goto out;
+	}
+
+	ji->ji_scan_ret = walk_journal(fs, ji->ji_slot, ji, buf);
+
+	/* errors finding the logged copies only spoil the replay */
+	ji->ji_replay_ret = gather_replay_blocks(fs, ji);
+
+	ocfs2_free(&buf);
+out:
+	time_since(&ji->ji_scan_time);
+	return NULL;
+}
+
+static void *replay_journal_thread(void *arg)
+{
+	struct journal_info *ji = arg;
+	errcode_t err;
+
+	gettimeofday(&ji->ji_replay_time, NULL);
+
+	err = replay_blocks(ji->ji_fs, ji);
+	if (err)
+		ji->ji_replay_ret = err;
+
+	time_since(&ji->ji_replay_time);
+	return NULL;
+}
+
+/*
+ * Each dirty journal gets its own thread.  The journals live in
+ * different parts of the disk, so their I/O can proceed together.  If a
+ * thread can't be started, that slot is done here and now.
+ */
+static void run_journal_threads(struct journal_info *jis, int max_slots,
+				void *(*func)(void *))
+{
+	int i;
+	struct journal_info *ji;
+
+	for (i = 0, ji = jis; i < max_slots; i++, ji++) {
+		if (!ji->ji_replay)
+			continue;
+
+		ji->ji_threaded = !pthread_create(&ji->ji_thread, NULL, func,
+						  ji);
+		if (!ji->ji_threaded)
+			func(ji);
+	}
+
+	for (i = 0, ji = jis; i < max_slots; i++, ji++) {
+		if (ji->ji_threaded)
+			pthread_join(ji->ji_thread, NULL);
+		ji->ji_threaded = 0;
+	}
+}
+
+static inline double timeval_in_secs(struct timeval *tv)
+{
+	return tv->tv_sec + ((double)tv->tv_usec / 1000000);
+}
+
+static void print_journal_stats(o2fsck_state *ost, struct journal_info *jis,
+				int max_slots)
+{
+	int i;
+	struct journal_info *ji;
+
+	if (!ost->ost_show_stats)
+		return;
+
+	for (i = 0, ji = jis; i < max_slots; i++, ji++) {
+		if (!ji->ji_replay || !ji->ji_set_final_seq)
+			continue;
+
+		printf("  Slot %d journal: %"PRIu64" blocks replayed, "
+		       "%"PRIu64" elided, scan: %.3fs, replay: %.3fs\n", i,
+		       ji->ji_nr_blocks, ji->ji_elided + ji->ji_conflicts,
+		       timeval_in_secs(&ji->ji_scan_time),
+		       timeval_in_secs(&ji->ji_replay_time));
+	}
+}
+
+/*
+ * Try and replay the slots journals if they're dirty.  This only returns
+ * a non-zero error if the caller should not continue.
+ *
+ * The dirty journals are scanned in parallel.  Then, slot by slot, the
+ * blocks they use are checked against the other journals and each home
+ * block is given to the last slot that logged it.  Finally the journals
+ * are replayed in parallel.
+ */
+errcode_t o2fsck_replay_journals(o2fsck_state *ost, int *replayed)
 {
 	errcode_t err = 0, ret = 0;
+	ocfs2_filesys *fs = ost->ost_fs;
 	struct journal_info *jis = NULL, *ji;
 	journal_superblock_t *jsb;
-	char *buf = NULL;
 	int journal_trouble = 0;
 	uint16_t i, max_slots;
 	ocfs2_bitmap *used_blocks = NULL;
+	struct o2fsck_resource_track rt;
+
+	o2fsck_init_resource_track(&rt, fs->fs_io);
 
 	max_slots = OCFS2_RAW_SB(fs->fs_super)->s_max_slots;
 
@@ -618,13 +1043,6 @@ errcode_t o2fsck_replay_journals(ocfs2_filesys *fs, int *replayed)
 		goto out;
 	}
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, 1, &buf);
-	if (ret) {
-		com_err(whoami, ret, "while allocating room to read journal "
-			    "blocks");
-		goto out;
-	}
-
 	ret = ocfs2_malloc0(sizeof(struct journal_info) * max_slots, &jis);
 	if (ret) {
 		com_err(whoami, ret, "while allocating an array of block "
@@ -638,6 +1056,7 @@ errcode_t o2fsck_replay_journals(ocfs2_filesys *fs, int *replayed)
 		ji->ji_used_blocks = used_blocks;
 		ji->ji_revoke = RB_ROOT;
 		ji->ji_slot = i;
+		ji->ji_fs = fs;
 
 		/* sets ji->ji_replay */
 		err = prep_journal_info(fs, i, ji);
@@ -648,26 +1067,47 @@ errcode_t o2fsck_replay_journals(ocfs2_filesys *fs, int *replayed)
 			continue;
 		}
 
-		if (!ji->ji_replay) {
+		if (!ji->ji_replay)
 			verbosef("slot %d is clean\n", i);
+	}
+
+	run_journal_threads(jis, max_slots, scan_journal_thread);
+
+	for (i = 0, ji = jis; i < max_slots; i++, ji++) {
+		if (!ji->ji_replay)
 			continue;
-		}
 
-		err = walk_journal(fs, i, ji, buf, 0);
-		if (err) {
+		err = claim_replay_blocks(ji);
+		if (err || ji->ji_scan_ret) {
 			printf("Slot %d's journal can not be replayed.\n", i);
 			journal_trouble = 1;
 		}
+
+		/* a journal sharing its own blocks with another is garbage */
+		if (err) {
+			ji->ji_replay = 0;
+			continue;
+		}
+
+		pick_replay_blocks(ji);
 	}
 
+	ret = resolve_replay_conflicts(fs, jis, max_slots);
+	if (ret)
+		goto out;
+
+	for (i = 0, ji = jis; i < max_slots; i++, ji++) {
+		if (ji->ji_replay)
+			printf("Replaying slot %d's journal.\n", i);
+	}
+
+	run_journal_threads(jis, max_slots, replay_journal_thread);
+
 	for (i = 0, ji = jis; i < max_slots; i++, ji++) {
 		if (!ji->ji_replay)
 			continue;
 
-		printf("Replaying slot %d's journal.\n", i);
-
-		err = walk_journal(fs, i, ji, buf, 1);
-		if (err) {
+		if (ji->ji_replay_ret) {
 			journal_trouble = 1;
 			continue;
 		} 
@@ -697,6 +1137,11 @@ errcode_t o2fsck_replay_journals(ocfs2_filesys *fs, int *replayed)
 		}
 	}
 
+	o2fsck_compute_resource_track(&rt, fs->fs_io);
+	print_journal_stats(ost, jis, max_slots);
+	o2fsck_print_resource_track("Journal replay", ost, &rt, fs->fs_io);
+	o2fsck_add_resource_track(&ost->ost_rt, &rt);
+
 	/* this is awkward, but we want fsck -n to tell us as much as it
 	 * can so we don't want to ask to proceed here.  */
 	if (journal_trouble)
@@ -715,12 +1160,14 @@ out:
 				ocfs2_free_cached_inode(fs, 
 							ji->ji_cinode);
 			revoke_free_all(&ji->ji_revoke);
+			if (ji->ji_walked)
+				ocfs2_free(&ji->ji_walked);
+			if (ji->ji_blocks)
+				ocfs2_free(&ji->ji_blocks);
 		}
 		ocfs2_free(&jis);
 	}
 
-	if (buf)
-		ocfs2_free(&buf);
 	if (used_blocks)
 		ocfs2_bitmap_free(used_blocks);
 
@@ -55,8 +55,13 @@
  * 	free an inodes chains and extents and such if we free it
  */
 #include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <assert.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
@@ -85,12 +90,42 @@ void o2fsck_free_inode_allocs(o2fsck_state *ost)
 		ocfs2_free_cached_inode(ost->ost_fs, ost->ost_inode_allocs[i]);
 }
 
+/* A staged inode is no longer in memory when its allocation is checked */
+static void fix_staged_suballoc_slot(o2fsck_state *ost, uint64_t blkno,
+				     int16_t slot)
+{
+	errcode_t ret;
+	char *buf = NULL;
+	struct ocfs2_dinode *di;
+
+	ret = ocfs2_malloc_block(ost->ost_fs->fs_io, &buf);
+	if (ret) {
+		com_err(whoami, ret, "while allocating an inode buffer");
+		return;
+	}
+
+	ret = ocfs2_read_blocks(ost->ost_fs, blkno, 1, buf);
+	if (ret) {
+		com_err(whoami, ret, "while reading inode %"PRIu64, blkno);
+		goto out;
+	}
+
+	di = (struct ocfs2_dinode *)buf;
+	ocfs2_swap_inode_to_cpu(ost->ost_fs, di);
+	di->i_suballoc_slot = slot;
+	o2fsck_write_inode(ost, blkno, di);
+
+out:
+	ocfs2_free(&buf);
+}
+
 /* update our in memory images of the inode chain alloc bitmaps.  these
  * will be written out at the end of pass1 and the library will read
- * them off disk for use from then on. */
+ * them off disk for use from then on.  di is NULL for inodes staged by
+ * a pass 1 thread. */
 static void update_inode_alloc(o2fsck_state *ost,
 			       struct ocfs2_dinode *di, 
-			       uint64_t blkno, int val)
+			       uint64_t blkno, int16_t suballoc_slot, int val)
 {
 	int16_t slot;
 	uint16_t max_slots, yn;
@@ -164,15 +199,18 @@ static void update_inode_alloc(o2fsck_state *ost,
 		  "%"PRId16"\n", blkno, val, oldval, slot);
 
 	/* make sure the inode's fields are consistent if it's allocated */
-	if (val == 1 && slot != (int16_t)di->i_suballoc_slot &&
+	if (val == 1 && slot != suballoc_slot &&
 	    prompt(ost, PY, PR_INODE_SUBALLOC,
 		   "Inode %"PRIu64" indicates that it was allocated "
 		   "from slot %"PRId16" but slot %"PRId16"'s chain allocator "
 		   "covers the inode.  Fix the inode's record of where it is "
 		   "allocated?",
-		   blkno, di->i_suballoc_slot, slot)) {
-		di->i_suballoc_slot = slot;
-		o2fsck_write_inode(ost, di->i_blkno, di);
+		   blkno, suballoc_slot, slot)) {
+		if (di) {
+			di->i_suballoc_slot = slot;
+			o2fsck_write_inode(ost, di->i_blkno, di);
+		} else
+			fix_staged_suballoc_slot(ost, blkno, slot);
 	}
 out:
 	return;
@@ -427,6 +465,50 @@ static errcode_t verify_truncate_log(o2fsck_state *ost,
 	return ret;
 }
 
+/*
+ * These record what pass 1 learns about an inode.  A pass 1 thread
+ * stages them instead; see o2fsck_pass1_stage().
+ */
+static void mark_dir_inode(o2fsck_state *ost, uint64_t blkno, int orphaned)
+{
+	if (ost->ost_shard) {
+		o2fsck_pass1_stage(ost, P1_DIR_INODE, blkno, !!orphaned, 0);
+		return;
+	}
+
+	o2fsck_bitmap_set(ost->ost_dir_inodes, blkno, NULL);
+	o2fsck_add_dir_parent(&ost->ost_dir_parents, blkno, 0, 0, orphaned);
+}
+
+static void mark_reg_inode(o2fsck_state *ost, uint64_t blkno)
+{
+	if (ost->ost_shard)
+		o2fsck_pass1_stage(ost, P1_REG_INODE, blkno, 0, 0);
+	else
+		o2fsck_bitmap_set(ost->ost_reg_inodes, blkno, NULL);
+}
+
+static void set_inode_icount(o2fsck_state *ost, uint64_t blkno,
+			     uint16_t count)
+{
+	if (ost->ost_shard)
+		o2fsck_pass1_stage(ost, P1_ICOUNT, blkno, count, 0);
+	else
+		o2fsck_icount_set(ost->ost_icount_in_inodes, blkno, count);
+}
+
+static errcode_t add_dir_block(o2fsck_state *ost, uint64_t ino,
+			       uint64_t blkno, uint64_t blkcount)
+{
+	if (ost->ost_shard) {
+		o2fsck_pass1_stage(ost, P1_DIR_BLOCK, ino, blkno, blkcount);
+		return 0;
+	}
+
+	return o2fsck_add_dir_block(&ost->ost_dirblocks, ino, blkno,
+				    blkcount);
+}
+
 /* Check the basics of the ocfs2_dinode itself.  If we find problems
  * we clear the VALID flag and the caller will see that and update
  * inode allocations and write the inode to disk. 
@@ -536,14 +618,12 @@ static void o2fsck_verify_inode_fields(ocfs2_filesys *fs,
 	}
 
 	if (S_ISDIR(di->i_mode)) {
-		o2fsck_bitmap_set(ost->ost_dir_inodes, blkno, NULL);
-		o2fsck_add_dir_parent(&ost->ost_dir_parents, blkno, 0, 0,
-				      di->i_flags & OCFS2_ORPHANED_FL);
+		mark_dir_inode(ost, blkno, di->i_flags & OCFS2_ORPHANED_FL);
 		ost->ost_dir_count++;
 		if (di->i_dyn_features & OCFS2_INLINE_DATA_FL)
 			ost->ost_inline_dir_count++;
 	} else if (S_ISREG(di->i_mode)) {
-		o2fsck_bitmap_set(ost->ost_reg_inodes, blkno, NULL);
+		mark_reg_inode(ost, blkno);
 		ost->ost_file_count++;
 		if (di->i_dyn_features & OCFS2_INLINE_DATA_FL)
 			ost->ost_inline_file_count++;
@@ -583,8 +663,7 @@ static void o2fsck_verify_inode_fields(ocfs2_filesys *fs,
 	/* put this after all opportunities to clear so we don't have to
 	 * unwind it */
 	if (di->i_links_count) {
-		o2fsck_icount_set(ost->ost_icount_in_inodes, di->i_blkno,
-					di->i_links_count);
+		set_inode_icount(ost, di->i_blkno, di->i_links_count);
 		if (di->i_links_count > 1)
 			ost->ost_links_count++;
 	}
@@ -593,7 +672,7 @@ static void o2fsck_verify_inode_fields(ocfs2_filesys *fs,
 	 * and assert that their links_count should include the dirent
 	 * reference from the orphan dir. */
 	if (di->i_flags & OCFS2_ORPHANED_FL && di->i_links_count == 0)
-		o2fsck_icount_set(ost->ost_icount_in_inodes, di->i_blkno, 1);
+		set_inode_icount(ost, di->i_blkno, 1);
 
 	if (di->i_flags & OCFS2_LOCAL_ALLOC_FL)
 		verify_local_alloc(ost, di);
@@ -613,7 +692,7 @@ out:
 		 * should back-out the inode count we found in the inode
 		 * so that we're not surprised when there aren't any
 		 * references to it in pass 4 */
-		o2fsck_icount_set(ost->ost_icount_in_inodes, di->i_blkno, 0);
+		set_inode_icount(ost, di->i_blkno, 0);
 	}
 }
 
@@ -769,9 +848,7 @@ static int verify_block(ocfs2_filesys *fs,
 
 	if (S_ISDIR(di->i_mode)) {
 		verbosef("adding dir block %"PRIu64"\n", blkno);
-		ret = o2fsck_add_dir_block(&ost->ost_dirblocks,
-					   (uint64_t)di->i_blkno,
-					   blkno, bcount);
+		ret = add_dir_block(ost, (uint64_t)di->i_blkno, blkno, bcount);
 		if (ret) {
 			com_err(whoami, ret, "while trying to track block in "
 				"directory inode %"PRIu64,
@@ -892,9 +969,7 @@ static errcode_t o2fsck_check_blocks(ocfs2_filesys *fs, o2fsck_state *ost,
 		 * directory check.
 		 */
 		if (S_ISDIR(di->i_mode)) {
-			ret = o2fsck_add_dir_block(&ost->ost_dirblocks,
-						   di->i_blkno,
-						   di->i_blkno, 0);
+			ret = add_dir_block(ost, di->i_blkno, di->i_blkno, 0);
 			if (ret)
 				return ret;
 		}
@@ -945,8 +1020,7 @@ static errcode_t o2fsck_check_blocks(ocfs2_filesys *fs, o2fsck_state *ost,
 	 */
 	if (vb.vb_clear) {
 		di->i_links_count = 0;
-		o2fsck_icount_set(ost->ost_icount_in_inodes, di->i_blkno,
-				  di->i_links_count);
+		set_inode_icount(ost, di->i_blkno, di->i_links_count);
 		di->i_dtime = time(NULL);
 		/* clear valid flag and stuff. */
 		ret = ocfs2_block_iterate_inode(fs, di,
@@ -1451,6 +1525,601 @@ static void write_inode_alloc(o2fsck_state *ost)
 	o2fsck_free_inode_allocs(ost);
 }
 
+/*
+ * Check one inode from the inode scan.  Everything pass 1 learns about
+ * the inode is recorded in ost, and its bit in the inode allocators is
+ * brought in line.
+ */
+static errcode_t check_inode(o2fsck_state *ost, uint64_t blkno,
+			     struct ocfs2_dinode *di)
+{
+	errcode_t ret = 0;
+	ocfs2_filesys *fs = ost->ost_fs;
+	int valid = 0;
+
+	/* we never consider inodes who don't have a signature */
+	if (!memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
+		    strlen(OCFS2_INODE_SIGNATURE))) {
+
+		ocfs2_swap_inode_to_cpu(fs, di);
+
+		/*
+		 * System inodes and refcount trees touch state that
+		 * isn't staged.  There are few of them; a pass 1
+		 * thread leaves them to the serial pass.
+		 */
+		if (ost->ost_shard &&
+		    ((di->i_flags & OCFS2_SYSTEM_FL) ||
+		     (di->i_dyn_features & OCFS2_HAS_REFCOUNT_FL))) {
+			o2fsck_pass1_defer(ost);
+			return 0;
+		}
+
+		 /* We only consider inodes whose generations don't
+		  * match if the user has asked us to */
+		if ((ost->ost_fix_fs_gen ||
+		    (di->i_fs_generation == ost->ost_fs_generation))) {
+
+			if (di->i_flags & OCFS2_VALID_FL)
+				o2fsck_verify_inode_fields(fs, ost, blkno, di);
+			if (di->i_flags & OCFS2_VALID_FL) {
+				ret = o2fsck_check_refcount_tree(ost, di);
+				if (ret)
+					goto out;
+				ret = o2fsck_check_blocks(fs, ost, blkno, di);
+				if (ret)
+					goto out;
+				ret = o2fsck_check_xattr(ost, di);
+				if (ret)
+					goto out;
+			}
+
+			valid = di->i_flags & OCFS2_VALID_FL;
+		}
+	}
+
+	if (ost->ost_shard)
+		o2fsck_pass1_stage(ost, P1_INODE_ALLOC, blkno, valid,
+				   (uint16_t)di->i_suballoc_slot);
+	else
+		update_inode_alloc(ost, di, blkno, di->i_suballoc_slot,
+				   valid);
+
+out:
+	return ret;
+}
+
+/*
+ * With -j, pass 1 splits the inode scan into partitions and checks
+ * them on separate threads.
+ *
+ * Each thread checks inodes against a private o2fsck_state, its shard,
+ * that has none of the shared bitmaps, icounts, or trees.  Changes to
+ * those are staged as a list of ops instead.  The ops for an inode are
+ * kept only if the inode checked out clean.  If checking it would have
+ * asked a question or written to disk, o2fsck_pass1_defer() throws the
+ * inode's ops away and saves it for a serial pass over the deferred
+ * inodes after the threads finish.
+ *
+ * A thread replays its staged ops into the shared state when enough
+ * have piled up.  Replay holds p1_lock, so the questions it can ask
+ * (about the inode allocators) are still asked one at a time.
+ *
+ * Errors reported while a thread checks an inode are held with its ops.
+ * They are printed if the inode is clean and dropped if it is deferred,
+ * as the serial pass will report them again.
+ */
+#define PASS1_FLUSH_OPS		4096
+#define PASS1_PROGRESS_STEPS	256
+
+/* A check on a shard only moves the counters, which fsck.h keeps last */
+#define PASS1_COUNTERS_OFFSET	offsetof(o2fsck_state, ost_file_count)
+#define PASS1_COUNTERS_SIZE	(sizeof(o2fsck_state) - PASS1_COUNTERS_OFFSET)
+
+struct pass1_op {
+	enum o2fsck_pass1_op	p_op;
+	uint64_t		p_a;
+	uint64_t		p_b;
+	uint64_t		p_c;
+};
+
+struct pass1_msg {
+	const char		*m_prog;
+	long			m_code;
+	char			*m_text;
+};
+
+struct o2fsck_pass1_shard {
+	o2fsck_state		ps_ost;		/* What the checks see */
+	o2fsck_state		*ps_shared;
+	pthread_mutex_t		*ps_lock;
+	ocfs2_inode_scan	*ps_scan;
+	pthread_t		ps_thread;
+	int			ps_started;
+	errcode_t		ps_ret;		/* Stopped the thread */
+
+	struct pass1_op		*ps_ops;
+	int			ps_nr_ops;
+	int			ps_max_ops;
+	errcode_t		ps_stage_ret;	/* Couldn't grow ps_ops */
+
+	int			ps_defer;	/* Current inode is deferred */
+	char			ps_counters[PASS1_COUNTERS_SIZE];
+	uint64_t		*ps_deferred;
+	uint64_t		ps_nr_deferred;
+	uint64_t		ps_max_deferred;
+
+	struct pass1_msg	*ps_msgs;	/* Errors about this inode */
+	int			ps_nr_msgs;
+	int			ps_max_msgs;
+
+	unsigned int		ps_steps;	/* Unreported progress */
+};
+
+void o2fsck_pass1_stage(o2fsck_state *ost, enum o2fsck_pass1_op op,
+			uint64_t a, uint64_t b, uint64_t c)
+{
+	errcode_t ret;
+	struct o2fsck_pass1_shard *ps = ost->ost_shard;
+	struct pass1_op *p;
+
+	if (ps->ps_nr_ops == ps->ps_max_ops) {
+		ret = ocfs2_realloc(sizeof(struct pass1_op) *
+				    ps->ps_max_ops * 2, &ps->ps_ops);
+		if (ret) {
+			/* The serial pass will have to do it */
+			ps->ps_stage_ret = ret;
+			o2fsck_pass1_defer(ost);
+			return;
+		}
+		ps->ps_max_ops *= 2;
+	}
+
+	p = &ps->ps_ops[ps->ps_nr_ops++];
+	p->p_op = op;
+	p->p_a = a;
+	p->p_b = b;
+	p->p_c = c;
+}
+
+void o2fsck_pass1_defer(o2fsck_state *ost)
+{
+	ost->ost_shard->ps_defer = 1;
+}
+
+static void replay_op(o2fsck_state *ost, struct pass1_op *p)
+{
+	errcode_t ret;
+
+	switch (p->p_op) {
+		case P1_DIR_INODE:
+			mark_dir_inode(ost, p->p_a, p->p_b);
+			break;
+		case P1_REG_INODE:
+			mark_reg_inode(ost, p->p_a);
+			break;
+		case P1_ICOUNT:
+			set_inode_icount(ost, p->p_a, p->p_b);
+			break;
+		case P1_DIR_BLOCK:
+			ret = add_dir_block(ost, p->p_a, p->p_b, p->p_c);
+			if (ret)
+				com_err(whoami, ret, "while trying to track "
+					"block in directory inode %"PRIu64,
+					p->p_a);
+			break;
+		case P1_CLUSTERS_USED:
+			o2fsck_mark_clusters_allocated(ost, p->p_a, p->p_b);
+			break;
+		case P1_CLUSTER_FREE:
+			o2fsck_mark_cluster_unallocated(ost, p->p_a);
+			break;
+		case P1_INODE_ALLOC:
+			update_inode_alloc(ost, NULL, p->p_a, (int16_t)p->p_c,
+					   p->p_b);
+			break;
+		default:
+			assert(0);
+	}
+}
+
+static void flush_shard(struct o2fsck_pass1_shard *ps)
+{
+	int i;
+	o2fsck_state *ost = ps->ps_shared;
+
+	pthread_mutex_lock(ps->ps_lock);
+	for (i = 0; i < ps->ps_nr_ops; i++)
+		replay_op(ost, &ps->ps_ops[i]);
+	if (ost->ost_prog && ps->ps_steps)
+		tools_progress_step(ost->ost_prog, ps->ps_steps);
+	pthread_mutex_unlock(ps->ps_lock);
+
+	ps->ps_nr_ops = 0;
+	ps->ps_steps = 0;
+}
+
+static errcode_t defer_inode(struct o2fsck_pass1_shard *ps, uint64_t blkno)
+{
+	errcode_t ret;
+
+	if (ps->ps_nr_deferred == ps->ps_max_deferred) {
+		ret = ocfs2_realloc(sizeof(uint64_t) * ps->ps_max_deferred * 2,
+				    &ps->ps_deferred);
+		if (ret)
+			return ret;
+		ps->ps_max_deferred *= 2;
+	}
+
+	ps->ps_deferred[ps->ps_nr_deferred++] = blkno;
+	return 0;
+}
+
+/* The shard whose thread is inside check_inode(), if any */
+static __thread struct o2fsck_pass1_shard *pass1_checking;
+static void (*pass1_old_hook)(const char *, long, const char *, va_list);
+
+static int save_msg(struct o2fsck_pass1_shard *ps, const char *prog,
+		    long errcode, const char *fmt, va_list args)
+{
+	va_list copy;
+	int len;
+	char *text;
+	struct pass1_msg *m;
+
+	if (ps->ps_nr_msgs == ps->ps_max_msgs) {
+		if (ocfs2_realloc(sizeof(struct pass1_msg) *
+				  (ps->ps_max_msgs + 8), &ps->ps_msgs))
+			return 0;
+		ps->ps_max_msgs += 8;
+	}
+
+	va_copy(copy, args);
+	len = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+	if ((len < 0) || ocfs2_malloc(len + 1, &text))
+		return 0;
+
+	va_copy(copy, args);
+	vsnprintf(text, len + 1, fmt, copy);
+	va_end(copy);
+
+	m = &ps->ps_msgs[ps->ps_nr_msgs++];
+	m->m_prog = prog;
+	m->m_code = errcode;
+	m->m_text = text;
+	return 1;
+}
+
+/*
+ * Holds what a thread says about the inode it is checking.  Anything
+ * else, or anything that can't be held, goes straight through.
+ */
+static void pass1_thread_com_err(const char *prog, long errcode,
+				 const char *fmt, va_list args)
+{
+	struct o2fsck_pass1_shard *ps = pass1_checking;
+
+	if (!ps || !save_msg(ps, prog, errcode, fmt, args))
+		pass1_old_hook(prog, errcode, fmt, args);
+}
+
+static void print_msg(const char *prog, long errcode, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	pass1_old_hook(prog, errcode, fmt, args);
+	va_end(args);
+}
+
+static void drop_msgs(struct o2fsck_pass1_shard *ps, int print)
+{
+	int i;
+	struct pass1_msg *m;
+
+	for (i = 0; i < ps->ps_nr_msgs; i++) {
+		m = &ps->ps_msgs[i];
+		if (print)
+			print_msg(m->m_prog, m->m_code, "%s", m->m_text);
+		ocfs2_free(&m->m_text);
+	}
+	ps->ps_nr_msgs = 0;
+}
+
+static void *pass1_thread(void *arg)
+{
+	struct o2fsck_pass1_shard *ps = arg;
+	o2fsck_state *ost = &ps->ps_ost;
+	char *counters = (char *)ost + PASS1_COUNTERS_OFFSET;
+	uint64_t blkno;
+	errcode_t ret;
+	char *buf;
+	int nr_ops;
+
+	ret = ocfs2_malloc_block(ost->ost_fs->fs_io, &buf);
+	if (ret) {
+		ps->ps_ret = ret;
+		return NULL;
+	}
+
+	for (;;) {
+		ret = ocfs2_get_next_inode(ps->ps_scan, &blkno, buf);
+		if (ret) {
+			ps->ps_ret = ret;
+			break;
+		}
+		if (blkno == 0)
+			break;
+
+		/* Counters live in the shard, so a deferral rolls back */
+		memcpy(ps->ps_counters, counters, PASS1_COUNTERS_SIZE);
+		nr_ops = ps->ps_nr_ops;
+		ps->ps_defer = 0;
+
+		pass1_checking = ps;
+		ret = check_inode(ost, blkno, (struct ocfs2_dinode *)buf);
+		pass1_checking = NULL;
+		drop_msgs(ps, !ret && !ps->ps_defer);
+		if (ret || ps->ps_defer) {
+			memcpy(counters, ps->ps_counters, PASS1_COUNTERS_SIZE);
+			ps->ps_nr_ops = nr_ops;
+			ret = defer_inode(ps, blkno);
+			if (ret) {
+				ps->ps_ret = ret;
+				break;
+			}
+			continue;
+		}
+
+		ps->ps_steps++;
+		if ((ps->ps_nr_ops >= PASS1_FLUSH_OPS) ||
+		    (ps->ps_steps >= PASS1_PROGRESS_STEPS))
+			flush_shard(ps);
+	}
+
+	flush_shard(ps);
+	ocfs2_free(&buf);
+	return NULL;
+}
+
+static void add_shard_counters(o2fsck_state *ost, o2fsck_state *from)
+{
+	int i;
+
+	ost->ost_file_count += from->ost_file_count;
+	ost->ost_inline_file_count += from->ost_inline_file_count;
+	ost->ost_dir_count += from->ost_dir_count;
+	ost->ost_inline_dir_count += from->ost_inline_dir_count;
+	ost->ost_reflinks_count += from->ost_reflinks_count;
+	ost->ost_links_count += from->ost_links_count;
+	ost->ost_chardev_count += from->ost_chardev_count;
+	ost->ost_sockets_count += from->ost_sockets_count;
+	ost->ost_fifo_count += from->ost_fifo_count;
+	ost->ost_blockdev_count += from->ost_blockdev_count;
+	ost->ost_symlinks_count += from->ost_symlinks_count;
+	ost->ost_fast_symlinks_count += from->ost_fast_symlinks_count;
+	ost->ost_orphan_count += from->ost_orphan_count;
+	ost->ost_orphan_deleted_count += from->ost_orphan_deleted_count;
+	for (i = 0; i <= OCFS2_MAX_PATH_DEPTH; i++)
+		ost->ost_tree_depth_count[i] += from->ost_tree_depth_count[i];
+}
+
+/*
+ * A shard starts out knowing only what the checks may read.  The
+ * shared structures are left NULL so that anything unstaged that
+ * reaches them fails loudly rather than racing.
+ */
+static errcode_t init_shard(o2fsck_state *ost, struct o2fsck_pass1_shard *ps,
+			    ocfs2_inode_scan *scan, pthread_mutex_t *lock)
+{
+	errcode_t ret;
+	o2fsck_state *sost = &ps->ps_ost;
+
+	memset(ps, 0, sizeof(struct o2fsck_pass1_shard));
+	ps->ps_shared = ost;
+	ps->ps_lock = lock;
+	ps->ps_scan = scan;
+
+	sost->ost_fs = ost->ost_fs;
+	sost->ost_fs_generation = ost->ost_fs_generation;
+	sost->ost_lostfound_ino = ost->ost_lostfound_ino;
+	sost->ost_num_clusters = ost->ost_num_clusters;
+	sost->ost_fix_fs_gen = ost->ost_fix_fs_gen;
+	sost->ost_dir_parents = RB_ROOT;
+	sost->ost_refcount_trees = RB_ROOT;
+	sost->ost_shard = ps;
+
+	ps->ps_max_ops = PASS1_FLUSH_OPS * 2;
+	ret = ocfs2_malloc(sizeof(struct pass1_op) * ps->ps_max_ops,
+			   &ps->ps_ops);
+	if (ret)
+		return ret;
+
+	ps->ps_max_deferred = 64;
+	return ocfs2_malloc(sizeof(uint64_t) * ps->ps_max_deferred,
+			    &ps->ps_deferred);
+}
+
+static int blkno_cmp(const void *a, const void *b)
+{
+	const uint64_t *l = a, *r = b;
+
+	if (*l < *r)
+		return -1;
+	if (*l > *r)
+		return 1;
+	return 0;
+}
+
+/*
+ * The deferred inodes get the same check as in a serial pass 1, in
+ * disk order.  Any question about them is asked here.
+ */
+static errcode_t check_deferred_inodes(o2fsck_state *ost,
+				       struct o2fsck_pass1_shard *shards,
+				       int nr_shards)
+{
+	errcode_t ret;
+	uint64_t *deferred = NULL, nr = 0, i;
+	char *buf = NULL;
+	int s;
+
+	for (s = 0; s < nr_shards; s++)
+		nr += shards[s].ps_nr_deferred;
+
+	verbosef("%"PRIu64" inodes deferred to the serial pass\n", nr);
+	if (!nr)
+		return 0;
+
+	ret = ocfs2_malloc_block(ost->ost_fs->fs_io, &buf);
+	if (ret)
+		goto out;
+	ret = ocfs2_malloc(sizeof(uint64_t) * nr, &deferred);
+	if (ret)
+		goto out;
+
+	for (s = 0, nr = 0; s < nr_shards; s++) {
+		memcpy(deferred + nr, shards[s].ps_deferred,
+		       sizeof(uint64_t) * shards[s].ps_nr_deferred);
+		nr += shards[s].ps_nr_deferred;
+	}
+	qsort(deferred, nr, sizeof(uint64_t), blkno_cmp);
+
+	for (i = 0; i < nr; i++) {
+		ret = ocfs2_read_blocks(ost->ost_fs, deferred[i], 1, buf);
+		if (ret) {
+			com_err(whoami, ret, "while reading inode %"PRIu64,
+				deferred[i]);
+			goto out;
+		}
+
+		ret = check_inode(ost, deferred[i],
+				  (struct ocfs2_dinode *)buf);
+		if (ret)
+			goto out;
+
+		if (ost->ost_prog)
+			tools_progress_step(ost->ost_prog, 1);
+	}
+
+out:
+	if (deferred)
+		ocfs2_free(&deferred);
+	if (buf)
+		ocfs2_free(&buf);
+	return ret;
+}
+
+/*
+ * Check every inode on ost_threads threads.  Like the serial loop, a
+ * scan error stops pass 1 before the allocators are written.
+ */
+static errcode_t check_inodes_threaded(o2fsck_state *ost, int *scan_failed)
+{
+	errcode_t ret;
+	int i, nr = ost->ost_threads;
+	uint64_t numinodes = 0;
+	ocfs2_inode_scan *scans[O2FSCK_MAX_THREADS];
+	struct o2fsck_pass1_shard *shards = NULL;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	*scan_failed = 0;
+
+	ret = ocfs2_open_inode_scan_partitioned(ost->ost_fs, nr, scans);
+	if (ret) {
+		com_err(whoami, ret, "while opening inode scan");
+		*scan_failed = 1;
+		return ret;
+	}
+
+	ret = ocfs2_malloc0(sizeof(struct o2fsck_pass1_shard) * nr, &shards);
+	if (ret) {
+		com_err(whoami, ret, "while allocating pass 1 threads");
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = init_shard(ost, &shards[i], scans[i], &lock);
+		if (ret) {
+			com_err(whoami, ret, "while allocating pass 1 threads");
+			goto out;
+		}
+		numinodes += ocfs2_get_max_inode_count(scans[i]);
+	}
+
+	if (tools_progress_enabled()) {
+		if (numinodes)
+			ost->ost_prog =
+				tools_progress_start("Scanning inodes",
+						     "inodes", numinodes);
+		if (ost->ost_prog)
+			setbuf(stdout, NULL);
+	}
+
+	pass1_old_hook = set_com_err_hook(pass1_thread_com_err);
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&shards[i].ps_thread, NULL, pass1_thread,
+				   &shards[i])) {
+			ret = OCFS2_ET_NO_MEMORY;
+			break;
+		}
+		shards[i].ps_started = 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!shards[i].ps_started)
+			continue;
+		pthread_join(shards[i].ps_thread, NULL);
+		add_shard_counters(ost, &shards[i].ps_ost);
+	}
+	set_com_err_hook(pass1_old_hook);
+
+	if (ret) {
+		com_err(whoami, ret, "while starting pass 1 threads");
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (shards[i].ps_stage_ret)
+			verbosef("pass 1 thread %d ran out of memory "
+				 "staging inodes\n", i);
+		if (shards[i].ps_ret) {
+			/* we don't deal with corrupt inode allocation
+			 * files yet.  See the serial loop. */
+			ret = shards[i].ps_ret;
+			com_err(whoami, ret, "while scanning inodes");
+			*scan_failed = 1;
+			goto out;
+		}
+	}
+
+	ret = check_deferred_inodes(ost, shards, nr);
+
+out:
+	for (i = 0; i < nr; i++) {
+		if (shards) {
+			if (shards[i].ps_ops)
+				ocfs2_free(&shards[i].ps_ops);
+			if (shards[i].ps_deferred)
+				ocfs2_free(&shards[i].ps_deferred);
+			if (shards[i].ps_msgs)
+				ocfs2_free(&shards[i].ps_msgs);
+		}
+		ocfs2_close_inode_scan(scans[i]);
+	}
+	if (shards)
+		ocfs2_free(&shards);
+
+	return ret;
+}
+
+/*
+ * The serial scan reads two runs of inodes ahead while it checks the
+ * current one.
+ */
+#define PASS1_PREFETCH_DEPTH	2
+
 errcode_t o2fsck_pass1(o2fsck_state *ost)
 {
 	errcode_t ret;
@@ -1459,14 +2128,23 @@ errcode_t o2fsck_pass1(o2fsck_state *ost)
 	struct ocfs2_dinode *di;
 	ocfs2_inode_scan *scan;
 	ocfs2_filesys *fs = ost->ost_fs;
-	int valid;
 	struct o2fsck_resource_track rt;
 	uint64_t numinodes;
+	int scan_failed;
 
 	printf("Pass 1: Checking inodes and blocks\n");
 
 	o2fsck_init_resource_track(&rt, fs->fs_io);
 
+	if (ost->ost_threads > 1) {
+		ret = check_inodes_threaded(ost, &scan_failed);
+		if (scan_failed)
+			goto out_stats;
+		if (ret)
+			goto out;
+		goto out_allocs;
+	}
+
 	ret = ocfs2_malloc_block(fs->fs_io, &buf);
 	if (ret) {
 		com_err(whoami, ret, "while allocating inode buffer");
@@ -1475,7 +2153,7 @@ errcode_t o2fsck_pass1(o2fsck_state *ost)
 
 	di = (struct ocfs2_dinode *)buf;
 
-	ret = ocfs2_open_inode_scan(fs, &scan);
+	ret = ocfs2_open_inode_scan_prefetch(fs, PASS1_PREFETCH_DEPTH, &scan);
 	if (ret) {
 		com_err(whoami, ret, "while opening inode scan");
 		goto out_free;
@@ -1505,46 +2183,18 @@ errcode_t o2fsck_pass1(o2fsck_state *ost)
 		if (blkno == 0)
 			break;
 
-		valid = 0;
-
-		/* we never consider inodes who don't have a signature */
-		if (!memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
-			    strlen(OCFS2_INODE_SIGNATURE))) {
-
-			ocfs2_swap_inode_to_cpu(fs, di);
-
-			 /* We only consider inodes whose generations don't
-			  * match if the user has asked us to */
-			if ((ost->ost_fix_fs_gen ||
-			    (di->i_fs_generation == ost->ost_fs_generation))) {
-
-				if (di->i_flags & OCFS2_VALID_FL)
-					o2fsck_verify_inode_fields(fs, ost,
-								   blkno, di);
-				if (di->i_flags & OCFS2_VALID_FL) {
-					ret = o2fsck_check_refcount_tree(ost,
-									 di);
-					if (ret)
-						goto out;
-					ret = o2fsck_check_blocks(fs, ost,
-								  blkno, di);
-					if (ret)
-						goto out;
-					ret = o2fsck_check_xattr(ost, di);
-					if (ret)
-						goto out;
-				}
-
-				valid = di->i_flags & OCFS2_VALID_FL;
-			}
-		}
-
-		update_inode_alloc(ost, di, blkno, valid);
+		ret = check_inode(ost, blkno, di);
+		if (ret)
+			goto out;
 
 		if (ost->ost_prog)
 			tools_progress_step(ost->ost_prog, 1);
 	}
 
+	ocfs2_close_inode_scan(scan);
+	ocfs2_free(&buf);
+
+out_allocs:
 	mark_local_allocs(ost);
 	mark_truncate_logs(ost);
 	ret = o2fsck_check_mark_refcounted_clusters(ost);
@@ -1552,12 +2202,14 @@ errcode_t o2fsck_pass1(o2fsck_state *ost)
 		com_err(whoami, ret, "while checking refcounted clusters");
 	write_cluster_alloc(ost);
 	write_inode_alloc(ost);
+	goto out_stats;
 
 out_close_scan:
 	ocfs2_close_inode_scan(scan);
 out_free:
 	ocfs2_free(&buf);
 
+out_stats:
 	if (!ret && ost->ost_duplicate_clusters)
 		ret = ocfs2_pass1_dups(ost);
 
@@ -35,8 +35,9 @@
  *
  * Pass 1C walks the directory tree and gives names to each inode.  This
  * is so the user can see the name of the file they are fixing.  The pass
- * does a depth-first traversal of the tree.  For every inode in the
- * rbtree of duplicates it finds, it stores the path for it.  It will
+ * indexes the tree once with ocfs2_name_index_build_for(), stopping when
+ * every inode with duplicates has a name, then stores the first path of
+ * each inode in the rbtree of duplicates.  It will
  * ignore errors in the directory tree, because we haven't fixed it yet.
  * When reporting to the user, inodes without names will just get their
  * inode number printed.
@@ -352,6 +353,8 @@ static void o2fsck_empty_dup_context(struct dup_context *dct)
 	while ((node = rb_first(&dct->dup_inodes)) != NULL) {
 		di = rb_entry(node, struct dup_inode, di_node);
 		rb_erase(&di->di_node, &dct->dup_inodes);
+		if (di->di_path)
+			free(di->di_path);
 		ocfs2_free(&di);
 	}
 }
@@ -823,28 +826,6 @@ out:
  * Pass 1C
  */
 
-struct dir_to_scan {
-	struct list_head ts_list;
-	uint64_t ts_ino;
-	char *ts_path;
-};
-
-struct dir_scan_context {
-	o2fsck_state *ds_ost;
-	struct dup_context *ds_dct;
-
-	/* Inodes we still have to find */
-	int64_t ds_inodes_left;
-
-	/* Subdirs that are pending */
-	struct list_head ds_paths;
-
-	/* The cwd's path and ino */
-	uint64_t ds_ino;
-	char *ds_cwd;
-	int ds_cwdlen;
-};
-
 static void pass1c_warn(errcode_t ret)
 {
 	static int warned = 0;
@@ -859,159 +840,56 @@ static void pass1c_warn(errcode_t ret)
 		"inode number instead of name.");
 }
 
-static char *de_to_path(struct dir_scan_context *scan,
-			struct ocfs2_dir_entry *de)
-{
-	/* The 2 is for the path separator and the null */
-	int copied, pathlen = scan->ds_cwdlen + de->name_len + 2;
-	char *path = NULL;
-	/* We start with an empty cwd as we add '/' or '//' */
-	const char *cwdstr = scan->ds_cwdlen ? scan->ds_cwd : "";
-	const char *sep = "/";
-
-	/* Don't repeat '/' */
-	if (scan->ds_cwdlen &&
-	    (scan->ds_cwd[scan->ds_cwdlen - 1] == '/'))
-		sep = "";
-	if (de->name_len && (de->name[0] == '/'))
-		sep = "";
-
-	if (!ocfs2_malloc0(sizeof(char) * pathlen, &path)) {
-		copied = snprintf(path, pathlen, "%s%s%.*s",
-				  cwdstr, sep, de->name_len, de->name);
-		assert(copied < pathlen);
-	}
-
-	return path;
-}
-
-static void push_dir(struct dir_scan_context *scan,
-		     struct ocfs2_dir_entry *de)
+/* The first name found is the one we use */
+static int name_inode(uint64_t ino, char *path, int file_type,
+		      void *priv_data)
 {
-	errcode_t ret;
-	struct dir_to_scan *ts = NULL;
-
-	ret = ocfs2_malloc0(sizeof(struct dir_to_scan), &ts);
-	if (ret)
-		goto warn;
-
-	ts->ts_ino = de->inode;
-	ts->ts_path = de_to_path(scan, de);
-	if (!ts->ts_path) {
-		ret = OCFS2_ET_NO_MEMORY;
-		goto warn;
-	}
-
-	list_add(&ts->ts_list, &scan->ds_paths);
-	return;
-
-warn:
-	if (ts)
-		ocfs2_free(&ts);
-	pass1c_warn(ret);
-}
-
-static void set_next_cwd(struct dir_scan_context *scan)
-{
-	struct dir_to_scan *ts;
-
-	if (scan->ds_cwd)
-		ocfs2_free(&scan->ds_cwd);
-
-	ts = list_entry(scan->ds_paths.next, struct dir_to_scan, ts_list);
-	list_del(&ts->ts_list);
-
-	/* Steal the string from ts */
-	scan->ds_cwd = ts->ts_path;
-	scan->ds_cwdlen = strlen(scan->ds_cwd);
-	scan->ds_ino = ts->ts_ino;
-
-	ocfs2_free(&ts);
-}
-
-static void name_inode(struct dir_scan_context *scan,
-		       struct ocfs2_dir_entry *de)
-{
-	struct dup_inode *di = dup_inode_lookup(scan->ds_dct, de->inode);
-
-	if (!di || di->di_path)
-		return;
+	struct dup_inode *di = priv_data;
 
-	scan->ds_inodes_left--;
-
-	di->di_path = de_to_path(scan, de);
+	di->di_path = strdup(path);
 	if (!di->di_path)
 		pass1c_warn(OCFS2_ET_NO_MEMORY);
-}
-
-static int walk_iterate(struct ocfs2_dir_entry *de, uint64_t blocknr,
-			int offset, int blocksize, char *buf, void *priv_data)
-{
-	struct dir_scan_context *scan = priv_data;
 
-	/* Directories are checked when they're traversed */
-	if (de->file_type == OCFS2_FT_DIR)
-		push_dir(scan, de);
-	else
-		name_inode(scan, de);
-
-	return scan->ds_inodes_left ? 0 : OCFS2_DIRENT_ABORT;
-}
-
-static void walk_cwd(struct dir_scan_context *scan)
-{
-	errcode_t ret;
-	struct ocfs2_dir_entry *de;
-	int len = sizeof(struct ocfs2_dir_entry);
-
-	if (scan->ds_cwdlen > OCFS2_MAX_FILENAME_LEN)
-		len = sizeof(struct ocfs2_dir_entry) + scan->ds_cwdlen
-			- OCFS2_MAX_FILENAME_LEN;
-
-	ret = ocfs2_malloc(len, &de);
-
-	memcpy(de->name, scan->ds_cwd, scan->ds_cwdlen);
-	de->name_len = scan->ds_cwdlen;
-	name_inode(scan, de);
-	free(de);
- 
-	ret = ocfs2_dir_iterate(scan->ds_ost->ost_fs, scan->ds_ino,
-				OCFS2_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
-				walk_iterate, scan);
-	if (ret)
-		pass1c_warn(ret);
+	return OCFS2_NAME_ABORT;
 }
 
 static void o2fsck_pass1c(o2fsck_state *ost, struct dup_context *dct)
 {
-	struct dir_scan_context scan = {
-		.ds_ost = ost,
-		.ds_dct = dct,
-		.ds_inodes_left = dct->dup_inode_count,
-	};
+	errcode_t ret;
+	ocfs2_name_index *ni;
+	struct rb_node *node;
+	struct dup_inode *di;
+	uint64_t *inos, nr = 0;
 
 	whoami = "pass1c";
 	printf("Pass 1c: Determining the names of inodes owning "
 	       "multiply-claimed clusters\n");
 
-	INIT_LIST_HEAD(&scan.ds_paths);
-	push_dir(&scan, &(struct ocfs2_dir_entry){
-		 .name = "/",
-		 .name_len = 1,
-		 .file_type = OCFS2_FT_DIR,
-		 .inode = ost->ost_fs->fs_root_blkno,
-		 });
-	push_dir(&scan, &(struct ocfs2_dir_entry){
-		 .name = "//",
-		 .name_len = 2,
-		 .file_type = OCFS2_FT_DIR,
-		 .inode = ost->ost_fs->fs_sysdir_blkno,
-		 });
-
-	while (scan.ds_inodes_left && !list_empty(&scan.ds_paths)) {
-		set_next_cwd(&scan);
-		walk_cwd(&scan);
+	ret = ocfs2_malloc(sizeof(uint64_t) * dct->dup_inode_count, &inos);
+	if (ret) {
+		pass1c_warn(ret);
+		return;
 	}
+	for (node = rb_first(&dct->dup_inodes); node; node = rb_next(node)) {
+		di = rb_entry(node, struct dup_inode, di_node);
+		inos[nr++] = di->di_ino;
+	}
+
+	ret = ocfs2_name_index_build_for(ost->ost_fs, inos, nr, &ni);
+	ocfs2_free(&inos);
+	if (ret) {
+		pass1c_warn(ret);
+		return;
+	}
+
+	for (node = rb_first(&dct->dup_inodes); node; node = rb_next(node)) {
+		di = rb_entry(node, struct dup_inode, di_node);
+		ret = ocfs2_name_index_iterate(ni, di->di_ino, name_inode, di);
+		if (ret && (ret != OCFS2_ET_FILE_NOT_FOUND))
+			pass1c_warn(ret);
+	}
+
+	ocfs2_name_index_free(ni);
 }
 
 
@@ -707,9 +707,8 @@ static int corrupt_dirent_lengths(struct ocfs2_dir_entry *dirent, int left)
 	return 1;
 }
 
-/* this could certainly be more clever to issue reads in groups */
-static unsigned pass2_dir_block_iterate(o2fsck_dirblock_entry *dbe, 
-					void *priv_data) 
+static unsigned pass2_dir_block_iterate(o2fsck_dirblock_entry *dbe,
+					char *buf, void *priv_data)
 {
 	struct dirblock_data *dd = priv_data;
 	struct ocfs2_dir_entry *dirent, *prev = NULL;
@@ -775,8 +774,13 @@ static unsigned pass2_dir_block_iterate(o2fsck_dirblock_entry *dbe,
 							     di->i_size))
 			goto out;
 
-		ret = ocfs2_read_dir_block(dd->fs, di, dbe->e_blkno,
-					   dd->dirblock_buf);
+		if (buf) {
+			memcpy(dd->dirblock_buf, buf, dd->fs->fs_blocksize);
+			ret = ocfs2_validate_checked_dir_block(dd->fs, di,
+							dd->dirblock_buf);
+		} else
+			ret = ocfs2_read_dir_block(dd->fs, di, dbe->e_blkno,
+						   dd->dirblock_buf);
 		if (ret && ret != OCFS2_ET_DIR_CORRUPTED) {
 			com_err(whoami, ret, "while reading dir block %"PRIu64,
 				dbe->e_blkno);
@@ -955,11 +959,11 @@ out:
 static void release_re_idx_dirs_rbtree(struct rb_root * root)
 {
 	struct rb_node *node;
-	o2fsck_dirblock_entry *dp;
+	o2fsck_reidx_dir *dp;
 
 	while ((node = rb_first(root)) != NULL) {
-		dp = rb_entry(node, o2fsck_dirblock_entry, e_node);
-		rb_erase(&dp->e_node, root);
+		dp = rb_entry(node, o2fsck_reidx_dir, rd_node);
+		rb_erase(&dp->rd_node, root);
 		ocfs2_free(&dp);
 	}
 }
@@ -1022,6 +1026,7 @@ errcode_t o2fsck_pass2(o2fsck_state *ost)
 		dp->dp_dirent = ost->ost_fs->fs_sysdir_blkno;
 
 	o2fsck_dir_block_iterate(ost, pass2_dir_block_iterate, &dd);
+	o2fsck_free_dir_blocks(&ost->ost_dirblocks);
 
 	if (dd.re_idx_dirs.rb_node) {
 		ret = o2fsck_rebuild_indexed_dirs(ost->ost_fs, &dd.re_idx_dirs);
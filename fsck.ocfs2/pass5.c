@@ -495,7 +495,8 @@ errcode_t o2fsck_pass5(o2fsck_state *ost)
 		if (ret)
 			goto out;
 	}
-	ret = ocfs2_compute_quota_usage(fs, qhash[USRQUOTA], qhash[GRPQUOTA]);
+	ret = ocfs2_compute_quota_usage(fs, qhash[USRQUOTA], qhash[GRPQUOTA],
+					ost->ost_threads);
 	if (ret) {
 		com_err(whoami, ret, "while computing quota usage");
 		goto out;
@@ -38,6 +38,7 @@
 
 #include "ocfs2/ocfs2.h"
 
+#include "pass1.h"
 #include "problem.h"
 #include "util.h"
 
@@ -98,6 +99,12 @@ int prompt_input(o2fsck_state *ost, unsigned flags, struct prompt_code code,
 	int c, ans = 0;
 	static char yes[] = " <y> ", no[] = " <n> ";
 
+	/* A pass 1 thread can't ask; the serial pass will */
+	if (ost->ost_shard) {
+		o2fsck_pass1_defer(ost);
+		return 0;
+	}
+
 	/* paranoia for jokers that claim to default to both */
 	if((flags & PY) && (flags & PN))
 		flags &= ~PY;
@@ -25,6 +25,7 @@
 #include "problem.h"
 #include "fsck.h"
 #include "extent.h"
+#include "pass1.h"
 #include "util.h"
 #include "refcount.h"
 
@@ -463,6 +464,12 @@ errcode_t o2fsck_mark_clusters_refcounted(o2fsck_state *ost,
 	struct list_head *p, *next;
 	struct refcount_extent *extent;
 
+	/* The refcount trees aren't staged; see check_inode() in pass1.c */
+	if (ost->ost_shard) {
+		o2fsck_pass1_defer(ost);
+		return 0;
+	}
+
 	if (file && file->i_blkno == i_blkno)
 		goto add_clusters;
 
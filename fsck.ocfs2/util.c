@@ -36,6 +36,8 @@
 #include "ocfs2/ocfs2.h"
 
 
+#include "icount.h"
+#include "pass1.h"
 #include "util.h"
 
 void o2fsck_write_inode(o2fsck_state *ost, uint64_t blkno,
@@ -44,6 +46,12 @@ void o2fsck_write_inode(o2fsck_state *ost, uint64_t blkno,
 	errcode_t ret;
 	const char *whoami = __FUNCTION__;
 
+	/* A pass 1 thread leaves the fix to the serial pass */
+	if (ost->ost_shard) {
+		o2fsck_pass1_defer(ost);
+		return;
+	}
+
 	if (blkno != di->i_blkno) {
 		com_err(whoami, OCFS2_ET_INTERNAL_FAILURE, "when asked to "
 			"write an inode with an i_blkno of %"PRIu64" to block "
@@ -65,6 +73,11 @@ void o2fsck_mark_cluster_allocated(o2fsck_state *ost, uint32_t cluster)
 	errcode_t ret;
 	const char *whoami = __FUNCTION__;
 
+	if (ost->ost_shard) {
+		o2fsck_pass1_stage(ost, P1_CLUSTERS_USED, cluster, 1, 0);
+		return;
+	}
+
 	o2fsck_bitmap_set(ost->ost_allocated_clusters, cluster, &was_set);
 
 	if (!was_set)
@@ -92,6 +105,11 @@ void o2fsck_mark_cluster_allocated(o2fsck_state *ost, uint32_t cluster)
 void o2fsck_mark_clusters_allocated(o2fsck_state *ost, uint32_t cluster,
 				    uint32_t num)
 {
+	if (ost->ost_shard) {
+		o2fsck_pass1_stage(ost, P1_CLUSTERS_USED, cluster, num, 0);
+		return;
+	}
+
 	while(num--)
 		o2fsck_mark_cluster_allocated(ost, cluster++);
 }
@@ -100,6 +118,11 @@ void o2fsck_mark_cluster_unallocated(o2fsck_state *ost, uint32_t cluster)
 {
 	int was_set;
 
+	if (ost->ost_shard) {
+		o2fsck_pass1_stage(ost, P1_CLUSTER_FREE, cluster, 0, 0);
+		return;
+	}
+
 	o2fsck_bitmap_clear(ost->ost_allocated_clusters, cluster, &was_set);
 }
 
@@ -252,6 +275,7 @@ void o2fsck_add_resource_track(struct o2fsck_resource_track *rt1,
 	io1->is_cache_misses += io2->is_cache_misses;
 	io1->is_cache_inserts += io2->is_cache_inserts;
 	io1->is_cache_removes += io2->is_cache_removes;
+	io1->is_cache_evictions += io2->is_cache_evictions;
 
 }
 
@@ -282,6 +306,8 @@ void o2fsck_compute_resource_track(struct o2fsck_resource_track *rt,
 	rtio->is_cache_misses = ios->is_cache_misses - rtio->is_cache_misses;
 	rtio->is_cache_inserts = ios->is_cache_inserts - rtio->is_cache_inserts;
 	rtio->is_cache_removes = ios->is_cache_removes - rtio->is_cache_removes;
+	rtio->is_cache_evictions = ios->is_cache_evictions -
+		rtio->is_cache_evictions;
 }
 
 void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
@@ -321,8 +347,9 @@ void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
 	total_io = rtio->is_bytes_read + rtio->is_bytes_written;
 
 	if (!pass)
-		printf("  Cache size: %luMB\n",
-		       mbytes(io_get_cache_size(channel)));
+		printf("  Cache size: %luMB (%s)\n",
+		       mbytes(io_get_cache_size(channel)),
+		       io_get_cache_engine(channel));
 
 	printf("  I/O read disk/cache: %"PRIu64"MB / %"PRIu64"MB, "
 	       "write: %"PRIu64"MB, rate: %.2fMB/s\n",
@@ -330,6 +357,18 @@ void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
 	       mbytes(cache_read), mbytes(rtio->is_bytes_written),
 	       (double)(mbytes(total_io) / walltime));
 
+	printf("  Cache hits: %"PRIu32", misses: %"PRIu32", "
+	       "evictions: %"PRIu32"\n", rtio->is_cache_hits,
+	       rtio->is_cache_misses, rtio->is_cache_evictions);
+
+	if (ost->ost_icount_in_inodes && ost->ost_icount_refs)
+		printf("  Link counts: %"PRIu64" multiply linked inodes, "
+		       "%"PRIu64" refs, memory: %luKB\n",
+		       o2fsck_icount_multiple(ost->ost_icount_in_inodes),
+		       o2fsck_icount_multiple(ost->ost_icount_refs),
+		       kbytes(o2fsck_icount_memory(ost->ost_icount_in_inodes) +
+			      o2fsck_icount_memory(ost->ost_icount_refs)));
+
 	printf("  Times real: %dm%.3fs, user: %dm%.3fs, sys: %dm%.3fs\n",
 	       rtime_m, rtime_s, utime_m, utime_s, stime_m, stime_s);
 }
@@ -402,7 +441,8 @@ void o2fsck_init_cache(o2fsck_state *ost, enum o2fsck_cache_hint hint)
 			 blocks_wanted);
 		if (blocks_wanted > av_blocks)
 			blocks_wanted = av_blocks;
-		ret = io_init_cache(fs->fs_io, blocks_wanted);
+		ret = io_init_cache_engine(fs->fs_io, blocks_wanted,
+					   IO_CACHE_ENGINE_HASH);
 		if (!ret) {
 			/*
 			 * We want to pin our cache; there's no point in
@@ -38,6 +38,8 @@ extern int ocfs2_find_first_bit_set(void *addr, int size);
 extern int ocfs2_find_first_bit_clear(void *addr, int size);
 extern int ocfs2_find_next_bit_set(void *addr, int size, int offset);
 extern int ocfs2_find_next_bit_clear(void *addr, int size, int offset);
+extern int ocfs2_find_next_bits_clear(void *addr, int size, int offset,
+				      int len);
 extern int ocfs2_get_bits_set(void *addr, int size, int offset);
 
 #endif
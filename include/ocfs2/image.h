@@ -30,11 +30,19 @@
  * 		metadata blocks and a bitmap.
  * 2. raw    - A raw image is a sparse file containing the metadata blocks.
  *
- * 		Usage: o2image [-rI] <device> <imagefile>
+ * 		Usage: o2image [-rI1] <device> <imagefile>
  *
  * Packed format contains bitmap towards the end of the image-file. Each bit in
  * the bitmap represents a block in the filesystem.
  *
+ * Version 2 of the packed format compresses the metadata blocks in chunks of
+ * hdr_chunkblks image blocks, followed by the bitmap in chunks of
+ * hdr_chunkblks bitmap blocks. A chunk index and then an ocfs2_image_trailer
+ * end the file. Everything is written in order, so the image can be streamed
+ * to a pipe. Readers find the index from the trailer and decompress the chunk
+ * holding a block on demand. Version 1 images store the blocks and the bitmap
+ * uncompressed.
+ *
  * When the packed image is opened using o2image or debugfs.ocfs2, bitmap is
  * loaded into memory and used to map disk blocks to image blocks.
  *
@@ -47,12 +55,18 @@
 
 #define OCFS2_IMAGE_MAGIC		0x72a3d45f
 #define OCFS2_IMAGE_DESC 		"OCFS2 IMAGE"
-#define OCFS2_IMAGE_VERSION		1
+#define OCFS2_IMAGE_VERSION		2
 #define OCFS2_IMAGE_READ_CHAIN_NO	0
 #define OCFS2_IMAGE_READ_INODE_NO	1
 #define OCFS2_IMAGE_READ_INODE_YES	2
 #define OCFS2_IMAGE_BITMAP_BLOCKSIZE	4096
 #define OCFS2_IMAGE_BITS_IN_BLOCK	(OCFS2_IMAGE_BITMAP_BLOCKSIZE * 8)
+#define OCFS2_IMAGE_CHUNK_BLOCKS	256
+
+/* How a version 2 chunk is stored */
+#define OCFS2_IMAGE_CODEC_NONE		0
+#define OCFS2_IMAGE_CODEC_RLE		1	/* Built in, always there */
+#define OCFS2_IMAGE_CODEC_ZSTD		2
 
 /* on disk ocfs2 image header format */
 struct ocfs2_image_hdr {
@@ -66,19 +80,43 @@ struct ocfs2_image_hdr {
 	__le64	hdr_bmpblksz;		/* bitmap block size */
 	__le64	hdr_superblkcnt;	/* number of super blocks */
 	__le64	hdr_superblocks[OCFS2_MAX_BACKUP_SUPERBLOCKS];
+	__le32	hdr_chunkblks;		/* v2: image blocks per chunk */
+	__le32	hdr_reserved;
+};
+
+/* v2: where a chunk lives in the image file */
+struct ocfs2_image_chunk {
+	__le64	ic_offset;		/* Byte offset of the chunk */
+	__le32	ic_len;			/* Bytes stored */
+	__le16	ic_codec;		/* OCFS2_IMAGE_CODEC_* */
+	__le16	ic_reserved;
 };
 
+/* v2: the last bytes of the image file */
+struct ocfs2_image_trailer {
+	__le32	it_magic;		/* OCFS2_IMAGE_MAGIC */
+	__le32	it_reserved;
+	__le64	it_index;		/* Byte offset of the chunk index */
+	__le64	it_chunks;		/* Chunks of metadata blocks */
+	__le64	it_bmpchunks;		/* Chunks of bitmap blocks */
+};
+
+struct ocfs2_image_chunk_cache;
+
 /*
  * array to hold pointers to bitmap blocks. arr_set_bit_cnt holds cumulative
  * count of bits used previous to the current block. arr_self will be pointing
  * to the memory chunks allocated. arr_map will be pointing to bitmap blocks
  * of size OCFS2_IMAGE_BITMAP_BLOCKSIZE. Each block maps to
- * OCFS2_IMAGE_BITS_IN_BLOCK number of filesystem blocks.
+ * OCFS2_IMAGE_BITS_IN_BLOCK number of filesystem blocks. arr_rank[i] holds
+ * the count of bits set in the block before its 64-bit word i, so a block's
+ * place in the image is found with one popcount.
  */
 struct _ocfs2_image_bitmap_arr {
 	uint64_t	arr_set_bit_cnt;
 	char		*arr_self;
 	char    	*arr_map;
+	uint16_t	*arr_rank;
 };
 typedef struct _ocfs2_image_bitmap_arr ocfs2_image_bitmap_arr;
 
@@ -97,6 +135,12 @@ struct ocfs2_image_state {
 	int		ost_bpc; 		/* blocks per cluster */
 	int 		ost_superblkcnt; 	/* number of super blocks */
 	ocfs2_image_bitmap_arr	*ost_bmparr; 	/* points to bitmap blocks */
+	uint16_t	*ost_rank;		/* backs every arr_rank */
+	uint64_t	ost_version;		/* of the image file */
+	uint32_t	ost_chunkblks;		/* v2: image blocks per chunk */
+	uint64_t	ost_nr_chunks;		/* v2: chunks of metadata */
+	struct ocfs2_image_chunk *ost_chunks;	/* v2: chunk index */
+	struct ocfs2_image_chunk_cache *ost_cache; /* v2: decompressed chunks */
 };
 
 errcode_t ocfs2_image_load_bitmap(ocfs2_filesys *ofs);
@@ -105,4 +149,14 @@ errcode_t ocfs2_image_alloc_bitmap(ocfs2_filesys *ofs);
 void ocfs2_image_mark_bitmap(ocfs2_filesys *ofs, uint64_t blkno);
 int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno);
 uint64_t ocfs2_image_get_blockno(ocfs2_filesys *ofs, uint64_t blkno);
+errcode_t ocfs2_image_count_bits(ocfs2_filesys *ofs, uint64_t *bits_set);
 void ocfs2_image_swap_header(struct ocfs2_image_hdr *hdr);
+void ocfs2_image_swap_chunk(struct ocfs2_image_chunk *chunk);
+void ocfs2_image_swap_trailer(struct ocfs2_image_trailer *trailer);
+int ocfs2_image_compressed(ocfs2_filesys *ofs);
+errcode_t ocfs2_image_read_blocks(ocfs2_filesys *ofs, uint64_t blkno,
+				  int count, char *data);
+errcode_t ocfs2_image_compress(char *src, uint32_t len, char *dst,
+			       uint32_t *dst_len, uint16_t *codec);
+errcode_t ocfs2_image_decompress(uint16_t codec, char *src, uint32_t len,
+				 char *dst, uint32_t dst_len);
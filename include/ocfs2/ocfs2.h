@@ -93,6 +93,9 @@
 						 * information on block
 						 * reads. */
 #define OCFS2_FLAG_HARD_RO            0x0400
+#define OCFS2_FLAG_IO_URING           0x0800	/* Use io_uring for I/O
+						 * if the kernel has
+						 * it. */
 
 
 /* Return flags for the directory iterator functions */
@@ -111,6 +114,9 @@
 #define OCFS2_CHAIN_ABORT	0x02
 #define OCFS2_CHAIN_ERROR	0x04
 
+/* Return flags for the name index iterator function */
+#define OCFS2_NAME_ABORT	0x02
+
 /* Directory constants */
 #define OCFS2_DIRENT_DOT_FILE		1
 #define OCFS2_DIRENT_DOT_DOT_FILE	2
@@ -145,6 +151,7 @@ typedef struct _ocfs2_cached_dquot ocfs2_cached_dquot;
 typedef struct _io_channel io_channel;
 typedef struct _ocfs2_inode_scan ocfs2_inode_scan;
 typedef struct _ocfs2_dir_scan ocfs2_dir_scan;
+typedef struct _ocfs2_name_index ocfs2_name_index;
 typedef struct _ocfs2_bitmap ocfs2_bitmap;
 typedef struct _ocfs2_devices ocfs2_devices;
 
@@ -214,6 +221,10 @@ struct _ocfs2_cached_inode {
 	uint64_t ci_blkno;
 	struct ocfs2_dinode *ci_inode;
 	ocfs2_bitmap *ci_chains;
+
+	/* Leaf extents of a deep tree, see ocfs2_get_clusters() */
+	struct _ocfs2_extent_map *ci_map;
+	unsigned int ci_map_lookups;
 };
 
 typedef unsigned int qid_t;
@@ -317,6 +328,7 @@ struct ocfs2_io_stats {
 	uint32_t is_cache_misses;
 	uint32_t is_cache_inserts;
 	uint32_t is_cache_removes;
+	uint32_t is_cache_evictions;
 };
 
 void io_get_stats(io_channel *channel, struct ocfs2_io_stats *stats);
@@ -343,14 +355,48 @@ errcode_t io_write_block(io_channel *channel, int64_t blkno, int count,
 			 const char *data);
 errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 			 const char *data);
+
+/*
+ * Zero-copy reads.  io_get_blocks() points bufs[0..count) at the cached
+ * copies of the blocks and pins them until io_put_blocks().  The buffers
+ * are read-only.  Without a usable cache the blocks are read into a
+ * private buffer, so callers always pair get with put.
+ */
+errcode_t io_get_blocks(io_channel *channel, int64_t blkno, int count,
+			char **bufs);
+void io_put_blocks(io_channel *channel, int count, char **bufs);
+
+/*
+ * The LRU engine is the classic rbtree + LRU list.  The hash engine is
+ * a sharded hash table with CLOCK eviction; it is cheaper per block on
+ * large caches and safe for concurrent readers.  io_init_cache() and
+ * io_init_cache_size() create an LRU cache.
+ */
+enum io_cache_engine {
+	IO_CACHE_ENGINE_LRU = 0,
+	IO_CACHE_ENGINE_HASH,
+};
+
 errcode_t io_init_cache(io_channel *channel, size_t nr_blocks);
+errcode_t io_init_cache_engine(io_channel *channel, size_t nr_blocks,
+			       enum io_cache_engine engine);
 void io_set_nocache(io_channel *channel, bool nocache);
 errcode_t io_init_cache_size(io_channel *channel, size_t bytes);
 size_t io_get_cache_size(io_channel *channel);
+const char *io_get_cache_engine(io_channel *channel);
 errcode_t io_share_cache(io_channel *from, io_channel *to);
 errcode_t io_mlock_cache(io_channel *channel);
 void io_destroy_cache(io_channel *channel);
 
+/*
+ * Write-back caching.  Writes stay in memory until io_flush(), until
+ * nr_blocks of them are dirty, or until the cache goes away.  Flushes
+ * go out sorted, with adjacent blocks merged into large writes.  Reads
+ * always see the latest writes.
+ */
+errcode_t io_set_writeback(io_channel *channel, size_t nr_blocks);
+errcode_t io_flush(io_channel *channel);
+
 
 struct io_vec_unit {
 	uint64_t	ivu_blkno;
@@ -361,6 +407,14 @@ struct io_vec_unit {
 errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
 			     int count);
 
+/*
+ * Asynchronous vectored reads.  io_vec_submit() queues the units and
+ * returns; io_vec_wait() waits for one of them to finish.
+ */
+errcode_t io_vec_submit(io_channel *channel, struct io_vec_unit *ivus,
+			int count);
+errcode_t io_vec_wait(io_channel *channel, struct io_vec_unit *ivu);
+
 errcode_t ocfs2_read_super(ocfs2_filesys *fs, uint64_t superblock, char *sb);
 /* Writes the main superblock at OCFS2_SUPER_BLOCK_BLKNO */
 errcode_t ocfs2_write_primary_super(ocfs2_filesys *fs);
@@ -376,6 +430,13 @@ errcode_t ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno, int count,
 			    char *data);
 errcode_t ocfs2_read_blocks_nocache(ocfs2_filesys *fs, int64_t blkno, int count,
 				    char *data);
+/*
+ * ocfs2_get_blocks() and ocfs2_put_blocks() wrap io_get_blocks() and
+ * io_put_blocks() the same way.
+ */
+errcode_t ocfs2_get_blocks(ocfs2_filesys *fs, int64_t blkno, int count,
+			   char **bufs);
+void ocfs2_put_blocks(ocfs2_filesys *fs, int count, char **bufs);
 int ocfs2_is_hard_readonly(ocfs2_filesys *fs);
 int ocfs2_mount_local(ocfs2_filesys *fs);
 errcode_t ocfs2_open(const char *name, int flags,
@@ -424,6 +485,7 @@ errcode_t ocfs2_get_clusters(ocfs2_cached_inode *cinode,
 			     uint32_t *p_cluster,
 			     uint32_t *num_clusters,
 			     uint16_t *extent_flags);
+void ocfs2_extent_map_drop(ocfs2_cached_inode *cinode);
 errcode_t ocfs2_xattr_get_clusters(ocfs2_filesys *fs,
 				   struct ocfs2_extent_list *el,
 				   uint64_t el_blkno,
@@ -523,6 +585,11 @@ errcode_t ocfs2_swap_dir_entries_to_cpu(void *buf, uint64_t bytes);
 void ocfs2_swap_dir_trailer(struct ocfs2_dir_block_trailer *trailer);
 errcode_t ocfs2_read_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 			       uint64_t block, void *buf);
+errcode_t ocfs2_validate_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+				   void *buf);
+errcode_t ocfs2_validate_checked_dir_block(ocfs2_filesys *fs,
+					   struct ocfs2_dinode *di,
+					   void *buf);
 errcode_t ocfs2_write_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 				uint64_t block, void *buf);
 unsigned int ocfs2_dir_trailer_blk_off(ocfs2_filesys *fs);
@@ -607,6 +674,21 @@ errcode_t ocfs2_unlink(ocfs2_filesys *fs, uint64_t dir,
 
 errcode_t ocfs2_open_inode_scan(ocfs2_filesys *fs,
 				ocfs2_inode_scan **ret_scan);
+/*
+ * Like ocfs2_open_inode_scan(), but reads up to prefetch_depth runs of
+ * inodes ahead of the caller, along with the next group descriptor.  A
+ * depth of 0, which ocfs2_open_inode_scan() uses, reads each run when
+ * the caller gets to it.
+ */
+errcode_t ocfs2_open_inode_scan_prefetch(ocfs2_filesys *fs,
+					 int prefetch_depth,
+					 ocfs2_inode_scan **ret_scan);
+/*
+ * Open nparts scans into scans[] that, between them, return every inode
+ * once.  The partitions may be walked from separate threads.
+ */
+errcode_t ocfs2_open_inode_scan_partitioned(ocfs2_filesys *fs, int nparts,
+					    ocfs2_inode_scan **scans);
 void ocfs2_close_inode_scan(ocfs2_inode_scan *scan);
 errcode_t ocfs2_get_next_inode(ocfs2_inode_scan *scan,
 			       uint64_t *blkno, char *inode);
@@ -618,6 +700,27 @@ void ocfs2_close_dir_scan(ocfs2_dir_scan *scan);
 errcode_t ocfs2_get_next_dir_entry(ocfs2_dir_scan *scan,
 				   struct ocfs2_dir_entry *dirent);
 
+/*
+ * Walk the namespace once and index every name by the inode it refers
+ * to.  Iterating an inode calls func() with each of its paths, such as
+ * "/dir/file" or "//orphan_dir:0000"; the path is only valid until
+ * func() returns.  An index may not be shared between threads.
+ *
+ * ocfs2_name_index_build_for() stops walking once each of the nr_inos
+ * inodes has a name, so it only promises names for those inodes.
+ */
+errcode_t ocfs2_name_index_build(ocfs2_filesys *fs,
+				 ocfs2_name_index **ret_ni);
+errcode_t ocfs2_name_index_build_for(ocfs2_filesys *fs, uint64_t *inos,
+				     uint64_t nr_inos,
+				     ocfs2_name_index **ret_ni);
+errcode_t ocfs2_name_index_iterate(ocfs2_name_index *ni, uint64_t ino,
+				   int (*func)(uint64_t ino, char *path,
+					       int file_type,
+					       void *priv_data),
+				   void *priv_data);
+void ocfs2_name_index_free(ocfs2_name_index *ni);
+
 errcode_t ocfs2_cluster_bitmap_new(ocfs2_filesys *fs,
 				   const char *description,
 				   ocfs2_bitmap **ret_bitmap);
@@ -826,6 +929,19 @@ errcode_t ocfs2_follow_link(ocfs2_filesys *fs, uint64_t root, uint64_t cwd,
 errcode_t ocfs2_file_read(ocfs2_cached_inode *ci, void *buf, uint32_t count,
 			  uint64_t offset, uint32_t *got);
 
+/*
+ * Calls func on the whole file in order.  buf is NULL for holes and
+ * unwritten extents.  A non-zero return from func stops the stream and
+ * is returned.
+ */
+errcode_t ocfs2_file_stream(ocfs2_cached_inode *ci,
+			    errcode_t (*func)(ocfs2_filesys *fs,
+					      uint64_t offset,
+					      char *buf,
+					      uint64_t len,
+					      void *priv_data),
+			    void *priv_data);
+
 errcode_t ocfs2_file_write(ocfs2_cached_inode *ci, void *buf, uint32_t count,
 			   uint64_t offset, uint32_t *wrote);
 
@@ -897,7 +1013,8 @@ errcode_t ocfs2_find_read_quota_hash(ocfs2_filesys *fs, ocfs2_quota_hash *hash,
 				     ocfs2_cached_dquot **dquotp);
 errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
 				    ocfs2_quota_hash *usr_hash,
-				    ocfs2_quota_hash *grp_hash);
+				    ocfs2_quota_hash *grp_hash,
+				    int nr_threads);
 errcode_t ocfs2_init_quota_change(ocfs2_filesys *fs,
 				  ocfs2_quota_hash **usrhash,
 				  ocfs2_quota_hash **grphash);
@@ -938,11 +1055,24 @@ void ocfs2_compute_meta_ecc(ocfs2_filesys *fs, void *data,
 			    struct ocfs2_block_check *bc);
 errcode_t ocfs2_validate_meta_ecc(ocfs2_filesys *fs, void *data,
 				  struct ocfs2_block_check *bc);
+/* The same for nr blocks end to end, the check check_offset into each */
+void ocfs2_compute_meta_ecc_blocks(ocfs2_filesys *fs, void *data, int nr,
+				   size_t check_offset);
+errcode_t ocfs2_validate_meta_ecc_blocks(ocfs2_filesys *fs, void *data,
+					 int nr, size_t check_offset,
+					 errcode_t *errs);
 /* Low level checksum compute functions.  Use the high-level ones. */
 extern void ocfs2_block_check_compute(void *data, size_t blocksize,
 				      struct ocfs2_block_check *bc);
 extern errcode_t ocfs2_block_check_validate(void *data, size_t blocksize,
 					    struct ocfs2_block_check *bc);
+extern void ocfs2_block_check_compute_blocks(void *data, int nr,
+					     size_t blocksize,
+					     size_t check_offset);
+extern errcode_t ocfs2_block_check_validate_blocks(void *data, int nr,
+						   size_t blocksize,
+						   size_t check_offset,
+						   errcode_t *errs);
 
 /* High level */
 errcode_t ocfs2_format_slot_map(ocfs2_filesys *fs);
@@ -27,9 +27,12 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+#include "ocfs2/byteorder.h"
 #include "ocfs2/bitops.h"
 
 /*
@@ -86,101 +89,145 @@ int ocfs2_find_first_bit_clear(void *addr, int size)
 	return ocfs2_find_next_bit_clear(addr, size, 0);
 }
 
-int ocfs2_find_next_bit_set(void *addr, int size, int offset)
+/*
+ * The scans below work a 64-bit word at a time.  Bitmaps are
+ * little-endian byte arrays with no promised alignment, so each word
+ * is gathered with memcpy() and byteswapped on big-endian hosts.  Only
+ * the (size + 7) / 8 bytes of the bitmap are ever read; the missing
+ * bytes of a short final word read as zero.
+ */
+static inline uint64_t bitops_word(const unsigned char *p, int pos,
+				   int bytes)
 {
-	unsigned char * p;
-	int set = 0, d0;
-	unsigned int	bit = offset & 7, res = 0;
-	unsigned char	tilde = ~0;
-	unsigned int	mask = 0U | tilde;
+	uint64_t word = 0;
+	int i;
 
-	/* XXX care to check for null ADDR and <= 0 for int args? */
-	if (size == 0)
-		return 0;
-	
-	res = offset >> 3;
-	p = ((unsigned char *) addr) + res;
-	res <<= 3;
-	
-	if (bit) {
-		set = ffs(*p & ~((1 << bit) - 1));
-		if (set)
-			return (offset & ~7) + set - 1;
-		p++;
-		res += 8;
-	}
-	while ((size > res) && (*p == 0)) {
-		p++;
-		res += 8;
+	if (bytes - pos >= 8) {
+		memcpy(&word, p + pos, sizeof(word));
+		return le64_to_cpu(word);
 	}
-	if (res >= size)
-		return size;
-	if ((res + 8) > size)
-		mask >>= 8 - (size - res);
-	d0 = ffs(*p & mask);
-	if (d0 == 0)
+
+	for (i = 0; pos + i < bytes; i++)
+		word |= (uint64_t)p[pos + i] << (i * 8);
+
+	return word;
+}
+
+int ocfs2_find_next_bit_set(void *addr, int size, int offset)
+{
+	const unsigned char *p = addr;
+	int bytes, pos;
+	uint64_t word;
+
+	if (offset >= size)
 		return size;
 
-	return (res + d0 - 1);
+	/*
+	 * Walking every set bit of a full bitmap lands on the answer
+	 * straight away.  Testing it first keeps that a predictable
+	 * branch rather than a chain through the word scan.
+	 */
+	if ((p[offset >> 3] & (1 << (offset & 7))))
+		return offset;
+
+	bytes = (size + 7) >> 3;
+	pos = (offset >> 6) << 3;
+	word = bitops_word(p, pos, bytes) & (~0ULL << (offset & 63));
+	while (!word) {
+		pos += 8;
+		if (pos >= bytes)
+			return size;
+		word = bitops_word(p, pos, bytes);
+	}
+
+	/* Bits past size in the last byte aren't ours */
+	offset = (pos << 3) + __builtin_ctzll(word);
+	return offset < size ? offset : size;
 }
 
 int ocfs2_find_next_bit_clear(void *addr, int size, int offset)
 {
-	unsigned char * p;
-	int set = 0, d0;
-	unsigned int	bit = offset & 7, res = 0;
-	unsigned char tilde = ~0;
-	unsigned int	mask = 0U | tilde;
+	const unsigned char *p = addr;
+	int bytes, pos;
+	uint64_t word;
 
-	if (size == 0)
-		return 0;
-	
-	res = offset >> 3;
-	p = ((unsigned char *) addr) + res;
-	res <<= 3;
-	
-	if (bit) {
-		set = ffs(~*p & ~((1 << bit) - 1) & mask);
-		if (set)
-			return (offset & ~7) + set - 1;
-		p++;
-		res += 8;
+	if (offset >= size)
+		return size;
+
+	if (!(p[offset >> 3] & (1 << (offset & 7))))
+		return offset;
+
+	bytes = (size + 7) >> 3;
+	pos = (offset >> 6) << 3;
+	word = ~bitops_word(p, pos, bytes) & (~0ULL << (offset & 63));
+	while (!word) {
+		pos += 8;
+		if (pos >= bytes)
+			return size;
+		word = ~bitops_word(p, pos, bytes);
 	}
-	while ((size > res) && (*p == tilde)) {
-		p++;
-		res += 8;
+
+	offset = (pos << 3) + __builtin_ctzll(word);
+	return offset < size ? offset : size;
+}
+
+/*
+ * Find the first run of len clear bits at or after offset.  Returns
+ * the start of the run, or size if there isn't one.
+ */
+int ocfs2_find_next_bits_clear(void *addr, int size, int offset, int len)
+{
+	int start = offset, end;
+
+	if (len < 1)
+		len = 1;
+
+	while (start < size && size - start >= len) {
+		start = ocfs2_find_next_bit_clear(addr, size, start);
+		if (size - start < len)
+			break;
+
+		/* Only the len bits after start matter */
+		end = ocfs2_find_next_bit_set(addr, start + len, start);
+		if (end == start + len)
+			return start;
+
+		start = end + 1;
 	}
-	if (res >= size)
-		return size;
-	if ((res + 8) > size)
-		mask >>= 8 - (size - res);
-	d0 = ffs(~(*p & mask));
-	if (d0 == 0)
-		return size;
 
-	return (res + d0 - 1);
+	return size;
 }
 
 int ocfs2_get_bits_set(void *addr, int size, int offset)
 {
-	int set_bits = 0, found = 0;
+	const unsigned char *p = addr;
+	int bytes, pos, last, set_bits = 0;
+	uint64_t word;
 
-	while (1) {
-		found = ocfs2_find_next_bit_set(addr, size, offset);
-		if (found < size) {
-			set_bits++;
-			offset = found + 1;
-		} else
-			break;
+	if (offset >= size)
+		return 0;
+
+	bytes = (size + 7) >> 3;
+	pos = (offset >> 6) << 3;
+	last = ((size - 1) >> 6) << 3;
+	word = bitops_word(p, pos, bytes) & (~0ULL << (offset & 63));
+	while (pos < last) {
+		set_bits += __builtin_popcountll(word);
+		pos += 8;
+		word = bitops_word(p, pos, bytes);
 	}
 
-	return set_bits;
+	if (size & 63)
+		word &= ~0ULL >> (64 - (size & 63));
+
+	return set_bits + __builtin_popcountll(word);
 }
 
 #ifdef DEBUG_EXE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #define bit_expect(expect, which, args...) do {				\
 	int _ret = ocfs2_find_##which(bitmap, args);			\
@@ -189,10 +236,259 @@ int ocfs2_get_bits_set(void *addr, int size, int offset)
 			_ret == expect ? "correct" : "_incorrect_");	\
 } while (0)
 
+/*
+ * Byte at a time scans, as these used to be.  They are the reference
+ * for the checks and the baseline for the benchmark.
+ */
+static int byte_find_next_bit_set(void *addr, int size, int offset)
+{
+	int res;
+	unsigned char *p = addr;
+
+	for (res = offset; res < size; res++) {
+		if (!(res & 7) && !p[res >> 3]) {
+			res += 7;
+			continue;
+		}
+		if (p[res >> 3] & (1 << (res & 7)))
+			return res;
+	}
+
+	return size;
+}
+
+static int byte_find_next_bit_clear(void *addr, int size, int offset)
+{
+	int res;
+	unsigned char *p = addr;
+
+	for (res = offset; res < size; res++) {
+		if (!(res & 7) && (p[res >> 3] == 0xFF)) {
+			res += 7;
+			continue;
+		}
+		if (!(p[res >> 3] & (1 << (res & 7))))
+			return res;
+	}
+
+	return size;
+}
+
+static int byte_find_next_bits_clear(void *addr, int size, int offset,
+				     int len)
+{
+	int start = offset, end;
+
+	while (start < size) {
+		start = byte_find_next_bit_clear(addr, size, start);
+		if (start == size)
+			break;
+		end = byte_find_next_bit_set(addr, size, start);
+		if (end - start >= len)
+			return start;
+		start = end;
+	}
+
+	return size;
+}
+
+static int byte_get_bits_set(void *addr, int size, int offset)
+{
+	int set_bits = 0;
+
+	while ((offset = byte_find_next_bit_set(addr, size, offset)) < size) {
+		set_bits++;
+		offset++;
+	}
+
+	return set_bits;
+}
+
+static void fill_random(unsigned char *bitmap, int bytes, int density)
+{
+	int i, j;
+
+	for (i = 0; i < bytes; i++) {
+		bitmap[i] = 0;
+		for (j = 0; j < 8; j++)
+			if ((random() % 100) < density)
+				bitmap[i] |= 1 << j;
+	}
+}
+
+/* Compare against the byte scans on random bitmaps of random sizes */
+static int check_random(int rounds)
+{
+	unsigned char bitmap[512];
+	int r, i, size, offset, len, want, got, bad = 0;
+	static const int densities[] = { 0, 1, 10, 50, 90, 99, 100 };
+
+	for (r = 0; r < rounds; r++) {
+		size = 1 + random() % (sizeof(bitmap) * 8);
+		fill_random(bitmap, (size + 7) >> 3,
+			    densities[r % (sizeof(densities) /
+					   sizeof(densities[0]))]);
+
+		/* Junk past size must be ignored */
+		if (size & 7)
+			bitmap[size >> 3] |= 0xFF << (size & 7);
+
+		for (i = 0; i < 16; i++) {
+			offset = random() % (size + 2);
+			len = 1 + random() % 70;
+
+			want = byte_find_next_bit_set(bitmap, size, offset);
+			got = ocfs2_find_next_bit_set(bitmap, size, offset);
+			if (want != got)
+				bad++;
+
+			want = byte_find_next_bit_clear(bitmap, size, offset);
+			got = ocfs2_find_next_bit_clear(bitmap, size, offset);
+			if (want != got)
+				bad++;
+
+			want = byte_find_next_bits_clear(bitmap, size, offset,
+							 len);
+			got = ocfs2_find_next_bits_clear(bitmap, size, offset,
+							 len);
+			if (want != got)
+				bad++;
+
+			want = byte_get_bits_set(bitmap, size, offset);
+			got = ocfs2_get_bits_set(bitmap, size, offset);
+			if (want != got)
+				bad++;
+		}
+	}
+
+	fprintf(stdout, "%d random rounds: %d mismatches\n", rounds, bad);
+	return bad;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Walk every set (or clear) bit, as the group checks do */
+static int walk_bits(int (*find)(void *, int, int), void *bitmap, int size)
+{
+	int bit, n = 0;
+
+	for (bit = 0; (bit = find(bitmap, size, bit)) < size; bit++)
+		n++;
+
+	return n;
+}
+
+/* Find each run of clear bits, as the free space reports do */
+static int walk_extents(int (*find_clear)(void *, int, int),
+			int (*find_set)(void *, int, int), void *bitmap,
+			int size)
+{
+	int start, end = 0, n = 0;
+
+	while ((start = find_clear(bitmap, size, end)) < size) {
+		end = find_set(bitmap, size, start);
+		n++;
+	}
+
+	return n;
+}
+
+static int walk_runs(int (*find)(void *, int, int, int), void *bitmap,
+		     int size, int len)
+{
+	int bit, n = 0;
+
+	for (bit = 0; (bit = find(bitmap, size, bit, len)) < size; bit += len)
+		n++;
+
+	return n;
+}
+
+#define bench(name, loops, expr) do {					\
+	int _i, _n = 0;							\
+	double _start = now();						\
+	for (_i = 0; _i < (loops); _i++)				\
+		_n += (expr);						\
+	fprintf(stdout, "  %-28s %10.3f ms  (%d)\n", name,		\
+		(now() - _start) * 1000 / (loops), _n / (loops));	\
+} while (0)
+
+/* A 4MB group bitmap, the largest a 1M cluster filesystem has */
+static void benchmark(int loops)
+{
+	int bytes = 4 * 1024 * 1024, size = bytes * 8;
+	unsigned char *bitmap;
+	static const int densities[] = { 1, 50, 99 };
+	int d;
+
+	bitmap = malloc(bytes);
+	if (!bitmap) {
+		fprintf(stderr, "Unable to allocate the bitmap\n");
+		return;
+	}
+
+	for (d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+		fill_random(bitmap, bytes, densities[d]);
+		fprintf(stdout, "%d%% set, %d bits:\n", densities[d], size);
+
+		bench("byte next_bit_set", loops,
+		      walk_bits(byte_find_next_bit_set, bitmap, size));
+		bench("word next_bit_set", loops,
+		      walk_bits(ocfs2_find_next_bit_set, bitmap, size));
+		bench("byte next_bit_clear", loops,
+		      walk_bits(byte_find_next_bit_clear, bitmap, size));
+		bench("word next_bit_clear", loops,
+		      walk_bits(ocfs2_find_next_bit_clear, bitmap, size));
+		bench("byte free extents", loops,
+		      walk_extents(byte_find_next_bit_clear,
+				   byte_find_next_bit_set, bitmap, size));
+		bench("word free extents", loops,
+		      walk_extents(ocfs2_find_next_bit_clear,
+				   ocfs2_find_next_bit_set, bitmap, size));
+		bench("byte get_bits_set", loops,
+		      byte_get_bits_set(bitmap, size, 0));
+		bench("word get_bits_set", loops,
+		      ocfs2_get_bits_set(bitmap, size, 0));
+		bench("byte next_bits_clear(16)", loops,
+		      walk_runs(byte_find_next_bits_clear, bitmap, size, 16));
+		bench("word next_bits_clear(16)", loops,
+		      walk_runs(ocfs2_find_next_bits_clear, bitmap, size, 16));
+	}
+
+	free(bitmap);
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: bitops [-b [loops]]\n");
+}
+
 int main(int argc, char *argv[])
 {
 	char bitmap[8 * sizeof(unsigned long)];
 	int size = sizeof(bitmap) * 8;
+	int loops = 10;
+
+	if (argc > 1) {
+		if (strcmp(argv[1], "-b")) {
+			print_usage();
+			return 1;
+		}
+		if (argc > 2)
+			loops = atoi(argv[2]);
+		if (loops < 1) {
+			print_usage();
+			return 1;
+		}
+		benchmark(loops);
+		return 0;
+	}
 
 	/* Test an arbitrary size (not byte bounded) */
 	memset(bitmap, 0, sizeof(bitmap));
@@ -202,6 +498,8 @@ int main(int argc, char *argv[])
 	bit_expect(size - 1, first_bit_set, size);
 	bit_expect(size - 1, next_bit_set, size, size - 1);
 	bit_expect(size, next_bit_clear, size, size - 1);
+	bit_expect(0, next_bits_clear, size, 0, size - 1);
+	bit_expect(size, next_bits_clear, size, 1, size - 1);
 
 	memset(bitmap, 0xFF, sizeof(bitmap));
 	ocfs2_clear_bit(size - 1, bitmap);
@@ -210,9 +508,9 @@ int main(int argc, char *argv[])
 	bit_expect(size - 1, first_bit_clear, size);
 	bit_expect(size - 1, next_bit_clear, size, size - 1);
 	bit_expect(size, next_bit_set, size, size - 1);
+	bit_expect(size - 1, next_bits_clear, size, 0, 1);
+	bit_expect(size, next_bits_clear, size, 0, 2);
 
-	/* XXX add more tests */
-	return 0;
+	return check_random(10000) ? 1 : 0;
 }
 #endif
-
@@ -96,6 +96,43 @@ static unsigned int calc_code_bit(unsigned int i, unsigned int *p_cache)
 	return b;
 }
 
+/*
+ * The positions of the bits set in w, xored together.  Bit k of the
+ * answer is the parity of the set bits whose position has bit k set.
+ */
+static inline uint32_t hc_xor_positions(uint64_t w)
+{
+	return __builtin_parityll(w & 0xAAAAAAAAAAAAAAAAULL) |
+		(__builtin_parityll(w & 0xCCCCCCCCCCCCCCCCULL) << 1) |
+		(__builtin_parityll(w & 0xF0F0F0F0F0F0F0F0ULL) << 2) |
+		(__builtin_parityll(w & 0xFF00FF00FF00FF00ULL) << 3) |
+		(__builtin_parityll(w & 0xFFFF0000FFFF0000ULL) << 4) |
+		(__builtin_parityll(w & 0xFFFFFFFF00000000ULL) << 5);
+}
+
+/*
+ * A data word whose bit j is code bit b + j.  With r = b & 63, code
+ * bit b + j is (b & ~63) | (r + j) while r + j < 64, and
+ * ((b & ~63) + 64) | (r + j - 64) after.  So the low six bits of
+ * every code bit are the positions of w rotated up by r.  Those are
+ * xored into *positions, to be summed once with hc_xor_positions().
+ * The high bits come back as parity: each half of the word
+ * contributes its base if it has an odd number of bits set.
+ */
+static inline uint32_t hc_encode_word(uint64_t w, unsigned int b,
+				      uint64_t *positions)
+{
+	unsigned int r = b & 63;
+	uint32_t base = b & ~63, odd_low, odd_high;
+	uint64_t low = w << r;
+
+	odd_low = __builtin_parityll(low);
+	odd_high = __builtin_parityll(w) ^ odd_low;
+	*positions ^= r ? (low | (w >> (64 - r))) : w;
+
+	return (base & -odd_low) ^ ((base + 64) & -odd_high);
+}
+
 /*
  * This is the low level encoder function.  It can be called across
  * multiple hunks just like the crc32 code.  'd' is the number of bits
@@ -110,7 +147,9 @@ static unsigned int calc_code_bit(unsigned int i, unsigned int *p_cache)
 uint32_t ocfs2_hamming_encode(uint32_t parity, void *data, unsigned int d,
 			      unsigned int nr)
 {
-	unsigned int i, b, p = 0;
+	unsigned int i, j, b, p = 0, p_end;
+	unsigned char *buf = data;
+	uint64_t w, positions = 0;
 
 	if (!d)
 		abort();
@@ -120,36 +159,53 @@ uint32_t ocfs2_hamming_encode(uint32_t parity, void *data, unsigned int d,
 	 * 1-based array, but C uses 0-based.  So 'i' is for C, and 'b' is
 	 * for the algorithm.
 	 *
-	 * The i++ in the for loop is so that the start offset passed
-	 * to ocfs2_find_next_bit_set() is one greater than the previously
-	 * found bit.
+	 * Data bits in the resultant code are checked by parity bits
+	 * that are part of the bit number representation.  Huh?
+	 *
+	 * <wikipedia href="http://en.wikipedia.org/wiki/Hamming_code">
+	 * In other words, the parity bit at position 2^k checks bits in
+	 * positions having bit k set in their binary representation.
+	 * Conversely, for instance, bit 13, i.e. 1101(2), is checked by
+	 * bits 1000(2) = 8, 0100(2)=4 and 0001(2) = 1.
+	 * </wikipedia>
+	 *
+	 * So the parity is every set bit's code bit number xored
+	 * together.  Take the data 64 bits at a time.  Unless a parity
+	 * bit falls inside them, their code bits are b to b + 63 and
+	 * hc_encode_word() does the whole word at once.  Words with a
+	 * parity bit inside, at most one per power of two, go a bit at a
+	 * time.
 	 */
-	for (i = 0; (i = ocfs2_find_next_bit_set(data, d, i)) < d; i++)
-	{
+	for (i = 0; i + 64 <= d; i += 64) {
+		memcpy(&w, buf + (i >> 3), sizeof(w));
+		w = le64_to_cpu(w);
+		if (!w)
+			continue;
+
 		/*
 		 * i is the offset in this hunk, nr + i is the total bit
 		 * offset.
 		 */
 		b = calc_code_bit(nr + i, &p);
+		p_end = p;
+		if (calc_code_bit(nr + i + 63, &p_end) == b + 63) {
+			parity ^= hc_encode_word(w, b, &positions);
+			continue;
+		}
 
-		/*
-		 * Data bits in the resultant code are checked by
-		 * parity bits that are part of the bit number
-		 * representation.  Huh?
-		 *
-		 * <wikipedia href="http://en.wikipedia.org/wiki/Hamming_code">
-		 * In other words, the parity bit at position 2^k
-		 * checks bits in positions having bit k set in
-		 * their binary representation.  Conversely, for
-		 * instance, bit 13, i.e. 1101(2), is checked by
-		 * bits 1000(2) = 8, 0100(2)=4 and 0001(2) = 1.
-		 * </wikipedia>
-		 *
-		 * Note that 'k' is the _code_ bit number.  'b' in
-		 * our loop.
-		 */
-		parity ^= b;
+		for (j = 0; j < 64; j++)
+			if (w & (1ULL << j))
+				parity ^= calc_code_bit(nr + i + j, &p);
 	}
+	parity ^= hc_xor_positions(positions);
+
+	/*
+	 * The rest a bit at a time.  The i++ in the for loop is so that
+	 * the start offset passed to ocfs2_find_next_bit_set() is one
+	 * greater than the previously found bit.
+	 */
+	for (; (i = ocfs2_find_next_bit_set(data, d, i)) < d; i++)
+		parity ^= calc_code_bit(nr + i, &p);
 
 	/* While the data buffer was treated as little endian, the
 	 * return value is in host endian. */
@@ -240,60 +296,118 @@ void ocfs2_hamming_fix_block(void *data, unsigned int blocksize,
  * bits.  We fit.
  */
 
-/**
- * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
- * @crc - seed value for computation.  ~0 for Ethernet, sometimes 0 for
- *        other uses, or the previous crc32 value if computing incrementally.
- * @p   - pointer to buffer over which CRC is run
- * @len - length of buffer @p
- *
+/*
+ * Slicing-by-8, as in the kernel's crc32_body().  crc32table_le[n] is
+ * the CRC of a byte followed by n zero bytes, so each pair of 32-bit
+ * loads is folded in with eight independent table lookups.
  */
-uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
-{
-	const uint32_t      *b =(uint32_t *)p;
-	const uint32_t      *tab = crc32table_le;
-
+#define T(n) crc32table_le[n]
 #if __BYTE_ORDER == __LITTLE_ENDIAN
-# define DO_CRC(x) crc = tab[ (crc ^ (x)) & 255 ] ^ (crc>>8)
+# define DO_CRC(crc, x) crc = T(0)[((crc) ^ (x)) & 255] ^ ((crc) >> 8)
+# define DO_CRC4(q) (T(3)[(q) & 255] ^ T(2)[((q) >> 8) & 255] ^ \
+		     T(1)[((q) >> 16) & 255] ^ T(0)[((q) >> 24) & 255])
+# define DO_CRC8(q) (T(7)[(q) & 255] ^ T(6)[((q) >> 8) & 255] ^ \
+		     T(5)[((q) >> 16) & 255] ^ T(4)[((q) >> 24) & 255])
 #else
-# define DO_CRC(x) crc = tab[ ((crc >> 24) ^ (x)) & 255] ^ (crc<<8)
+# define DO_CRC(crc, x) crc = T(0)[(((crc) >> 24) ^ (x)) & 255] ^ ((crc) << 8)
+# define DO_CRC4(q) (T(0)[(q) & 255] ^ T(1)[((q) >> 8) & 255] ^ \
+		     T(2)[((q) >> 16) & 255] ^ T(3)[((q) >> 24) & 255])
+# define DO_CRC8(q) (T(4)[(q) & 255] ^ T(5)[((q) >> 8) & 255] ^ \
+		     T(6)[((q) >> 16) & 255] ^ T(7)[((q) >> 24) & 255])
 #endif
 
-	crc = cpu_to_le32(crc);
+static inline uint32_t crc32_body(uint32_t crc, unsigned char const *buf,
+				  size_t len)
+{
+	const uint32_t *b;
+	size_t rem_len, i;
+	uint32_t q;
+
 	/* Align it */
-	if(((long)b)&3 && len){
+	if (((long)buf & 3) && len) {
 		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while ((--len) && ((long)b)&3 );
+			DO_CRC(crc, *buf++);
+		} while ((--len) && ((long)buf & 3));
 	}
-	if(len >= 4){
-		/* load data 32 bits wide, xor data 32 bits wide. */
-		size_t save_len = len & 3;
-	        len = len >> 2;
-		--b; /* use pre increment below(*++b) for speed */
-		do {
-			crc ^= *++b;
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-		} while (--len);
-		b++; /* point to next byte(s) */
-		len = save_len;
+
+	rem_len = len & 7;
+	len = len >> 3;
+
+	b = (const uint32_t *)buf;
+	for (i = 0; i < len; i++) {
+		q = crc ^ *b++;
+		crc = DO_CRC8(q);
+		q = *b++;
+		crc ^= DO_CRC4(q);
 	}
+
 	/* And the last few bytes */
-	if(len){
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while (--len);
+	buf = (unsigned char const *)b;
+	while (rem_len--)
+		DO_CRC(crc, *buf++);
+
+	return crc;
+}
+
+/*
+ * crc32_body() of four aligned buffers whose length is a multiple of
+ * eight.  Each step of one crc waits on the loads of the step before
+ * it.  Four independent streams keep the CPU busy while they land.
+ */
+static void crc32_body_4(uint32_t *crcs, unsigned char const **bufs,
+			 size_t len)
+{
+	const uint32_t *b0 = (const uint32_t *)bufs[0];
+	const uint32_t *b1 = (const uint32_t *)bufs[1];
+	const uint32_t *b2 = (const uint32_t *)bufs[2];
+	const uint32_t *b3 = (const uint32_t *)bufs[3];
+	uint32_t c0 = crcs[0], c1 = crcs[1], c2 = crcs[2], c3 = crcs[3];
+	uint32_t q0, q1, q2, q3;
+	size_t i;
+
+	for (i = 0; i < (len >> 3); i++) {
+		q0 = c0 ^ *b0++;
+		q1 = c1 ^ *b1++;
+		q2 = c2 ^ *b2++;
+		q3 = c3 ^ *b3++;
+		c0 = DO_CRC8(q0);
+		c1 = DO_CRC8(q1);
+		c2 = DO_CRC8(q2);
+		c3 = DO_CRC8(q3);
+		q0 = *b0++;
+		q1 = *b1++;
+		q2 = *b2++;
+		q3 = *b3++;
+		c0 ^= DO_CRC4(q0);
+		c1 ^= DO_CRC4(q1);
+		c2 ^= DO_CRC4(q2);
+		c3 ^= DO_CRC4(q3);
 	}
 
-	return le32_to_cpu(crc);
+	crcs[0] = c0;
+	crcs[1] = c1;
+	crcs[2] = c2;
+	crcs[3] = c3;
+}
+
+#undef DO_CRC8
+#undef DO_CRC4
 #undef DO_CRC
+#undef T
+
+/**
+ * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
+ * @crc - seed value for computation.  ~0 for Ethernet, sometimes 0 for
+ *        other uses, or the previous crc32 value if computing incrementally.
+ * @p   - pointer to buffer over which CRC is run
+ * @len - length of buffer @p
+ *
+ */
+uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
+{
+	crc = cpu_to_le32(crc);
+	crc = crc32_body(crc, p, len);
+	return le32_to_cpu(crc);
 }
 
 /*
@@ -369,6 +483,126 @@ out:
 	return err;
 }
 
+/*
+ * The crc32_le(~0, ...) of nr blocks, four at a time where they allow
+ * it.  nr is at most four.
+ */
+static void block_check_crcs(unsigned char const **blocks, int nr,
+			     size_t blocksize, uint32_t *crcs)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		crcs[i] = cpu_to_le32(~0);
+
+	if ((nr == 4) && !(blocksize & 7) &&
+	    !(((long)blocks[0] | (long)blocks[1] |
+	       (long)blocks[2] | (long)blocks[3]) & 3))
+		crc32_body_4(crcs, blocks, blocksize);
+	else {
+		for (i = 0; i < nr; i++)
+			crcs[i] = crc32_body(crcs[i], blocks[i], blocksize);
+	}
+
+	for (i = 0; i < nr; i++)
+		crcs[i] = le32_to_cpu(crcs[i]);
+}
+
+#define BLOCK_CHECK_BATCH	4
+
+/*
+ * ocfs2_block_check_compute() for nr blocks laid end to end in data.
+ * Each block's ocfs2_block_check is check_offset bytes into it.
+ */
+void ocfs2_block_check_compute_blocks(void *data, int nr, size_t blocksize,
+				      size_t check_offset)
+{
+	unsigned char const *blocks[BLOCK_CHECK_BATCH];
+	struct ocfs2_block_check *bc;
+	uint32_t crcs[BLOCK_CHECK_BATCH];
+	uint16_t ecc;
+	int i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i;
+		if (n > BLOCK_CHECK_BATCH)
+			n = BLOCK_CHECK_BATCH;
+
+		for (j = 0; j < n; j++) {
+			blocks[j] = (unsigned char *)data +
+				(i + j) * blocksize;
+			bc = (struct ocfs2_block_check *)(blocks[j] +
+							  check_offset);
+			memset(bc, 0, sizeof(struct ocfs2_block_check));
+		}
+
+		block_check_crcs(blocks, n, blocksize, crcs);
+
+		for (j = 0; j < n; j++) {
+			bc = (struct ocfs2_block_check *)(blocks[j] +
+							  check_offset);
+			ecc = (uint16_t)ocfs2_hamming_encode_block(
+						(void *)blocks[j], blocksize);
+			bc->bc_crc32e = cpu_to_le32(crcs[j]);
+			bc->bc_ecc = cpu_to_le16(ecc);
+		}
+	}
+}
+
+/*
+ * ocfs2_block_check_validate() for nr blocks laid end to end in data.
+ * The crcs are checked a batch at a time.  Only a block whose crc is
+ * wrong goes through ocfs2_block_check_validate() for the ECC fixup.
+ * If errs isn't NULL, it gets the result for each block.  Returns the
+ * first error.
+ */
+errcode_t ocfs2_block_check_validate_blocks(void *data, int nr,
+					    size_t blocksize,
+					    size_t check_offset,
+					    errcode_t *errs)
+{
+	unsigned char const *blocks[BLOCK_CHECK_BATCH];
+	struct ocfs2_block_check *bc, saved[BLOCK_CHECK_BATCH];
+	uint32_t crcs[BLOCK_CHECK_BATCH];
+	errcode_t err, ret = 0;
+	int i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i;
+		if (n > BLOCK_CHECK_BATCH)
+			n = BLOCK_CHECK_BATCH;
+
+		for (j = 0; j < n; j++) {
+			blocks[j] = (unsigned char *)data +
+				(i + j) * blocksize;
+			bc = (struct ocfs2_block_check *)(blocks[j] +
+							  check_offset);
+			saved[j] = *bc;
+			memset(bc, 0, sizeof(struct ocfs2_block_check));
+		}
+
+		block_check_crcs(blocks, n, blocksize, crcs);
+
+		for (j = 0; j < n; j++) {
+			bc = (struct ocfs2_block_check *)(blocks[j] +
+							  check_offset);
+			*bc = saved[j];
+
+			err = 0;
+			if (crcs[j] != le32_to_cpu(bc->bc_crc32e))
+				err = ocfs2_block_check_validate(
+						(void *)blocks[j], blocksize,
+						bc);
+			if (errs)
+				errs[i + j] = err;
+			if (err && !ret)
+				ret = err;
+		}
+	}
+
+	return ret;
+}
+
 /*
  * These are the main API.  They check the superblock flag before
  * calling the underlying operations.
@@ -394,6 +628,29 @@ errcode_t ocfs2_validate_meta_ecc(ocfs2_filesys *fs, void *data,
 	return err;
 }
 
+void ocfs2_compute_meta_ecc_blocks(ocfs2_filesys *fs, void *data, int nr,
+				   size_t check_offset)
+{
+	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)))
+		ocfs2_block_check_compute_blocks(data, nr, fs->fs_blocksize,
+						 check_offset);
+}
+
+errcode_t ocfs2_validate_meta_ecc_blocks(ocfs2_filesys *fs, void *data,
+					 int nr, size_t check_offset,
+					 errcode_t *errs)
+{
+	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)) &&
+	    !(fs->fs_flags & OCFS2_FLAG_NO_ECC_CHECKS))
+		return ocfs2_block_check_validate_blocks(data, nr,
+							 fs->fs_blocksize,
+							 check_offset, errs);
+
+	if (errs)
+		memset(errs, 0, nr * sizeof(errcode_t));
+	return 0;
+}
+
 #ifdef DEBUG_EXE
 #include <stdio.h>
 #include <string.h>
@@ -407,6 +664,59 @@ errcode_t ocfs2_validate_meta_ecc(ocfs2_filesys *fs, void *data,
 #include <assert.h>
 #include <errno.h>
 
+/*
+ * crc32_le() as it was before slicing-by-8, a table lookup per byte.
+ * It is the reference for the checks below.
+ */
+static uint32_t crc32_le_orig(uint32_t crc, unsigned char const *p,
+			      size_t len)
+{
+	const uint32_t      *b =(uint32_t *)p;
+	const uint32_t      *tab = crc32table_le[0];
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+# define DO_CRC(x) crc = tab[ (crc ^ (x)) & 255 ] ^ (crc>>8)
+#else
+# define DO_CRC(x) crc = tab[ ((crc >> 24) ^ (x)) & 255] ^ (crc<<8)
+#endif
+
+	crc = cpu_to_le32(crc);
+	/* Align it */
+	if(((long)b)&3 && len){
+		do {
+			uint8_t *p = (uint8_t *)b;
+			DO_CRC(*p++);
+			b = (void *)p;
+		} while ((--len) && ((long)b)&3 );
+	}
+	if(len >= 4){
+		/* load data 32 bits wide, xor data 32 bits wide. */
+		size_t save_len = len & 3;
+	        len = len >> 2;
+		--b; /* use pre increment below(*++b) for speed */
+		do {
+			crc ^= *++b;
+			DO_CRC(0);
+			DO_CRC(0);
+			DO_CRC(0);
+			DO_CRC(0);
+		} while (--len);
+		b++; /* point to next byte(s) */
+		len = save_len;
+	}
+	/* And the last few bytes */
+	if(len){
+		do {
+			uint8_t *p = (uint8_t *)b;
+			DO_CRC(*p++);
+			b = (void *)p;
+		} while (--len);
+	}
+
+	return le32_to_cpu(crc);
+#undef DO_CRC
+}
+
 /*
  * The function hamming_encode_orig() is my original, tested version.  It's
  * slow.  We work from it to make a faster one.
@@ -762,6 +1072,7 @@ static void timeme(struct run_context *ct)
 	struct rusage start;
 	struct rusage stop;
 	struct timeval sys_diff, usr_diff;
+	double secs;
 
 	assert(!getrusage(RUSAGE_SELF, &start));
 
@@ -772,29 +1083,86 @@ static void timeme(struct run_context *ct)
 	timersub(&stop.ru_utime, &start.ru_utime, &usr_diff);
 	timersub(&stop.ru_stime, &start.ru_stime, &sys_diff);
 
-	fprintf(stderr, "Time for %s: %ld.%06ld user, %ld.%06ld system\n",
+	secs = usr_diff.tv_sec + usr_diff.tv_usec / 1000000.0;
+
+	fprintf(stderr, "Time for %s: %ld.%06ld user, %ld.%06ld system",
 		ct->rc_name, usr_diff.tv_sec, usr_diff.tv_usec,
 		sys_diff.tv_sec, sys_diff.tv_usec);
+	if (secs > 0)
+		fprintf(stderr, ", %.1f MB/s",
+			(double)ct->rc_size * ct->rc_count / secs / 1048576);
+	fprintf(stderr, "\n");
 }
 
+/* Keeps the compiler from throwing the timed crcs away */
+static volatile uint32_t crc_result;
+
 static void crc32_func(struct run_context *ct, int nr)
 {
-	uint32_t crc = ~0;
+	crc_result = crc32_le(~0, ct->rc_data, ct->rc_size);
+}
 
-	crc = crc32_le(crc, ct->rc_data, ct->rc_size);
+static void crc32_orig_func(struct run_context *ct, int nr)
+{
+	crc_result = crc32_le_orig(~0, ct->rc_data, ct->rc_size);
 }
 
 static void run_crc32(char *buf, int size, int count)
 {
 	struct run_context ct = {
-		.rc_name = "CRC32",
+		.rc_name = "Original CRC32",
 		.rc_data = buf,
 		.rc_size = size,
 		.rc_count = count,
-		.rc_func = crc32_func,
+		.rc_func = crc32_orig_func,
 	};
 
 	timeme(&ct);
+
+	ct.rc_name = "Current CRC32";
+	ct.rc_func = crc32_func;
+	timeme(&ct);
+}
+
+/*
+ * crc32_le() must match the original at every alignment and length,
+ * and when fed the buffer in pieces.
+ */
+static void check_crc32(char *buf, int size)
+{
+	int off, len, split;
+	unsigned char *p;
+	uint32_t crc, want;
+
+	for (off = 0; off < 8 && off < size; off++) {
+		p = (unsigned char *)buf + off;
+		for (len = 0; len <= size - off;
+		     len = len < 64 ? len + 1 : len * 3 + 7) {
+			want = crc32_le_orig(~0, p, len);
+			crc = crc32_le(~0, p, len);
+			if (crc != want) {
+				fprintf(stderr,
+					"CRC32 of %d bytes at offset %d is "
+					"%"PRIu32", expected %"PRIu32"\n",
+					len, off, crc, want);
+				exit(1);
+			}
+
+			split = len / 3;
+			crc = crc32_le(crc32_le(~0, p, split), p + split,
+				       len - split);
+			if (crc != want) {
+				fprintf(stderr,
+					"CRC32 of %d bytes at offset %d split "
+					"at %d is %"PRIu32", expected "
+					"%"PRIu32"\n",
+					len, off, split, crc, want);
+				exit(1);
+			}
+		}
+	}
+
+	fprintf(stderr, "CRC32 matches the original\n");
 }
 
 struct hamming_context {
@@ -864,6 +1232,215 @@ static void run_hamming(char *buf, int size, int count)
 	timeme(&hc.hc_rc);
 }
 
+/*
+ * Encode in hunks of odd sizes, so words straddle hunks and the last
+ * hunk ends part way through a byte.  The per-bit encoder is the
+ * reference because it handles any hunk.
+ */
+static void check_hamming_hunks(char *buf, int size)
+{
+	unsigned int d = size * 8, nr, len;
+	uint32_t ecc, want;
+	int round;
+
+	for (round = 0; round < 64; round++) {
+		ecc = want = 0;
+		for (nr = 0; nr < d; nr += len) {
+			len = 8 * (1 + random() % 700);
+			if (len > d - nr) {
+				/* Leave a few bits off the end */
+				if (d - nr <= round % 8)
+					break;
+				len = d - nr - (round % 8);
+			}
+			ecc = ocfs2_hamming_encode(ecc, buf + nr / 8, len,
+						   nr);
+			want = ocfs2_hamming_encode_orig_code_bit(want,
+								  buf + nr / 8,
+								  len, nr);
+		}
+		if (ecc != want) {
+			fprintf(stderr,
+				"Hunked ecc %"PRIu32" != reference ecc "
+				"%"PRIu32" in round %d\n", ecc, want, round);
+			exit(1);
+		}
+	}
+
+	fprintf(stderr, "Hunked hamming code matches the original\n");
+}
+
+/* Flip single bits in each block and make sure validate repairs them */
+static void check_hamming_fix(char *buf, int size)
+{
+	int blocksize = 4096, off, i, bit;
+	struct ocfs2_block_check bc;
+	char *block;
+	errcode_t ret;
+
+	if (size < blocksize)
+		blocksize = size & ~511;
+	if (!blocksize)
+		return;
+
+	block = malloc(blocksize);
+	assert(block);
+
+	for (off = 0; off + blocksize <= size; off += blocksize) {
+		ocfs2_block_check_compute(buf + off, blocksize, &bc);
+		for (i = 0; i < 8; i++) {
+			memcpy(block, buf + off, blocksize);
+			bit = random() % (blocksize * 8);
+			block[bit / 8] ^= 1 << (bit % 8);
+			ret = ocfs2_block_check_validate(block, blocksize,
+							 &bc);
+			if (ret || memcmp(block, buf + off, blocksize)) {
+				fprintf(stderr,
+					"Unable to repair bit %d of the block "
+					"at offset %d\n", bit, off);
+				exit(1);
+			}
+		}
+	}
+
+	free(block);
+	fprintf(stderr, "Single bit errors are repaired\n");
+}
+
+#define BATCH_BLOCKSIZE		4096
+#define BATCH_CHECK_OFFSET	offsetof(struct ocfs2_dinode, i_check)
+
+/* The whole 4K blocks of buf, copied so the checks can be written */
+static char *get_blocks(char *buf, int size, int *nr)
+{
+	char *blocks;
+
+	*nr = size / BATCH_BLOCKSIZE;
+	if (!*nr)
+		return NULL;
+
+	blocks = malloc(*nr * BATCH_BLOCKSIZE);
+	assert(blocks);
+	memcpy(blocks, buf, *nr * BATCH_BLOCKSIZE);
+
+	return blocks;
+}
+
+/*
+ * The batched calls must write the same checks as the one block calls,
+ * repair what they repair, and fail only the blocks they fail.
+ */
+static void check_batch(char *buf, int size)
+{
+	int i, nr, bit;
+	char *one, *batch, *blk;
+	errcode_t ret, *errs;
+	struct ocfs2_block_check *bc;
+
+	one = get_blocks(buf, size, &nr);
+	if (!one)
+		return;
+	batch = get_blocks(buf, size, &nr);
+	errs = malloc(nr * sizeof(errcode_t));
+	assert(errs);
+
+	for (i = 0; i < nr; i++) {
+		blk = one + i * BATCH_BLOCKSIZE;
+		bc = (struct ocfs2_block_check *)(blk + BATCH_CHECK_OFFSET);
+		ocfs2_block_check_compute(blk, BATCH_BLOCKSIZE, bc);
+	}
+	ocfs2_block_check_compute_blocks(batch, nr, BATCH_BLOCKSIZE,
+					 BATCH_CHECK_OFFSET);
+	if (memcmp(one, batch, nr * BATCH_BLOCKSIZE)) {
+		fprintf(stderr, "Batched checks differ from single ones\n");
+		exit(1);
+	}
+
+	/* One bit off in every block, outside the check, is repaired */
+	for (i = 0; i < nr; i++) {
+		do {
+			bit = random() % (BATCH_BLOCKSIZE * 8);
+		} while ((bit / 8 >= BATCH_CHECK_OFFSET) &&
+			 (bit / 8 < BATCH_CHECK_OFFSET +
+			  sizeof(struct ocfs2_block_check)));
+		batch[i * BATCH_BLOCKSIZE + bit / 8] ^= 1 << (bit % 8);
+	}
+	ret = ocfs2_block_check_validate_blocks(batch, nr, BATCH_BLOCKSIZE,
+						BATCH_CHECK_OFFSET, errs);
+	if (ret || memcmp(one, batch, nr * BATCH_BLOCKSIZE)) {
+		fprintf(stderr, "Batched validate did not repair the "
+			"blocks\n");
+		exit(1);
+	}
+
+	/* Two bits off in the last block can't be */
+	blk = batch + (nr - 1) * BATCH_BLOCKSIZE;
+	blk[0] ^= 1;
+	blk[BATCH_BLOCKSIZE - 1] ^= 0x80;
+	ret = ocfs2_block_check_validate_blocks(batch, nr, BATCH_BLOCKSIZE,
+						BATCH_CHECK_OFFSET, errs);
+	for (i = 0; i < nr - 1; i++) {
+		if (errs[i])
+			break;
+	}
+	if ((ret != OCFS2_ET_BAD_CRC32) || (i < nr - 1) ||
+	    (errs[nr - 1] != OCFS2_ET_BAD_CRC32)) {
+		fprintf(stderr, "Batched validate missed a bad block\n");
+		exit(1);
+	}
+
+	free(errs);
+	free(batch);
+	free(one);
+	fprintf(stderr, "Batched checks match single ones\n");
+}
+
+static void validate_func(struct run_context *ct, int nr)
+{
+	int i;
+	char *blk;
+
+	for (i = 0; i < ct->rc_size / BATCH_BLOCKSIZE; i++) {
+		blk = (char *)ct->rc_data + i * BATCH_BLOCKSIZE;
+		ocfs2_block_check_validate(blk, BATCH_BLOCKSIZE,
+			(struct ocfs2_block_check *)(blk + BATCH_CHECK_OFFSET));
+	}
+}
+
+static void validate_blocks_func(struct run_context *ct, int nr)
+{
+	ocfs2_block_check_validate_blocks(ct->rc_data,
+					  ct->rc_size / BATCH_BLOCKSIZE,
+					  BATCH_BLOCKSIZE, BATCH_CHECK_OFFSET,
+					  NULL);
+}
+
+static void run_validate(char *buf, int size, int count)
+{
+	int nr;
+	char *blocks = get_blocks(buf, size, &nr);
+	struct run_context ct = {
+		.rc_name = "Validate one block at a time",
+		.rc_data = blocks,
+		.rc_size = nr * BATCH_BLOCKSIZE,
+		.rc_count = count,
+		.rc_func = validate_func,
+	};
+
+	if (!blocks)
+		return;
+
+	ocfs2_block_check_compute_blocks(blocks, nr, BATCH_BLOCKSIZE,
+					 BATCH_CHECK_OFFSET);
+	timeme(&ct);
+
+	ct.rc_name = "Validate in batches";
+	ct.rc_func = validate_blocks_func;
+	timeme(&ct);
+
+	free(blocks);
+}
+
 static uint64_t read_number(const char *num)
 {
 	uint64_t val;
@@ -958,7 +1535,12 @@ int main(int argc, char *argv[])
 	}
 
 	get_file(filename, &buf, &size);
+	check_crc32(buf, size);
+	check_hamming_hunks(buf, size);
+	check_hamming_fix(buf, size);
+	check_batch(buf, size);
 	run_crc32(buf, size, count);
+	run_validate(buf, size, count);
 	run_hamming(buf, size, count);
 
 
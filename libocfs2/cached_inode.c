@@ -76,6 +76,8 @@ errcode_t ocfs2_free_cached_inode(ocfs2_filesys *fs,
 	if (cinode->ci_chains)
 		ocfs2_bitmap_free(cinode->ci_chains);
 
+	ocfs2_extent_map_drop(cinode);
+
 	if (cinode->ci_inode)
 		ocfs2_free(&cinode->ci_inode);
 
@@ -96,6 +98,9 @@ errcode_t ocfs2_write_cached_inode(ocfs2_filesys *fs,
 	    (cinode->ci_blkno > fs->fs_blocks))
 		return OCFS2_ET_BAD_BLKNO;
 
+	/* The caller may have changed the extent list */
+	ocfs2_extent_map_drop(cinode);
+
 	ret = ocfs2_write_inode(fs, cinode->ci_blkno,
 				(char *)cinode->ci_inode);
 
@@ -110,6 +115,8 @@ errcode_t ocfs2_refresh_cached_inode(ocfs2_filesys *fs,
 		cinode->ci_chains = NULL;
 	}
 
+	ocfs2_extent_map_drop(cinode);
+
 	return ocfs2_read_inode(fs, cinode->ci_blkno,
 				(char *)cinode->ci_inode);
 }
@@ -308,7 +308,7 @@ errcode_t ocfs2_cache_chain_allocator_blocks(ocfs2_filesys *fs,
 {
 	struct io_vec_unit *ivus = NULL;
 	char *buf = NULL;
-	errcode_t ret = 0;
+	errcode_t ret = 0, *errs = NULL;
 	int i, j, count;
 	struct ocfs2_chain_list *cl;
 	struct ocfs2_chain_rec *cr;
@@ -346,6 +346,10 @@ errcode_t ocfs2_cache_chain_allocator_blocks(ocfs2_filesys *fs,
 	if (ret)
 		goto out;
 
+	ret = ocfs2_malloc(sizeof(errcode_t) * count, &errs);
+	if (ret)
+		goto out;
+
 	for (i = 0; i < count; ++i) {
 		cr = &(cl->cl_recs[i]);
 		ivus[i].ivu_blkno = cr->c_blkno;
@@ -358,11 +362,15 @@ errcode_t ocfs2_cache_chain_allocator_blocks(ocfs2_filesys *fs,
 		if (ret)
 			goto out;
 
+		/* The group descriptors sit end to end in buf */
+		ocfs2_validate_meta_ecc_blocks(fs, buf, count,
+				offsetof(struct ocfs2_group_desc, bg_check),
+				errs);
+
 		for (i = 0, j = 0; i < count; ++i) {
 			gd = (struct ocfs2_group_desc *)ivus[i].ivu_buf;
 
-			ret = ocfs2_validate_meta_ecc(fs, ivus[i].ivu_buf,
-						      &gd->bg_check);
+			ret = errs[i];
 			if (ret)
 				goto out;
 
@@ -386,6 +394,7 @@ errcode_t ocfs2_cache_chain_allocator_blocks(ocfs2_filesys *fs,
 	}
 
 out:
+	ocfs2_free(&errs);
 	ocfs2_free(&ivus);
 	ocfs2_free(&buf);
 	return ret;
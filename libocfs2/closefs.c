@@ -60,6 +60,10 @@ errcode_t ocfs2_close(ocfs2_filesys *fs)
 			return ret;
 	}
 
+	ret = io_flush(fs->fs_io);
+	if (ret)
+		return ret;
+
 	ocfs2_freefs(fs);
 	return 0;
 }
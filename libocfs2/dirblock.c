@@ -164,24 +164,24 @@ void ocfs2_swap_dir_trailer(struct ocfs2_dir_block_trailer *trailer)
 	trailer->db_free_next = bswap_64(trailer->db_free_next);
 }
 
-errcode_t ocfs2_read_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
-			       uint64_t block, void *buf)
+static errcode_t validate_dir_block(ocfs2_filesys *fs,
+				    struct ocfs2_dinode *di, void *buf,
+				    int check_ecc)
 {
 	errcode_t retval;
 	int end = fs->fs_blocksize;
 	struct ocfs2_dir_block_trailer *trailer = NULL;
 
-	retval = ocfs2_read_blocks(fs, block, 1, buf);
-	if (retval)
-		goto out;
-
 	if (ocfs2_dir_has_trailer(fs, di)) {
 		end = ocfs2_dir_trailer_blk_off(fs);
 		trailer = ocfs2_dir_trailer_from_block(fs, buf);
 
-		retval = ocfs2_validate_meta_ecc(fs, buf, &trailer->db_check);
-		if (retval)
-			goto out;
+		if (check_ecc) {
+			retval = ocfs2_validate_meta_ecc(fs, buf,
+							 &trailer->db_check);
+			if (retval)
+				goto out;
+		}
 
 		if (memcmp(trailer->db_signature, OCFS2_DIR_TRAILER_SIGNATURE,
 			   strlen(OCFS2_DIR_TRAILER_SIGNATURE))) {
@@ -201,6 +201,39 @@ out:
 	return retval;
 }
 
+/*
+ * Check and swap a directory block the caller has already read from
+ * disk.  ocfs2_read_dir_block() is this plus the read.
+ */
+errcode_t ocfs2_validate_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+				   void *buf)
+{
+	return validate_dir_block(fs, di, buf, 1);
+}
+
+/*
+ * The same for a block whose ECC the caller has already validated,
+ * usually along with its neighbours by ocfs2_validate_meta_ecc_blocks().
+ */
+errcode_t ocfs2_validate_checked_dir_block(ocfs2_filesys *fs,
+					   struct ocfs2_dinode *di,
+					   void *buf)
+{
+	return validate_dir_block(fs, di, buf, 0);
+}
+
+errcode_t ocfs2_read_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+			       uint64_t block, void *buf)
+{
+	errcode_t retval;
+
+	retval = ocfs2_read_blocks(fs, block, 1, buf);
+	if (retval)
+		return retval;
+
+	return ocfs2_validate_dir_block(fs, di, buf);
+}
+
 errcode_t ocfs2_write_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 				uint64_t block, void *inbuf)
 {
@@ -70,6 +70,7 @@ errcode_t ocfs2_cached_inode_insert_extent(ocfs2_cached_inode *ci,
 {
 	struct ocfs2_extent_tree et;
 
+	ocfs2_extent_map_drop(ci);
 	ocfs2_init_dinode_extent_tree(&et, ci->ci_fs, (char *)ci->ci_inode,
 				      ci->ci_inode->i_blkno);
 
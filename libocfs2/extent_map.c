@@ -126,6 +126,150 @@ out:
 	return ret;
 }
 
+/*
+ * Looking up a cluster in a deep tree reads an extent block at each
+ * level.  Callers like ocfs2_file_read() look up one extent after the
+ * next, so the second lookup on a cached inode reads all of its leaf
+ * extents into ci_map.  Later lookups are a binary search of the map.
+ *
+ * The map is dropped when the tree changes through the cached inode,
+ * and by ocfs2_write_cached_inode() and ocfs2_refresh_cached_inode().
+ * Code that changes the tree any other way must call
+ * ocfs2_extent_map_drop().
+ */
+struct extent_map_context {
+	struct _ocfs2_extent_map *em;
+	errcode_t errcode;
+};
+
+static int extent_map_fill_func(ocfs2_filesys *fs,
+				struct ocfs2_extent_rec *rec,
+				int tree_depth,
+				uint32_t ccount,
+				uint64_t ref_blkno,
+				int ref_recno,
+				void *priv_data)
+{
+	uint32_t max;
+	uint32_t clusters = ocfs2_rec_clusters(tree_depth, rec);
+	struct extent_map_context *ctxt = priv_data;
+	struct _ocfs2_extent_map *em = ctxt->em;
+	struct ocfs2_extent_map_rec *er;
+
+	if (tree_depth || !clusters)
+		return 0;
+
+	/* Overlapping extents are left for the tree lookup to sort out */
+	if (em->em_nr) {
+		er = &em->em_recs[em->em_nr - 1];
+		if (rec->e_cpos < (uint64_t)er->er_cpos + er->er_clusters) {
+			ctxt->errcode = OCFS2_ET_CORRUPT_EXTENT_BLOCK;
+			return OCFS2_EXTENT_ABORT;
+		}
+	}
+
+	if (em->em_nr == em->em_max) {
+		max = em->em_max ? em->em_max * 2 : 64;
+		ctxt->errcode = ocfs2_realloc(sizeof(struct ocfs2_extent_map_rec) *
+					      max, &em->em_recs);
+		if (ctxt->errcode)
+			return OCFS2_EXTENT_ABORT;
+		em->em_max = max;
+	}
+
+	er = &em->em_recs[em->em_nr++];
+	er->er_cpos = rec->e_cpos;
+	er->er_clusters = clusters;
+	er->er_blkno = rec->e_blkno;
+	er->er_flags = rec->e_flags;
+
+	return 0;
+}
+
+/*
+ * If the tree can't be walked, an invalid map is left behind so that
+ * we don't try again.
+ */
+static void extent_map_build(ocfs2_cached_inode *cinode)
+{
+	errcode_t ret;
+	struct extent_map_context ctxt = { .em = NULL, .errcode = 0 };
+
+	ret = ocfs2_malloc0(sizeof(struct _ocfs2_extent_map), &ctxt.em);
+	if (ret)
+		return;
+
+	ret = ocfs2_extent_iterate_inode(cinode->ci_fs, cinode->ci_inode,
+					 OCFS2_EXTENT_FLAG_DATA_ONLY, NULL,
+					 extent_map_fill_func, &ctxt);
+	if (!ret && !ctxt.errcode)
+		ctxt.em->em_valid = 1;
+	else if (ctxt.em->em_recs) {
+		ocfs2_free(&ctxt.em->em_recs);
+		ctxt.em->em_nr = ctxt.em->em_max = 0;
+	}
+
+	cinode->ci_map = ctxt.em;
+}
+
+/* The same answers ocfs2_get_clusters() finds in the tree */
+static errcode_t extent_map_lookup(ocfs2_filesys *fs,
+				   struct _ocfs2_extent_map *em,
+				   uint32_t v_cluster,
+				   uint32_t *p_cluster,
+				   uint32_t *num_clusters,
+				   uint16_t *extent_flags)
+{
+	uint32_t lo = 0, hi = em->em_nr, mid, coff;
+	uint16_t flags = 0;
+	struct ocfs2_extent_map_rec *er;
+
+	/* Find the first extent past v_cluster */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (em->em_recs[mid].er_cpos <= v_cluster)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	er = lo ? &em->em_recs[lo - 1] : NULL;
+	if (er && (v_cluster < (uint64_t)er->er_cpos + er->er_clusters)) {
+		if (!er->er_blkno)
+			return OCFS2_ET_BAD_BLKNO;
+
+		coff = v_cluster - er->er_cpos;
+		*p_cluster = ocfs2_blocks_to_clusters(fs, er->er_blkno) + coff;
+		if (num_clusters)
+			*num_clusters = er->er_clusters - coff;
+		flags = er->er_flags;
+	} else {
+		*p_cluster = 0;
+		if (num_clusters) {
+			if (lo < em->em_nr)
+				*num_clusters = em->em_recs[lo].er_cpos -
+					v_cluster;
+			else
+				*num_clusters = UINT32_MAX - v_cluster;
+		}
+	}
+
+	if (extent_flags)
+		*extent_flags = flags;
+
+	return 0;
+}
+
+void ocfs2_extent_map_drop(ocfs2_cached_inode *cinode)
+{
+	if (cinode->ci_map) {
+		if (cinode->ci_map->em_recs)
+			ocfs2_free(&cinode->ci_map->em_recs);
+		ocfs2_free(&cinode->ci_map);
+	}
+	cinode->ci_map_lookups = 0;
+}
+
 errcode_t ocfs2_get_clusters(ocfs2_cached_inode *cinode,
 			     uint32_t v_cluster,
 			     uint32_t *p_cluster,
@@ -147,6 +291,14 @@ errcode_t ocfs2_get_clusters(ocfs2_cached_inode *cinode,
 	el = &di->id2.i_list;
 
 	if (el->l_tree_depth) {
+		if (!cinode->ci_map && (++cinode->ci_map_lookups > 1) &&
+		    !(di->i_dyn_features & OCFS2_INLINE_DATA_FL))
+			extent_map_build(cinode);
+		if (cinode->ci_map && cinode->ci_map->em_valid)
+			return extent_map_lookup(fs, cinode->ci_map,
+						 v_cluster, p_cluster,
+						 num_clusters, extent_flags);
+
 		ret = ocfs2_find_leaf(fs, di, v_cluster, &eb_buf);
 		if (ret)
 			goto out;
@@ -27,19 +27,23 @@
 #ifndef _EXTENT_MAP_H
 #define _EXTENT_MAP_H
 
-#include "ocfs2/kernel-rbtree.h"
-
-typedef struct _ocfs2_extent_map_entry ocfs2_extent_map_entry;
-
-struct _ocfs2_extent_map {
-	struct rb_root em_extents;
-	uint32_t em_clusters;
+/* A leaf extent, as ocfs2_get_clusters() needs it */
+struct ocfs2_extent_map_rec {
+	uint32_t	er_cpos;
+	uint32_t	er_clusters;
+	uint64_t	er_blkno;
+	uint16_t	er_flags;
 };
 
-struct _ocfs2_extent_map_entry {
-	struct rb_node e_node;
-	int e_tree_depth;
-	struct ocfs2_extent_rec e_rec;
+/*
+ * All the leaf extents of an inode, sorted by cpos.  If the tree
+ * couldn't be walked, em_valid is clear and lookups go to the tree.
+ */
+struct _ocfs2_extent_map {
+	struct ocfs2_extent_map_rec	*em_recs;
+	uint32_t			em_nr;
+	uint32_t			em_max;
+	int				em_valid;
 };
 
 #endif  /* _EXTENT_MAP_H */
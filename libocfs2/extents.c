@@ -125,17 +125,17 @@ errcode_t ocfs2_read_extent_block_nocheck(ocfs2_filesys *fs,
 	    (blkno > fs->fs_blocks))
 		return OCFS2_ET_BAD_BLKNO;
 
-	ret = ocfs2_malloc_block(fs->fs_io, &blk);
+	ret = ocfs2_get_blocks(fs, blkno, 1, &blk);
 	if (ret)
 		return ret;
 
-	ret = ocfs2_read_blocks(fs, blkno, 1, blk);
-	if (ret)
-		goto out;
+	/* ECC validation may fix up the buffer, so do it on our copy */
+	memcpy(eb_buf, blk, fs->fs_blocksize);
+	ocfs2_put_blocks(fs, 1, &blk);
 
-	eb = (struct ocfs2_extent_block *)blk;
+	eb = (struct ocfs2_extent_block *) eb_buf;
 
-	ret = ocfs2_validate_meta_ecc(fs, blk, &eb->h_check);
+	ret = ocfs2_validate_meta_ecc(fs, eb_buf, &eb->h_check);
 	if (ret)
 		goto out;
 
@@ -145,14 +145,9 @@ errcode_t ocfs2_read_extent_block_nocheck(ocfs2_filesys *fs,
 		goto out;
 	}
 
-	memcpy(eb_buf, blk, fs->fs_blocksize);
-
-	eb = (struct ocfs2_extent_block *) eb_buf;
 	ocfs2_swap_extent_block_to_cpu(fs, eb);
 
 out:
-	ocfs2_free(&blk);
-
 	return ret;
 }
 
@@ -234,6 +234,221 @@ errcode_t ocfs2_file_read(ocfs2_cached_inode *ci, void *buf, uint32_t count,
 	return ret;
 }
 
+/*
+ * ocfs2_file_stream() hands a whole file to func in file order.  Each
+ * extent is cut into runs of up to FILE_STREAM_RUN_BYTES, and reads for
+ * up to FILE_STREAM_RUNS runs are in flight while func works on the
+ * oldest one.  Small files get fewer and smaller runs.  Holes and
+ * unwritten extents are passed with a NULL buf, however large, so that
+ * the caller can skip them instead of writing zeros.  Image files and
+ * channels that can't queue reads fall back to reading each run when it
+ * is due.
+ */
+#define FILE_STREAM_RUN_BYTES	(1024 * 1024)
+#define FILE_STREAM_RUNS	8
+
+enum stream_run_state {
+	STREAM_RUN_HOLE = 0,
+	STREAM_RUN_READ,	/* Read when the run is due */
+	STREAM_RUN_READING,
+	STREAM_RUN_ERROR,
+	STREAM_RUN_DONE,
+};
+
+struct stream_run {
+	uint64_t		sr_offset;	/* Byte offset in the file */
+	uint64_t		sr_len;		/* Bytes for func */
+	uint64_t		sr_blkno;
+	uint64_t		sr_blocks;
+	enum stream_run_state	sr_state;
+	errcode_t		sr_ret;
+	char			*sr_buf;
+	struct io_vec_unit	sr_ivu;
+};
+
+struct file_stream {
+	ocfs2_cached_inode	*st_ci;
+	uint64_t		st_next;	/* Next virtual block to queue */
+	uint64_t		st_end;		/* Blocks in i_size */
+	int			st_head;
+	int			st_queued;
+	int			st_async;
+	int			st_nr_runs;
+	uint64_t		st_run_blocks;	/* Size of each run buffer */
+	struct stream_run	st_runs[FILE_STREAM_RUNS];
+};
+
+static void stream_queue_runs(struct file_stream *st)
+{
+	errcode_t ret;
+	ocfs2_filesys *fs = st->st_ci->ci_fs;
+	int bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+	uint64_t p_blkno, contig;
+	uint16_t extent_flags;
+	struct stream_run *run;
+
+	while ((st->st_queued < st->st_nr_runs) &&
+	       (st->st_next < st->st_end)) {
+		run = &st->st_runs[(st->st_head + st->st_queued) %
+				   st->st_nr_runs];
+		st->st_queued++;
+
+		ret = ocfs2_extent_map_get_blocks(st->st_ci, st->st_next, 1,
+						  &p_blkno, &contig,
+						  &extent_flags);
+		if (ret) {
+			run->sr_state = STREAM_RUN_ERROR;
+			run->sr_ret = ret;
+			st->st_next = st->st_end;
+			break;
+		}
+
+		if (contig > st->st_end - st->st_next)
+			contig = st->st_end - st->st_next;
+
+		if (!p_blkno || (extent_flags & OCFS2_EXT_UNWRITTEN))
+			run->sr_state = STREAM_RUN_HOLE;
+		else {
+			if (contig > st->st_run_blocks)
+				contig = st->st_run_blocks;
+			run->sr_state = STREAM_RUN_READ;
+		}
+
+		run->sr_offset = st->st_next << bits;
+		run->sr_len = contig << bits;
+		run->sr_blkno = p_blkno;
+		run->sr_blocks = contig;
+		st->st_next += contig;
+
+		if (run->sr_offset + run->sr_len > st->st_ci->ci_inode->i_size)
+			run->sr_len = st->st_ci->ci_inode->i_size -
+				run->sr_offset;
+
+		if ((run->sr_state != STREAM_RUN_READ) || !st->st_async)
+			continue;
+
+		run->sr_ivu.ivu_blkno = p_blkno;
+		run->sr_ivu.ivu_buf = run->sr_buf;
+		run->sr_ivu.ivu_buflen = contig << bits;
+		if (!io_vec_submit(fs->fs_io, &run->sr_ivu, 1))
+			run->sr_state = STREAM_RUN_READING;
+		else
+			st->st_async = 0;
+	}
+}
+
+static errcode_t stream_run_wait(ocfs2_filesys *fs, struct stream_run *run)
+{
+	errcode_t ret = 0;
+
+	switch (run->sr_state) {
+	case STREAM_RUN_READING:
+		ret = io_vec_wait(fs->fs_io, &run->sr_ivu);
+		break;
+	case STREAM_RUN_READ:
+		ret = ocfs2_read_blocks(fs, run->sr_blkno, run->sr_blocks,
+					run->sr_buf);
+		break;
+	case STREAM_RUN_ERROR:
+		ret = run->sr_ret;
+		break;
+	default:
+		break;
+	}
+
+	run->sr_state = STREAM_RUN_DONE;
+	return ret;
+}
+
+errcode_t ocfs2_file_stream(ocfs2_cached_inode *ci,
+			    errcode_t (*func)(ocfs2_filesys *fs,
+					      uint64_t offset,
+					      char *buf,
+					      uint64_t len,
+					      void *priv_data),
+			    void *priv_data)
+{
+	int i;
+	errcode_t ret = 0;
+	ocfs2_filesys *fs = ci->ci_fs;
+	struct ocfs2_dinode *di = ci->ci_inode;
+	struct file_stream *st = NULL;
+	struct stream_run *run;
+
+	if (di->i_dyn_features & OCFS2_INLINE_DATA_FL) {
+		if (di->i_size > di->id2.i_data.id_count)
+			return OCFS2_ET_INVALID_ARGUMENT;
+		if (di->i_size)
+			ret = func(fs, 0, (char *)di->id2.i_data.id_data,
+				   di->i_size, priv_data);
+		return ret;
+	}
+
+	ret = ocfs2_malloc0(sizeof(struct file_stream), &st);
+	if (ret)
+		return ret;
+
+	st->st_ci = ci;
+	st->st_end = (di->i_size + fs->fs_blocksize - 1) /
+		fs->fs_blocksize;
+	st->st_async = !(fs->fs_flags & OCFS2_FLAG_IMAGE_FILE);
+
+	st->st_run_blocks = ocfs2_min(st->st_end,
+				      (uint64_t)(FILE_STREAM_RUN_BYTES /
+						 fs->fs_blocksize));
+	st->st_nr_runs = FILE_STREAM_RUNS;
+	if (st->st_end < st->st_run_blocks * FILE_STREAM_RUNS)
+		st->st_nr_runs = (st->st_end + st->st_run_blocks - 1) /
+			st->st_run_blocks;
+	if (!st->st_nr_runs)
+		goto out;
+
+	for (i = 0; i < st->st_nr_runs; i++) {
+		ret = ocfs2_malloc_blocks(fs->fs_io, st->st_run_blocks,
+					  &st->st_runs[i].sr_buf);
+		if (ret)
+			goto out;
+	}
+
+	for (;;) {
+		stream_queue_runs(st);
+		if (!st->st_queued)
+			break;
+
+		run = &st->st_runs[st->st_head];
+		if (run->sr_state == STREAM_RUN_HOLE)
+			ret = func(fs, run->sr_offset, NULL, run->sr_len,
+				   priv_data);
+		else {
+			ret = stream_run_wait(fs, run);
+			if (!ret)
+				ret = func(fs, run->sr_offset, run->sr_buf,
+					   run->sr_len, priv_data);
+		}
+		if (ret)
+			break;
+
+		st->st_head = (st->st_head + 1) % st->st_nr_runs;
+		st->st_queued--;
+	}
+
+out:
+	/* The reads have to land before their buffers go away */
+	for (i = 0; i < st->st_queued; i++) {
+		run = &st->st_runs[(st->st_head + i) % st->st_nr_runs];
+		if (run->sr_state == STREAM_RUN_READING)
+			io_vec_wait(fs->fs_io, &run->sr_ivu);
+	}
+
+	for (i = 0; i < FILE_STREAM_RUNS; i++) {
+		if (st->st_runs[i].sr_buf)
+			ocfs2_free(&st->st_runs[i].sr_buf);
+	}
+	ocfs2_free(&st);
+
+	return ret;
+}
+
 /*
  * Emtpy the blocks on the disk.
  */
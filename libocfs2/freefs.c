@@ -31,6 +31,7 @@
 #include <stdlib.h>
 
 #include "ocfs2/ocfs2.h"
+#include "ocfs2/image.h"
 
 
 void ocfs2_freefs(ocfs2_filesys *fs)
@@ -44,6 +45,10 @@ void ocfs2_freefs(ocfs2_filesys *fs)
 		ocfs2_free(&fs->fs_super);
 	if (fs->fs_devname)
 		ocfs2_free(&fs->fs_devname);
+	if (fs->ost) {
+		ocfs2_image_free_bitmap(fs);
+		ocfs2_free(&fs->ost);
+	}
 	if (fs->fs_io)
 		io_close(fs->fs_io);
 
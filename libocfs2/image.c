@@ -35,12 +35,238 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <ocfs2/bitops.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/byteorder.h"
 #include "ocfs2/image.h"
 
+/* Decompressed v2 chunks kept around for the next read */
+#define IMAGE_CACHE_CHUNKS	8
+
+struct image_chunk_slot {
+	uint64_t	cs_chunk;
+	uint64_t	cs_used;	/* cc_clock at last use, 0 if empty */
+	char		*cs_buf;
+};
+
+struct ocfs2_image_chunk_cache {
+	pthread_mutex_t		cc_lock;
+	int			cc_fd;		/* Not O_DIRECT, unlike fs_io */
+	char			*cc_cbuf;	/* A chunk as stored */
+	uint32_t		cc_cbuf_len;
+	uint64_t		cc_clock;
+	struct image_chunk_slot	cc_slots[IMAGE_CACHE_CHUNKS];
+};
+
+/*
+ * A chunk codec.  compress() fails with OCFS2_ET_NO_SPACE if the result
+ * won't fit in cap bytes.  decompress() must produce exactly dst_len
+ * bytes.
+ */
+struct image_codec {
+	uint16_t	ic_id;
+	errcode_t	(*ic_compress)(char *src, uint32_t len, char *dst,
+				       uint32_t cap, uint32_t *dst_len);
+	errcode_t	(*ic_decompress)(char *src, uint32_t len, char *dst,
+					 uint32_t dst_len);
+};
+
+/*
+ * The built-in codec.  Metadata blocks are mostly runs of zeros, so a
+ * run-length code gets much of what a real compressor would.  The
+ * stream is a series of ops, each a tag byte and a LEB128 count.  A
+ * literal is followed by count bytes, a run by the byte to repeat.
+ */
+#define RLE_LITERAL		0
+#define RLE_RUN			1
+#define RLE_MIN_RUN		4
+
+static int rle_put_op(char *dst, uint32_t *pos, uint32_t cap, int tag,
+		      uint32_t count, char *payload, uint32_t payload_len)
+{
+	unsigned char *out = (unsigned char *)dst;
+
+	if (*pos + 1 + 5 + payload_len > cap)
+		return 0;
+
+	out[(*pos)++] = tag;
+	do {
+		out[*pos] = count & 0x7f;
+		count >>= 7;
+		if (count)
+			out[*pos] |= 0x80;
+		(*pos)++;
+	} while (count);
+
+	memcpy(dst + *pos, payload, payload_len);
+	*pos += payload_len;
+
+	return 1;
+}
+
+static errcode_t rle_compress(char *src, uint32_t len, char *dst,
+			      uint32_t cap, uint32_t *dst_len)
+{
+	uint32_t i = 0, lit = 0, run, pos = 0;
+
+	while (i < len) {
+		for (run = 1; (i + run < len) && (src[i + run] == src[i]);
+		     run++)
+			;
+
+		if (run < RLE_MIN_RUN) {
+			i += run;
+			continue;
+		}
+
+		if ((i > lit) &&
+		    !rle_put_op(dst, &pos, cap, RLE_LITERAL, i - lit,
+				src + lit, i - lit))
+			return OCFS2_ET_NO_SPACE;
+		if (!rle_put_op(dst, &pos, cap, RLE_RUN, run, src + i, 1))
+			return OCFS2_ET_NO_SPACE;
+
+		i += run;
+		lit = i;
+	}
+
+	if ((len > lit) &&
+	    !rle_put_op(dst, &pos, cap, RLE_LITERAL, len - lit, src + lit,
+			len - lit))
+		return OCFS2_ET_NO_SPACE;
+
+	*dst_len = pos;
+	return 0;
+}
+
+static errcode_t rle_decompress(char *src, uint32_t len, char *dst,
+				uint32_t dst_len)
+{
+	unsigned char *in = (unsigned char *)src;
+	uint32_t pos = 0, out = 0, count;
+	int tag, shift;
+
+	while (pos < len) {
+		tag = in[pos++];
+		count = 0;
+		shift = 0;
+		do {
+			if ((pos == len) || (shift > 28))
+				return OCFS2_ET_CORRUPT_IMAGE_FILE;
+			count |= (uint32_t)(in[pos] & 0x7f) << shift;
+			shift += 7;
+		} while (in[pos++] & 0x80);
+
+		if (count > dst_len - out)
+			return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+		if (tag == RLE_LITERAL) {
+			if (count > len - pos)
+				return OCFS2_ET_CORRUPT_IMAGE_FILE;
+			memcpy(dst + out, src + pos, count);
+			pos += count;
+		} else if ((tag == RLE_RUN) && (pos < len)) {
+			memset(dst + out, src[pos++], count);
+		} else
+			return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+		out += count;
+	}
+
+	if (out != dst_len)
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	return 0;
+}
+
+#ifdef HAVE_ZSTD
+static errcode_t zstd_compress(char *src, uint32_t len, char *dst,
+			       uint32_t cap, uint32_t *dst_len)
+{
+	size_t ret;
+
+	ret = ZSTD_compress(dst, cap, src, len, 3);
+	if (ZSTD_isError(ret))
+		return OCFS2_ET_NO_SPACE;
+
+	*dst_len = ret;
+	return 0;
+}
+
+static errcode_t zstd_decompress(char *src, uint32_t len, char *dst,
+				 uint32_t dst_len)
+{
+	size_t ret;
+
+	ret = ZSTD_decompress(dst, dst_len, src, len);
+	if (ZSTD_isError(ret) || (ret != dst_len))
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	return 0;
+}
+#endif
+
+/* New images use the first codec */
+static struct image_codec image_codecs[] = {
+#ifdef HAVE_ZSTD
+	{ OCFS2_IMAGE_CODEC_ZSTD, zstd_compress, zstd_decompress },
+#endif
+	{ OCFS2_IMAGE_CODEC_RLE, rle_compress, rle_decompress },
+};
+
+/*
+ * Compress len bytes of src into dst, which must have room for len
+ * bytes.  If the chunk doesn't shrink, it is copied as is and *codec is
+ * OCFS2_IMAGE_CODEC_NONE.
+ */
+errcode_t ocfs2_image_compress(char *src, uint32_t len, char *dst,
+			       uint32_t *dst_len, uint16_t *codec)
+{
+	errcode_t ret;
+	struct image_codec *ic = &image_codecs[0];
+
+	ret = ic->ic_compress(src, len, dst, len, dst_len);
+	if (!ret && (*dst_len < len)) {
+		*codec = ic->ic_id;
+		return 0;
+	}
+	if (ret && (ret != OCFS2_ET_NO_SPACE))
+		return ret;
+
+	memcpy(dst, src, len);
+	*dst_len = len;
+	*codec = OCFS2_IMAGE_CODEC_NONE;
+
+	return 0;
+}
+
+errcode_t ocfs2_image_decompress(uint16_t codec, char *src, uint32_t len,
+				 char *dst, uint32_t dst_len)
+{
+	int i;
+
+	if (codec == OCFS2_IMAGE_CODEC_NONE) {
+		if (len != dst_len)
+			return OCFS2_ET_CORRUPT_IMAGE_FILE;
+		memcpy(dst, src, len);
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(image_codecs); i++) {
+		if (image_codecs[i].ic_id == codec)
+			return image_codecs[i].ic_decompress(src, len, dst,
+							     dst_len);
+	}
+
+	/* Written by a build with a codec this one doesn't have */
+	return OCFS2_ET_UNSUPP_FEATURE;
+}
+
 void ocfs2_image_swap_header(struct ocfs2_image_hdr *hdr)
 {
 	int i;
@@ -59,6 +285,57 @@ void ocfs2_image_swap_header(struct ocfs2_image_hdr *hdr)
 	hdr->hdr_imgblkcnt	= bswap_64(hdr->hdr_imgblkcnt);
 	hdr->hdr_bmpblksz	= bswap_64(hdr->hdr_bmpblksz);
 	hdr->hdr_superblkcnt	= bswap_64(hdr->hdr_superblkcnt);
+	hdr->hdr_chunkblks	= bswap_32(hdr->hdr_chunkblks);
+}
+
+void ocfs2_image_swap_chunk(struct ocfs2_image_chunk *chunk)
+{
+	if (cpu_is_little_endian)
+		return;
+
+	chunk->ic_offset	= bswap_64(chunk->ic_offset);
+	chunk->ic_len		= bswap_32(chunk->ic_len);
+	chunk->ic_codec		= bswap_16(chunk->ic_codec);
+}
+
+void ocfs2_image_swap_trailer(struct ocfs2_image_trailer *trailer)
+{
+	if (cpu_is_little_endian)
+		return;
+
+	trailer->it_magic	= bswap_32(trailer->it_magic);
+	trailer->it_index	= bswap_64(trailer->it_index);
+	trailer->it_chunks	= bswap_64(trailer->it_chunks);
+	trailer->it_bmpchunks	= bswap_64(trailer->it_bmpchunks);
+}
+
+int ocfs2_image_compressed(ocfs2_filesys *ofs)
+{
+	return (ofs->fs_flags & OCFS2_FLAG_IMAGE_FILE) &&
+		(ofs->ost->ost_version >= 2);
+}
+
+static void image_free_cache(struct ocfs2_image_state *ost)
+{
+	struct ocfs2_image_chunk_cache *cc = ost->ost_cache;
+	int i;
+
+	if (ost->ost_chunks)
+		ocfs2_free(&ost->ost_chunks);
+
+	if (!cc)
+		return;
+
+	for (i = 0; i < IMAGE_CACHE_CHUNKS; i++) {
+		if (cc->cc_slots[i].cs_buf)
+			ocfs2_free(&cc->cc_slots[i].cs_buf);
+	}
+	if (cc->cc_cbuf)
+		ocfs2_free(&cc->cc_cbuf);
+	if (cc->cc_fd >= 0)
+		close(cc->cc_fd);
+	pthread_mutex_destroy(&cc->cc_lock);
+	ocfs2_free(&ost->ost_cache);
 }
 
 errcode_t ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
@@ -70,6 +347,8 @@ errcode_t ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
 	if (!(ofs->fs_flags & OCFS2_FLAG_IMAGE_FILE))
 		return 0;
 
+	image_free_cache(ost);
+
 	if (!ost->ost_bmparr)
 		return 0;
 
@@ -79,6 +358,8 @@ errcode_t ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
 
 	if (ost->ost_bmparr)
 		ocfs2_free(&ost->ost_bmparr);
+	if (ost->ost_rank)
+		ocfs2_free(&ost->ost_rank);
 	return 0;
 }
 
@@ -157,6 +438,187 @@ out:
 	return ret;
 }
 
+static errcode_t image_pread(int fd, char *buf, size_t len, uint64_t off)
+{
+	ssize_t count;
+
+	while (len) {
+		count = pread64(fd, buf, len, off);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return OCFS2_ET_IO;
+		}
+		if (!count)
+			return OCFS2_ET_SHORT_READ;
+
+		buf += count;
+		len -= count;
+		off += count;
+	}
+
+	return 0;
+}
+
+static errcode_t image_read_chunk(ocfs2_filesys *ofs,
+				  struct ocfs2_image_chunk *ic, char *buf,
+				  uint32_t len)
+{
+	struct ocfs2_image_chunk_cache *cc = ofs->ost->ost_cache;
+	errcode_t ret;
+
+	if (ic->ic_len > cc->cc_cbuf_len)
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	ret = image_pread(cc->cc_fd, cc->cc_cbuf, ic->ic_len, ic->ic_offset);
+	if (ret)
+		return ret;
+
+	return ocfs2_image_decompress(ic->ic_codec, cc->cc_cbuf, ic->ic_len,
+				      buf, len);
+}
+
+/*
+ * Read the trailer and the chunk index at the end of a v2 image, and
+ * then the bitmap chunks that precede the index.  fs_io may be O_DIRECT,
+ * and chunks are neither aligned nor block sized, so the image is read
+ * through a descriptor of its own.
+ */
+static errcode_t image_load_v2(ocfs2_filesys *ofs)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	struct ocfs2_image_chunk_cache *cc;
+	struct ocfs2_image_trailer trailer;
+	uint64_t size, nr, bmpchunks, i, j, n;
+	uint32_t chunkblks = ost->ost_chunkblks;
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (!chunkblks)
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	ret = ocfs2_malloc0(sizeof(struct ocfs2_image_chunk_cache),
+			    &ost->ost_cache);
+	if (ret)
+		return ret;
+	cc = ost->ost_cache;
+	pthread_mutex_init(&cc->cc_lock, NULL);
+
+	cc->cc_fd = open64(ofs->fs_devname, O_RDONLY);
+	if (cc->cc_fd < 0)
+		return OCFS2_ET_IO;
+
+	size = lseek64(cc->cc_fd, 0, SEEK_END);
+	if ((size == (uint64_t)-1) || (size < sizeof(trailer)))
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	ret = image_pread(cc->cc_fd, (char *)&trailer, sizeof(trailer),
+			  size - sizeof(trailer));
+	if (ret)
+		return ret;
+	ocfs2_image_swap_trailer(&trailer);
+
+	ost->ost_nr_chunks = (ost->ost_imgblkcnt + chunkblks - 1) / chunkblks;
+	bmpchunks = (ost->ost_bmpblks + chunkblks - 1) / chunkblks;
+	nr = ost->ost_nr_chunks + bmpchunks;
+
+	if ((trailer.it_magic != OCFS2_IMAGE_MAGIC) ||
+	    (trailer.it_chunks != ost->ost_nr_chunks) ||
+	    (trailer.it_bmpchunks != bmpchunks) ||
+	    (trailer.it_index + (nr * sizeof(struct ocfs2_image_chunk)) +
+	     sizeof(trailer) != size))
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	ret = ocfs2_malloc(nr * sizeof(struct ocfs2_image_chunk),
+			   &ost->ost_chunks);
+	if (ret)
+		return ret;
+
+	ret = image_pread(cc->cc_fd, (char *)ost->ost_chunks,
+			  nr * sizeof(struct ocfs2_image_chunk),
+			  trailer.it_index);
+	if (ret)
+		return ret;
+	for (i = 0; i < nr; i++)
+		ocfs2_image_swap_chunk(&ost->ost_chunks[i]);
+
+	cc->cc_cbuf_len = chunkblks * ocfs2_max(ost->ost_fsblksz,
+						ost->ost_bmpblksz);
+	ret = ocfs2_malloc(cc->cc_cbuf_len, &cc->cc_cbuf);
+	if (ret)
+		return ret;
+
+	ret = ocfs2_malloc(chunkblks * ost->ost_bmpblksz, &buf);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < bmpchunks; i++) {
+		n = ocfs2_min((uint64_t)chunkblks,
+			      ost->ost_bmpblks - (i * chunkblks));
+		ret = image_read_chunk(ofs,
+				       &ost->ost_chunks[ost->ost_nr_chunks + i],
+				       buf, n * ost->ost_bmpblksz);
+		if (ret)
+			goto out;
+
+		for (j = 0; j < n; j++)
+			memcpy(ost->ost_bmparr[(i * chunkblks) + j].arr_map,
+			       buf + (j * ost->ost_bmpblksz),
+			       ost->ost_bmpblksz);
+	}
+
+out:
+	ocfs2_free(&buf);
+	return ret;
+}
+
+/* The bitmap is little-endian, like ocfs2_test_bit() */
+static inline uint64_t image_bitmap_word(char *map, int word)
+{
+	return le64_to_cpu(((uint64_t *)map)[word]);
+}
+
+/*
+ * Fill in arr_set_bit_cnt and arr_rank for every bitmap block, and
+ * return the number of bits set in all of them.  This must be redone
+ * after the bitmap changes.
+ */
+errcode_t ocfs2_image_count_bits(ocfs2_filesys *ofs, uint64_t *bits_set)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	int words = ost->ost_bmpblksz / sizeof(uint64_t);
+	ocfs2_image_bitmap_arr *arr;
+	uint64_t total = 0, word;
+	uint16_t rank;
+	errcode_t ret;
+	int i, j;
+
+	if (!ost->ost_rank) {
+		ret = ocfs2_malloc((uint64_t)ost->ost_bmpblks * words *
+				   sizeof(uint16_t), &ost->ost_rank);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < ost->ost_bmpblks; i++) {
+		arr = &ost->ost_bmparr[i];
+		arr->arr_set_bit_cnt = total;
+		arr->arr_rank = ost->ost_rank + ((uint64_t)i * words);
+
+		rank = 0;
+		for (j = 0; j < words; j++) {
+			arr->arr_rank[j] = rank;
+			word = image_bitmap_word(arr->arr_map, j);
+			rank += __builtin_popcountll(word);
+		}
+		total += rank;
+	}
+
+	if (bits_set)
+		*bits_set = total;
+	return 0;
+}
+
 /*
  * This routine loads bitmap blocks from an o2image image file into memory.
  * This process happens during file open. bitmap blocks reside towards
@@ -166,8 +628,8 @@ errcode_t ocfs2_image_load_bitmap(ocfs2_filesys *ofs)
 {
 	struct ocfs2_image_state *ost;
 	struct ocfs2_image_hdr *hdr;
-	uint64_t blk_off, bits_set;
-	int count, i, j, fd;
+	uint64_t blk_off;
+	int count, i, fd;
 	errcode_t ret;
 	char *blk;
 
@@ -204,35 +666,42 @@ errcode_t ocfs2_image_load_bitmap(ocfs2_filesys *ofs)
 	ost->ost_fsblksz 	= hdr->hdr_fsblksz;
 	ost->ost_imgblkcnt 	= hdr->hdr_imgblkcnt;
 	ost->ost_bmpblksz 	= hdr->hdr_bmpblksz;
+	ost->ost_version	= hdr->hdr_version;
+	ost->ost_chunkblks	= hdr->hdr_chunkblks;
 
 	ret = ocfs2_image_alloc_bitmap(ofs);
 	if (ret)
 		return ret;
 
+	if (ost->ost_version >= 2) {
+		ret = image_load_v2(ofs);
+		if (ret)
+			goto out;
+		goto count;
+	}
+
 	/* load bitmap blocks ocfs2 image state */
-	bits_set = 0;
 	fd 	= io_get_fd(ofs->fs_io);
 	blk_off = (ost->ost_imgblkcnt + 1) * ost->ost_fsblksz;
 
 	for (i = 0; i < ost->ost_bmpblks; i++) {
-		ost->ost_bmparr[i].arr_set_bit_cnt = bits_set;
 		/*
 		 * we don't use io_read_block as ocfs2 image bitmap block size
 		 * could be different from filesystem block size
 		 */
 		count = pread64(fd, ost->ost_bmparr[i].arr_map,
 				ost->ost_bmpblksz, blk_off);
-		if (count < ost->ost_bmpblksz)
+		if (count < ost->ost_bmpblksz) {
+			ret = OCFS2_ET_SHORT_READ;
 			goto out;
-
-		/* add bits set in this bitmap */
-		for (j = 0; j < (ost->ost_bmpblksz * 8); j++)
-			if (ocfs2_test_bit(j, ost->ost_bmparr[i].arr_map))
-				bits_set++;
+		}
 
 		blk_off += ost->ost_bmpblksz;
 	}
 
+count:
+	ret = ocfs2_image_count_bits(ofs, NULL);
+
 out:
 	if (blk)
 		ocfs2_free(&blk);
@@ -242,13 +711,16 @@ out:
 void ocfs2_image_mark_bitmap(ocfs2_filesys *ofs, uint64_t blkno)
 {
 	struct ocfs2_image_state *ost = ofs->ost;
+	unsigned char *map;
 	int bitmap_blk;
 	int bit;
 
 	bit = blkno % OCFS2_IMAGE_BITS_IN_BLOCK;
 	bitmap_blk = blkno / OCFS2_IMAGE_BITS_IN_BLOCK;
+	map = (unsigned char *)ost->ost_bmparr[bitmap_blk].arr_map;
 
-	ocfs2_set_bit(bit, ost->ost_bmparr[bitmap_blk].arr_map);
+	/* ocfs2_set_bit(), but o2image marks from several threads */
+	__sync_fetch_and_or(map + (bit >> 3), 1 << (bit & 0x07));
 }
 
 int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno)
@@ -266,26 +738,278 @@ int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno)
 		return 0;
 }
 
+/* Find chunk in the cache, or decompress it into the oldest slot */
+static errcode_t image_get_chunk(ocfs2_filesys *ofs, uint64_t chunk,
+				 char **buf)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	struct ocfs2_image_chunk_cache *cc = ost->ost_cache;
+	struct image_chunk_slot *slot, *victim = &cc->cc_slots[0];
+	uint64_t blocks;
+	errcode_t ret;
+	int i;
+
+	for (i = 0; i < IMAGE_CACHE_CHUNKS; i++) {
+		slot = &cc->cc_slots[i];
+		if (slot->cs_used && (slot->cs_chunk == chunk)) {
+			slot->cs_used = ++cc->cc_clock;
+			*buf = slot->cs_buf;
+			return 0;
+		}
+		if (slot->cs_used < victim->cs_used)
+			victim = slot;
+	}
+
+	if (chunk >= ost->ost_nr_chunks)
+		return OCFS2_ET_CORRUPT_IMAGE_FILE;
+
+	if (!victim->cs_buf) {
+		ret = ocfs2_malloc(ost->ost_chunkblks * ost->ost_fsblksz,
+				   &victim->cs_buf);
+		if (ret)
+			return ret;
+	}
+
+	blocks = ocfs2_min((uint64_t)ost->ost_chunkblks,
+			   ost->ost_imgblkcnt - (chunk * ost->ost_chunkblks));
+	victim->cs_used = 0;
+	ret = image_read_chunk(ofs, &ost->ost_chunks[chunk], victim->cs_buf,
+			       blocks * ost->ost_fsblksz);
+	if (ret)
+		return ret;
+
+	victim->cs_chunk = chunk;
+	victim->cs_used = ++cc->cc_clock;
+	*buf = victim->cs_buf;
+
+	return 0;
+}
+
+/*
+ * Read count blocks from a v2 image.  Like ocfs2_image_translate(), it
+ * fails if any of them is not in the image.  The blocks are in units of
+ * the channel's block size, which isn't the filesystem's while
+ * ocfs2_open() is still probing, so the read is done as a byte range.
+ */
+errcode_t ocfs2_image_read_blocks(ocfs2_filesys *ofs, uint64_t blkno,
+				  int count, char *data)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	struct ocfs2_image_chunk_cache *cc = ost->ost_cache;
+	uint64_t blksize = io_get_blksize(ofs->fs_io);
+	uint64_t off = blkno * blksize, len = count * blksize;
+	uint64_t fsblk, imgblk = 0, last = UINT64_MAX, boff, n;
+	errcode_t ret = 0;
+	char *buf;
+
+	pthread_mutex_lock(&cc->cc_lock);
+	while (len) {
+		fsblk = off / ost->ost_fsblksz;
+		boff = off % ost->ost_fsblksz;
+		n = ocfs2_min(len, ost->ost_fsblksz - boff);
+
+		if ((fsblk >= ost->ost_fsblkcnt) ||
+		    !ocfs2_image_test_bit(ofs, fsblk)) {
+			ret = OCFS2_ET_IO;
+			break;
+		}
+
+		/*
+		 * Image block 0 is the header.  Set blocks are stored in
+		 * order, so only the first one has to be looked up.
+		 */
+		if (last == UINT64_MAX)
+			imgblk = ocfs2_image_get_blockno(ofs, fsblk) - 1;
+		else if (fsblk != last)
+			imgblk++;
+		last = fsblk;
+
+		ret = image_get_chunk(ofs, imgblk / ost->ost_chunkblks, &buf);
+		if (ret)
+			break;
+
+		memcpy(data, buf + ((imgblk % ost->ost_chunkblks) *
+				    ost->ost_fsblksz) + boff, n);
+		data += n;
+		off += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&cc->cc_lock);
+
+	return ret;
+}
+
 uint64_t ocfs2_image_get_blockno(ocfs2_filesys *ofs, uint64_t blkno)
 {
 	struct ocfs2_image_state *ost = ofs->ost;
-	uint64_t ret_blk;
+	ocfs2_image_bitmap_arr *arr;
+	uint64_t ret_blk, word;
 	int bitmap_blk;
-	int i, bit;
+	int bit;
 
 	bit = blkno % OCFS2_IMAGE_BITS_IN_BLOCK;
 	bitmap_blk = blkno / OCFS2_IMAGE_BITS_IN_BLOCK;
+	arr = &ost->ost_bmparr[bitmap_blk];
 
-	if (ocfs2_test_bit(bit, ost->ost_bmparr[bitmap_blk].arr_map)) {
-		ret_blk = ost->ost_bmparr[bitmap_blk].arr_set_bit_cnt + 1;
-
+	if (ocfs2_test_bit(bit, arr->arr_map)) {
 		/* add bits set in this block before the block no */
-		for (i = 0; i < bit; i++)
-			if (ocfs2_test_bit(i,
-					   ost->ost_bmparr[bitmap_blk].arr_map))
-				ret_blk++;
+		word = image_bitmap_word(arr->arr_map, bit / 64);
+		word &= (1ULL << (bit % 64)) - 1;
+		ret_blk = arr->arr_set_bit_cnt + arr->arr_rank[bit / 64] +
+			__builtin_popcountll(word) + 1;
 	} else
 		ret_blk = -1;
 
 	return ret_blk;
 }
+
+
+#ifdef DEBUG_EXE
+/*
+ * Round-trips test chunks through every codec, then checks that every
+ * block in an image reads back the same as on the device it was taken
+ * from.
+ */
+static int check_codecs(void)
+{
+	uint32_t len = OCFS2_IMAGE_CHUNK_BLOCKS * 4096, clen, i;
+	char *src = NULL, *cbuf = NULL, *dst = NULL;
+	int c, t, bad = 0;
+	errcode_t ret;
+
+	if (ocfs2_malloc(len, &src) || ocfs2_malloc(len, &cbuf) ||
+	    ocfs2_malloc(len, &dst)) {
+		fprintf(stderr, "Unable to allocate test chunks\n");
+		bad = 1;
+		goto out;
+	}
+
+	/* Zeros, noise, and metadata-like runs with literals between */
+	for (t = 0; t < 3; t++) {
+		for (i = 0; i < len; i++) {
+			if (t == 0)
+				src[i] = 0;
+			else if (t == 1)
+				src[i] = rand();
+			else
+				src[i] = ((i % 512) < 48) ? rand() : 0;
+		}
+
+		for (c = 0; c < ARRAY_SIZE(image_codecs); c++) {
+			ret = image_codecs[c].ic_compress(src, len, cbuf,
+							  len, &clen);
+			if (ret == OCFS2_ET_NO_SPACE) {
+				fprintf(stdout, "codec %u test %d: no gain\n",
+					image_codecs[c].ic_id, t);
+				continue;
+			}
+			if (!ret)
+				ret = ocfs2_image_decompress(
+						image_codecs[c].ic_id, cbuf,
+						clen, dst, len);
+			if (ret || memcmp(src, dst, len)) {
+				fprintf(stdout, "codec %u test %d: FAILED\n",
+					image_codecs[c].ic_id, t);
+				bad = 1;
+				continue;
+			}
+			fprintf(stdout, "codec %u test %d: %u -> %u bytes\n",
+				image_codecs[c].ic_id, t, len, clen);
+		}
+	}
+
+out:
+	if (src)
+		ocfs2_free(&src);
+	if (cbuf)
+		ocfs2_free(&cbuf);
+	if (dst)
+		ocfs2_free(&dst);
+	return bad;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: image <device> <image-file>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	errcode_t ret;
+	uint64_t blkno, nr = 0, bad = 0;
+	char *dbuf = NULL, *ibuf = NULL;
+	ocfs2_filesys *fs = NULL, *ofs = NULL;
+
+	initialize_ocfs_error_table();
+
+	if (argc < 3) {
+		print_usage();
+		return 1;
+	}
+
+	if (check_codecs())
+		return 1;
+
+	ret = ocfs2_open(argv[1], OCFS2_FLAG_RO, 0, 0, &fs);
+	if (ret) {
+		com_err(argv[0], ret, "while opening \"%s\"", argv[1]);
+		goto out;
+	}
+
+	ret = ocfs2_open(argv[2], OCFS2_FLAG_RO | OCFS2_FLAG_IMAGE_FILE, 0, 0,
+			 &ofs);
+	if (ret) {
+		com_err(argv[0], ret, "while opening image \"%s\"", argv[2]);
+		goto out;
+	}
+
+	ret = ocfs2_malloc_block(fs->fs_io, &dbuf);
+	if (!ret)
+		ret = ocfs2_malloc_block(ofs->fs_io, &ibuf);
+	if (ret) {
+		com_err(argv[0], ret, "while allocating block buffers");
+		goto out;
+	}
+
+	for (blkno = 0; blkno < ofs->ost->ost_fsblkcnt; blkno++) {
+		if (!ocfs2_image_test_bit(ofs, blkno))
+			continue;
+
+		nr++;
+		ret = ocfs2_read_blocks(ofs, blkno, 1, ibuf);
+		if (ret) {
+			com_err(argv[0], ret, "while reading image block "
+				"%"PRIu64, blkno);
+			bad++;
+			continue;
+		}
+		ret = ocfs2_read_blocks(fs, blkno, 1, dbuf);
+		if (ret) {
+			com_err(argv[0], ret, "while reading block %"PRIu64,
+				blkno);
+			bad++;
+			continue;
+		}
+		if (memcmp(dbuf, ibuf, fs->fs_blocksize)) {
+			fprintf(stdout, "Block %"PRIu64" differs\n", blkno);
+			bad++;
+		}
+	}
+
+	fprintf(stdout, "Image version %"PRIu64", %"PRIu64" blocks "
+		"compared, %"PRIu64" bad\n", ofs->ost->ost_version, nr, bad);
+	ret = bad ? OCFS2_ET_CORRUPT_IMAGE_FILE : 0;
+
+out:
+	if (ibuf)
+		ocfs2_free(&ibuf);
+	if (dbuf)
+		ocfs2_free(&dbuf);
+	if (ofs)
+		ocfs2_close(ofs);
+	if (fs)
+		ocfs2_close(fs);
+
+	return ret ? 1 : 0;
+}
+#endif  /* DEBUG_EXE */
@@ -292,34 +292,33 @@ errcode_t ocfs2_read_inode(ocfs2_filesys *fs, uint64_t blkno,
 	    (blkno > fs->fs_blocks))
 		return OCFS2_ET_BAD_BLKNO;
 
-	ret = ocfs2_malloc_block(fs->fs_io, &blk);
+	/* Look at the cached copy; only a good inode is copied out */
+	ret = ocfs2_get_blocks(fs, blkno, 1, &blk);
 	if (ret)
 		return ret;
 
-	ret = ocfs2_read_blocks(fs, blkno, 1, blk);
-	if (ret)
-		goto out;
-
 	di = (struct ocfs2_dinode *)blk;
 
 	ret = OCFS2_ET_BAD_INODE_MAGIC;
 	if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
-		   strlen(OCFS2_INODE_SIGNATURE)))
+		   strlen(OCFS2_INODE_SIGNATURE))) {
+		ocfs2_put_blocks(fs, 1, &blk);
 		goto out;
+	}
 
 	memcpy(inode_buf, blk, fs->fs_blocksize);
+	ocfs2_put_blocks(fs, 1, &blk);
 
-	ret = ocfs2_validate_meta_ecc(fs, blk, &di->i_check);
+	/* The check may fix up the buffer, so it never runs on the cache */
+	di = (struct ocfs2_dinode *) inode_buf;
+	ret = ocfs2_validate_meta_ecc(fs, inode_buf, &di->i_check);
 	if (ret)
 		goto out;
 
-	di = (struct ocfs2_dinode *) inode_buf;
 	ocfs2_swap_inode_to_cpu(fs, di);
 
 	ret = 0;
 out:
-	ocfs2_free(&blk);
-
 	return ret;
 }
 
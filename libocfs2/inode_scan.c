@@ -32,6 +32,31 @@
 
 #include "extent_map.h"
 
+/*
+ * A run of inodes being read ahead of the caller.  The runs form a
+ * ring; the one at run_head is the one being handed out.
+ */
+enum inode_scan_run_state {
+	RUN_READING = 0,
+	RUN_READY,
+	RUN_ERROR,
+};
+
+struct inode_scan_run {
+	uint64_t r_blkno;
+	int r_blocks;
+	char *r_buf;
+	struct io_vec_unit r_ivu;
+	enum inode_scan_run_state r_state;
+	errcode_t r_ret;
+};
+
+/* One chain of one inode allocator, for partitioned scans */
+struct inode_scan_chain {
+	int sc_alloc;			/* Index into inode_alloc */
+	int sc_rec;			/* Index into cl_recs */
+};
+
 struct _ocfs2_inode_scan {
 	ocfs2_filesys *fs;
 	int num_inode_alloc;
@@ -44,15 +69,74 @@ struct _ocfs2_inode_scan {
 	unsigned int count;
 	uint64_t cur_blkno;
 	char *group_buffer;
-	char *cur_block;
+	char **block_bufs;		/* Where each block in the run lives */
+	uint64_t run_blkno;		/* First block of the run */
+	int cur_block;
 	int buffer_blocks;
 	int blocks_in_buffer;
+	int pinned_blocks;		/* block_bufs are pinned cache buffers */
 	unsigned int blocks_left;
 	uint64_t b_offset;		/* bit offset in the group bitmap. */
 	uint16_t cur_discontig_rec;	/* Only valid in discontig group. */
+
+	/*
+	 * Readahead.  The chain walking above runs ahead of the caller
+	 * by up to prefetch_depth runs, and their reads are in flight
+	 * while the caller works on the current one.
+	 */
+	int prefetch_depth;
+	struct inode_scan_run *runs;	/* prefetch_depth + 1 of them */
+	int run_head;
+	int runs_queued;		/* Including the one handed out */
+	int run_busy;			/* run_head is being handed out */
+	int walk_done;			/* No more runs to queue */
+
+	/*
+	 * The walk reads the next group descriptor ahead too, so it is
+	 * in the cache by the time the runs get there.
+	 */
+	char *next_desc_buf;
+	struct io_vec_unit next_desc_ivu;
+	int next_desc_reading;
+
+	/*
+	 * A partition of a scan only walks these chains.  When chains
+	 * is NULL, every chain of every allocator is walked.
+	 */
+	struct inode_scan_chain *chains;
+	int num_chains;
+	int next_chain;
 };
 
 
+static void wait_next_desc(ocfs2_inode_scan *scan)
+{
+	/* A failed read is left for ocfs2_read_group_desc() to report */
+	if (scan->next_desc_reading)
+		io_vec_wait(scan->fs->fs_io, &scan->next_desc_ivu);
+	scan->next_desc_reading = 0;
+}
+
+/* The next group in this chain, or else the head of the next chain */
+static void prefetch_next_desc(ocfs2_inode_scan *scan)
+{
+	struct ocfs2_chain_list *cl =
+		&scan->cur_inode_alloc->ci_inode->id2.i_chain;
+	uint64_t blkno = scan->cur_desc->bg_next_group;
+
+	if (!blkno && !scan->chains && (scan->next_rec < cl->cl_next_free_rec))
+		blkno = cl->cl_recs[scan->next_rec].c_blkno;
+
+	if (!scan->next_desc_buf || !blkno || (blkno > scan->fs->fs_blocks))
+		return;
+
+	scan->next_desc_ivu.ivu_blkno = blkno;
+	scan->next_desc_ivu.ivu_buf = scan->next_desc_buf;
+	scan->next_desc_ivu.ivu_buflen = scan->fs->fs_blocksize;
+	if (!io_vec_submit(scan->fs->fs_io, &scan->next_desc_ivu, 1))
+		scan->next_desc_reading = 1;
+}
+
 /*
  * This function is called by fill_group_buffer when an alloc group has
  * been completely read.  It must not be called from the last group.
@@ -82,6 +166,7 @@ static errcode_t get_next_group(ocfs2_inode_scan *scan)
 	if (!scan->cur_blkno)
 		abort();
 
+	wait_next_desc(scan);
 	ret = ocfs2_read_group_desc(scan->fs, scan->cur_blkno,
 				    (char *)scan->cur_desc);
 	if (ret)
@@ -90,6 +175,8 @@ static errcode_t get_next_group(ocfs2_inode_scan *scan)
 	if (scan->cur_desc->bg_blkno != scan->cur_blkno)
 		return OCFS2_ET_CORRUPT_GROUP_DESC;
 
+	prefetch_next_desc(scan);
+
 	/* Skip past group descriptor block */
 	scan->cur_blkno++;
 	scan->count++;
@@ -180,46 +267,227 @@ out:
 	return num_blocks;
 }
 
+static void put_group_buffer(ocfs2_inode_scan *scan)
+{
+	if (scan->pinned_blocks)
+		ocfs2_put_blocks(scan->fs, scan->pinned_blocks,
+				 scan->block_bufs);
+	scan->pinned_blocks = 0;
+}
+
+static int get_next_inode_alloc(ocfs2_inode_scan *scan);
+
+/*
+ * Walk the inode allocators to the next run of inode blocks.  The
+ * chain, group, and block counters all describe the walk, which can be
+ * ahead of what ocfs2_get_next_inode() has returned.  *num_blocks is 0
+ * when there are no more inodes.
+ */
+static errcode_t get_next_run(ocfs2_inode_scan *scan, uint64_t *blkno,
+			      int *num_blocks)
+{
+	errcode_t ret;
+	int num;
+
+	*num_blocks = 0;
+	do {
+		if (!scan->blocks_left && get_next_inode_alloc(scan))
+			return 0;  /* Out of inodes */
+
+		if (scan->cur_rec &&
+		    (scan->count > scan->cur_rec->c_total))
+			abort();
+
+		if (scan->cur_rec &&
+		    (scan->b_offset > scan->cur_desc->bg_bits))
+			abort();
+
+		if (!scan->cur_rec ||
+		    (scan->count == scan->cur_rec->c_total)) {
+			ret = get_next_chain(scan);
+			if (ret)
+				return ret;
+		}
+
+		if (!scan->b_offset ||
+		    (scan->b_offset == scan->cur_desc->bg_bits)) {
+			ret = get_next_group(scan);
+			if (ret)
+				return ret;
+		}
+
+		num = get_next_read_blocks(scan);
+		if (num > scan->blocks_left)
+			num = scan->blocks_left;
+	} while (!num);
+
+	*blkno = scan->cur_blkno;
+	*num_blocks = num;
+
+	scan->b_offset += num;
+	scan->cur_blkno += num;
+	scan->count += num;
+	scan->blocks_left -= num;
+
+	return 0;
+}
+
+static void set_run_buffers(ocfs2_inode_scan *scan, char *buf)
+{
+	int i;
+
+	for (i = 0; i < scan->buffer_blocks; i++)
+		scan->block_bufs[i] = buf + ((size_t)i * scan->fs->fs_blocksize);
+}
+
+/* Queue up reads until prefetch_depth runs are ahead of the caller */
+static void queue_runs(ocfs2_inode_scan *scan)
+{
+	errcode_t ret;
+	int nr_runs = scan->prefetch_depth + 1;
+	struct inode_scan_run *run;
+
+	while (!scan->walk_done && (scan->runs_queued < nr_runs)) {
+		run = &scan->runs[(scan->run_head + scan->runs_queued) %
+				  nr_runs];
+
+		ret = get_next_run(scan, &run->r_blkno, &run->r_blocks);
+		if (!ret && !run->r_blocks) {
+			scan->walk_done = 1;
+			break;
+		}
+
+		if (!ret) {
+			run->r_ivu.ivu_blkno = run->r_blkno;
+			run->r_ivu.ivu_buf = run->r_buf;
+			run->r_ivu.ivu_buflen =
+				run->r_blocks * scan->fs->fs_blocksize;
+			ret = io_vec_submit(scan->fs->fs_io, &run->r_ivu, 1);
+		}
+
+		/*
+		 * A bad chain stops the walk.  The caller sees the
+		 * error when it gets to this run.
+		 */
+		if (ret) {
+			run->r_state = RUN_ERROR;
+			run->r_ret = ret;
+			scan->walk_done = 1;
+		} else
+			run->r_state = RUN_READING;
+		scan->runs_queued++;
+	}
+}
+
+static errcode_t fill_prefetched_buffer(ocfs2_inode_scan *scan)
+{
+	errcode_t ret;
+	struct inode_scan_run *run;
+
+	if (scan->run_busy) {
+		scan->run_head = (scan->run_head + 1) %
+			(scan->prefetch_depth + 1);
+		scan->runs_queued--;
+		scan->run_busy = 0;
+	}
+
+	queue_runs(scan);
+	if (!scan->runs_queued)
+		return 0;
+
+	run = &scan->runs[scan->run_head];
+	if (run->r_state == RUN_READING) {
+		ret = io_vec_wait(scan->fs->fs_io, &run->r_ivu);
+		if (ret) {
+			run->r_state = RUN_ERROR;
+			run->r_ret = ret;
+		} else
+			run->r_state = RUN_READY;
+	}
+
+	/* A failed run is reported once; the next call moves past it */
+	scan->run_busy = 1;
+	if (run->r_state == RUN_ERROR)
+		return run->r_ret;
+
+	set_run_buffers(scan, run->r_buf);
+	scan->run_blkno = run->r_blkno;
+	scan->blocks_in_buffer = run->r_blocks;
+	scan->cur_block = 0;
+
+	return 0;
+}
+
 /*
  * This function is called by ocfs2_get_next_inode when it needs
- * to read in more clusters from the current inode alloc file.  It
- * must not be called when the current inode alloc file has been read
- * in its entirety.  This condition is detected by
- * ocfs2_get_next_inode().
+ * to read in more clusters.  scan->blocks_in_buffer is left at zero
+ * when every inode alloc file has been read in its entirety.
  */
 static errcode_t fill_group_buffer(ocfs2_inode_scan *scan)
 {
 	errcode_t ret;
+	uint64_t blkno;
 	int num_blocks;
 
-	if (scan->cur_rec && (scan->count > scan->cur_rec->c_total))
-		abort();
+	if (scan->prefetch_depth)
+		return fill_prefetched_buffer(scan);
 
-	if (scan->cur_rec && (scan->b_offset > scan->cur_desc->bg_bits))
-		abort();
+	ret = get_next_run(scan, &blkno, &num_blocks);
+	if (ret || !num_blocks)
+		return ret;
 
-	if (!scan->cur_rec || (scan->count == scan->cur_rec->c_total)) {
-		ret = get_next_chain(scan);
+	put_group_buffer(scan);
+	if (!scan->group_buffer) {
+		/* Walk the cache's copies of the run instead of copying */
+		ret = ocfs2_get_blocks(scan->fs, blkno, num_blocks,
+				       scan->block_bufs);
 		if (ret)
 			return ret;
-	}
-	
-	if (!scan->b_offset || (scan->b_offset == scan->cur_desc->bg_bits)) {
-		ret = get_next_group(scan);
+		scan->pinned_blocks = num_blocks;
+	} else {
+		ret = ocfs2_read_blocks(scan->fs, blkno, num_blocks,
+					scan->group_buffer);
 		if (ret)
 			return ret;
 	}
 
-	num_blocks = get_next_read_blocks(scan);
+	scan->run_blkno = blkno;
+	scan->blocks_in_buffer = num_blocks;
+	scan->cur_block = 0;
 
-	ret = ocfs2_read_blocks(scan->fs, scan->cur_blkno, num_blocks,
-				scan->group_buffer);
-	if (ret)
-		return ret;
+	return 0;
+}
 
-	scan->b_offset += num_blocks;
-	scan->blocks_in_buffer = num_blocks;
-	scan->cur_block = scan->group_buffer;
+static struct ocfs2_chain_rec *scan_chain_rec(ocfs2_inode_scan *scan,
+					       struct inode_scan_chain *sc)
+{
+	struct ocfs2_dinode *di = scan->inode_alloc[sc->sc_alloc]->ci_inode;
+
+	return &di->id2.i_chain.cl_recs[sc->sc_rec];
+}
+
+/*
+ * A partition walks its chains one at a time, so each chain looks like
+ * an allocator with a single chain record.
+ */
+static int get_next_scan_chain(ocfs2_inode_scan *scan)
+{
+	struct inode_scan_chain *sc;
+
+	do {
+		if (scan->next_chain == scan->num_chains)
+			return 1;  /* Out of chains */
+
+		sc = &scan->chains[scan->next_chain];
+		scan->next_chain++;
+	} while (!scan_chain_rec(scan, sc)->c_total);
+
+	scan->cur_inode_alloc = scan->inode_alloc[sc->sc_alloc];
+	scan->next_rec = sc->sc_rec;
+	scan->count = 0;
+	scan->cur_blkno = 0;
+	scan->cur_rec = NULL;
+	scan->blocks_left = scan_chain_rec(scan, sc)->c_total;
 
 	return 0;
 }
@@ -232,6 +500,9 @@ static int get_next_inode_alloc(ocfs2_inode_scan *scan)
 	if (cinode && scan->blocks_left)
 		abort();
 
+	if (scan->chains)
+		return get_next_scan_chain(scan);
+
 	do {
 		if (scan->next_inode_file == scan->num_inode_alloc)
 			return 1;  /* Out of files */
@@ -262,6 +533,12 @@ uint64_t ocfs2_get_max_inode_count(ocfs2_inode_scan *scan)
 	if (!scan || !scan->num_inode_alloc)
 		return 0;
 
+	if (scan->chains) {
+		for (i = 0; i < scan->num_chains; i++)
+			count += scan_chain_rec(scan, &scan->chains[i])->c_total;
+		return count;
+	}
+
 	for (i = 0; i < scan->num_inode_alloc; i++) {
 		if (scan->inode_alloc[i])
 			di = scan->inode_alloc[i]->ci_inode;
@@ -279,37 +556,37 @@ errcode_t ocfs2_get_next_inode(ocfs2_inode_scan *scan,
 {
 	errcode_t ret;
 
-	if (!scan->blocks_left) {
-		if (scan->blocks_in_buffer)
-			abort();
-
-		if (get_next_inode_alloc(scan)) {
-			*blkno = 0;
-			return 0;
-		}
-	}
-
 	if (!scan->blocks_in_buffer) {
 		ret = fill_group_buffer(scan);
 		if (ret)
 			return ret;
+
+		if (!scan->blocks_in_buffer) {
+			*blkno = 0;
+			return 0;
+		}
 	}
 	
 	/* the caller swap after verifying the inode's signature */
-	memcpy(inode, scan->cur_block, scan->fs->fs_blocksize);
+	memcpy(inode, scan->block_bufs[scan->cur_block],
+	       scan->fs->fs_blocksize);
 
-	scan->cur_block += scan->fs->fs_blocksize;
+	*blkno = scan->run_blkno + scan->cur_block;
+	scan->cur_block++;
 	scan->blocks_in_buffer--;
-	scan->blocks_left--;
-	*blkno = scan->cur_blkno;
-	scan->cur_blkno++;
-	scan->count++;
 
 	return 0;
 }
 
 errcode_t ocfs2_open_inode_scan(ocfs2_filesys *fs,
 				ocfs2_inode_scan **ret_scan)
+{
+	return ocfs2_open_inode_scan_prefetch(fs, 0, ret_scan);
+}
+
+errcode_t ocfs2_open_inode_scan_prefetch(ocfs2_filesys *fs,
+					 int prefetch_depth,
+					 ocfs2_inode_scan **ret_scan)
 {
 	ocfs2_inode_scan *scan;
 	uint64_t blkno;
@@ -339,11 +616,53 @@ errcode_t ocfs2_open_inode_scan(ocfs2_filesys *fs,
 #define OPEN_SCAN_BUFFER_SIZE	(4 * 1024 * 1024)
 	scan->buffer_blocks = OPEN_SCAN_BUFFER_SIZE / fs->fs_blocksize;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, scan->buffer_blocks,
-				  &scan->group_buffer);
+	ret = ocfs2_malloc0(sizeof(char *) * scan->buffer_blocks,
+			    &scan->block_bufs);
 	if (ret)
 		goto out_inode_files;
 
+	/* Image files need their block numbers translated on every read */
+	if ((prefetch_depth < 0) || (fs->fs_flags & OCFS2_FLAG_IMAGE_FILE))
+		prefetch_depth = 0;
+	scan->prefetch_depth = prefetch_depth;
+
+	if (prefetch_depth) {
+		ret = ocfs2_malloc0(sizeof(struct inode_scan_run) *
+				    (prefetch_depth + 1), &scan->runs);
+		if (ret)
+			goto out_cleanup;
+
+		for (i = 0; i <= prefetch_depth; i++) {
+			ret = ocfs2_malloc_blocks(fs->fs_io,
+						  scan->buffer_blocks,
+						  &scan->runs[i].r_buf);
+			if (ret)
+				goto out_cleanup;
+		}
+
+		/* Uncached, the descriptor would just be read twice */
+		if (io_get_cache_size(fs->fs_io)) {
+			ret = ocfs2_malloc_block(fs->fs_io,
+						 &scan->next_desc_buf);
+			if (ret)
+				goto out_cleanup;
+		}
+	} else if (io_get_cache_size(fs->fs_io) <
+		   (4 * OPEN_SCAN_BUFFER_SIZE)) {
+		/*
+		 * With a cache big enough to hold a few runs, the scan
+		 * pins the cached blocks rather than copying each run into
+		 * a buffer of its own.  Otherwise the runs would just
+		 * churn the cache.
+		 */
+		ret = ocfs2_malloc_blocks(fs->fs_io, scan->buffer_blocks,
+					  &scan->group_buffer);
+		if (ret)
+			goto out_cleanup;
+
+		set_run_buffers(scan, scan->group_buffer);
+	}
+
 	ret = ocfs2_lookup_system_inode(fs,
 					GLOBAL_INODE_ALLOC_SYSTEM_INODE,
 					0, &blkno);
@@ -391,9 +710,136 @@ out_cleanup:
 	return ret;
 }
 
+struct scan_chain_load {
+	struct inode_scan_chain cl_chain;
+	uint32_t cl_total;
+};
+
+/* Largest chains first, so the greedy split comes out even */
+static int scan_chain_load_cmp(const void *a, const void *b)
+{
+	const struct scan_chain_load *l = a, *r = b;
+
+	if (l->cl_total > r->cl_total)
+		return -1;
+	if (l->cl_total < r->cl_total)
+		return 1;
+	return 0;
+}
+
+/* Within a partition, walk the chains in disk order */
+static int scan_chain_cmp(const void *a, const void *b)
+{
+	const struct inode_scan_chain *l = a, *r = b;
+
+	if (l->sc_alloc != r->sc_alloc)
+		return l->sc_alloc - r->sc_alloc;
+	return l->sc_rec - r->sc_rec;
+}
+
+/*
+ * Split the inode scan into nparts scans that, together, return every
+ * inode exactly once.  The unit of work is an allocator chain; the
+ * chains are dealt out so that each partition gets about the same
+ * number of inode blocks.  A partition can get no chains at all.
+ *
+ * Each partition has its own allocator inodes and buffers, so the
+ * partitions can be walked from separate threads.  They do share
+ * fs->fs_io, whose cache is thread safe.  They don't read ahead; the
+ * vectored read queue belongs to one thread.  Close each with
+ * ocfs2_close_inode_scan().
+ */
+errcode_t ocfs2_open_inode_scan_partitioned(ocfs2_filesys *fs, int nparts,
+					    ocfs2_inode_scan **scans)
+{
+	errcode_t ret;
+	int i, j, a, nr_chains = 0, least;
+	uint64_t *loads = NULL;
+	struct ocfs2_dinode *di;
+	struct scan_chain_load *cl = NULL;
+	ocfs2_inode_scan *scan;
+
+	if (nparts < 1)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	memset(scans, 0, sizeof(ocfs2_inode_scan *) * nparts);
+	for (i = 0; i < nparts; i++) {
+		ret = ocfs2_open_inode_scan_prefetch(fs, 0, &scans[i]);
+		if (ret)
+			goto out;
+	}
+
+	/* Every partition read the same allocators; count from the first */
+	scan = scans[0];
+	for (a = 0; a < scan->num_inode_alloc; a++) {
+		di = scan->inode_alloc[a]->ci_inode;
+		if (di->id1.bitmap1.i_total)
+			nr_chains += di->id2.i_chain.cl_next_free_rec;
+	}
+
+	ret = ocfs2_malloc0(sizeof(struct scan_chain_load) * (nr_chains + 1),
+			    &cl);
+	if (ret)
+		goto out;
+	ret = ocfs2_malloc0(sizeof(uint64_t) * nparts, &loads);
+	if (ret)
+		goto out;
+
+	for (a = 0, j = 0; a < scan->num_inode_alloc; a++) {
+		di = scan->inode_alloc[a]->ci_inode;
+		if (!di->id1.bitmap1.i_total)
+			continue;
+		for (i = 0; i < di->id2.i_chain.cl_next_free_rec; i++, j++) {
+			cl[j].cl_chain.sc_alloc = a;
+			cl[j].cl_chain.sc_rec = i;
+			cl[j].cl_total = di->id2.i_chain.cl_recs[i].c_total;
+		}
+	}
+	qsort(cl, nr_chains, sizeof(struct scan_chain_load),
+	      scan_chain_load_cmp);
+
+	/*
+	 * Each partition gets room for every chain; it keeps the empty
+	 * chain list non-NULL so that it doesn't fall back to a full walk.
+	 */
+	for (i = 0; i < nparts; i++) {
+		ret = ocfs2_malloc0(sizeof(struct inode_scan_chain) *
+				    (nr_chains + 1), &scans[i]->chains);
+		if (ret)
+			goto out;
+	}
+
+	for (j = 0; j < nr_chains; j++) {
+		least = 0;
+		for (i = 1; i < nparts; i++)
+			if (loads[i] < loads[least])
+				least = i;
+		scan = scans[least];
+		scan->chains[scan->num_chains++] = cl[j].cl_chain;
+		loads[least] += cl[j].cl_total;
+	}
+
+	for (i = 0; i < nparts; i++)
+		qsort(scans[i]->chains, scans[i]->num_chains,
+		      sizeof(struct inode_scan_chain), scan_chain_cmp);
+
+out:
+	if (ret) {
+		for (i = 0; i < nparts; i++) {
+			ocfs2_close_inode_scan(scans[i]);
+			scans[i] = NULL;
+		}
+	}
+	ocfs2_free(&loads);
+	ocfs2_free(&cl);
+
+	return ret;
+}
+
 void ocfs2_close_inode_scan(ocfs2_inode_scan *scan)
 {
 	int i;
+	struct inode_scan_run *run;
 
 	if (!scan)
 		return;
@@ -405,6 +851,27 @@ void ocfs2_close_inode_scan(ocfs2_inode_scan *scan)
 		}
 	}
 
+	put_group_buffer(scan);
+
+	if (scan->runs) {
+		/* The reads have to land before their buffers go away */
+		for (i = 0; i < scan->runs_queued; i++) {
+			run = &scan->runs[(scan->run_head + i) %
+					  (scan->prefetch_depth + 1)];
+			if (run->r_state == RUN_READING)
+				io_vec_wait(scan->fs->fs_io, &run->r_ivu);
+		}
+		for (i = 0; i <= scan->prefetch_depth; i++)
+			if (scan->runs[i].r_buf)
+				ocfs2_free(&scan->runs[i].r_buf);
+		ocfs2_free(&scan->runs);
+	}
+
+	wait_next_desc(scan);
+	ocfs2_free(&scan->next_desc_buf);
+
+	ocfs2_free(&scan->chains);
+	ocfs2_free(&scan->block_bufs);
 	ocfs2_free(&scan->group_buffer);
 	ocfs2_free(&scan->cur_desc);
 	ocfs2_free(&scan->inode_alloc);
@@ -0,0 +1,449 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * name_index.c
+ *
+ * Map inodes back to the names that refer to them.  For the OCFS2
+ * userspace library.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * --
+ *
+ * The namespace is walked once, breadth first from the system directory
+ * and the root.  Every name found becomes an entry holding the inode,
+ * the directory it lives in, and the name itself.  The entries are then
+ * sorted by inode, so any batch of inodes can be resolved without
+ * walking the directories again.  A path is rebuilt by following the
+ * parents back up to "//" or "/".
+ *
+ * A caller that only wants certain inodes can stop the walk as soon as
+ * each of them has a name.  Names are found in the same order either
+ * way, so the first name of a wanted inode doesn't change.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "ocfs2/ocfs2.h"
+
+
+struct name_entry {
+	uint64_t	ne_ino;
+	uint64_t	ne_parent;	/* 0 for "//" and "/" */
+	uint64_t	ne_name;	/* Offset into ni_names */
+	uint8_t		ne_name_len;
+	uint8_t		ne_file_type;
+};
+
+struct _ocfs2_name_index {
+	ocfs2_filesys		*ni_fs;
+	struct name_entry	*ni_entries;
+	uint64_t		ni_nr;
+	uint64_t		ni_max;
+	char			*ni_names;	/* Not NUL terminated */
+	uint64_t		ni_names_len;
+	uint64_t		ni_names_max;
+
+	/* The path handed to iterate callbacks */
+	char			*ni_path;
+	size_t			ni_path_max;
+
+	/* While building, the directory being walked */
+	uint64_t		ni_dir;
+	errcode_t		ni_err;
+
+	/* While building for some inodes, those still without a name */
+	uint64_t		*ni_wanted;	/* Sorted */
+	char			*ni_named;
+	uint64_t		ni_nr_wanted;
+	uint64_t		ni_unnamed;
+};
+
+static int blkno_cmp(const void *a, const void *b)
+{
+	const uint64_t *l = a, *r = b;
+
+	if (*l < *r)
+		return -1;
+	if (*l > *r)
+		return 1;
+	return 0;
+}
+
+static void name_found(ocfs2_name_index *ni, uint64_t ino)
+{
+	uint64_t *p;
+
+	if (!ni->ni_unnamed)
+		return;
+
+	p = bsearch(&ino, ni->ni_wanted, ni->ni_nr_wanted, sizeof(uint64_t),
+		    blkno_cmp);
+	if (p && !ni->ni_named[p - ni->ni_wanted]) {
+		ni->ni_named[p - ni->ni_wanted] = 1;
+		ni->ni_unnamed--;
+	}
+}
+
+static errcode_t name_add(ocfs2_name_index *ni, uint64_t ino,
+			  uint64_t parent, const char *name, int name_len,
+			  int file_type)
+{
+	errcode_t ret;
+	uint64_t max;
+	struct name_entry *ne;
+
+	if (ni->ni_nr == ni->ni_max) {
+		max = ni->ni_max ? ni->ni_max * 2 : 1024;
+		ret = ocfs2_realloc(max * sizeof(struct name_entry),
+				    &ni->ni_entries);
+		if (ret)
+			return ret;
+		ni->ni_max = max;
+	}
+
+	if (ni->ni_names_len + name_len > ni->ni_names_max) {
+		max = ni->ni_names_max ? ni->ni_names_max * 2 : 16384;
+		while (max < ni->ni_names_len + name_len)
+			max *= 2;
+		ret = ocfs2_realloc(max, &ni->ni_names);
+		if (ret)
+			return ret;
+		ni->ni_names_max = max;
+	}
+
+	ne = &ni->ni_entries[ni->ni_nr++];
+	ne->ne_ino = ino;
+	ne->ne_parent = parent;
+	ne->ne_name = ni->ni_names_len;
+	ne->ne_name_len = name_len;
+	ne->ne_file_type = file_type;
+
+	memcpy(ni->ni_names + ni->ni_names_len, name, name_len);
+	ni->ni_names_len += name_len;
+
+	name_found(ni, ino);
+
+	return 0;
+}
+
+static int name_add_func(struct ocfs2_dir_entry *dentry, uint64_t blocknr,
+			 int offset, int blocksize, char *buf,
+			 void *priv_data)
+{
+	ocfs2_name_index *ni = priv_data;
+
+	/* A corrupt entry can't be followed, so don't name it */
+	if (!dentry->inode || (dentry->inode >= ni->ni_fs->fs_blocks))
+		return 0;
+
+	ni->ni_err = name_add(ni, dentry->inode, ni->ni_dir, dentry->name,
+			      dentry->name_len, dentry->file_type);
+
+	return ni->ni_err ? OCFS2_DIRENT_ABORT : 0;
+}
+
+/* By inode, and then in the order the names were found */
+static int name_entry_cmp(const void *a, const void *b)
+{
+	const struct name_entry *l = a, *r = b;
+
+	if (l->ne_ino != r->ne_ino)
+		return l->ne_ino < r->ne_ino ? -1 : 1;
+	if (l->ne_name != r->ne_name)
+		return l->ne_name < r->ne_name ? -1 : 1;
+	return 0;
+}
+
+errcode_t ocfs2_name_index_build_for(ocfs2_filesys *fs, uint64_t *inos,
+				     uint64_t nr_inos,
+				     ocfs2_name_index **ret_ni)
+{
+	errcode_t ret;
+	uint64_t i;
+	int was_set;
+	ocfs2_name_index *ni = NULL;
+	ocfs2_bitmap *walked = NULL;
+	struct name_entry *ne;
+
+	ret = ocfs2_malloc0(sizeof(struct _ocfs2_name_index), &ni);
+	if (ret)
+		goto out;
+	ni->ni_fs = fs;
+
+	if (nr_inos) {
+		ret = ocfs2_malloc(sizeof(uint64_t) * nr_inos,
+				   &ni->ni_wanted);
+		if (ret)
+			goto out;
+		ret = ocfs2_malloc0(nr_inos, &ni->ni_named);
+		if (ret)
+			goto out;
+		memcpy(ni->ni_wanted, inos, sizeof(uint64_t) * nr_inos);
+		qsort(ni->ni_wanted, nr_inos, sizeof(uint64_t), blkno_cmp);
+		ni->ni_nr_wanted = nr_inos;
+		ni->ni_unnamed = nr_inos;
+	}
+
+	ret = ocfs2_block_bitmap_new(fs, "walked directories", &walked);
+	if (ret)
+		goto out;
+
+	ret = name_add(ni, fs->fs_sysdir_blkno, 0, "//", 2, OCFS2_FT_DIR);
+	if (!ret)
+		ret = name_add(ni, fs->fs_root_blkno, 0, "/", 1, OCFS2_FT_DIR);
+	if (ret)
+		goto out;
+
+	/*
+	 * The entries double as the queue of directories to walk.  A
+	 * directory is only walked the first time it is found, so a
+	 * damaged tree can't send us around in circles.
+	 */
+	for (i = 0; i < ni->ni_nr; i++) {
+		if (ni->ni_nr_wanted && !ni->ni_unnamed)
+			break;
+
+		ne = &ni->ni_entries[i];
+		if (ne->ne_file_type != OCFS2_FT_DIR)
+			continue;
+
+		ret = ocfs2_bitmap_set(walked, ne->ne_ino, &was_set);
+		if (ret)
+			goto out;
+		if (was_set)
+			continue;
+
+		/*
+		 * A directory that can't be read just leaves its
+		 * children without names.
+		 */
+		ni->ni_dir = ne->ne_ino;
+		ocfs2_dir_iterate(fs, ni->ni_dir,
+				  OCFS2_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
+				  name_add_func, ni);
+		if (ni->ni_err) {
+			ret = ni->ni_err;
+			goto out;
+		}
+	}
+
+	qsort(ni->ni_entries, ni->ni_nr, sizeof(struct name_entry),
+	      name_entry_cmp);
+
+	*ret_ni = ni;
+	ni = NULL;
+
+out:
+	if (walked)
+		ocfs2_bitmap_free(walked);
+	if (ni)
+		ocfs2_name_index_free(ni);
+
+	return ret;
+}
+
+errcode_t ocfs2_name_index_build(ocfs2_filesys *fs,
+				 ocfs2_name_index **ret_ni)
+{
+	return ocfs2_name_index_build_for(fs, NULL, 0, ret_ni);
+}
+
+/* Index of the first entry for ino, or ni_nr */
+static uint64_t name_search(ocfs2_name_index *ni, uint64_t ino)
+{
+	uint64_t lo = 0, hi = ni->ni_nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ni->ni_entries[mid].ne_ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ((lo < ni->ni_nr) && (ni->ni_entries[lo].ne_ino == ino))
+		return lo;
+	return ni->ni_nr;
+}
+
+/* The name a directory was walked under is the first one found */
+static struct name_entry *name_dir(ocfs2_name_index *ni, uint64_t ino)
+{
+	uint64_t i;
+
+	for (i = name_search(ni, ino);
+	     (i < ni->ni_nr) && (ni->ni_entries[i].ne_ino == ino); i++) {
+		if (ni->ni_entries[i].ne_file_type == OCFS2_FT_DIR)
+			return &ni->ni_entries[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Fill ni_path from the back.  Each parent was walked before its
+ * children were found, so following them always ends at "//" or "/".
+ */
+static errcode_t name_path(ocfs2_name_index *ni, struct name_entry *ne)
+{
+	errcode_t ret;
+	struct name_entry *p, *parent;
+	size_t len = 0, pos;
+
+	for (p = ne; p->ne_parent; p = parent) {
+		parent = name_dir(ni, p->ne_parent);
+		if (!parent)
+			return OCFS2_ET_FILE_NOT_FOUND;
+		len += p->ne_name_len + 1;
+	}
+	len += p->ne_name_len;
+
+	/* The separator after "//" or "/" isn't needed */
+	if (ne->ne_parent)
+		len--;
+
+	if (len + 1 > ni->ni_path_max) {
+		ret = ocfs2_realloc(len + 1, &ni->ni_path);
+		if (ret)
+			return ret;
+		ni->ni_path_max = len + 1;
+	}
+
+	pos = len;
+	ni->ni_path[pos] = '\0';
+	for (p = ne; ; p = parent) {
+		pos -= p->ne_name_len;
+		memcpy(ni->ni_path + pos, ni->ni_names + p->ne_name,
+		       p->ne_name_len);
+		if (!p->ne_parent)
+			break;
+		parent = name_dir(ni, p->ne_parent);
+		if (parent->ne_parent)
+			ni->ni_path[--pos] = '/';
+	}
+
+	return 0;
+}
+
+errcode_t ocfs2_name_index_iterate(ocfs2_name_index *ni, uint64_t ino,
+				   int (*func)(uint64_t ino, char *path,
+					       int file_type,
+					       void *priv_data),
+				   void *priv_data)
+{
+	errcode_t ret;
+	uint64_t i;
+	struct name_entry *ne;
+
+	i = name_search(ni, ino);
+	if (i == ni->ni_nr)
+		return OCFS2_ET_FILE_NOT_FOUND;
+
+	for (; (i < ni->ni_nr) && (ni->ni_entries[i].ne_ino == ino); i++) {
+		ne = &ni->ni_entries[i];
+		ret = name_path(ni, ne);
+		if (ret == OCFS2_ET_FILE_NOT_FOUND)
+			continue;
+		if (ret)
+			return ret;
+
+		if (func(ino, ni->ni_path, ne->ne_file_type,
+			 priv_data) & OCFS2_NAME_ABORT)
+			break;
+	}
+
+	return 0;
+}
+
+void ocfs2_name_index_free(ocfs2_name_index *ni)
+{
+	if (ni->ni_entries)
+		ocfs2_free(&ni->ni_entries);
+	if (ni->ni_names)
+		ocfs2_free(&ni->ni_names);
+	if (ni->ni_path)
+		ocfs2_free(&ni->ni_path);
+	if (ni->ni_wanted)
+		ocfs2_free(&ni->ni_wanted);
+	if (ni->ni_named)
+		ocfs2_free(&ni->ni_named);
+	ocfs2_free(&ni);
+}
+
+
+#ifdef DEBUG_EXE
+#include <stdio.h>
+
+static int print_name(uint64_t ino, char *path, int file_type,
+		      void *priv_data)
+{
+	fprintf(stdout, "%"PRIu64"\t%s\n", ino, path);
+	return 0;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"Usage: name_index <filename> <inode_blkno> ...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	errcode_t ret;
+	int i;
+	uint64_t blkno;
+	char *ptr;
+	ocfs2_filesys *fs;
+	ocfs2_name_index *ni;
+
+	initialize_ocfs_error_table();
+
+	if (argc < 3) {
+		print_usage();
+		return 1;
+	}
+
+	ret = ocfs2_open(argv[1], OCFS2_FLAG_RO, 0, 0, &fs);
+	if (ret) {
+		com_err(argv[0], ret, "while opening file \"%s\"", argv[1]);
+		return 1;
+	}
+
+	ret = ocfs2_name_index_build(fs, &ni);
+	if (ret) {
+		com_err(argv[0], ret, "while indexing names");
+		goto out_close;
+	}
+
+	for (i = 2; i < argc; i++) {
+		blkno = strtoull(argv[i], &ptr, 0);
+		if (*ptr) {
+			fprintf(stderr, "Invalid inode block: %s\n",
+				argv[i]);
+			continue;
+		}
+
+		ret = ocfs2_name_index_iterate(ni, blkno, print_name, NULL);
+		if (ret)
+			com_err(argv[0], ret, "while naming inode %"PRIu64,
+				blkno);
+	}
+
+	ocfs2_name_index_free(ni);
+
+out_close:
+	ocfs2_close(fs);
+
+	return ret ? 1 : 0;
+}
+#endif  /* DEBUG_EXE */
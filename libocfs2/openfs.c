@@ -49,11 +49,10 @@
  * function. At this point this function returns EIO if image file has any
  * holes
  */
-static errcode_t __ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno,
-				     int count, char *data, bool nocache)
+static errcode_t ocfs2_image_translate(ocfs2_filesys *fs, int64_t *blkno,
+				       int count)
 {
 	int i;
-	errcode_t err;
 
 	if (fs->fs_flags & OCFS2_FLAG_IMAGE_FILE) {
 		/*
@@ -63,12 +62,28 @@ static errcode_t __ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno,
 		 * return -EIO if any.
 		 */
 		for (i = 0; i < count; i++)
-			if (!ocfs2_image_test_bit(fs, blkno+i))
+			if (!ocfs2_image_test_bit(fs, *blkno + i))
 				return OCFS2_ET_IO;
 		/* translate the block number */
-		blkno = ocfs2_image_get_blockno(fs, blkno);
+		*blkno = ocfs2_image_get_blockno(fs, *blkno);
 	}
 
+	return 0;
+}
+
+static errcode_t __ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno,
+				     int count, char *data, bool nocache)
+{
+	errcode_t err;
+
+	/* A compressed image can't be read through the io channel */
+	if (ocfs2_image_compressed(fs))
+		return ocfs2_image_read_blocks(fs, blkno, count, data);
+
+	err = ocfs2_image_translate(fs, &blkno, count);
+	if (err)
+		return err;
+
 	if (nocache)
 		err = io_read_block_nocache(fs->fs_io, blkno, count, data);
 	else
@@ -89,6 +104,43 @@ errcode_t ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno,
 	return __ocfs2_read_blocks(fs, blkno, count, data, false);
 }
 
+errcode_t ocfs2_get_blocks(ocfs2_filesys *fs, int64_t blkno, int count,
+			   char **bufs)
+{
+	errcode_t err;
+	char *data;
+	int i;
+
+	if (ocfs2_image_compressed(fs)) {
+		/* A private copy, which io_put_blocks() knows to free */
+		err = ocfs2_malloc_blocks(fs->fs_io, count, &data);
+		if (err)
+			return err;
+
+		err = ocfs2_image_read_blocks(fs, blkno, count, data);
+		if (err) {
+			ocfs2_free(&data);
+			return err;
+		}
+
+		for (i = 0; i < count; i++)
+			bufs[i] = data +
+				((size_t)i * io_get_blksize(fs->fs_io));
+		return 0;
+	}
+
+	err = ocfs2_image_translate(fs, &blkno, count);
+	if (err)
+		return err;
+
+	return io_get_blocks(fs->fs_io, blkno, count, bufs);
+}
+
+void ocfs2_put_blocks(ocfs2_filesys *fs, int count, char **bufs)
+{
+	io_put_blocks(fs->fs_io, count, bufs);
+}
+
 static errcode_t ocfs2_validate_ocfs1_header(ocfs2_filesys *fs)
 {
 	errcode_t ret;
@@ -201,10 +253,23 @@ errcode_t ocfs2_write_primary_super(ocfs2_filesys *fs)
 		   strlen(OCFS2_SUPER_BLOCK_SIGNATURE)))
 		goto out_blk;
 
+	/*
+	 * The superblock is how tools mark work in progress, so it is a
+	 * barrier on a write-back cache.  What was written before it is
+	 * on disk first, and it is on disk before anything after it.
+	 */
+	ret = io_flush(fs->fs_io);
+	if (ret)
+		goto out_blk;
+
 	ret = ocfs2_write_inode(fs, OCFS2_SUPER_BLOCK_BLKNO, blk);
 	if (ret)
 		goto out_blk;
 
+	ret = io_flush(fs->fs_io);
+	if (ret)
+		goto out_blk;
+
 	return 0;
 
 out_blk:
@@ -287,7 +352,8 @@ errcode_t ocfs2_open(const char *name, int flags,
 	fs->fs_umask = 022;
 
 	ret = io_open(name, (flags & (OCFS2_FLAG_RO | OCFS2_FLAG_RW |
-				      OCFS2_FLAG_BUFFERED)),
+				      OCFS2_FLAG_BUFFERED |
+				      OCFS2_FLAG_IO_URING)),
 		      &fs->fs_io);
 	if (ret)
 		goto out;
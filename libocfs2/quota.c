@@ -23,6 +23,7 @@
  */
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "ocfs2/byteorder.h"
 #include "ocfs2/ocfs2.h"
@@ -253,15 +254,14 @@ errcode_t ocfs2_find_read_quota_hash(ocfs2_filesys *fs, ocfs2_quota_hash *hash,
 	return 0;
 }
 
-errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
-				    ocfs2_quota_hash *usr_hash,
-				    ocfs2_quota_hash *grp_hash)
+static errcode_t quota_account_inodes(ocfs2_filesys *fs,
+				      ocfs2_inode_scan *scan,
+				      ocfs2_quota_hash *usr_hash,
+				      ocfs2_quota_hash *grp_hash)
 {
 	errcode_t err = 0;
-	ocfs2_inode_scan *scan;
 	uint64_t blkno;
 	char *buf;
-	int close_scan = 0;
 	struct ocfs2_dinode *di;
 	ocfs2_cached_dquot *dquot;
 
@@ -270,11 +270,6 @@ errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
 		return err;
 	di = (struct ocfs2_dinode *)buf;
 
-	err = ocfs2_open_inode_scan(fs, &scan);
-	if (err)
-		goto out;
-	close_scan = 1;
-
 	while (1) {
 		err = ocfs2_get_next_inode(scan, &blkno, buf);
 		if (err || !blkno)
@@ -313,13 +308,187 @@ errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
 			dquot->d_ddquot.dqb_curinodes++;
 		}
 	}
-out:
-	if (close_scan)
-		ocfs2_close_inode_scan(scan);
+
 	ocfs2_free(&buf);
 	return err;
 }
 
+/*
+ * Quota usage is a sum over every inode, so the inode scan splits up
+ * nicely.  Each thread walks one partition of the scan into hashes of
+ * its own, and the totals are merged when they are all done.
+ */
+
+struct quota_scan_part {
+	ocfs2_filesys *qp_fs;
+	ocfs2_inode_scan *qp_scan;
+	ocfs2_quota_hash *qp_hash[MAXQUOTAS];
+	pthread_t qp_thread;
+	int qp_started;
+	errcode_t qp_err;
+};
+
+static void *quota_scan_thread(void *arg)
+{
+	struct quota_scan_part *qp = arg;
+
+	qp->qp_err = quota_account_inodes(qp->qp_fs, qp->qp_scan,
+					  qp->qp_hash[USRQUOTA],
+					  qp->qp_hash[GRPQUOTA]);
+	return NULL;
+}
+
+struct quota_merge_ctx {
+	ocfs2_quota_hash *from;
+	ocfs2_quota_hash *to;
+};
+
+static errcode_t quota_merge_dquot(ocfs2_cached_dquot *dquot, void *p)
+{
+	struct quota_merge_ctx *ctx = p;
+	ocfs2_cached_dquot *to_dquot = NULL;
+	errcode_t err = 0;
+
+	if (ctx->to)
+		err = ocfs2_find_create_quota_hash(ctx->to,
+						   dquot->d_ddquot.dqb_id,
+						   &to_dquot);
+	if (!err && to_dquot) {
+		to_dquot->d_ddquot.dqb_curspace +=
+			dquot->d_ddquot.dqb_curspace;
+		to_dquot->d_ddquot.dqb_curinodes +=
+			dquot->d_ddquot.dqb_curinodes;
+	}
+
+	/* Empty the partition's hash even on error so it can be freed */
+	ocfs2_remove_quota_hash(ctx->from, dquot);
+	ocfs2_free(&dquot);
+	return err;
+}
+
+static errcode_t quota_merge_hash(ocfs2_quota_hash *from,
+				  ocfs2_quota_hash *to)
+{
+	struct quota_merge_ctx ctx = { .from = from, .to = to };
+	errcode_t err, ret;
+
+	err = ocfs2_iterate_quota_hash(from, quota_merge_dquot, &ctx);
+	if (err) {
+		/* Just throw the rest away */
+		ctx.to = NULL;
+		ocfs2_iterate_quota_hash(from, quota_merge_dquot, &ctx);
+	}
+	ret = ocfs2_free_quota_hash(from);
+	if (!err)
+		err = ret;
+	return err;
+}
+
+static errcode_t quota_compute_parallel(ocfs2_filesys *fs, int nparts,
+					ocfs2_quota_hash *usr_hash,
+					ocfs2_quota_hash *grp_hash)
+{
+	errcode_t err, ret;
+	int i;
+	ocfs2_inode_scan **scans = NULL;
+	struct quota_scan_part *parts = NULL, *qp;
+
+	err = ocfs2_malloc0(sizeof(ocfs2_inode_scan *) * nparts, &scans);
+	if (!err)
+		err = ocfs2_malloc0(sizeof(struct quota_scan_part) * nparts,
+				    &parts);
+	if (err)
+		goto out_free;
+
+	err = ocfs2_open_inode_scan_partitioned(fs, nparts, scans);
+	if (err)
+		goto out_free;
+
+	for (i = 0; i < nparts; i++) {
+		qp = &parts[i];
+		qp->qp_fs = fs;
+		qp->qp_scan = scans[i];
+		if (usr_hash) {
+			err = ocfs2_new_quota_hash(&qp->qp_hash[USRQUOTA]);
+			if (err)
+				goto out;
+		}
+		if (grp_hash) {
+			err = ocfs2_new_quota_hash(&qp->qp_hash[GRPQUOTA]);
+			if (err)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < nparts; i++) {
+		qp = &parts[i];
+		if (pthread_create(&qp->qp_thread, NULL, quota_scan_thread,
+				   qp)) {
+			err = OCFS2_ET_NO_MEMORY;
+			goto out;
+		}
+		qp->qp_started = 1;
+	}
+
+out:
+	for (i = 0; i < nparts; i++) {
+		qp = &parts[i];
+		if (qp->qp_started) {
+			pthread_join(qp->qp_thread, NULL);
+			if (!err)
+				err = qp->qp_err;
+		}
+	}
+
+	for (i = 0; i < nparts; i++) {
+		qp = &parts[i];
+		if (qp->qp_hash[USRQUOTA]) {
+			ret = quota_merge_hash(qp->qp_hash[USRQUOTA],
+					       err ? NULL : usr_hash);
+			if (!err)
+				err = ret;
+		}
+		if (qp->qp_hash[GRPQUOTA]) {
+			ret = quota_merge_hash(qp->qp_hash[GRPQUOTA],
+					       err ? NULL : grp_hash);
+			if (!err)
+				err = ret;
+		}
+		ocfs2_close_inode_scan(scans[i]);
+	}
+
+out_free:
+	ocfs2_free(&parts);
+	ocfs2_free(&scans);
+
+	return err;
+}
+
+/* With nr_threads of 1, a single scan reads ahead instead */
+#define QUOTA_SCAN_PREFETCH_DEPTH	2
+
+errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
+				    ocfs2_quota_hash *usr_hash,
+				    ocfs2_quota_hash *grp_hash,
+				    int nr_threads)
+{
+	errcode_t err;
+	ocfs2_inode_scan *scan;
+
+	if (nr_threads > 1)
+		return quota_compute_parallel(fs, nr_threads, usr_hash,
+					      grp_hash);
+
+	err = ocfs2_open_inode_scan_prefetch(fs, QUOTA_SCAN_PREFETCH_DEPTH,
+					     &scan);
+	if (err)
+		return err;
+
+	err = quota_account_inodes(fs, scan, usr_hash, grp_hash);
+	ocfs2_close_inode_scan(scan);
+	return err;
+}
+
 errcode_t ocfs2_init_quota_change(ocfs2_filesys *fs,
 				  ocfs2_quota_hash **usrhash,
 				  ocfs2_quota_hash **grphash)
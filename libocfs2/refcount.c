@@ -1630,6 +1630,9 @@ static int ocfs2_di_get_clusters(struct ocfs2_cow_context *context,
 {
 	ocfs2_cached_inode *cinode = context->cow_object;
 
+	/* The CoW changes the tree between lookups */
+	ocfs2_extent_map_drop(cinode);
+
 	return ocfs2_get_clusters(cinode, v_cluster, p_cluster,
 				  num_clusters, extent_flags);
 }
@@ -1801,6 +1804,7 @@ static int ocfs2_refcount_cow_hunk(ocfs2_cached_inode *cinode,
 		goto out;
 
 	ret = ocfs2_replace_cow(&context);
+	ocfs2_extent_map_drop(cinode);
 
 	ocfs2_free(&context.ref_root_buf);
 out:
@@ -258,6 +258,7 @@ static errcode_t ocfs2_zero_tail_and_truncate_full(ocfs2_filesys *fs,
 	ctxt.free_clusters = free_clusters;
 	ctxt.free_data = free_data;
 
+	ocfs2_extent_map_drop(ci);
 	ret = ocfs2_extent_iterate_inode(fs, ci->ci_inode,
 					 OCFS2_EXTENT_FLAG_DEPTH_TRAVERSE,
 					 NULL, truncate_iterate,
@@ -45,12 +45,17 @@
 #include <libaio.h>
 #endif
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "ocfs2/kernel-rbtree.h"
 
 #include "ocfs2/ocfs2.h"
 
+#include "uring.h"
+
 
 /*
  * We do cached I/O in 1MB hunks, so we need this constant.
@@ -61,29 +66,137 @@
 
 
 /*
- * The cache looks up blocks in two ways:
+ * The cache comes in two flavors, selected at io_init_cache_engine()
+ * time.  Both keep the block data in one contiguous allocation
+ * (ic_data_buffer) so that it can be mlocked.
+ *
+ * IO_CACHE_ENGINE_LRU looks up blocks in two ways:
  *
  * 1) If it needs a new block, it gets one off of ic->ic_lru.  The blocks
  *    attach to that list via icb->icb_list.
  *
  * 2) If it wants to look up an existing block, it gets it from
  *    ic->ic_lookup.  The blocks are attached vai icb->icb_node.
+ *
+ * One lock, ic->ic_lru_lock, covers the whole LRU engine.
+ *
+ * IO_CACHE_ENGINE_HASH splits the cache into shards by a hash of the
+ * block number.  Each shard owns a contiguous run of the io_hash_block
+ * array and an open-addressed table of indexes into that array.  A
+ * lookup is one hash and, usually, one probe.  Eviction is CLOCK: a
+ * hand sweeps the shard's blocks, giving a second chance to any block
+ * referenced since the hand last passed.  Hits only set a flag, so
+ * nothing is relinked on the hot path.  Each shard has its own lock,
+ * which makes this engine safe for concurrent readers.
+ *
+ * Either engine can pin blocks for io_get_blocks().  A pinned block is
+ * never chosen for eviction.  The LRU engine takes pinned blocks off of
+ * ic->ic_lru; the CLOCK hand just skips them.
+ *
+ * Normally the cache is write-through.  io_set_writeback() makes it
+ * write-back: written blocks are copied into dirty buffers, kept in
+ * ic->ic_dirty by block number, and only go to disk on io_flush() or
+ * when every dirty buffer is in use.  The flush walks the tree in
+ * order and writes each run of adjacent blocks with one pwritev().
+ * The engines don't know about dirty blocks.  Written blocks update
+ * any cached copy as always, and whatever we read from disk is patched
+ * with the dirty blocks before the engine sees it, so the cache always
+ * holds the newest data.  Dirty blocks live in the cache, not the
+ * channel, so channels sharing a cache see each other's writes.
  */
 struct io_cache_block {
 	struct rb_node icb_node;
 	struct list_head icb_list;
 	uint64_t icb_blkno;
 	char *icb_buf;
+	uint32_t icb_pins;
+};
+
+struct io_dirty_block {
+	struct rb_node db_node;
+	struct list_head db_list;	/* On ic_dirty_free when unused */
+	uint64_t db_blkno;
+	char *db_buf;
+};
+
+struct io_hash_block {
+	uint64_t hb_blkno;
+	uint32_t hb_referenced;
+	uint32_t hb_pins;
+};
+
+struct io_hash_shard {
+	pthread_mutex_t hs_lock;
+	uint32_t *hs_slots;		/* Indexes into ic_hash_blocks */
+	uint32_t hs_first;		/* First ic_hash_blocks entry owned */
+	uint32_t hs_nr_blocks;		/* Number of entries owned */
+	uint32_t hs_hand;		/* CLOCK hand, relative to hs_first */
+
+	/* stats */
+	uint32_t hs_hits;
+	uint32_t hs_misses;
+	uint32_t hs_inserts;
+	uint32_t hs_removes;
+	uint32_t hs_evictions;
+};
+
+struct io_cache;
+
+struct io_cache_operations {
+	const char *name;
+	errcode_t (*init)(io_channel *channel, struct io_cache *ic);
+	void (*free)(struct io_cache *ic);
+	errcode_t (*read_blocks)(io_channel *channel, int64_t blkno,
+				 int count, char *data, bool nocache);
+	errcode_t (*write_blocks)(io_channel *channel, int64_t blkno,
+				  int count, const char *data, bool nocache);
+	void (*vec_refresh)(io_channel *channel, struct io_vec_unit *ivus,
+			    int count, bool nocache, uint64_t gen);
+	void (*get_stats)(struct io_cache *ic, struct ocfs2_io_stats *stats);
+
+	/*
+	 * Pin the block's cache buffer.  If it isn't cached, a free
+	 * buffer is pinned instead, *missed is set, and the caller must
+	 * read into it and then publish_block() it.
+	 */
+	errcode_t (*pin_block)(io_channel *channel, uint64_t blkno,
+			       char **buf, bool *missed);
+	void (*publish_block)(io_channel *channel, uint64_t blkno,
+			      char **buf);
+	void (*unpin_block)(io_channel *channel, char *buf);
 };
 
 struct io_cache {
 	size_t ic_nr_blocks;
+	enum io_cache_engine ic_engine;
+	struct io_cache_operations *ic_ops;
+
+	/* IO_CACHE_ENGINE_LRU */
 	struct list_head ic_lru;
 	struct rb_root ic_lookup;
+	pthread_mutex_t ic_lru_lock;
+
+	/* IO_CACHE_ENGINE_HASH */
+	struct io_hash_block *ic_hash_blocks;
+	struct io_hash_shard *ic_shards;
+	int ic_shard_bits;
+	int ic_slot_bits;
+	uint32_t ic_shard_blocks;
+
+	/* Write-back */
+	struct rb_root ic_dirty;
+	struct list_head ic_dirty_free;
+	struct io_dirty_block *ic_dirty_blocks;
+	char *ic_dirty_data;
+	size_t ic_dirty_max;		/* 0 when write-through */
+	size_t ic_nr_dirty;
+	pthread_mutex_t ic_dirty_lock;
 
 	/* Housekeeping */
-	struct io_cache_block *ic_metadata_buffer;
+	void *ic_metadata_buffer;
 	unsigned long ic_metadata_buffer_len;
+	uint32_t *ic_slot_buffer;
+	unsigned long ic_slot_buffer_len;
 	char *ic_data_buffer;
 	unsigned long ic_data_buffer_len;
 	int ic_locked;
@@ -94,6 +207,70 @@ struct io_cache {
 	uint32_t ic_misses;
 	uint32_t ic_inserts;
 	uint32_t ic_removes;
+	uint32_t ic_evictions;
+};
+
+/*
+ * Vectored reads go through one libaio context per channel, set up on
+ * first use.  Units are queued on aa_pending and submitted as iocbs
+ * free up, so up to aa_depth I/Os stay in flight until the queue
+ * drains.  io_vec_read_blocks() waits for its own units; units from
+ * io_vec_submit() are parked on aa_done until io_vec_wait() claims
+ * them.
+ *
+ * Threads sharing a channel take turns in the io_vec_*() calls under
+ * io_aio_lock.  One thread at a time reaps completions for everyone.
+ * It drops the lock while it sleeps in the kernel, and the others wait
+ * on io_aio_cond for it to finish; see io_aio_getevents().
+ */
+#define IO_AIO_DEFAULT_DEPTH	64
+
+/*
+ * A wait that fails without reaping anything is retried after a short
+ * pause.  After this many in a row, io_aio_abort() gives up on the I/O.
+ */
+#define IO_AIO_MAX_WAIT_FAILURES	8
+
+/* One io_vec_read_blocks() call waiting for its units */
+struct io_aio_sync {
+	int as_left;
+	errcode_t as_ret;
+};
+
+struct io_aio_unit {
+	struct io_vec_unit *au_ivu;
+	struct io_aio_sync *au_sync;	/* NULL for io_vec_submit() */
+	errcode_t au_ret;
+	uint64_t au_gen;	/* io_write_gen() when queued */
+};
+
+struct io_aio_queue {
+	struct io_aio_unit *aq_units;
+	int aq_head;
+	int aq_count;
+	int aq_size;
+};
+
+struct io_aio_req {
+	struct iocb ar_iocb;	/* Must be first, see io_aio_iocb_req() */
+	struct io_aio_unit ar_unit;
+	bool ar_busy;		/* Owned by the kernel */
+};
+
+struct io_aio {
+	io_context_t aa_ctx;
+	struct o2_uring *aa_ring;	/* Used instead of aa_ctx if set */
+	int aa_depth;
+	struct io_aio_req *aa_reqs;
+	struct iocb **aa_iocbs;
+	struct io_event *aa_events;
+	int *aa_free;
+	int aa_nr_free;
+	int aa_inflight;
+	struct io_aio_queue aa_pending;
+	struct io_aio_queue aa_done;
+	int aa_wait_failures;
+	bool aa_reaping;	/* Someone is in io_aio_getevents() */
 };
 
 struct _io_channel {
@@ -104,12 +281,71 @@ struct _io_channel {
 	int io_fd;
 	bool io_nocache;
 	struct io_cache *io_cache;
+	struct io_aio *io_aio;
+	pthread_mutex_t io_aio_lock;
+	pthread_cond_t io_aio_cond;	/* Reaping is done */
 
-	/* stats */
+	/*
+	 * A read that overlaps a write may return the old contents, so
+	 * it can only refresh the cache if no write started after it
+	 * was queued.  See io_write_gen().
+	 */
+	uint64_t io_writes_started;
+	uint64_t io_writes_done;
+
+	/*
+	 * With OCFS2_FLAG_IO_URING, synchronous I/O goes through
+	 * io_uring and the vectored read queue gets a ring of its own.
+	 * The sync ring serializes its users.  A thread that finds it
+	 * busy just uses pread/pwrite rather than wait.  Once the ring
+	 * fails, io_uring_failed is set under the lock and everyone
+	 * uses pread/pwrite.
+	 */
+	bool io_want_uring;
+	struct o2_uring *io_uring;
+	pthread_mutex_t io_uring_lock;
+	bool io_uring_failed;
+
+	/* stats; threads can share a channel, so these are atomic */
 	uint64_t io_bytes_read;
 	uint64_t io_bytes_written;
 };
 
+static inline void io_count_bytes(uint64_t *counter, uint64_t bytes)
+{
+	__atomic_add_fetch(counter, bytes, __ATOMIC_RELAXED);
+}
+
+/* Writers refresh the cache unconditionally */
+#define IO_WRITE_GEN_ANY	UINT64_MAX
+
+static inline void io_write_begin(io_channel *channel)
+{
+	__atomic_add_fetch(&channel->io_writes_started, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void io_write_end(io_channel *channel)
+{
+	__atomic_add_fetch(&channel->io_writes_done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sampled before a read is issued.  A write still running then has
+ * io_writes_started ahead of io_writes_done, so it spoils the read just
+ * like one that starts later.
+ */
+static inline uint64_t io_write_gen(io_channel *channel)
+{
+	return __atomic_load_n(&channel->io_writes_done, __ATOMIC_ACQUIRE);
+}
+
+static inline bool io_write_gen_current(io_channel *channel, uint64_t gen)
+{
+	return (gen == IO_WRITE_GEN_ANY) ||
+		(__atomic_load_n(&channel->io_writes_started,
+				 __ATOMIC_ACQUIRE) == gen);
+}
+
 /*
  * We open code this because we don't have the ocfs2_filesys to call
  * ocfs2_blocks_in_bytes().
@@ -120,479 +356,2077 @@ static inline int one_meg_of_blocks(io_channel *channel)
 	return count / channel->io_blksize;
 }
 
-static errcode_t unix_vec_read_blocks(io_channel *channel,
-				      struct io_vec_unit *ivus, int count)
+static errcode_t io_aio_queue_push(struct io_aio_queue *aq,
+				   struct io_aio_unit *au)
 {
-	int i;
-	int ret;
-	io_context_t io_ctx;
-	struct iocb *iocb = NULL, **iocbs = NULL;
-	struct io_event *events = NULL;
-	int64_t offset;
-	int submitted, completed = 0;
-
-	ret = OCFS2_ET_NO_MEMORY;
-	iocb = malloc((sizeof(struct iocb) * count));
-	iocbs = malloc((sizeof(struct iocb *) * count));
-	events = malloc((sizeof(struct io_event) * count));
-	if (!iocb || !iocbs || !events)
-		goto out;
-
-	memset(&io_ctx, 0, sizeof(io_ctx));
-	ret = io_queue_init(count, &io_ctx);
-	if (ret)
-		return ret;
+	int i, size;
+	errcode_t ret;
+	struct io_aio_unit *units;
 
-	for (i = 0; i < count; ++i) {
-		offset = ivus[i].ivu_blkno * channel->io_blksize;
-		io_prep_pread(&(iocb[i]), channel->io_fd, ivus[i].ivu_buf,
-			      ivus[i].ivu_buflen, offset);
-		iocbs[i] = &iocb[i];
+	if (aq->aq_count == aq->aq_size) {
+		size = aq->aq_size ? aq->aq_size * 2 : IO_AIO_DEFAULT_DEPTH;
+		ret = ocfs2_malloc(sizeof(struct io_aio_unit) * size, &units);
+		if (ret)
+			return ret;
+		for (i = 0; i < aq->aq_count; i++)
+			units[i] = aq->aq_units[(aq->aq_head + i) %
+						aq->aq_size];
+		ocfs2_free(&aq->aq_units);
+		aq->aq_units = units;
+		aq->aq_head = 0;
+		aq->aq_size = size;
 	}
 
-resubmit:
-	ret = io_submit(io_ctx, count - completed, &iocbs[completed]);
-	if (!ret && (count - completed))
-		ret = OCFS2_ET_SHORT_READ;
-	if (ret < 0)
-		goto out;
-	submitted = ret;
+	aq->aq_units[(aq->aq_head + aq->aq_count) % aq->aq_size] = *au;
+	aq->aq_count++;
 
-	ret = io_getevents(io_ctx, submitted, submitted, events, NULL);
-	if (ret < 0)
-		goto out;
+	return 0;
+}
 
-	completed += submitted;
-	if (completed < count)
-		goto resubmit;
+static void io_aio_queue_pop(struct io_aio_queue *aq, struct io_aio_unit *au)
+{
+	*au = aq->aq_units[aq->aq_head];
+	aq->aq_head = (aq->aq_head + 1) % aq->aq_size;
+	aq->aq_count--;
+}
 
-out:
-	if (ret >= 0)
-		ret = 0;
-	if (!ret)
-		channel->io_bytes_read += (count * channel->io_blksize);
-	free(iocb);
-	free(iocbs);
-	free(events);
-	io_queue_release(io_ctx);
+static inline struct io_aio_req *io_aio_iocb_req(struct iocb *iocb)
+{
+	return (struct io_aio_req *)iocb;
+}
 
-	return ret;
+static void io_aio_free(io_channel *channel)
+{
+	struct io_aio *aa = channel->io_aio;
+
+	if (!aa)
+		return;
+
+	if (aa->aa_ctx)
+		io_queue_release(aa->aa_ctx);
+	o2_uring_free(aa->aa_ring);
+	ocfs2_free(&aa->aa_pending.aq_units);
+	ocfs2_free(&aa->aa_done.aq_units);
+	ocfs2_free(&aa->aa_free);
+	ocfs2_free(&aa->aa_events);
+	ocfs2_free(&aa->aa_iocbs);
+	ocfs2_free(&aa->aa_reqs);
+	ocfs2_free(&channel->io_aio);
 }
 
-static errcode_t unix_io_read_block(io_channel *channel, int64_t blkno,
-				    int count, char *data)
+static errcode_t io_aio_init(io_channel *channel)
 {
-	int ret;
-	ssize_t size, tot, rd;
-	uint64_t location;
+	int i, depth = IO_AIO_DEFAULT_DEPTH;
+	errcode_t ret;
+	struct io_aio *aa;
 
-	/* -ative means count is in bytes */
-	size = (count < 0) ? -count : count * channel->io_blksize;
-	location = blkno * channel->io_blksize;
+	if (channel->io_aio)
+		return 0;
 
-	tot = 0;
-	while (tot < size) {
-		rd = pread64(channel->io_fd, data + tot,
-			     size - tot, location + tot);
-		ret = OCFS2_ET_IO;
-		if (rd < 0) {
-			channel->io_error = errno;
-			goto out;
-		}
+	ret = ocfs2_malloc0(sizeof(struct io_aio), &aa);
+	if (ret)
+		return ret;
+	channel->io_aio = aa;
 
-		if (!rd) 
-			goto out;
+	aa->aa_depth = depth;
+	ret = ocfs2_malloc0(sizeof(struct io_aio_req) * depth, &aa->aa_reqs);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct iocb *) * depth,
+				   &aa->aa_iocbs);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct io_event) * depth,
+				   &aa->aa_events);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(int) * depth, &aa->aa_free);
+	if (ret)
+		goto out;
 
-		tot += rd;
-	}
+	for (i = 0; i < depth; i++)
+		aa->aa_free[i] = depth - i - 1;
+	aa->aa_nr_free = depth;
 
-	ret = 0;
+	if (channel->io_want_uring &&
+	    !o2_uring_init(depth, &aa->aa_ring))
+		goto out;
 
-out:
-	if (!ret && tot != size) {
-		ret = OCFS2_ET_SHORT_READ;
-		memset(data + tot, 0, size - tot);
+	ret = io_queue_init(depth, &aa->aa_ctx);
+	if (ret) {
+		aa->aa_ctx = NULL;
+		channel->io_error = -ret;
+		ret = OCFS2_ET_IO;
 	}
 
-	channel->io_bytes_read += tot;
+out:
+	if (ret)
+		io_aio_free(channel);
 
 	return ret;
 }
 
-static errcode_t unix_io_write_block_full(io_channel *channel, int64_t blkno,
-					  int count, const char *data,
-					  int *completed)
+/* A unit is done.  Sync units are counted, async ones wait for reap. */
+static errcode_t io_aio_complete(io_channel *channel, struct io_aio_unit *au)
 {
-	int ret;
-	ssize_t size, tot, wr;
-	uint64_t location;
-
-	/* -ative means count is in bytes */
-	size = (count < 0) ? -count : count * channel->io_blksize;
-	location = blkno * channel->io_blksize;
-
-	tot = 0;
-	while (tot < size) {
-		wr = pwrite64(channel->io_fd, data + tot,
- 			      size - tot, location + tot);
-		ret = OCFS2_ET_IO;
-		if (wr < 0) {
-			channel->io_error = errno;
-			goto out;
-		}
-
-		if (!wr) 
-			goto out;
+	struct io_aio *aa = channel->io_aio;
 
-		tot += wr;
+	if (au->au_sync) {
+		if (!au->au_sync->as_ret)
+			au->au_sync->as_ret = au->au_ret;
+		au->au_sync->as_left--;
+		return 0;
 	}
 
-	ret = 0;
-out:
-	if (completed)
-		*completed = tot / channel->io_blksize;
-	if (!ret && (tot != size))
-		ret = OCFS2_ET_SHORT_WRITE;
-
-	channel->io_bytes_written += tot;
-
-	return ret;
+	return io_aio_queue_push(&aa->aa_done, au);
 }
 
-static errcode_t unix_io_write_block(io_channel *channel, int64_t blkno,
-				     int count, const char *data)
+/* Fail every unit the kernel hasn't been handed */
+static errcode_t io_aio_fail_pending(io_channel *channel)
 {
-	return unix_io_write_block_full(channel, blkno, count, data, NULL);
+	errcode_t ret = 0, err;
+	struct io_aio *aa = channel->io_aio;
+	struct io_aio_unit au;
+
+	while (aa->aa_pending.aq_count) {
+		io_aio_queue_pop(&aa->aa_pending, &au);
+		au.au_ret = OCFS2_ET_IO;
+		err = io_aio_complete(channel, &au);
+		if (err && !ret)
+			ret = err;
+	}
+
+	return ret;
 }
 
 /*
- * See if the rbtree has a block for the given block number.
- *
- * The rb_node garbage lets insertion share the search.  Trivial callers
- * pass NULL.
+ * The io_uring flavor of io_aio_submit_pending().  Queued sqes stay in
+ * the ring until the kernel takes them, so nothing is ever handed back
+ * to aa_pending.
  */
-static struct io_cache_block *io_cache_lookup(struct io_cache *ic,
-					      uint64_t blkno)
+static errcode_t io_aio_ring_submit_pending(io_channel *channel)
 {
-	struct rb_node *p = ic->ic_lookup.rb_node;
-	struct io_cache_block *icb;
+	int rc;
+	struct io_aio *aa = channel->io_aio;
+	struct io_aio_req *ar;
+	struct io_vec_unit *ivu;
+	int idx;
+
+	while (aa->aa_pending.aq_count && aa->aa_nr_free &&
+	       o2_uring_sq_space(aa->aa_ring)) {
+		idx = aa->aa_free[--aa->aa_nr_free];
+		ar = &aa->aa_reqs[idx];
+		io_aio_queue_pop(&aa->aa_pending, &ar->ar_unit);
+		ivu = ar->ar_unit.au_ivu;
+		o2_uring_prep_rw(aa->aa_ring, false, channel->io_fd,
+				 ivu->ivu_buf, ivu->ivu_buflen,
+				 ivu->ivu_blkno * channel->io_blksize, idx);
+		ar->ar_busy = true;
+		aa->aa_inflight++;
+	}
 
-	while (p) {
-		icb = rb_entry(p, struct io_cache_block, icb_node);
-		if (blkno < icb->icb_blkno) {
-			p = p->rb_left;
-		} else if (blkno > icb->icb_blkno) {
-			p = p->rb_right;
-		} else
-			return icb;
+	rc = o2_uring_submit(aa->aa_ring, 0);
+	if (rc && (rc != -EAGAIN) && (rc != -EBUSY)) {
+		channel->io_error = -rc;
+		return OCFS2_ET_IO;
 	}
 
-	return NULL;
+	return 0;
 }
 
-static void io_cache_insert(struct io_cache *ic,
-			    struct io_cache_block *insert_icb)
+/* Move as many pending units as there are free iocbs into the kernel */
+static errcode_t io_aio_submit_pending(io_channel *channel)
 {
-	struct rb_node **p = &ic->ic_lookup.rb_node;
-	struct rb_node *parent = NULL;
-	struct io_cache_block *icb = NULL;
+	int i, nr, submitted;
+	errcode_t ret;
+	struct io_aio *aa = channel->io_aio;
+	struct io_aio_req *ar;
+	struct io_aio_unit au;
+	struct io_vec_unit *ivu;
+
+	if (aa->aa_ring)
+		return io_aio_ring_submit_pending(channel);
+
+	/* io_aio_abort() couldn't build a new context */
+	if (!aa->aa_ctx)
+		return io_aio_fail_pending(channel);
+
+	while (aa->aa_pending.aq_count && aa->aa_nr_free) {
+		nr = aa->aa_pending.aq_count;
+		if (nr > aa->aa_nr_free)
+			nr = aa->aa_nr_free;
+
+		for (i = 0; i < nr; i++) {
+			ar = &aa->aa_reqs[aa->aa_free[aa->aa_nr_free - i - 1]];
+			io_aio_queue_pop(&aa->aa_pending, &ar->ar_unit);
+			ivu = ar->ar_unit.au_ivu;
+			io_prep_pread(&ar->ar_iocb, channel->io_fd,
+				      ivu->ivu_buf, ivu->ivu_buflen,
+				      ivu->ivu_blkno * channel->io_blksize);
+			aa->aa_iocbs[i] = &ar->ar_iocb;
+		}
 
-	while (*p) {
-		parent = *p;
-		icb = rb_entry(parent, struct io_cache_block, icb_node);
-		if (insert_icb->icb_blkno < icb->icb_blkno) {
-			p = &(*p)->rb_left;
-			icb = NULL;
-		} else if (insert_icb->icb_blkno > icb->icb_blkno) {
-			p = &(*p)->rb_right;
-			icb = NULL;
-		} else
-			assert(0);  /* We erased it, remember? */
+		submitted = io_submit(aa->aa_ctx, nr, aa->aa_iocbs);
+		if (submitted < 0) {
+			if (submitted != -EAGAIN)
+				channel->io_error = -submitted;
+			submitted = 0;
+		}
+		for (i = 0; i < submitted; i++)
+			io_aio_iocb_req(aa->aa_iocbs[i])->ar_busy = true;
+		aa->aa_nr_free -= submitted;
+		aa->aa_inflight += submitted;
+
+		/*
+		 * Whatever the kernel didn't take goes back on the
+		 * queue in order.  If it took nothing and has nothing
+		 * in flight to wait on, fail the first unit so we keep
+		 * making progress.
+		 */
+		for (i = nr - 1; i >= submitted; i--) {
+			ar = io_aio_iocb_req(aa->aa_iocbs[i]);
+			aa->aa_pending.aq_head = (aa->aa_pending.aq_head +
+						  aa->aa_pending.aq_size - 1) %
+						 aa->aa_pending.aq_size;
+			aa->aa_pending.aq_units[aa->aa_pending.aq_head] =
+				ar->ar_unit;
+			aa->aa_pending.aq_count++;
+		}
+
+		if (submitted)
+			continue;
+		if (aa->aa_inflight)
+			break;
+
+		io_aio_queue_pop(&aa->aa_pending, &au);
+		au.au_ret = OCFS2_ET_IO;
+		ret = io_aio_complete(channel, &au);
+		if (ret)
+			return ret;
 	}
 
-	rb_link_node(&insert_icb->icb_node, parent, p);
-	rb_insert_color(&insert_icb->icb_node, &ic->ic_lookup);
-	ic->ic_inserts++;
+	return 0;
 }
 
-static void io_cache_seen(struct io_cache *ic, struct io_cache_block *icb)
+/* Record the result of one finished request and free its slot */
+static errcode_t io_aio_finish(io_channel *channel, struct io_aio_req *ar,
+			       long res)
 {
-	/* Move to the front of the LRU */
-	list_del(&icb->icb_list);
-	list_add_tail(&icb->icb_list, &ic->ic_lru);
-}
+	struct io_aio *aa = channel->io_aio;
+	struct io_vec_unit *ivu = ar->ar_unit.au_ivu;
+
+	ar->ar_unit.au_ret = 0;
+	if (res < 0) {
+		channel->io_error = -res;
+		ar->ar_unit.au_ret = OCFS2_ET_IO;
+	} else {
+		io_count_bytes(&channel->io_bytes_read, res);
+		if (res < ivu->ivu_buflen) {
+			ar->ar_unit.au_ret = OCFS2_ET_SHORT_READ;
+			memset(ivu->ivu_buf + res, 0, ivu->ivu_buflen - res);
+		}
+	}
 
-static void io_cache_unsee(struct io_cache *ic, struct io_cache_block *icb)
-{
-	/*
-	 * Move to the end of the LRU.  There's no point in removing an
-	 * "unseen" buffer from the cache.  It's valid, but we want the
-	 * next I/O to steal it.
-	 */
-	list_del(&icb->icb_list);
-	list_add(&icb->icb_list, &ic->ic_lru);
+	ar->ar_busy = false;
+	aa->aa_free[aa->aa_nr_free++] = ar - aa->aa_reqs;
+	aa->aa_inflight--;
+
+	return io_aio_complete(channel, &ar->ar_unit);
 }
 
-static void io_cache_disconnect(struct io_cache *ic,
-				struct io_cache_block *icb)
+/*
+ * Give up on everything the context holds.  I/Os the kernel has taken
+ * are reading into their owners' buffers, so they are waited out.  A
+ * failed io_uring hands what it never issued to a libaio context.  A
+ * failed libaio context fails it, and is rebuilt for the next caller.
+ */
+static void io_aio_abort(io_channel *channel)
 {
-	/*
-	 * This icb should longer be looked up.
-	 * If icb->icb_blkno is UINT64_MAX, it's already disconnected.
-	 */
-	if (icb->icb_blkno != UINT64_MAX) {
-		rb_erase(&icb->icb_node, &ic->ic_lookup);
-		memset(&icb->icb_node, 0, sizeof(struct rb_node));
-		icb->icb_blkno = UINT64_MAX;
+	int i, res;
+	uint64_t idx;
+	struct io_aio *aa = channel->io_aio;
+	struct io_aio_req *ar;
+
+	if (aa->aa_ring) {
+		while (o2_uring_retract(aa->aa_ring, &idx)) {
+			ar = &aa->aa_reqs[idx];
+			ar->ar_busy = false;
+			aa->aa_free[aa->aa_nr_free++] = idx;
+			aa->aa_inflight--;
+			if (io_aio_queue_push(&aa->aa_pending, &ar->ar_unit)) {
+				ar->ar_unit.au_ret = OCFS2_ET_NO_MEMORY;
+				io_aio_complete(channel, &ar->ar_unit);
+			}
+		}
+
+		while (aa->aa_inflight) {
+			o2_uring_wait_out(aa->aa_ring, &idx, &res);
+			io_aio_finish(channel, &aa->aa_reqs[idx], res);
+		}
+
+		o2_uring_free(aa->aa_ring);
+		aa->aa_ring = NULL;
+	} else {
+		/* io_destroy() waits for whatever is in flight */
+		if (aa->aa_ctx)
+			io_queue_release(aa->aa_ctx);
+		aa->aa_ctx = NULL;
+		for (i = 0; i < aa->aa_depth; i++)
+			if (aa->aa_reqs[i].ar_busy)
+				io_aio_finish(channel, &aa->aa_reqs[i],
+					      -ECANCELED);
+		io_aio_fail_pending(channel);
 	}
+
+	/* Without a context, io_aio_submit_pending() fails everything */
+	if (io_queue_init(aa->aa_depth, &aa->aa_ctx))
+		aa->aa_ctx = NULL;
+	aa->aa_wait_failures = 0;
 }
 
-static struct io_cache_block *io_cache_pop_lru(struct io_cache *ic)
+/* The caller has already paused; see io_aio_getevents() */
+static void io_aio_wait_failed(io_channel *channel)
 {
-	struct io_cache_block *icb;
-
-	icb = list_entry(ic->ic_lru.next, struct io_cache_block, icb_list);
-	io_cache_disconnect(ic, icb);
-	ic->ic_removes++;
+	struct io_aio *aa = channel->io_aio;
 
-	return icb;
+	if (++aa->aa_wait_failures >= IO_AIO_MAX_WAIT_FAILURES)
+		io_aio_abort(channel);
+}
+
+/*
+ * Wait for at least min_nr completions, then refill the queue.  Called
+ * with io_aio_lock held.
+ *
+ * Only one thread reaps at a time.  The reaper drops io_aio_lock while
+ * it sleeps in the kernel, so other threads can queue I/O and claim
+ * units that have landed.  Only the reaper touches the context or the
+ * ring's completions, and only it may abort them.  A thread that finds
+ * someone else reaping sleeps on io_aio_cond until they are done, then
+ * returns so the caller can look again for what it wanted.
+ *
+ * Every completion that has arrived is reaped, even after an error, so
+ * that no unit is left finished but uncounted.  The first error wins.
+ */
+static errcode_t io_aio_getevents(io_channel *channel, int min_nr)
+{
+	int i, rc = 0, res, nr = 0;
+	uint64_t idx;
+	errcode_t ret = 0, err;
+	struct io_aio *aa = channel->io_aio;
+
+	if (aa->aa_reaping) {
+		pthread_cond_wait(&channel->io_aio_cond,
+				  &channel->io_aio_lock);
+		return 0;
+	}
+
+	if (min_nr > aa->aa_inflight)
+		min_nr = aa->aa_inflight;
+
+	aa->aa_reaping = true;
+	pthread_mutex_unlock(&channel->io_aio_lock);
+
+	if (aa->aa_ring) {
+		rc = o2_uring_wait_cq(aa->aa_ring, min_nr);
+	} else {
+		nr = io_getevents(aa->aa_ctx, min_nr, aa->aa_depth,
+				  aa->aa_events, NULL);
+		if (nr < 0) {
+			rc = (nr == -EINTR) ? 0 : nr;
+			nr = 0;
+		}
+	}
+
+	/* A wait that failed is retried after a pause */
+	if (rc && (aa->aa_wait_failures + 1 < IO_AIO_MAX_WAIT_FAILURES))
+		usleep(1000 << (aa->aa_wait_failures + 1));
+
+	pthread_mutex_lock(&channel->io_aio_lock);
+
+	if (rc && (rc != -EAGAIN) && (rc != -EBUSY)) {
+		channel->io_error = -rc;
+		ret = OCFS2_ET_IO;
+	}
+
+	if (aa->aa_ring) {
+		while (o2_uring_reap(aa->aa_ring, &idx, &res)) {
+			err = io_aio_finish(channel, &aa->aa_reqs[idx], res);
+			if (err && !ret)
+				ret = err;
+			nr++;
+		}
+	} else {
+		for (i = 0; i < nr; i++) {
+			err = io_aio_finish(channel,
+				io_aio_iocb_req(aa->aa_events[i].obj),
+				(long)aa->aa_events[i].res);
+			if (err && !ret)
+				ret = err;
+		}
+	}
+
+	if (nr)
+		aa->aa_wait_failures = 0;
+	else if (rc)
+		io_aio_wait_failed(channel);
+
+	err = io_aio_submit_pending(channel);
+
+	aa->aa_reaping = false;
+	pthread_cond_broadcast(&channel->io_aio_cond);
+
+	return ret ? ret : err;
+}
+
+static errcode_t io_aio_queue_units(io_channel *channel,
+				    struct io_vec_unit *ivus, int count,
+				    struct io_aio_sync *sync)
+{
+	int i;
+	errcode_t ret;
+	struct io_aio_unit au = {
+		.au_sync = sync,
+		.au_gen = io_write_gen(channel),
+	};
+
+	ret = io_aio_init(channel);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		au.au_ivu = &ivus[i];
+		ret = io_aio_queue_push(&channel->io_aio->aa_pending, &au);
+		if (ret)
+			break;
+		if (sync)
+			sync->as_left++;
+	}
+
+	/*
+	 * A unit that is queued reports trouble submitting it as its
+	 * own status, so only a unit that never got queued fails here.
+	 */
+	io_aio_submit_pending(channel);
+
+	return ret;
+}
+
+static errcode_t unix_vec_read_blocks(io_channel *channel,
+				      struct io_vec_unit *ivus, int count)
+{
+	errcode_t ret;
+	struct io_aio *aa;
+	struct io_aio_sync sync = { 0, 0 };
+
+	if (!count)
+		return 0;
+
+	pthread_mutex_lock(&channel->io_aio_lock);
+
+	ret = io_aio_queue_units(channel, ivus, count, &sync);
+	aa = channel->io_aio;
+	if (!aa)
+		goto out;
+
+	/*
+	 * Even when queueing fails, the units that made it into the
+	 * queue are reading into the caller's buffers.  We can't return
+	 * until all of them are done, so a failed wait is just tried
+	 * again.  Waits that keep failing abort the queue, which fails
+	 * every unit.
+	 */
+	while (sync.as_left) {
+		if (!aa->aa_inflight && !aa->aa_pending.aq_count)
+			break;
+		io_aio_getevents(channel, sync.as_left);
+	}
+
+	if (!ret)
+		ret = sync.as_ret;
+
+out:
+	pthread_mutex_unlock(&channel->io_aio_lock);
+	return ret;
+}
+
+/* Take the sync ring if it's free and still working */
+static bool unix_uring_trylock(io_channel *channel)
+{
+	if (!channel->io_uring ||
+	    pthread_mutex_trylock(&channel->io_uring_lock))
+		return false;
+
+	if (!channel->io_uring_failed)
+		return true;
+
+	pthread_mutex_unlock(&channel->io_uring_lock);
+	return false;
+}
+
+/*
+ * Returns false if the I/O wasn't done, in which case the caller falls
+ * back to pread/pwrite.  Otherwise *done is what they would return.
+ */
+static bool unix_uring_rw(io_channel *channel, bool write, void *buf,
+			  size_t count, uint64_t offset, ssize_t *done)
+{
+	int rc, res;
+
+	if (!unix_uring_trylock(channel))
+		return false;
+
+	rc = o2_uring_rw(channel->io_uring, write, channel->io_fd, buf,
+			 count, offset, &res);
+	if (rc)
+		channel->io_uring_failed = true;
+	pthread_mutex_unlock(&channel->io_uring_lock);
+
+	if (rc)
+		return false;
+
+	if (res < 0) {
+		errno = -res;
+		*done = -1;
+	} else
+		*done = res;
+
+	return true;
+}
+
+static ssize_t unix_pread(io_channel *channel, void *buf, size_t count,
+			  uint64_t offset)
+{
+	ssize_t rd;
+
+	if (unix_uring_rw(channel, false, buf, count, offset, &rd))
+		return rd;
+
+	return pread64(channel->io_fd, buf, count, offset);
+}
+
+static ssize_t unix_pwrite(io_channel *channel, const void *buf,
+			   size_t count, uint64_t offset)
+{
+	ssize_t wr;
+
+	if (unix_uring_rw(channel, true, (void *)buf, count, offset, &wr))
+		return wr;
+
+	return pwrite64(channel->io_fd, buf, count, offset);
+}
+
+static errcode_t unix_io_read_block(io_channel *channel, int64_t blkno,
+				    int count, char *data)
+{
+	int ret;
+	ssize_t size, tot, rd;
+	uint64_t location;
+
+	/* -ative means count is in bytes */
+	size = (count < 0) ? -count : count * channel->io_blksize;
+	location = blkno * channel->io_blksize;
+
+	tot = 0;
+	while (tot < size) {
+		rd = unix_pread(channel, data + tot, size - tot,
+				location + tot);
+		ret = OCFS2_ET_IO;
+		if (rd < 0) {
+			channel->io_error = errno;
+			goto out;
+		}
+
+		if (!rd) 
+			goto out;
+
+		tot += rd;
+	}
+
+	ret = 0;
+
+out:
+	if (!ret && tot != size) {
+		ret = OCFS2_ET_SHORT_READ;
+		memset(data + tot, 0, size - tot);
+	}
+
+	io_count_bytes(&channel->io_bytes_read, tot);
+
+	return ret;
+}
+
+/*
+ * Read a contiguous run of blocks into separate buffers, one block
+ * each.  A short read falls back to unix_io_read_block() for the block
+ * it landed in, which takes care of EOF.
+ */
+#define IO_READV_MAX_BLOCKS	64
+
+/*
+ * With io_uring, each block is its own read.  The buffers are usually
+ * cache blocks, so they are in the registered buffer and the kernel
+ * doesn't have to map them.  Returns the number of blocks read from the
+ * front of the run.
+ */
+static int unix_uring_readv_blocks(io_channel *channel, int64_t blkno,
+				   int count, char **bufs)
+{
+	int i, nr, res, good = 0;
+	uint64_t idx;
+	bool done[IO_READV_MAX_BLOCKS] = { false, };
+
+	nr = o2_uring_sq_space(channel->io_uring);
+	if (nr > count)
+		nr = count;
+	if (nr > IO_READV_MAX_BLOCKS)
+		nr = IO_READV_MAX_BLOCKS;
+
+	for (i = 0; i < nr; i++)
+		o2_uring_prep_rw(channel->io_uring, false, channel->io_fd,
+				 bufs[i], channel->io_blksize,
+				 (blkno + i) * channel->io_blksize, i);
+
+	/*
+	 * The reads land in the caller's buffers, so all of them are
+	 * reaped before we return, however submitting or waiting goes.
+	 * If the ring fails, reads it never took are dropped and the
+	 * rest are waited out.
+	 */
+	o2_uring_submit(channel->io_uring, nr);
+	for (i = 0; i < nr; ) {
+		if (channel->io_uring_failed)
+			o2_uring_wait_out(channel->io_uring, &idx, &res);
+		else if (o2_uring_wait(channel->io_uring, &idx, &res)) {
+			channel->io_uring_failed = true;
+			while (o2_uring_retract(channel->io_uring, &idx))
+				i++;
+			continue;
+		}
+		if (idx >= nr)
+			continue;	/* Not one of ours */
+		i++;
+		if (res > 0)
+			io_count_bytes(&channel->io_bytes_read, res);
+		done[idx] = (res == channel->io_blksize);
+	}
+
+	while ((good < nr) && done[good])
+		good++;
+
+	return good;
+}
+
+static errcode_t unix_io_readv_blocks(io_channel *channel, int64_t blkno,
+				      int count, char **bufs)
+{
+	int i, nr, done = 0;
+	ssize_t rd;
+	errcode_t ret;
+	struct iovec iov[IO_READV_MAX_BLOCKS];
+
+	if (unix_uring_trylock(channel)) {
+		while ((done < count) && !channel->io_uring_failed) {
+			nr = unix_uring_readv_blocks(channel, blkno + done,
+						     count - done,
+						     bufs + done);
+			if (!nr)
+				break;
+			done += nr;
+		}
+		pthread_mutex_unlock(&channel->io_uring_lock);
+	}
+
+	while (done < count) {
+		nr = count - done;
+		if (nr > IO_READV_MAX_BLOCKS)
+			nr = IO_READV_MAX_BLOCKS;
+		for (i = 0; i < nr; i++) {
+			iov[i].iov_base = bufs[done + i];
+			iov[i].iov_len = channel->io_blksize;
+		}
+
+		rd = preadv64(channel->io_fd, iov, nr,
+			      (blkno + done) * channel->io_blksize);
+		if (rd < 0) {
+			channel->io_error = errno;
+			return OCFS2_ET_IO;
+		}
+
+		io_count_bytes(&channel->io_bytes_read, rd);
+		nr = rd / channel->io_blksize;
+		if (!nr) {
+			ret = unix_io_read_block(channel, blkno + done, 1,
+						 bufs[done]);
+			if (ret)
+				return ret;
+			nr = 1;
+		}
+		done += nr;
+	}
+
+	return 0;
+}
+
+static errcode_t unix_io_write_block_full(io_channel *channel, int64_t blkno,
+					  int count, const char *data,
+					  int *completed)
+{
+	int ret;
+	ssize_t size, tot, wr;
+	uint64_t location;
+
+	/* -ative means count is in bytes */
+	size = (count < 0) ? -count : count * channel->io_blksize;
+	location = blkno * channel->io_blksize;
+
+	io_write_begin(channel);
+	tot = 0;
+	while (tot < size) {
+		wr = unix_pwrite(channel, data + tot, size - tot,
+				 location + tot);
+		ret = OCFS2_ET_IO;
+		if (wr < 0) {
+			channel->io_error = errno;
+			goto out;
+		}
+
+		if (!wr) 
+			goto out;
+
+		tot += wr;
+	}
+
+	ret = 0;
+out:
+	io_write_end(channel);
+	if (completed)
+		*completed = tot / channel->io_blksize;
+	if (!ret && (tot != size))
+		ret = OCFS2_ET_SHORT_WRITE;
+
+	io_count_bytes(&channel->io_bytes_written, tot);
+
+	return ret;
+}
+
+static errcode_t unix_io_write_block(io_channel *channel, int64_t blkno,
+				     int count, const char *data)
+{
+	return unix_io_write_block_full(channel, blkno, count, data, NULL);
+}
+
+/*
+ * Write-back.  Dirty blocks are looked up, inserted, and flushed under
+ * ic->ic_dirty_lock.
+ */
+#define IO_WRITEV_MAX_BLOCKS	256
+
+/* The dirty block for blkno or, without one, the first one after it */
+static struct io_dirty_block *io_dirty_first(struct io_cache *ic,
+					     uint64_t blkno)
+{
+	struct rb_node *p = ic->ic_dirty.rb_node;
+	struct io_dirty_block *db, *after = NULL;
+
+	while (p) {
+		db = rb_entry(p, struct io_dirty_block, db_node);
+		if (blkno < db->db_blkno) {
+			after = db;
+			p = p->rb_left;
+		} else if (blkno > db->db_blkno) {
+			p = p->rb_right;
+		} else
+			return db;
+	}
+
+	return after;
+}
+
+static inline struct io_dirty_block *io_dirty_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct io_dirty_block, db_node) : NULL;
+}
+
+static void io_dirty_insert(struct io_cache *ic,
+			    struct io_dirty_block *insert_db)
+{
+	struct rb_node **p = &ic->ic_dirty.rb_node;
+	struct rb_node *parent = NULL;
+	struct io_dirty_block *db;
+
+	while (*p) {
+		parent = *p;
+		db = rb_entry(parent, struct io_dirty_block, db_node);
+		if (insert_db->db_blkno < db->db_blkno)
+			p = &(*p)->rb_left;
+		else if (insert_db->db_blkno > db->db_blkno)
+			p = &(*p)->rb_right;
+		else
+			assert(0);  /* The caller looked it up first */
+	}
+
+	rb_link_node(&insert_db->db_node, parent, p);
+	rb_insert_color(&insert_db->db_node, &ic->ic_dirty);
+	ic->ic_nr_dirty++;
+}
+
+/* Copy the dirty blocks in [blkno, blkno + count) over what we read */
+static void io_dirty_patch(io_channel *channel, uint64_t blkno, int count,
+			   char *data)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_dirty_block *db;
+
+	if (!ic->ic_dirty_max)
+		return;
+
+	pthread_mutex_lock(&ic->ic_dirty_lock);
+	for (db = io_dirty_first(ic, blkno);
+	     db && (db->db_blkno < blkno + count);
+	     db = io_dirty_entry(rb_next(&db->db_node)))
+		memcpy(data + ((db->db_blkno - blkno) * channel->io_blksize),
+		       db->db_buf, channel->io_blksize);
+	pthread_mutex_unlock(&ic->ic_dirty_lock);
+}
+
+static void io_dirty_patch_vec(io_channel *channel, struct io_vec_unit *ivus,
+			       int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		io_dirty_patch(channel, ivus[i].ivu_blkno,
+			       ivus[i].ivu_buflen / channel->io_blksize,
+			       ivus[i].ivu_buf);
+}
+
+/* How the cache engines read from disk */
+static errcode_t io_cache_disk_read(io_channel *channel, int64_t blkno,
+				    int count, char *data)
+{
+	errcode_t ret;
+
+	ret = unix_io_read_block(channel, blkno, count, data);
+	if (!ret)
+		io_dirty_patch(channel, blkno, count, data);
+
+	return ret;
+}
+
+/*
+ * Write a contiguous run of blocks from separate buffers.  As with
+ * unix_io_readv_blocks(), a write that stops inside a block finishes
+ * it with unix_io_write_block().
+ */
+static errcode_t unix_io_writev_blocks(io_channel *channel, int64_t blkno,
+				       int count, char **bufs)
+{
+	int i, nr, done = 0;
+	ssize_t wr;
+	errcode_t ret = 0;
+	struct iovec iov[IO_WRITEV_MAX_BLOCKS];
+
+	io_write_begin(channel);
+	while (done < count) {
+		nr = count - done;
+		if (nr > IO_WRITEV_MAX_BLOCKS)
+			nr = IO_WRITEV_MAX_BLOCKS;
+		for (i = 0; i < nr; i++) {
+			iov[i].iov_base = bufs[done + i];
+			iov[i].iov_len = channel->io_blksize;
+		}
+
+		wr = pwritev64(channel->io_fd, iov, nr,
+			       (blkno + done) * channel->io_blksize);
+		if (wr < 0) {
+			channel->io_error = errno;
+			ret = OCFS2_ET_IO;
+			break;
+		}
+
+		io_count_bytes(&channel->io_bytes_written, wr);
+		nr = wr / channel->io_blksize;
+		if (!nr) {
+			ret = unix_io_write_block(channel, blkno + done, 1,
+						  bufs[done]);
+			if (ret)
+				break;
+			nr = 1;
+		}
+		done += nr;
+	}
+	io_write_end(channel);
+
+	return ret;
+}
+
+/*
+ * Write out every dirty block in block order, one run of adjacent
+ * blocks at a time.  A block stays dirty until it is on disk, so a
+ * failed flush loses nothing.
+ */
+static errcode_t io_dirty_flush(io_channel *channel)
+{
+	int i, nr;
+	errcode_t ret = 0;
+	struct io_cache *ic = channel->io_cache;
+	struct io_dirty_block *db, *run[IO_WRITEV_MAX_BLOCKS];
+	char *bufs[IO_WRITEV_MAX_BLOCKS];
+
+	db = io_dirty_entry(rb_first(&ic->ic_dirty));
+	while (db) {
+		nr = 0;
+		do {
+			run[nr] = db;
+			bufs[nr] = db->db_buf;
+			nr++;
+			db = io_dirty_entry(rb_next(&db->db_node));
+		} while (db && (nr < IO_WRITEV_MAX_BLOCKS) &&
+			 (db->db_blkno == run[nr - 1]->db_blkno + 1));
+
+		ret = unix_io_writev_blocks(channel, run[0]->db_blkno, nr,
+					    bufs);
+		if (ret)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			rb_erase(&run[i]->db_node, &ic->ic_dirty);
+			list_add_tail(&run[i]->db_list, &ic->ic_dirty_free);
+		}
+		ic->ic_nr_dirty -= nr;
+	}
+
+	return ret;
+}
+
+/*
+ * Copy the blocks into dirty buffers, flushing if we run out, and then
+ * sync the cache just as a write-through would.
+ */
+static errcode_t io_dirty_write_blocks(io_channel *channel, int64_t blkno,
+				       int count, const char *data,
+				       bool nocache)
+{
+	int i;
+	errcode_t ret = 0;
+	struct io_cache *ic = channel->io_cache;
+	struct io_dirty_block *db;
+	struct io_vec_unit ivu;
+
+	io_write_begin(channel);
+	pthread_mutex_lock(&ic->ic_dirty_lock);
+	for (i = 0; i < count; i++) {
+		db = io_dirty_first(ic, blkno + i);
+		if (!db || (db->db_blkno != blkno + i)) {
+			if (list_empty(&ic->ic_dirty_free)) {
+				ret = io_dirty_flush(channel);
+				if (ret)
+					break;
+			}
+			db = list_entry(ic->ic_dirty_free.next,
+					struct io_dirty_block, db_list);
+			list_del(&db->db_list);
+			db->db_blkno = blkno + i;
+			io_dirty_insert(ic, db);
+		}
+
+		memcpy(db->db_buf, data + ((size_t)i * channel->io_blksize),
+		       channel->io_blksize);
+	}
+	pthread_mutex_unlock(&ic->ic_dirty_lock);
+	io_write_end(channel);
+
+	if (i) {
+		ivu.ivu_blkno = blkno;
+		ivu.ivu_buf = (char *)data;
+		ivu.ivu_buflen = i * channel->io_blksize;
+		ic->ic_ops->vec_refresh(channel, &ivu, 1, nocache,
+					IO_WRITE_GEN_ANY);
+	}
+
+	return ret;
+}
+
+/*
+ * See if the rbtree has a block for the given block number.
+ *
+ * The rb_node garbage lets insertion share the search.  Trivial callers
+ * pass NULL.
+ */
+static struct io_cache_block *io_cache_lookup(struct io_cache *ic,
+					      uint64_t blkno)
+{
+	struct rb_node *p = ic->ic_lookup.rb_node;
+	struct io_cache_block *icb;
+
+	while (p) {
+		icb = rb_entry(p, struct io_cache_block, icb_node);
+		if (blkno < icb->icb_blkno) {
+			p = p->rb_left;
+		} else if (blkno > icb->icb_blkno) {
+			p = p->rb_right;
+		} else
+			return icb;
+	}
+
+	return NULL;
+}
+
+static void io_cache_insert(struct io_cache *ic,
+			    struct io_cache_block *insert_icb)
+{
+	struct rb_node **p = &ic->ic_lookup.rb_node;
+	struct rb_node *parent = NULL;
+	struct io_cache_block *icb = NULL;
+
+	while (*p) {
+		parent = *p;
+		icb = rb_entry(parent, struct io_cache_block, icb_node);
+		if (insert_icb->icb_blkno < icb->icb_blkno) {
+			p = &(*p)->rb_left;
+			icb = NULL;
+		} else if (insert_icb->icb_blkno > icb->icb_blkno) {
+			p = &(*p)->rb_right;
+			icb = NULL;
+		} else
+			assert(0);  /* We erased it, remember? */
+	}
+
+	rb_link_node(&insert_icb->icb_node, parent, p);
+	rb_insert_color(&insert_icb->icb_node, &ic->ic_lookup);
+	ic->ic_inserts++;
+}
+
+static void io_cache_seen(struct io_cache *ic, struct io_cache_block *icb)
+{
+	/* Pinned blocks stay off the LRU until io_cache_unpin() */
+	if (icb->icb_pins)
+		return;
+
+	/* Move to the front of the LRU */
+	list_del(&icb->icb_list);
+	list_add_tail(&icb->icb_list, &ic->ic_lru);
+}
+
+static void io_cache_unsee(struct io_cache *ic, struct io_cache_block *icb)
+{
+	/*
+	 * Move to the end of the LRU.  There's no point in removing an
+	 * "unseen" buffer from the cache.  It's valid, but we want the
+	 * next I/O to steal it.
+	 */
+	if (icb->icb_pins)
+		return;
+
+	list_del(&icb->icb_list);
+	list_add(&icb->icb_list, &ic->ic_lru);
+}
+
+static void io_cache_disconnect(struct io_cache *ic,
+				struct io_cache_block *icb)
+{
+	/*
+	 * This icb should longer be looked up.
+	 * If icb->icb_blkno is UINT64_MAX, it's already disconnected.
+	 */
+	if (icb->icb_blkno != UINT64_MAX) {
+		rb_erase(&icb->icb_node, &ic->ic_lookup);
+		memset(&icb->icb_node, 0, sizeof(struct rb_node));
+		icb->icb_blkno = UINT64_MAX;
+	}
+}
+
+/* Returns NULL when every block in the cache is pinned */
+static struct io_cache_block *io_cache_pop_lru(struct io_cache *ic)
+{
+	struct io_cache_block *icb;
+
+	if (list_empty(&ic->ic_lru))
+		return NULL;
+
+	icb = list_entry(ic->ic_lru.next, struct io_cache_block, icb_list);
+	if (icb->icb_blkno != UINT64_MAX)
+		ic->ic_evictions++;
+	io_cache_disconnect(ic, icb);
+	ic->ic_removes++;
+
+	return icb;
+}
+
+static void io_cache_pin(struct io_cache *ic, struct io_cache_block *icb)
+{
+	if (!icb->icb_pins++)
+		list_del(&icb->icb_list);
+}
+
+static void io_cache_unpin(struct io_cache *ic, struct io_cache_block *icb)
+{
+	if (--icb->icb_pins)
+		return;
+
+	/* A buffer that never got a block goes where it is reused first */
+	if (icb->icb_blkno == UINT64_MAX)
+		list_add(&icb->icb_list, &ic->ic_lru);
+	else
+		list_add_tail(&icb->icb_list, &ic->ic_lru);
+}
+
+static inline struct io_cache_block *io_cache_buf_to_icb(io_channel *channel,
+							 char *buf)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb_list = ic->ic_metadata_buffer;
+
+	return icb_list + ((buf - ic->ic_data_buffer) / channel->io_blksize);
+}
+
+static void io_lru_vec_refresh(io_channel *channel, struct io_vec_unit *ivus,
+			       int count, bool nocache, uint64_t gen)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb;
+	int i, j, blksize = channel->io_blksize;
+	uint64_t blkno;
+	uint32_t numblks;
+	char *buf;
+
+	/* LRU writers hold off refreshes for the whole write */
+	if (!io_write_gen_current(channel, gen))
+		return;
+
+	for (i = 0; i < count; i++) {
+		blkno = ivus[i].ivu_blkno;
+		numblks = ivus[i].ivu_buflen / blksize;
+		buf = ivus[i].ivu_buf;
+
+		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
+			icb = io_cache_lookup(ic, blkno);
+			if (!icb) {
+				if (nocache)
+					continue;
+				icb = io_cache_pop_lru(ic);
+				if (!icb)
+					continue;
+				icb->icb_blkno = blkno;
+				io_cache_insert(ic, icb);
+			}
+
+			memcpy(icb->icb_buf, buf, blksize);
+
+			if (nocache)
+				io_cache_unsee(ic, icb);
+			else
+				io_cache_seen(ic, icb);
+		}
+	}
+}
+
+/*
+ * This relies on the fact that our cache is always up to date.  If a
+ * block is in the cache, the same thing is on disk.  Even if we re-read
+ * the disk block, we don't need to update the cache.  This allows us
+ * to look for optimal I/O sizes; it's better to call one read 1MB of
+ * half-cached blocks than to read every other block.
+ *
+ * If the caller specifies "nocache", we still want to give them anything
+ * we found in the cache, but we want cached blocks moved to the front
+ * of the LRU.  That way they get stolen first.
+ */
+static errcode_t io_lru_read_blocks(io_channel *channel, int64_t blkno,
+				    int count, char *data, bool nocache)
+{
+	int i, good_blocks;
+	errcode_t ret = 0;
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb;
+
+	/*
+	 * Here we check two things:
+	 *
+	 * 1) Are all the blocks cached?  If so, we can skip I/O.
+	 * 2) If they are not all cached, we want to start our read at the
+	 *    first uncached blkno.
+	 */
+	for (good_blocks = 0; good_blocks < count; good_blocks++) {
+		icb = io_cache_lookup(ic, blkno + good_blocks);
+		if (!icb)
+			break;
+		ic->ic_hits++;
+	}
+
+	/* Read any blocks not in the cache */
+	if (good_blocks < count) {
+		ic->ic_misses += (count - good_blocks);
+		ret = io_cache_disk_read(channel, blkno + good_blocks,
+					 count - good_blocks,
+					 data + (channel->io_blksize *
+						 good_blocks));
+		if (ret)
+			goto out;
+	}
+
+	/* Now we sync up the cache with the data buffer */
+	for (i = 0; i < count; i++, data += channel->io_blksize) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (i < good_blocks) {
+			/*
+			 * We skipped reading this because it was in the
+			 * cache.  Copy it to the data buffer.
+			 */
+			assert(icb);
+			memcpy(data, icb->icb_buf, channel->io_blksize);
+		} else if (!icb) {
+			if (nocache)
+				continue;
+
+			/* Steal the LRU buffer */
+			icb = io_cache_pop_lru(ic);
+			if (!icb)
+				continue;
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, icb);
+
+			/*
+			 * We did I/O into the data buffer, now update
+			 * the cache.
+			 */
+			memcpy(icb->icb_buf, data, channel->io_blksize);
+		}
+		/*
+		 * What about if ((i >= good_blocks) && icb)?  That means
+		 * we had the buffer in the cache, but we read it anyway
+		 * to get a single I/O.  Our cache guarantees that the
+		 * contents will match, so we just skip to marking the
+		 * buffer seen.
+		 */
+
+		if (nocache)
+			io_cache_unsee(ic, icb);
+		else
+			io_cache_seen(ic, icb);
+	}
+
+out:
+	return ret;
+}
+
+static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
+				     int count, char *data, bool nocache)
+
+{
+	int todo = one_meg_of_blocks(channel);
+	errcode_t ret = 0;
+
+	/*
+	 * We do this in one meg hunks so that each hunk has an
+	 * opportunity to be in cache, but we get a good throughput.
+	 */
+	while (count) {
+		if (todo > count)
+			todo = count;
+		ret = channel->io_cache->ic_ops->read_blocks(channel, blkno,
+							     todo, data,
+							     nocache);
+		if (ret)
+			break;
+
+		blkno += todo;
+		count -= todo;
+		data += (channel->io_blksize * todo);
+	}
+
+	return ret;
+}
+
+/*
+ * This relies on the fact that our cache is always up to date.  If a
+ * block is in the cache, the same thing is on disk.  So here we'll write
+ * a whole stream and update the cache as needed.
+ */
+static errcode_t io_lru_write_blocks(io_channel *channel, int64_t blkno,
+				     int count, const char *data,
+				     bool nocache)
+{
+	int i, completed = 0;
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb;
+
+	/* Get the write out of the way */
+	ret = unix_io_write_block_full(channel, blkno, count, data,
+				       &completed);
+
+	/*
+	 * Now we sync up the cache with the data buffer.  We have
+	 * to sync up I/O that completed, even if the entire I/O did not.
+	 *
+	 * In the nocache case, we want to skip blocks that weren't in the
+	 * cache, but we want to update blocks that where.  Even though
+	 * the caller specified "don't cache this", it's already in the
+	 * cache.  We don't want stale data.
+	 */
+	for (i = 0; i < completed; i++, data += channel->io_blksize) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (!icb) {
+			if (nocache)
+				continue;
+
+			/*
+			 * Steal the LRU buffer.  We can't error here, so
+			 * we can safely insert it before we copy the data.
+			 * If everything is pinned, the block just isn't
+			 * cached.
+			 */
+			icb = io_cache_pop_lru(ic);
+			if (!icb)
+				continue;
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, icb);
+		}
+
+		memcpy(icb->icb_buf, data, channel->io_blksize);
+		if (nocache)
+			io_cache_unsee(ic, icb);
+		else
+			io_cache_seen(ic, icb);
+	}
+
+	return ret;
+}
+
+static errcode_t io_cache_write_block(io_channel *channel, int64_t blkno,
+				      int count, const char *data,
+				      bool nocache)
+{
+	int todo = one_meg_of_blocks(channel);
+	errcode_t ret = 0;
+
+	/*
+	 * Unlike io_read_cache_block(), we're going to do all of the
+	 * I/O no matter what.  We keep the separation of
+	 * io_cache_write_block() and the engine's write_blocks() for
+	 * consistency.
+	 */
+	if (!channel->io_cache->ic_dirty_max)
+		return channel->io_cache->ic_ops->write_blocks(channel, blkno,
+							       count, data,
+							       nocache);
+
+	/* Write-back syncs the cache in the same hunks as reads */
+	while (count) {
+		if (todo > count)
+			todo = count;
+		ret = io_dirty_write_blocks(channel, blkno, todo, data,
+					    nocache);
+		if (ret)
+			break;
+
+		blkno += todo;
+		count -= todo;
+		data += (channel->io_blksize * todo);
+	}
+
+	return ret;
 }
 
 /*
  * Unlike its sync counterpart, this function issues ios even for cached blocks.
  */
-static errcode_t io_cache_vec_read_blocks(io_channel *channel,
-					  struct io_vec_unit *ivus,
-					  int count, bool nocache)
+static errcode_t io_cache_vec_read_blocks(io_channel *channel,
+					  struct io_vec_unit *ivus,
+					  int count, bool nocache)
+{
+	errcode_t ret;
+
+	/*
+	 * Read all blocks. We could extend this to not issue ios for already
+	 * cached blocks. But is it worth the effort?
+	 */
+	uint64_t gen = io_write_gen(channel);
+
+	ret = unix_vec_read_blocks(channel, ivus, count);
+	if (!ret) {
+		io_dirty_patch_vec(channel, ivus, count);
+		channel->io_cache->ic_ops->vec_refresh(channel, ivus, count,
+						       nocache, gen);
+	}
+
+	return ret;
+}
+
+static errcode_t io_lru_init(io_channel *channel, struct io_cache *ic)
+{
+	int i;
+	char *dbuf;
+	struct io_cache_block *icb_list;
+	errcode_t ret;
+
+	ic->ic_lookup = RB_ROOT;
+	INIT_LIST_HEAD(&ic->ic_lru);
+	pthread_mutex_init(&ic->ic_lru_lock, NULL);
+
+	ret = ocfs2_malloc0(sizeof(struct io_cache_block) * ic->ic_nr_blocks,
+			    &ic->ic_metadata_buffer);
+	if (ret)
+		return ret;
+	ic->ic_metadata_buffer_len =
+		(unsigned long)ic->ic_nr_blocks * sizeof(struct io_cache_block);
+
+	icb_list = ic->ic_metadata_buffer;
+	dbuf = ic->ic_data_buffer;
+	for (i = 0; i < ic->ic_nr_blocks; i++) {
+		icb_list[i].icb_blkno = UINT64_MAX;
+		icb_list[i].icb_buf = dbuf;
+		dbuf += channel->io_blksize;
+		list_add_tail(&icb_list[i].icb_list, &ic->ic_lru);
+	}
+
+	return 0;
+}
+
+static void io_lru_get_stats(struct io_cache *ic,
+			     struct ocfs2_io_stats *stats)
+{
+	stats->is_cache_hits = ic->ic_hits;
+	stats->is_cache_misses = ic->ic_misses;
+	stats->is_cache_inserts = ic->ic_inserts;
+	stats->is_cache_removes = ic->ic_removes;
+	stats->is_cache_evictions = ic->ic_evictions;
+}
+
+static errcode_t io_lru_pin_block(io_channel *channel, uint64_t blkno,
+				  char **buf, bool *missed)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb;
+
+	icb = io_cache_lookup(ic, blkno);
+	if (icb) {
+		ic->ic_hits++;
+		*missed = false;
+	} else {
+		icb = io_cache_pop_lru(ic);
+		if (!icb)
+			return OCFS2_ET_NO_MEMORY;
+		ic->ic_misses++;
+		*missed = true;
+	}
+
+	io_cache_pin(ic, icb);
+	*buf = icb->icb_buf;
+
+	return 0;
+}
+
+static void io_lru_publish_block(io_channel *channel, uint64_t blkno,
+				 char **buf)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb = io_cache_buf_to_icb(channel, *buf);
+	struct io_cache_block *other;
+
+	/*
+	 * Another thread, or a plain read, may have cached the block
+	 * while we were reading it.  Theirs wins; it might have been
+	 * written since.  Our buffer goes back to be reused first.
+	 */
+	other = io_cache_lookup(ic, blkno);
+	if (other) {
+		io_cache_pin(ic, other);
+		io_cache_unpin(ic, icb);
+		*buf = other->icb_buf;
+		return;
+	}
+
+	icb->icb_blkno = blkno;
+	io_cache_insert(ic, icb);
+}
+
+static void io_lru_unpin_block(io_channel *channel, char *buf)
+{
+	io_cache_unpin(channel->io_cache, io_cache_buf_to_icb(channel, buf));
+}
+
+/*
+ * The LRU engine is single threaded at heart.  One lock around each
+ * operation lets threaded callers share it; they just don't scale.
+ */
+static errcode_t io_lru_locked_read_blocks(io_channel *channel, int64_t blkno,
+					   int count, char *data,
+					   bool nocache)
+{
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+
+	pthread_mutex_lock(&ic->ic_lru_lock);
+	ret = io_lru_read_blocks(channel, blkno, count, data, nocache);
+	pthread_mutex_unlock(&ic->ic_lru_lock);
+
+	return ret;
+}
+
+static errcode_t io_lru_locked_write_blocks(io_channel *channel,
+					    int64_t blkno, int count,
+					    const char *data, bool nocache)
+{
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+
+	pthread_mutex_lock(&ic->ic_lru_lock);
+	ret = io_lru_write_blocks(channel, blkno, count, data, nocache);
+	pthread_mutex_unlock(&ic->ic_lru_lock);
+
+	return ret;
+}
+
+static void io_lru_locked_vec_refresh(io_channel *channel,
+				      struct io_vec_unit *ivus, int count,
+				      bool nocache, uint64_t gen)
+{
+	struct io_cache *ic = channel->io_cache;
+
+	pthread_mutex_lock(&ic->ic_lru_lock);
+	io_lru_vec_refresh(channel, ivus, count, nocache, gen);
+	pthread_mutex_unlock(&ic->ic_lru_lock);
+}
+
+static errcode_t io_lru_locked_pin_block(io_channel *channel, uint64_t blkno,
+					 char **buf, bool *missed)
+{
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+
+	pthread_mutex_lock(&ic->ic_lru_lock);
+	ret = io_lru_pin_block(channel, blkno, buf, missed);
+	pthread_mutex_unlock(&ic->ic_lru_lock);
+
+	return ret;
+}
+
+static void io_lru_locked_publish_block(io_channel *channel, uint64_t blkno,
+					char **buf)
+{
+	struct io_cache *ic = channel->io_cache;
+
+	pthread_mutex_lock(&ic->ic_lru_lock);
+	io_lru_publish_block(channel, blkno, buf);
+	pthread_mutex_unlock(&ic->ic_lru_lock);
+}
+
+static void io_lru_locked_unpin_block(io_channel *channel, char *buf)
+{
+	struct io_cache *ic = channel->io_cache;
+
+	pthread_mutex_lock(&ic->ic_lru_lock);
+	io_lru_unpin_block(channel, buf);
+	pthread_mutex_unlock(&ic->ic_lru_lock);
+}
+
+static struct io_cache_operations io_lru_ops = {
+	.name		= "lru",
+	.init		= io_lru_init,
+	.read_blocks	= io_lru_locked_read_blocks,
+	.write_blocks	= io_lru_locked_write_blocks,
+	.vec_refresh	= io_lru_locked_vec_refresh,
+	.get_stats	= io_lru_get_stats,
+	.pin_block	= io_lru_locked_pin_block,
+	.publish_block	= io_lru_locked_publish_block,
+	.unpin_block	= io_lru_locked_unpin_block,
+};
+
+
+/*
+ * The hash engine.  Shards never share blocks, so a block is found,
+ * inserted, and evicted entirely under its shard's lock.
+ */
+#define IO_HASH_MAX_SHARD_BITS		6
+#define IO_HASH_MIN_SHARD_BLOCKS	256
+#define IO_HASH_EMPTY_SLOT		UINT32_MAX
+
+static inline uint64_t io_hash_blkno(uint64_t blkno)
+{
+	return blkno * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline struct io_hash_shard *io_hash_shard(struct io_cache *ic,
+						  uint64_t hash)
+{
+	if (!ic->ic_shard_bits)
+		return ic->ic_shards;
+	return ic->ic_shards + (hash >> (64 - ic->ic_shard_bits));
+}
+
+/* The home slot uses the hash bits below those picking the shard */
+static inline uint32_t io_hash_home(struct io_cache *ic, uint64_t hash)
+{
+	return (hash << ic->ic_shard_bits) >> (64 - ic->ic_slot_bits);
+}
+
+static inline char *io_hash_buf(io_channel *channel, struct io_cache *ic,
+				struct io_hash_block *hb)
+{
+	return ic->ic_data_buffer +
+		((hb - ic->ic_hash_blocks) * (size_t)channel->io_blksize);
+}
+
+static struct io_hash_block *io_hash_lookup(struct io_cache *ic,
+					    struct io_hash_shard *hs,
+					    uint64_t hash, uint64_t blkno)
+{
+	uint32_t mask = (1U << ic->ic_slot_bits) - 1;
+	uint32_t i = io_hash_home(ic, hash);
+	struct io_hash_block *hb;
+
+	for (; hs->hs_slots[i] != IO_HASH_EMPTY_SLOT; i = (i + 1) & mask) {
+		hb = ic->ic_hash_blocks + hs->hs_slots[i];
+		if (hb->hb_blkno == blkno)
+			return hb;
+	}
+
+	return NULL;
+}
+
+static void io_hash_insert(struct io_cache *ic, struct io_hash_shard *hs,
+			   uint64_t hash, struct io_hash_block *hb)
+{
+	uint32_t mask = (1U << ic->ic_slot_bits) - 1;
+	uint32_t i = io_hash_home(ic, hash);
+
+	while (hs->hs_slots[i] != IO_HASH_EMPTY_SLOT)
+		i = (i + 1) & mask;
+
+	hs->hs_slots[i] = hb - ic->ic_hash_blocks;
+	hs->hs_inserts++;
+}
+
+/*
+ * Linear probing lets us delete without tombstones.  Every entry in
+ * the probe run after the hole is shifted back into it unless its home
+ * slot lies cyclically in (hole, entry].
+ */
+static void io_hash_remove(struct io_cache *ic, struct io_hash_shard *hs,
+			   struct io_hash_block *hb)
+{
+	uint32_t mask = (1U << ic->ic_slot_bits) - 1;
+	uint32_t idx = hb - ic->ic_hash_blocks;
+	uint32_t i, j, home;
+
+	i = io_hash_home(ic, io_hash_blkno(hb->hb_blkno));
+	while (hs->hs_slots[i] != idx)
+		i = (i + 1) & mask;
+
+	for (j = (i + 1) & mask; hs->hs_slots[j] != IO_HASH_EMPTY_SLOT;
+	     j = (j + 1) & mask) {
+		home = io_hash_home(ic,
+			io_hash_blkno(ic->ic_hash_blocks[hs->hs_slots[j]].hb_blkno));
+		if ((i <= j) ? ((i < home) && (home <= j)) :
+			       ((i < home) || (home <= j)))
+			continue;
+		hs->hs_slots[i] = hs->hs_slots[j];
+		i = j;
+	}
+	hs->hs_slots[i] = IO_HASH_EMPTY_SLOT;
+
+	hb->hb_blkno = UINT64_MAX;
+	hb->hb_referenced = 0;
+}
+
+static inline struct io_hash_block *io_hash_buf_to_block(io_channel *channel,
+							 char *buf)
+{
+	struct io_cache *ic = channel->io_cache;
+
+	return ic->ic_hash_blocks +
+		((buf - ic->ic_data_buffer) / channel->io_blksize);
+}
+
+/* Victims come from the shard's own run of blocks */
+static inline struct io_hash_shard *io_hash_block_shard(struct io_cache *ic,
+							struct io_hash_block *hb)
+{
+	uint32_t shard = (hb - ic->ic_hash_blocks) / ic->ic_shard_blocks;
+
+	if (shard >= (1U << ic->ic_shard_bits))
+		shard = (1U << ic->ic_shard_bits) - 1;
+	return ic->ic_shards + shard;
+}
+
+/*
+ * Advance the CLOCK hand until it finds a block that is empty or has
+ * not been referenced since the last sweep.  Two passes over the shard
+ * find one unless everything is pinned, in which case we return NULL.
+ * The victim is returned disconnected from the table.
+ */
+static struct io_hash_block *io_hash_victim(struct io_cache *ic,
+					    struct io_hash_shard *hs)
+{
+	struct io_hash_block *hb;
+	uint32_t tries = hs->hs_nr_blocks * 2;
+
+	while (tries--) {
+		hb = ic->ic_hash_blocks + hs->hs_first + hs->hs_hand;
+		if (++hs->hs_hand == hs->hs_nr_blocks)
+			hs->hs_hand = 0;
+
+		if (hb->hb_pins)
+			continue;
+		if (hb->hb_blkno == UINT64_MAX)
+			goto found;
+		if (!hb->hb_referenced) {
+			io_hash_remove(ic, hs, hb);
+			hs->hs_evictions++;
+			goto found;
+		}
+		hb->hb_referenced = 0;
+	}
+
+	return NULL;
+
+found:
+	hs->hs_removes++;
+	return hb;
+}
+
+/*
+ * Sync one block we just did I/O for into the cache.  When the block
+ * came from a cache miss, a cached copy is already identical and is
+ * left alone.
+ */
+static void io_hash_refresh_block(io_channel *channel, uint64_t blkno,
+				  const char *data, bool nocache,
+				  bool missed, uint64_t gen)
 {
 	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
-	errcode_t ret = 0;
-	int i, j, blksize = channel->io_blksize;
-	uint64_t blkno;
-	uint32_t numblks;
-	char *buf;
+	uint64_t hash = io_hash_blkno(blkno);
+	struct io_hash_shard *hs = io_hash_shard(ic, hash);
+	struct io_hash_block *hb;
+
+	pthread_mutex_lock(&hs->hs_lock);
+	if (missed)
+		hs->hs_misses++;
 
 	/*
-	 * Read all blocks. We could extend this to not issue ios for already
-	 * cached blocks. But is it worth the effort?
+	 * Checked under the shard lock, so a write that started after
+	 * this can only refresh the block after we do.
 	 */
-	ret = unix_vec_read_blocks(channel, ivus, count);
-	if (ret)
+	if (!io_write_gen_current(channel, gen))
 		goto out;
 
-	/* refresh cache */
+	hb = io_hash_lookup(ic, hs, hash, blkno);
+	if (!hb) {
+		if (nocache)
+			goto out;
+		hb = io_hash_victim(ic, hs);
+		if (!hb)
+			goto out;
+		hb->hb_blkno = blkno;
+		io_hash_insert(ic, hs, hash, hb);
+		missed = false;
+	}
+
+	if (!missed)
+		memcpy(io_hash_buf(channel, ic, hb), data,
+		       channel->io_blksize);
+
+	/*
+	 * An unreferenced block is the next one the hand will take,
+	 * which is what nocache wants.
+	 */
+	hb->hb_referenced = !nocache;
+
+out:
+	pthread_mutex_unlock(&hs->hs_lock);
+}
+
+static void io_hash_vec_refresh(io_channel *channel, struct io_vec_unit *ivus,
+				int count, bool nocache, uint64_t gen)
+{
+	int i, j, blksize = channel->io_blksize;
+	uint64_t blkno;
+	uint32_t numblks;
+	char *buf;
+
 	for (i = 0; i < count; i++) {
 		blkno = ivus[i].ivu_blkno;
 		numblks = ivus[i].ivu_buflen / blksize;
 		buf = ivus[i].ivu_buf;
 
-		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
-			icb = io_cache_lookup(ic, blkno);
-			if (!icb) {
-				if (nocache)
-					continue;
-				icb = io_cache_pop_lru(ic);
-				icb->icb_blkno = blkno;
-				io_cache_insert(ic, icb);
-			}
-
-			memcpy(icb->icb_buf, buf, blksize);
-
-			if (nocache)
-				io_cache_unsee(ic, icb);
-			else
-				io_cache_seen(ic, icb);
-		}
+		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize)
+			io_hash_refresh_block(channel, blkno, buf, nocache,
+					      false, gen);
 	}
-
-out:
-	return ret;
 }
 
 /*
- * This relies on the fact that our cache is always up to date.  If a
- * block is in the cache, the same thing is on disk.  Even if we re-read
- * the disk block, we don't need to update the cache.  This allows us
- * to look for optimal I/O sizes; it's better to call one read 1MB of
- * half-cached blocks than to read every other block.
- *
- * If the caller specifies "nocache", we still want to give them anything
- * we found in the cache, but we want cached blocks moved to the front
- * of the LRU.  That way they get stolen first.
+ * Same contract as io_lru_read_blocks(), but cached blocks are copied
+ * out as they are found, so each block is looked up once.
  */
-static errcode_t io_cache_read_blocks(io_channel *channel, int64_t blkno,
-				      int count, char *data, bool nocache)
+static errcode_t io_hash_read_blocks(io_channel *channel, int64_t blkno,
+				     int count, char *data, bool nocache)
 {
 	int i, good_blocks;
 	errcode_t ret = 0;
 	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
+	struct io_hash_shard *hs;
+	struct io_hash_block *hb;
+	uint64_t hash, gen = io_write_gen(channel);
 
-	/*
-	 * Here we check two things:
-	 *
-	 * 1) Are all the blocks cached?  If so, we can skip I/O.
-	 * 2) If they are not all cached, we want to start our read at the
-	 *    first uncached blkno.
-	 */
 	for (good_blocks = 0; good_blocks < count; good_blocks++) {
-		icb = io_cache_lookup(ic, blkno + good_blocks);
-		if (!icb)
-			break;
-		ic->ic_hits++;
-	}
+		hash = io_hash_blkno(blkno + good_blocks);
+		hs = io_hash_shard(ic, hash);
+
+		pthread_mutex_lock(&hs->hs_lock);
+		hb = io_hash_lookup(ic, hs, hash, blkno + good_blocks);
+		if (hb) {
+			memcpy(data + (channel->io_blksize * good_blocks),
+			       io_hash_buf(channel, ic, hb),
+			       channel->io_blksize);
+			hb->hb_referenced = !nocache;
+			hs->hs_hits++;
+		}
+		pthread_mutex_unlock(&hs->hs_lock);
 
-	/* Read any blocks not in the cache */
-	if (good_blocks < count) {
-		ic->ic_misses += (count - good_blocks);
-		ret = unix_io_read_block(channel, blkno + good_blocks,
-					 count - good_blocks,
-					 data + (channel->io_blksize *
-						 good_blocks));
-		if (ret)
-			goto out;
+		if (!hb)
+			break;
 	}
 
-	/* Now we sync up the cache with the data buffer */
-	for (i = 0; i < count; i++, data += channel->io_blksize) {
-		icb = io_cache_lookup(ic, blkno + i);
-		if (i < good_blocks) {
-			/*
-			 * We skipped reading this because it was in the
-			 * cache.  Copy it to the data buffer.
-			 */
-			assert(icb);
-			memcpy(data, icb->icb_buf, channel->io_blksize);
-		} else if (!icb) {
-			if (nocache)
-				continue;
-
-			/* Steal the LRU buffer */
-			icb = io_cache_pop_lru(ic);
-			icb->icb_blkno = blkno + i;
-			io_cache_insert(ic, icb);
+	if (good_blocks == count)
+		goto out;
 
-			/*
-			 * We did I/O into the data buffer, now update
-			 * the cache.
-			 */
-			memcpy(icb->icb_buf, data, channel->io_blksize);
-		}
-		/*
-		 * What about if ((i >= good_blocks) && icb)?  That means
-		 * we had the buffer in the cache, but we read it anyway
-		 * to get a single I/O.  Our cache guarantees that the
-		 * contents will match, so we just skip to marking the
-		 * buffer seen.
-		 */
+	ret = io_cache_disk_read(channel, blkno + good_blocks,
+				 count - good_blocks,
+				 data + (channel->io_blksize * good_blocks));
+	if (ret)
+		goto out;
 
-		if (nocache)
-			io_cache_unsee(ic, icb);
-		else
-			io_cache_seen(ic, icb);
-	}
+	for (i = good_blocks; i < count; i++)
+		io_hash_refresh_block(channel, blkno + i,
+				      data + (channel->io_blksize * i),
+				      nocache, true, gen);
 
 out:
 	return ret;
 }
 
-static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
-				     int count, char *data, bool nocache)
-
+static errcode_t io_hash_write_blocks(io_channel *channel, int64_t blkno,
+				      int count, const char *data,
+				      bool nocache)
 {
-	int todo = one_meg_of_blocks(channel);
-	errcode_t ret = 0;
+	int i, completed = 0;
+	errcode_t ret;
 
-	/*
-	 * We do this in one meg hunks so that each hunk has an
-	 * opportunity to be in cache, but we get a good throughput.
-	 */
-	while (count) {
-		if (todo > count)
-			todo = count;
-		ret = io_cache_read_blocks(channel, blkno, todo, data,
-					   nocache);
-		if (ret)
-			break;
+	ret = unix_io_write_block_full(channel, blkno, count, data,
+				       &completed);
 
-		blkno += todo;
-		count -= todo;
-		data += (channel->io_blksize * todo);
-	}
+	/* As with the LRU, blocks that made it to disk must be synced. */
+	for (i = 0; i < completed; i++, data += channel->io_blksize)
+		io_hash_refresh_block(channel, blkno + i, data, nocache,
+				      false, IO_WRITE_GEN_ANY);
 
 	return ret;
 }
 
-/*
- * This relies on the fact that our cache is always up to date.  If a
- * block is in the cache, the same thing is on disk.  So here we'll write
- * a whole stream and update the cache as needed.
- */
-static errcode_t io_cache_write_blocks(io_channel *channel, int64_t blkno,
-				       int count, const char *data,
-				       bool nocache)
+static errcode_t io_hash_init(io_channel *channel, struct io_cache *ic)
 {
-	int i, completed = 0;
+	int i;
+	uint32_t per_shard, slots;
+	struct io_hash_shard *hs;
 	errcode_t ret;
-	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
 
-	/* Get the write out of the way */
-	ret = unix_io_write_block_full(channel, blkno, count, data,
-				       &completed);
+	if (ic->ic_nr_blocks >= IO_HASH_EMPTY_SLOT)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	while ((ic->ic_shard_bits < IO_HASH_MAX_SHARD_BITS) &&
+	       ((ic->ic_nr_blocks >> (ic->ic_shard_bits + 1)) >=
+		IO_HASH_MIN_SHARD_BLOCKS))
+		ic->ic_shard_bits++;
 
 	/*
-	 * Now we sync up the cache with the data buffer.  We have
-	 * to sync up I/O that completed, even if the entire I/O did not.
-	 *
-	 * In the nocache case, we want to skip blocks that weren't in the
-	 * cache, but we want to update blocks that where.  Even though
-	 * the caller specified "don't cache this", it's already in the
-	 * cache.  We don't want stale data.
+	 * The last shard takes the remainder.  Size every table for it,
+	 * at no more than half full.
 	 */
-	for (i = 0; i < completed; i++, data += channel->io_blksize) {
-		icb = io_cache_lookup(ic, blkno + i);
-		if (!icb) {
-			if (nocache)
-				continue;
+	per_shard = ic->ic_nr_blocks >> ic->ic_shard_bits;
+	ic->ic_shard_blocks = per_shard;
+	slots = ic->ic_nr_blocks - (per_shard << ic->ic_shard_bits) +
+		per_shard;
+	for (ic->ic_slot_bits = 1; (1UL << ic->ic_slot_bits) < (slots * 2UL);
+	     ic->ic_slot_bits++)
+		;
+
+	ret = ocfs2_malloc0(sizeof(struct io_hash_shard) << ic->ic_shard_bits,
+			    &ic->ic_shards);
+	if (ret)
+		return ret;
 
-			/*
-			 * Steal the LRU buffer.  We can't error here, so
-			 * we can safely insert it before we copy the data.
-			 */
-			icb = io_cache_pop_lru(ic);
-			icb->icb_blkno = blkno + i;
-			io_cache_insert(ic, icb);
-		}
+	/* io_hash_free() destroys these, so they are set up first */
+	for (i = 0; i < (1 << ic->ic_shard_bits); i++)
+		pthread_mutex_init(&ic->ic_shards[i].hs_lock, NULL);
 
-		memcpy(icb->icb_buf, data, channel->io_blksize);
-		if (nocache)
-			io_cache_unsee(ic, icb);
+	ret = ocfs2_malloc0(sizeof(struct io_hash_block) * ic->ic_nr_blocks,
+			    &ic->ic_metadata_buffer);
+	if (ret)
+		return ret;
+	ic->ic_metadata_buffer_len =
+		(unsigned long)ic->ic_nr_blocks * sizeof(struct io_hash_block);
+	ic->ic_hash_blocks = ic->ic_metadata_buffer;
+
+	ic->ic_slot_buffer_len = (sizeof(uint32_t) << ic->ic_slot_bits) <<
+		ic->ic_shard_bits;
+	ret = ocfs2_malloc(ic->ic_slot_buffer_len, &ic->ic_slot_buffer);
+	if (ret)
+		return ret;
+	memset(ic->ic_slot_buffer, 0xff, ic->ic_slot_buffer_len);
+
+	for (i = 0; i < ic->ic_nr_blocks; i++)
+		ic->ic_hash_blocks[i].hb_blkno = UINT64_MAX;
+
+	for (i = 0; i < (1 << ic->ic_shard_bits); i++) {
+		hs = ic->ic_shards + i;
+		hs->hs_slots = ic->ic_slot_buffer + ((size_t)i << ic->ic_slot_bits);
+		hs->hs_first = i * per_shard;
+		if (i == (1 << ic->ic_shard_bits) - 1)
+			hs->hs_nr_blocks = ic->ic_nr_blocks - hs->hs_first;
 		else
-			io_cache_seen(ic, icb);
+			hs->hs_nr_blocks = per_shard;
+	}
+
+	return 0;
+}
+
+static void io_hash_free(struct io_cache *ic)
+{
+	int i;
+
+	if (!ic->ic_shards)
+		return;
+
+	for (i = 0; i < (1 << ic->ic_shard_bits); i++)
+		pthread_mutex_destroy(&ic->ic_shards[i].hs_lock);
+	ocfs2_free(&ic->ic_shards);
+}
+
+static void io_hash_get_stats(struct io_cache *ic,
+			      struct ocfs2_io_stats *stats)
+{
+	int i;
+	struct io_hash_shard *hs;
+
+	for (i = 0; i < (1 << ic->ic_shard_bits); i++) {
+		hs = ic->ic_shards + i;
+		pthread_mutex_lock(&hs->hs_lock);
+		stats->is_cache_hits += hs->hs_hits;
+		stats->is_cache_misses += hs->hs_misses;
+		stats->is_cache_inserts += hs->hs_inserts;
+		stats->is_cache_removes += hs->hs_removes;
+		stats->is_cache_evictions += hs->hs_evictions;
+		pthread_mutex_unlock(&hs->hs_lock);
+	}
+}
+
+static errcode_t io_hash_pin_block(io_channel *channel, uint64_t blkno,
+				   char **buf, bool *missed)
+{
+	struct io_cache *ic = channel->io_cache;
+	uint64_t hash = io_hash_blkno(blkno);
+	struct io_hash_shard *hs = io_hash_shard(ic, hash);
+	struct io_hash_block *hb;
+	errcode_t ret = 0;
+
+	pthread_mutex_lock(&hs->hs_lock);
+	hb = io_hash_lookup(ic, hs, hash, blkno);
+	if (hb) {
+		hs->hs_hits++;
+		hb->hb_referenced = 1;
+		*missed = false;
+	} else {
+		/*
+		 * The victim stays out of the table, pinned, until it
+		 * has been read and published.
+		 */
+		hb = io_hash_victim(ic, hs);
+		if (!hb) {
+			ret = OCFS2_ET_NO_MEMORY;
+			goto out;
+		}
+		hs->hs_misses++;
+		*missed = true;
 	}
 
+	hb->hb_pins++;
+	*buf = io_hash_buf(channel, ic, hb);
+
+out:
+	pthread_mutex_unlock(&hs->hs_lock);
 	return ret;
 }
 
-static errcode_t io_cache_write_block(io_channel *channel, int64_t blkno,
-				      int count, const char *data,
-				      bool nocache)
+static void io_hash_publish_block(io_channel *channel, uint64_t blkno,
+				  char **buf)
 {
+	struct io_cache *ic = channel->io_cache;
+	uint64_t hash = io_hash_blkno(blkno);
+	struct io_hash_shard *hs = io_hash_shard(ic, hash);
+	struct io_hash_block *hb = io_hash_buf_to_block(channel, *buf);
+	struct io_hash_block *other;
+
+	pthread_mutex_lock(&hs->hs_lock);
 	/*
-	 * Unlike io_read_cache_block(), we're going to do all of the
-	 * I/O no matter what.  We keep the separation of
-	 * io_cache_write_block() and io_cache_write_blocks() for
-	 * consistency.
+	 * Someone else may have cached the block while we were reading
+	 * it.  Theirs wins; it might have been written since.
 	 */
-	return io_cache_write_blocks(channel, blkno, count, data,
-				     nocache);
+	other = io_hash_lookup(ic, hs, hash, blkno);
+	if (other) {
+		other->hb_pins++;
+		hb->hb_pins--;
+		*buf = io_hash_buf(channel, ic, other);
+	} else {
+		hb->hb_blkno = blkno;
+		hb->hb_referenced = 1;
+		io_hash_insert(ic, hs, hash, hb);
+	}
+	pthread_mutex_unlock(&hs->hs_lock);
+}
+
+static void io_hash_unpin_block(io_channel *channel, char *buf)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_hash_block *hb = io_hash_buf_to_block(channel, buf);
+	struct io_hash_shard *hs = io_hash_block_shard(ic, hb);
+
+	pthread_mutex_lock(&hs->hs_lock);
+	hb->hb_pins--;
+	pthread_mutex_unlock(&hs->hs_lock);
+}
+
+static struct io_cache_operations io_hash_ops = {
+	.name		= "hash",
+	.init		= io_hash_init,
+	.free		= io_hash_free,
+	.read_blocks	= io_hash_read_blocks,
+	.write_blocks	= io_hash_write_blocks,
+	.vec_refresh	= io_hash_vec_refresh,
+	.get_stats	= io_hash_get_stats,
+	.pin_block	= io_hash_pin_block,
+	.publish_block	= io_hash_publish_block,
+	.unpin_block	= io_hash_unpin_block,
+};
+
+static void io_free_writeback(struct io_cache *ic)
+{
+	if (ic->ic_dirty_blocks)
+		ocfs2_free(&ic->ic_dirty_blocks);
+	if (ic->ic_dirty_data)
+		ocfs2_free(&ic->ic_dirty_data);
+	ic->ic_dirty_max = 0;
+	ic->ic_nr_dirty = 0;
+	ic->ic_dirty = RB_ROOT;
+	INIT_LIST_HEAD(&ic->ic_dirty_free);
 }
 
 static void io_free_cache(struct io_cache *ic)
 {
 	if (ic) {
+		if (ic->ic_ops && ic->ic_ops->free)
+			ic->ic_ops->free(ic);
+		io_free_writeback(ic);
+		pthread_mutex_destroy(&ic->ic_dirty_lock);
 		if (ic->ic_data_buffer) {
 			if (ic->ic_locked)
 				munlock(ic->ic_data_buffer,
@@ -605,6 +2439,12 @@ static void io_free_cache(struct io_cache *ic)
 					ic->ic_metadata_buffer_len);
 			ocfs2_free(&ic->ic_metadata_buffer);
 		}
+		if (ic->ic_slot_buffer) {
+			if (ic->ic_locked)
+				munlock(ic->ic_slot_buffer,
+					ic->ic_slot_buffer_len);
+			ocfs2_free(&ic->ic_slot_buffer);
+		}
 		ocfs2_free(&ic);
 	}
 }
@@ -612,8 +2452,16 @@ static void io_free_cache(struct io_cache *ic)
 void io_destroy_cache(io_channel *channel)
 {
 	if (channel->io_cache) {
-		if (!--channel->io_cache->ic_use_count)
+		if (channel->io_uring)
+			o2_uring_unregister_buffer(channel->io_uring);
+		/*
+		 * The last user takes the dirty blocks to disk.  Callers
+		 * that care about errors io_flush() first.
+		 */
+		if (!--channel->io_cache->ic_use_count) {
+			io_flush(channel);
 			io_free_cache(channel->io_cache);
+		}
 		channel->io_cache = NULL;
 	}
 }
@@ -651,6 +2499,14 @@ errcode_t io_mlock_cache(io_channel *channel)
 		if (rc)
 			munlock(ic->ic_data_buffer, ic->ic_data_buffer_len);
 	}
+	if (!rc && ic->ic_slot_buffer) {
+		rc = mlock(ic->ic_slot_buffer, ic->ic_slot_buffer_len);
+		if (rc) {
+			munlock(ic->ic_metadata_buffer,
+				ic->ic_metadata_buffer_len);
+			munlock(ic->ic_data_buffer, ic->ic_data_buffer_len);
+		}
+	}
 
 	if (rc)
 		return OCFS2_ET_NO_MEMORY;
@@ -659,45 +2515,60 @@ errcode_t io_mlock_cache(io_channel *channel)
 	return 0;
 }
 
-errcode_t io_init_cache(io_channel *channel, size_t nr_blocks)
+static struct io_cache_operations *io_cache_engines[] = {
+	[IO_CACHE_ENGINE_LRU]	= &io_lru_ops,
+	[IO_CACHE_ENGINE_HASH]	= &io_hash_ops,
+};
+
+/*
+ * Cache blocks are read into directly by io_get_blocks(), so register
+ * the data buffer with the ring.  If the kernel won't pin it for us,
+ * the reads just aren't fixed.
+ */
+static void io_uring_register_cache(io_channel *channel)
 {
-	int i;
-	struct io_cache *ic;
-	char *dbuf;
-	struct io_cache_block *icb_list;
+	struct io_cache *ic = channel->io_cache;
+
+	if (channel->io_uring)
+		o2_uring_register_buffer(channel->io_uring,
+					 ic->ic_data_buffer,
+					 ic->ic_data_buffer_len);
+}
+
+errcode_t io_init_cache_engine(io_channel *channel, size_t nr_blocks,
+			       enum io_cache_engine engine)
+{
+	struct io_cache *ic = NULL;
 	errcode_t ret;
 
+	if (((unsigned int)engine >=
+	     sizeof(io_cache_engines) / sizeof(io_cache_engines[0])) ||
+	    !nr_blocks)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
 	ret = ocfs2_malloc0(sizeof(struct io_cache), &ic);
 	if (ret)
 		goto out;
 
 	ic->ic_nr_blocks = nr_blocks;
-	ic->ic_lookup = RB_ROOT;
-	INIT_LIST_HEAD(&ic->ic_lru);
+	ic->ic_engine = engine;
+	ic->ic_ops = io_cache_engines[engine];
+	ic->ic_dirty = RB_ROOT;
+	INIT_LIST_HEAD(&ic->ic_dirty_free);
+	pthread_mutex_init(&ic->ic_dirty_lock, NULL);
 
 	ret = ocfs2_malloc_blocks(channel, nr_blocks, &ic->ic_data_buffer);
 	if (ret)
 		goto out;
 	ic->ic_data_buffer_len = (unsigned long)nr_blocks * channel->io_blksize;
 
-	ret = ocfs2_malloc0(sizeof(struct io_cache_block) * nr_blocks,
-			    &ic->ic_metadata_buffer);
+	ret = ic->ic_ops->init(channel, ic);
 	if (ret)
 		goto out;
-	ic->ic_metadata_buffer_len =
-		(unsigned long)nr_blocks * sizeof(struct io_cache_block);
-
-	icb_list = ic->ic_metadata_buffer;
-	dbuf = ic->ic_data_buffer;
-	for (i = 0; i < nr_blocks; i++) {
-		icb_list[i].icb_blkno = UINT64_MAX;
-		icb_list[i].icb_buf = dbuf;
-		dbuf += channel->io_blksize;
-		list_add_tail(&icb_list[i].icb_list, &ic->ic_lru);
-	}
 
 	ic->ic_use_count = 1;
 	channel->io_cache = ic;
+	io_uring_register_cache(channel);
 
 out:
 	if (ret)
@@ -706,6 +2577,11 @@ out:
 	return ret;
 }
 
+errcode_t io_init_cache(io_channel *channel, size_t nr_blocks)
+{
+	return io_init_cache_engine(channel, nr_blocks, IO_CACHE_ENGINE_LRU);
+}
+
 errcode_t io_init_cache_size(io_channel *channel, size_t bytes)
 {
 	size_t blocks;
@@ -722,6 +2598,13 @@ size_t io_get_cache_size(io_channel *channel)
 	return 0;
 }
 
+const char *io_get_cache_engine(io_channel *channel)
+{
+	if (channel->io_cache)
+		return channel->io_cache->ic_ops->name;
+	return "none";
+}
+
 errcode_t io_share_cache(io_channel *from, io_channel *to)
 {
 	if (!from->io_cache)
@@ -730,9 +2613,75 @@ errcode_t io_share_cache(io_channel *from, io_channel *to)
 		return OCFS2_ET_INTERNAL_FAILURE;
 	to->io_cache = from->io_cache;
 	from->io_cache->ic_use_count++;
+	io_uring_register_cache(to);
+	return 0;
+}
+
+/*
+ * io_set_writeback() makes the cache write-back with room for
+ * nr_blocks dirty blocks; 0 makes it write-through again.  Either way,
+ * what is dirty now is flushed first.  The setting belongs to the
+ * cache, so it covers every channel sharing it.
+ */
+errcode_t io_set_writeback(io_channel *channel, size_t nr_blocks)
+{
+	size_t i;
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+	struct io_dirty_block *dirty = NULL;
+	char *data = NULL;
+
+	if (!ic)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (nr_blocks > INT_MAX)
+		return OCFS2_ET_NO_MEMORY;
+
+	ret = io_flush(channel);
+	if (ret)
+		return ret;
+
+	if (nr_blocks) {
+		ret = ocfs2_malloc0(sizeof(struct io_dirty_block) * nr_blocks,
+				    &dirty);
+		if (ret)
+			return ret;
+
+		ret = ocfs2_malloc_blocks(channel, nr_blocks, &data);
+		if (ret) {
+			ocfs2_free(&dirty);
+			return ret;
+		}
+	}
+
+	io_free_writeback(ic);
+	ic->ic_dirty_blocks = dirty;
+	ic->ic_dirty_data = data;
+	ic->ic_dirty_max = nr_blocks;
+	for (i = 0; i < nr_blocks; i++) {
+		dirty[i].db_buf = data + (i * channel->io_blksize);
+		list_add_tail(&dirty[i].db_list, &ic->ic_dirty_free);
+	}
+
 	return 0;
 }
 
+/* Dirty blocks written before io_flush() are on disk when it returns */
+errcode_t io_flush(io_channel *channel)
+{
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+
+	if (!ic || !ic->ic_dirty_max)
+		return 0;
+
+	pthread_mutex_lock(&ic->ic_dirty_lock);
+	ret = io_dirty_flush(channel);
+	pthread_mutex_unlock(&ic->ic_dirty_lock);
+
+	return ret;
+}
+
 static errcode_t io_validate_o_direct(io_channel *channel)
 {
 	errcode_t ret = OCFS2_ET_UNEXPECTED_BLOCK_SIZE;
@@ -790,6 +2739,9 @@ errcode_t io_open(const char *name, int flags, io_channel **channel)
 	chan->io_blksize = OCFS2_MIN_BLOCKSIZE;
 	chan->io_flags = (flags & OCFS2_FLAG_RW) ? O_RDWR : O_RDONLY;
 	chan->io_nocache = false;
+	pthread_mutex_init(&chan->io_uring_lock, NULL);
+	pthread_mutex_init(&chan->io_aio_lock, NULL);
+	pthread_cond_init(&chan->io_aio_cond, NULL);
 	if (!(flags & OCFS2_FLAG_BUFFERED))
 		chan->io_flags |= O_DIRECT;
 	chan->io_error = 0;
@@ -804,6 +2756,13 @@ errcode_t io_open(const char *name, int flags, io_channel **channel)
 		goto out_name;
 	}
 
+	/* No io_uring in this kernel just means pread and libaio */
+	if (flags & OCFS2_FLAG_IO_URING) {
+		chan->io_want_uring = true;
+		if (o2_uring_init(IO_READV_MAX_BLOCKS, &chan->io_uring))
+			chan->io_uring = NULL;
+	}
+
 	if (!(flags & OCFS2_FLAG_BUFFERED)) {
 		ret = io_validate_o_direct(chan);
 		if (ret)
@@ -850,6 +2809,7 @@ errcode_t io_open(const char *name, int flags, io_channel **channel)
 	return 0;
 
 out_close:
+	o2_uring_free(chan->io_uring);
 	/* Ignore the return, leave the original error */
 	close(chan->io_fd);
 
@@ -865,11 +2825,21 @@ out_chan:
 
 errcode_t io_close(io_channel *channel)
 {
-	errcode_t ret = 0;
+	errcode_t ret;
+
+	ret = io_flush(channel);
 
+	/*
+	 * Nobody is left to reap outstanding I/O; let it land first.
+	 * Waits that keep failing abort the queue, so this ends.
+	 */
+	while (channel->io_aio && channel->io_aio->aa_inflight)
+		io_aio_getevents(channel, channel->io_aio->aa_inflight);
+	io_aio_free(channel);
 	io_destroy_cache(channel);
+	o2_uring_free(channel->io_uring);
 
-	if (close(channel->io_fd) < 0)
+	if ((close(channel->io_fd) < 0) && !ret)
 		ret = errno;
 
 	ocfs2_free(&channel->io_name);
@@ -914,12 +2884,8 @@ void io_get_stats(io_channel *channel, struct ocfs2_io_stats *stats)
 	memset(stats, 0, sizeof(struct ocfs2_io_stats));
 	stats->is_bytes_read = channel->io_bytes_read;
 	stats->is_bytes_written = channel->io_bytes_written;
-	if (ioc) {
-		stats->is_cache_hits = ioc->ic_hits;
-		stats->is_cache_misses = ioc->ic_misses;
-		stats->is_cache_inserts = ioc->ic_inserts;
-		stats->is_cache_removes = ioc->ic_removes;
-	}
+	if (ioc)
+		ioc->ic_ops->get_stats(ioc, stats);
 }
 
 /*
@@ -944,6 +2910,98 @@ errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
 		return unix_vec_read_blocks(channel, ivus, count);
 }
 
+/*
+ * io_vec_submit() queues the units and returns without waiting, and
+ * io_vec_wait() claims them one at a time along with their I/O status.
+ * The blocks land in the cache when they are claimed.
+ *
+ * If io_vec_submit() fails part way, the units before the one that
+ * failed are queued and must still be waited for.  The rest are not.
+ */
+errcode_t io_vec_submit(io_channel *channel, struct io_vec_unit *ivus,
+			int count)
+{
+	errcode_t ret;
+
+	pthread_mutex_lock(&channel->io_aio_lock);
+	ret = io_aio_queue_units(channel, ivus, count, NULL);
+	pthread_mutex_unlock(&channel->io_aio_lock);
+
+	return ret;
+}
+
+/*
+ * Wait for one particular unit from io_vec_submit().  Anything else
+ * that completes meanwhile stays queued for another io_vec_wait(), so
+ * several users can share the channel's queue.
+ *
+ * A unit that was in flight across a write may hold the old contents.
+ * It is read again through the cache rather than trusted.
+ */
+errcode_t io_vec_wait(io_channel *channel, struct io_vec_unit *ivu)
+{
+	int i, idx;
+	errcode_t ret = OCFS2_ET_INVALID_ARGUMENT;
+	struct io_aio *aa;
+	struct io_aio_queue *done;
+	struct io_aio_unit au;
+
+	pthread_mutex_lock(&channel->io_aio_lock);
+
+	aa = channel->io_aio;
+	if (!aa)
+		goto out_unlock;
+
+	done = &aa->aa_done;
+	for (;;) {
+		for (i = 0; i < done->aq_count; i++) {
+			idx = (done->aq_head + i) % done->aq_size;
+			if (done->aq_units[idx].au_ivu == ivu)
+				break;
+		}
+		if (i < done->aq_count)
+			break;
+
+		if (!aa->aa_inflight && !aa->aa_pending.aq_count) {
+			ret = OCFS2_ET_INVALID_ARGUMENT;
+			goto out_unlock;
+		}
+
+		/* As in unix_vec_read_blocks(), the unit has to land */
+		io_aio_getevents(channel, 1);
+	}
+
+	/* Swap it to the head so it can be popped */
+	au = done->aq_units[idx];
+	done->aq_units[idx] = done->aq_units[done->aq_head];
+	done->aq_units[done->aq_head] = au;
+	io_aio_queue_pop(done, &au);
+
+	pthread_mutex_unlock(&channel->io_aio_lock);
+
+	ret = au.au_ret;
+	if (ret)
+		goto out;
+
+	if (!io_write_gen_current(channel, au.au_gen))
+		ret = io_read_block(channel, ivu->ivu_blkno,
+				    ivu->ivu_buflen / channel->io_blksize,
+				    ivu->ivu_buf);
+	else if (channel->io_cache) {
+		io_dirty_patch_vec(channel, ivu, 1);
+		channel->io_cache->ic_ops->vec_refresh(channel, ivu, 1,
+						       channel->io_nocache,
+						       au.au_gen);
+	}
+
+out:
+	return ret;
+
+out_unlock:
+	pthread_mutex_unlock(&channel->io_aio_lock);
+	return ret;
+}
+
 errcode_t io_read_block(io_channel *channel, int64_t blkno, int count,
 			char *data)
 {
@@ -984,6 +3042,150 @@ errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 		return unix_io_write_block(channel, blkno, count, data);
 }
 
+static bool io_cache_owns(io_channel *channel, char *buf)
+{
+	struct io_cache *ic = channel->io_cache;
+
+	return ic && (buf >= ic->ic_data_buffer) &&
+		(buf < ic->ic_data_buffer +
+		       ((size_t)ic->ic_nr_blocks * channel->io_blksize));
+}
+
+static void io_cache_unpin_blocks(io_channel *channel, int count, char **bufs)
+{
+	int i;
+	struct io_cache *ic = channel->io_cache;
+
+	for (i = 0; i < count; i++)
+		ic->ic_ops->unpin_block(channel, bufs[i]);
+}
+
+/* Read and publish the missed blocks bufs[0..count) */
+static errcode_t io_cache_fill_pinned(io_channel *channel, int64_t blkno,
+				      int count, char **bufs)
+{
+	int i;
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+
+	ret = unix_io_readv_blocks(channel, blkno, count, bufs);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		io_dirty_patch(channel, blkno + i, 1, bufs[i]);
+		ic->ic_ops->publish_block(channel, blkno + i, &bufs[i]);
+	}
+
+	return 0;
+}
+
+static errcode_t io_cache_get_blocks(io_channel *channel, int64_t blkno,
+				     int count, char **bufs)
+{
+	int i, run = 0;
+	bool missed;
+	errcode_t ret = 0;
+	struct io_cache *ic = channel->io_cache;
+
+	for (i = 0; i < count; i++) {
+		ret = ic->ic_ops->pin_block(channel, blkno + i, &bufs[i],
+					    &missed);
+		if (ret)
+			break;
+
+		if (missed) {
+			run++;
+			continue;
+		}
+
+		if (run) {
+			ret = io_cache_fill_pinned(channel, blkno + i - run,
+						   run, bufs + i - run);
+			run = 0;
+			if (ret) {
+				i++;
+				break;
+			}
+		}
+	}
+
+	if (!ret && run)
+		ret = io_cache_fill_pinned(channel, blkno + i - run, run,
+					   bufs + i - run);
+
+	if (ret)
+		io_cache_unpin_blocks(channel, i, bufs);
+
+	return ret;
+}
+
+/*
+ * Used when there is no cache to pin from.  The blocks are read into
+ * one private allocation that io_put_blocks() frees.
+ */
+static errcode_t io_get_blocks_private(io_channel *channel, int64_t blkno,
+				       int count, char **bufs)
+{
+	int i;
+	char *data;
+	errcode_t ret;
+
+	ret = ocfs2_malloc_blocks(channel, count, &data);
+	if (ret)
+		return ret;
+
+	ret = io_read_block(channel, blkno, count, data);
+	if (ret) {
+		ocfs2_free(&data);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++)
+		bufs[i] = data + ((size_t)i * channel->io_blksize);
+
+	return 0;
+}
+
+/*
+ * io_get_blocks() fills bufs[] with pointers to count blocks starting
+ * at blkno without copying them out of the cache.  The buffers are
+ * pinned and must be released with io_put_blocks().  They are
+ * read-only, and their contents are undefined once the caller writes
+ * to the same blocks.
+ *
+ * If the channel has no cache, is set to nocache, or the cache is too
+ * small to pin count blocks, the blocks are read into a private buffer
+ * instead.  Callers can't tell the difference.
+ */
+errcode_t io_get_blocks(io_channel *channel, int64_t blkno, int count,
+			char **bufs)
+{
+	errcode_t ret;
+
+	if (count <= 0)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (channel->io_cache && !channel->io_nocache) {
+		ret = io_cache_get_blocks(channel, blkno, count, bufs);
+		if (ret != OCFS2_ET_NO_MEMORY)
+			return ret;
+	}
+
+	return io_get_blocks_private(channel, blkno, count, bufs);
+}
+
+void io_put_blocks(io_channel *channel, int count, char **bufs)
+{
+	if (count <= 0)
+		return;
+
+	if (io_cache_owns(channel, bufs[0]))
+		io_cache_unpin_blocks(channel, count, bufs);
+	else
+		ocfs2_free(&bufs[0]);
+}
+
 
 #ifdef DEBUG_EXE
 #include <stdio.h>
@@ -1032,11 +3234,147 @@ static void dump_block(int64_t blkno, int blksize, char *buf)
 	fprintf(stdout, "\n");
 }
 
+/*
+ * -t runs threads against a hash cache much smaller than the blocks
+ * they read.  Each pins a few blocks with io_get_blocks() and reads
+ * others while holding them, so eviction runs around the pins.  Every
+ * block must match what an uncached read returned.
+ */
+#define STRESS_ROUNDS		20000
+#define STRESS_PINS		4
+
+struct stress_thread {
+	pthread_t	st_thread;
+	io_channel	*st_channel;
+	int64_t		st_blkno;
+	int64_t		st_count;
+	char		*st_expect;	/* The blocks, read without a cache */
+	unsigned int	st_seed;
+	uint64_t	st_bad;
+};
+
+static int stress_check(struct stress_thread *st, int64_t blkno, char *buf)
+{
+	int blksize = io_get_blksize(st->st_channel);
+
+	return !memcmp(buf, st->st_expect + (blkno - st->st_blkno) * blksize,
+		       blksize);
+}
+
+static void *stress_thread(void *arg)
+{
+	struct stress_thread *st = arg;
+	char *bufs[STRESS_PINS], *other = NULL;
+	int64_t blkno, extra;
+	int i, j, nr;
+
+	if (ocfs2_malloc_block(st->st_channel, &other)) {
+		st->st_bad++;
+		return NULL;
+	}
+
+	for (i = 0; i < STRESS_ROUNDS; i++) {
+		nr = 1 + rand_r(&st->st_seed) % STRESS_PINS;
+		if (nr > st->st_count)
+			nr = st->st_count;
+		blkno = st->st_blkno +
+			rand_r(&st->st_seed) % (st->st_count - nr + 1);
+
+		if (io_get_blocks(st->st_channel, blkno, nr, bufs)) {
+			st->st_bad++;
+			continue;
+		}
+
+		for (j = 0; j < STRESS_PINS; j++) {
+			extra = st->st_blkno +
+				rand_r(&st->st_seed) % st->st_count;
+			if (io_read_block(st->st_channel, extra, 1, other) ||
+			    !stress_check(st, extra, other))
+				st->st_bad++;
+		}
+
+		for (j = 0; j < nr; j++) {
+			if (!stress_check(st, blkno + j, bufs[j]))
+				st->st_bad++;
+		}
+		io_put_blocks(st->st_channel, nr, bufs);
+	}
+
+	ocfs2_free(&other);
+	return NULL;
+}
+
+static errcode_t stress_cache(io_channel *channel, int64_t blkno,
+			      int64_t count, int nr_threads)
+{
+	errcode_t ret;
+	int i, started = 0;
+	uint64_t bad = 0;
+	size_t nr_blocks;
+	char *expect = NULL;
+	struct stress_thread *threads = NULL;
+	struct ocfs2_io_stats stats;
+
+	ret = ocfs2_malloc_blocks(channel, (int)count, &expect);
+	if (ret)
+		goto out;
+	ret = io_read_block(channel, blkno, (int)count, expect);
+	if (ret)
+		goto out;
+
+	/* Small enough to evict, big enough for every thread's pins */
+	nr_blocks = count / 8;
+	if (nr_blocks < nr_threads * STRESS_PINS * 2)
+		nr_blocks = nr_threads * STRESS_PINS * 2;
+	ret = io_init_cache_engine(channel, nr_blocks, IO_CACHE_ENGINE_HASH);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(struct stress_thread) * nr_threads,
+			    &threads);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].st_channel = channel;
+		threads[i].st_blkno = blkno;
+		threads[i].st_count = count;
+		threads[i].st_expect = expect;
+		threads[i].st_seed = i + 1;
+		if (pthread_create(&threads[i].st_thread, NULL, stress_thread,
+				   &threads[i])) {
+			ret = OCFS2_ET_NO_MEMORY;
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].st_thread, NULL);
+		bad += threads[i].st_bad;
+	}
+
+	io_get_stats(channel, &stats);
+	fprintf(stdout, "%d threads, %zu cache blocks: %u hits, %u misses, "
+		"%u evictions, %"PRIu64" bad\n", started, nr_blocks,
+		stats.is_cache_hits, stats.is_cache_misses,
+		stats.is_cache_evictions, bad);
+	if (!ret && bad)
+		ret = OCFS2_ET_IO;
+
+out:
+	if (threads)
+		ocfs2_free(&threads);
+	if (expect)
+		ocfs2_free(&expect);
+	return ret;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr,
 		"Usage: unix_io [-b <blkno>] [-c <count>] [-B <blksize>]\n"
-	       	"               <filename>\n");
+		"               [-t <threads>] <filename>\n");
 }
 
 extern int opterr, optind;
@@ -1045,7 +3383,7 @@ extern char *optarg;
 int main(int argc, char *argv[])
 {
 	errcode_t ret;
-	int c;
+	int c, nr_threads = 0, failed = 0;
 	int64_t blkno, count, blksize;
 	char *filename;
 	io_channel *channel;
@@ -1058,7 +3396,7 @@ int main(int argc, char *argv[])
 
 	initialize_ocfs_error_table();
 
-	while((c = getopt(argc, argv, "b:c:B:")) != EOF) {
+	while((c = getopt(argc, argv, "b:c:B:t:")) != EOF) {
 		switch (c) {
 			case 'b':
 				blkno = read_number(optarg);
@@ -1093,6 +3431,17 @@ int main(int argc, char *argv[])
 				}
 				break;
 
+			case 't':
+				nr_threads = read_number(optarg);
+				if (nr_threads <= 0) {
+					fprintf(stderr,
+						"Invalid threads: %s\n",
+						optarg);
+					print_usage();
+					return 1;
+				}
+				break;
+
 			default:
 				print_usage();
 				return 1;
@@ -1137,6 +3486,17 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (nr_threads) {
+		ret = io_set_blksize(channel, blksize);
+		if (!ret)
+			ret = stress_cache(channel, blkno, count, nr_threads);
+		if (ret) {
+			com_err(argv[0], ret, "while stressing the cache");
+			failed = 1;
+		}
+		goto out_channel;
+	}
+
 	ret = ocfs2_malloc_blocks(channel, (int)count, &blks);
 	if (ret) {
 		com_err(argv[0], ret,
@@ -1167,6 +3527,6 @@ out_channel:
 	}
 
 out:
-	return 0;
+	return failed;
 }
 #endif  /* DEBUG_EXE */
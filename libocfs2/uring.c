@@ -0,0 +1,466 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * uring.c
+ *
+ * A minimal io_uring ring for unix_io.c.  We talk to the kernel
+ * directly rather than pulling in liburing; we only need reads and
+ * writes.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers ISOC99, UNIX98 in features.h */
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include "ocfs2/ocfs2.h"
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+/* o2_uring_rw() tags its I/O so it can tell it from anyone else's */
+#define O2_URING_RW_TAG		UINT64_MAX
+
+/* A ring that is out of resources gets this many more tries */
+#define O2_URING_WAIT_RETRIES	8
+
+struct o2_uring {
+	int ur_fd;
+	unsigned int ur_features;
+
+	/* Submission ring */
+	void *ur_sq_ring;
+	size_t ur_sq_ring_len;
+	unsigned int *ur_sq_head;
+	unsigned int *ur_sq_tail;
+	unsigned int *ur_sq_mask;
+	unsigned int *ur_sq_entries;
+	unsigned int *ur_sq_array;
+	struct io_uring_sqe *ur_sqes;
+	size_t ur_sqes_len;
+	unsigned int ur_sq_local_tail;	/* Queued but not published */
+
+	/* Completion ring, may share the submission mapping */
+	void *ur_cq_ring;
+	size_t ur_cq_ring_len;
+	unsigned int *ur_cq_head;
+	unsigned int *ur_cq_tail;
+	unsigned int *ur_cq_mask;
+	struct io_uring_cqe *ur_cqes;
+
+	/* The one registered buffer, index 0 */
+	char *ur_fixed_buf;
+	size_t ur_fixed_len;
+};
+
+static inline int sys_io_uring_setup(unsigned int entries,
+				     struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+				     unsigned int min_complete,
+				     unsigned int flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+					const void *arg, unsigned int nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void o2_uring_free(struct o2_uring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->ur_sqes)
+		munmap(ring->ur_sqes, ring->ur_sqes_len);
+	if (ring->ur_cq_ring && (ring->ur_cq_ring != ring->ur_sq_ring))
+		munmap(ring->ur_cq_ring, ring->ur_cq_ring_len);
+	if (ring->ur_sq_ring)
+		munmap(ring->ur_sq_ring, ring->ur_sq_ring_len);
+	if (ring->ur_fd >= 0)
+		close(ring->ur_fd);
+	ocfs2_free(&ring);
+}
+
+errcode_t o2_uring_init(unsigned int entries, struct o2_uring **ret_ring)
+{
+	errcode_t ret;
+	struct o2_uring *ring;
+	struct io_uring_params p;
+	void *ptr;
+
+	ret = ocfs2_malloc0(sizeof(struct o2_uring), &ring);
+	if (ret)
+		return ret;
+
+	memset(&p, 0, sizeof(p));
+	ring->ur_fd = sys_io_uring_setup(entries, &p);
+	if (ring->ur_fd < 0) {
+		ret = OCFS2_ET_UNSUPP_FEATURE;
+		goto out;
+	}
+
+	/*
+	 * IORING_OP_READ/WRITE came with RW_CUR_POS.  Without NODROP a
+	 * full completion ring would lose I/Os.
+	 */
+	ring->ur_features = p.features;
+	ret = OCFS2_ET_UNSUPP_FEATURE;
+	if (!(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_RW_CUR_POS))
+		goto out;
+
+	ret = OCFS2_ET_NO_MEMORY;
+	ring->ur_sq_ring_len = p.sq_off.array +
+		p.sq_entries * sizeof(unsigned int);
+	ring->ur_cq_ring_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->ur_cq_ring_len > ring->ur_sq_ring_len)
+			ring->ur_sq_ring_len = ring->ur_cq_ring_len;
+		ring->ur_cq_ring_len = ring->ur_sq_ring_len;
+	}
+
+	ptr = mmap(NULL, ring->ur_sq_ring_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->ur_fd,
+		   IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto out;
+	ring->ur_sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ptr = ring->ur_sq_ring;
+	else {
+		ptr = mmap(NULL, ring->ur_cq_ring_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->ur_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto out;
+	}
+	ring->ur_cq_ring = ptr;
+
+	ring->ur_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->ur_sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->ur_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto out;
+	ring->ur_sqes = ptr;
+
+	ptr = ring->ur_sq_ring;
+	ring->ur_sq_head = ptr + p.sq_off.head;
+	ring->ur_sq_tail = ptr + p.sq_off.tail;
+	ring->ur_sq_mask = ptr + p.sq_off.ring_mask;
+	ring->ur_sq_entries = ptr + p.sq_off.ring_entries;
+	ring->ur_sq_array = ptr + p.sq_off.array;
+	ring->ur_sq_local_tail = *ring->ur_sq_tail;
+
+	ptr = ring->ur_cq_ring;
+	ring->ur_cq_head = ptr + p.cq_off.head;
+	ring->ur_cq_tail = ptr + p.cq_off.tail;
+	ring->ur_cq_mask = ptr + p.cq_off.ring_mask;
+	ring->ur_cqes = ptr + p.cq_off.cqes;
+
+	ret = 0;
+	*ret_ring = ring;
+
+out:
+	if (ret)
+		o2_uring_free(ring);
+
+	return ret;
+}
+
+errcode_t o2_uring_register_buffer(struct o2_uring *ring, void *buf,
+				   size_t len)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+
+	o2_uring_unregister_buffer(ring);
+
+	/* Registration pins the pages, so it can hit RLIMIT_MEMLOCK */
+	if (sys_io_uring_register(ring->ur_fd, IORING_REGISTER_BUFFERS,
+				  &iov, 1) < 0)
+		return OCFS2_ET_NO_MEMORY;
+
+	ring->ur_fixed_buf = buf;
+	ring->ur_fixed_len = len;
+
+	return 0;
+}
+
+void o2_uring_unregister_buffer(struct o2_uring *ring)
+{
+	if (!ring->ur_fixed_buf)
+		return;
+
+	sys_io_uring_register(ring->ur_fd, IORING_UNREGISTER_BUFFERS,
+			      NULL, 0);
+	ring->ur_fixed_buf = NULL;
+	ring->ur_fixed_len = 0;
+}
+
+unsigned int o2_uring_sq_space(struct o2_uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->ur_sq_head,
+					    __ATOMIC_ACQUIRE);
+
+	return *ring->ur_sq_entries - (ring->ur_sq_local_tail - head);
+}
+
+void o2_uring_prep_rw(struct o2_uring *ring, bool write, int fd, void *buf,
+		      unsigned int len, uint64_t offset, uint64_t user_data)
+{
+	unsigned int idx = ring->ur_sq_local_tail & *ring->ur_sq_mask;
+	struct io_uring_sqe *sqe = &ring->ur_sqes[idx];
+	char *p = buf;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	if (ring->ur_fixed_buf && (p >= ring->ur_fixed_buf) &&
+	    (p + len <= ring->ur_fixed_buf + ring->ur_fixed_len)) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED :
+			IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+	} else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->user_data = user_data;
+
+	ring->ur_sq_array[idx] = idx;
+	ring->ur_sq_local_tail++;
+}
+
+int o2_uring_submit(struct o2_uring *ring, unsigned int wait_nr)
+{
+	int rc;
+	unsigned int to_submit;
+
+	/* Publish what we've queued; anything unconsumed stays queued */
+	__atomic_store_n(ring->ur_sq_tail, ring->ur_sq_local_tail,
+			 __ATOMIC_RELEASE);
+
+	do {
+		to_submit = ring->ur_sq_local_tail -
+			__atomic_load_n(ring->ur_sq_head, __ATOMIC_ACQUIRE);
+		if (!to_submit && !wait_nr)
+			return 0;
+
+		rc = sys_io_uring_enter(ring->ur_fd, to_submit, wait_nr,
+					wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while ((rc < 0) && (errno == EINTR));
+
+	return (rc < 0) ? -errno : 0;
+}
+
+int o2_uring_wait_cq(struct o2_uring *ring, unsigned int wait_nr)
+{
+	int rc;
+	unsigned int to_submit;
+
+	do {
+		to_submit = __atomic_load_n(ring->ur_sq_tail,
+					    __ATOMIC_ACQUIRE) -
+			__atomic_load_n(ring->ur_sq_head, __ATOMIC_ACQUIRE);
+		rc = sys_io_uring_enter(ring->ur_fd, to_submit, wait_nr,
+					IORING_ENTER_GETEVENTS);
+	} while ((rc < 0) && (errno == EINTR));
+
+	return (rc < 0) ? -errno : 0;
+}
+
+int o2_uring_reap(struct o2_uring *ring, uint64_t *user_data, int *res)
+{
+	unsigned int head = *ring->ur_cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(ring->ur_cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring->ur_cqes[head & *ring->ur_cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->ur_cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* The kernel only consumes the submission ring inside io_uring_enter() */
+int o2_uring_retract(struct o2_uring *ring, uint64_t *user_data)
+{
+	unsigned int head = __atomic_load_n(ring->ur_sq_head,
+					    __ATOMIC_ACQUIRE);
+
+	if (ring->ur_sq_local_tail == head)
+		return 0;
+
+	ring->ur_sq_local_tail--;
+	*user_data =
+		ring->ur_sqes[ring->ur_sq_local_tail & *ring->ur_sq_mask].user_data;
+	__atomic_store_n(ring->ur_sq_tail, ring->ur_sq_local_tail,
+			 __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int o2_uring_wait(struct o2_uring *ring, uint64_t *user_data, int *res)
+{
+	int rc, tries = 0;
+
+	while (!o2_uring_reap(ring, user_data, res)) {
+		rc = o2_uring_submit(ring, 1);
+		if (!rc)
+			continue;
+		if (((rc != -EAGAIN) && (rc != -EBUSY)) ||
+		    (++tries >= O2_URING_WAIT_RETRIES))
+			return rc;
+		sched_yield();
+	}
+
+	return 0;
+}
+
+/*
+ * Completions are posted without io_uring_enter(); at worst they wait
+ * for us to return from a syscall, which the sleep provides.
+ */
+void o2_uring_wait_out(struct o2_uring *ring, uint64_t *user_data,
+		       int *res)
+{
+	while (!o2_uring_reap(ring, user_data, res)) {
+		if (o2_uring_submit(ring, 1))
+			usleep(1000);
+	}
+}
+
+int o2_uring_rw(struct o2_uring *ring, bool write, int fd, void *buf,
+		size_t len, uint64_t offset, int *res)
+{
+	int rc;
+	uint64_t user_data;
+
+	/* A single sqe carries 32 bits of length */
+	if (len > INT32_MAX)
+		len = INT32_MAX;
+
+	/* Completions that aren't ours are not ours to report */
+	o2_uring_prep_rw(ring, write, fd, buf, len, offset, O2_URING_RW_TAG);
+	do {
+		rc = o2_uring_wait(ring, &user_data, res);
+		if (rc) {
+			if (o2_uring_retract(ring, &user_data))
+				return rc;
+			do
+				o2_uring_wait_out(ring, &user_data, res);
+			while (user_data != O2_URING_RW_TAG);
+		}
+	} while (user_data != O2_URING_RW_TAG);
+
+	return 0;
+}
+
+#else  /* HAVE_IO_URING */
+
+struct o2_uring {
+	int ur_unused;
+};
+
+errcode_t o2_uring_init(unsigned int entries, struct o2_uring **ret_ring)
+{
+	return OCFS2_ET_UNSUPP_FEATURE;
+}
+
+void o2_uring_free(struct o2_uring *ring)
+{
+}
+
+errcode_t o2_uring_register_buffer(struct o2_uring *ring, void *buf,
+				   size_t len)
+{
+	return OCFS2_ET_UNSUPP_FEATURE;
+}
+
+void o2_uring_unregister_buffer(struct o2_uring *ring)
+{
+}
+
+unsigned int o2_uring_sq_space(struct o2_uring *ring)
+{
+	return 0;
+}
+
+void o2_uring_prep_rw(struct o2_uring *ring, bool write, int fd, void *buf,
+		      unsigned int len, uint64_t offset, uint64_t user_data)
+{
+}
+
+int o2_uring_submit(struct o2_uring *ring, unsigned int wait_nr)
+{
+	return -ENOSYS;
+}
+
+int o2_uring_wait_cq(struct o2_uring *ring, unsigned int wait_nr)
+{
+	return -ENOSYS;
+}
+
+int o2_uring_reap(struct o2_uring *ring, uint64_t *user_data, int *res)
+{
+	return 0;
+}
+
+int o2_uring_retract(struct o2_uring *ring, uint64_t *user_data)
+{
+	return 0;
+}
+
+int o2_uring_wait(struct o2_uring *ring, uint64_t *user_data, int *res)
+{
+	return -ENOSYS;
+}
+
+void o2_uring_wait_out(struct o2_uring *ring, uint64_t *user_data,
+		       int *res)
+{
+	*user_data = 0;
+	*res = -ENOSYS;
+}
+
+int o2_uring_rw(struct o2_uring *ring, bool write, int fd, void *buf,
+		size_t len, uint64_t offset, int *res)
+{
+	return -ENOSYS;
+}
+
+#endif  /* HAVE_IO_URING */
@@ -0,0 +1,89 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * uring.h
+ *
+ * Internal io_uring ring for the OCFS2 userspace library.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+/*
+ * A bare io_uring.  The ring is not locked; callers serialize.  Reads
+ * and writes that fall inside the registered buffer use the fixed
+ * opcodes, so the kernel doesn't map those pages for every I/O.
+ *
+ * Without HAVE_IO_URING, o2_uring_init() always fails and callers fall
+ * back to pread/libaio.
+ */
+struct o2_uring;
+
+errcode_t o2_uring_init(unsigned int entries, struct o2_uring **ret_ring);
+void o2_uring_free(struct o2_uring *ring);
+
+errcode_t o2_uring_register_buffer(struct o2_uring *ring, void *buf,
+				   size_t len);
+void o2_uring_unregister_buffer(struct o2_uring *ring);
+
+/* Queue an I/O; o2_uring_sq_space() must be nonzero */
+unsigned int o2_uring_sq_space(struct o2_uring *ring);
+void o2_uring_prep_rw(struct o2_uring *ring, bool write, int fd, void *buf,
+		      unsigned int len, uint64_t offset, uint64_t user_data);
+
+/*
+ * Hand queued I/Os to the kernel, waiting for wait_nr completions.
+ * Returns 0 or -errno.
+ */
+int o2_uring_submit(struct o2_uring *ring, unsigned int wait_nr);
+
+/* Pop one completion; returns 0 if there are none */
+int o2_uring_reap(struct o2_uring *ring, uint64_t *user_data, int *res);
+
+/*
+ * Sleep until wait_nr completions are waiting to be reaped, handing the
+ * kernel whatever o2_uring_submit() has published on the way.  It
+ * touches no ring state of ours, so one thread may wait here while
+ * another, holding the caller's lock, queues and submits more I/O.
+ * Returns 0 or -errno.
+ */
+int o2_uring_wait_cq(struct o2_uring *ring, unsigned int wait_nr);
+
+/*
+ * Take back the newest queued I/O the kernel hasn't consumed.  Returns
+ * 0 if there is none.
+ */
+int o2_uring_retract(struct o2_uring *ring, uint64_t *user_data);
+
+/*
+ * Pop one completion, waiting for it if need be.  Returns 0, or -errno
+ * if the ring can't wait.
+ */
+int o2_uring_wait(struct o2_uring *ring, uint64_t *user_data, int *res);
+
+/*
+ * After o2_uring_wait() fails, the I/Os the kernel has taken still own
+ * their buffers.  This pops one of their completions, polling until it
+ * lands.  Anything not yet taken should be retracted first.
+ */
+void o2_uring_wait_out(struct o2_uring *ring, uint64_t *user_data,
+		       int *res);
+
+/*
+ * One synchronous I/O.  *res gets what pread()/pwrite() would return,
+ * or -errno.  If the ring fails before the I/O is issued, it returns
+ * -errno and the caller has to do the I/O some other way.
+ */
+int o2_uring_rw(struct o2_uring *ring, bool write, int fd, void *buf,
+		size_t len, uint64_t offset, int *res);
+
+#endif  /* _URING_H */
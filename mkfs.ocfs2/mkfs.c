@@ -401,7 +401,8 @@ static void format_quota_files(State *s, ocfs2_filesys *fs)
 		}
 	}
 
-	ret = ocfs2_compute_quota_usage(fs, usr_hash, grp_hash);
+	/* A new filesystem has next to no inodes to scan */
+	ret = ocfs2_compute_quota_usage(fs, usr_hash, grp_hash, 1);
 	if (ret) {
 		com_err(s->progname, ret, "while computing quota usage");
 		goto error;
@@ -1956,41 +1957,13 @@ destroy_bitmap(AllocBitmap *bitmap)
 static int
 find_clear_bits(void *buf, unsigned int size, uint32_t num_bits, uint32_t offset)
 {
-	uint32_t next_zero, off, count = 0, first_zero = -1;
+	int start;
 
-	off = offset;
+	start = ocfs2_find_next_bits_clear(buf, size, offset, num_bits);
+	if (start >= size)
+		return -1;
 
-	while ((size - off + count >= num_bits) &&
-	       (next_zero = ocfs2_find_next_bit_clear(buf, size, off)) != size) {
-		if (next_zero >= size)
-			break;
-
-		if (next_zero != off) {
-			first_zero = next_zero;
-			off = next_zero + 1;
-			count = 0;
-		} else {
-			off++;
-			if (count == 0)
-				first_zero = next_zero;
-		}
-
-		count++;
-
-		if (count == num_bits)
-			goto bail;
-	}
-
-	first_zero = -1;
-
-bail:
-	if (first_zero != (uint32_t)-1 && first_zero > size) {
-		fprintf(stderr, "erf... first_zero > bitmap->valid_bits "
-				"(%d > %d)", first_zero, size);
-		first_zero = -1;
-	}
-
-	return first_zero;
+	return start;
 }
 
 static int
@@ -38,6 +38,7 @@
 #include <fcntl.h>
 #include <ocfs2/bitops.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sys/vfs.h>
 
 #include "ocfs2/ocfs2.h"
@@ -46,9 +47,45 @@
 static errcode_t traverse_inode(ocfs2_filesys *ofs, uint64_t inode);
 char *program_name = NULL;
 
+/*
+ * Blocks are read in runs of up to COPY_RUN_BYTES.  The copy keeps
+ * COPY_RUNS runs in flight ahead of the writer, and the scan reads the
+ * inodes of a group a run at a time.
+ */
+#define COPY_RUNS		8
+#define COPY_RUN_BYTES		(1024 * 1024)
+
+#define SCAN_MAX_THREADS	64
+
+/*
+ * With -j, the groups of the inode allocators are scanned on several
+ * threads.  traverse_chains() queues each such group rather than
+ * walking it, and a thread that comes across another inode allocator
+ * queues its groups in turn.  The scan is done when the queue is empty
+ * and no thread is busy.
+ */
+struct scan_job {
+	uint64_t		sj_blkno;	/* Group descriptor */
+	int			sj_bpc;
+	struct scan_job		*sj_next;
+};
+
+struct scan_pool {
+	ocfs2_filesys		*sp_ofs;
+	pthread_mutex_t		sp_lock;
+	pthread_cond_t		sp_cond;
+	struct scan_job		*sp_head;
+	struct scan_job		*sp_tail;
+	int			sp_busy;
+	errcode_t		sp_ret;
+};
+
+static int scan_threads = 1;
+static struct scan_pool *scan_pool;	/* NULL when scanning serially */
+
 static void usage(void)
 {
-	fprintf(stderr, ("Usage: %s [-frI] device image_file\n"),
+	fprintf(stderr, ("Usage: %s [-irI1] [-j threads] device image_file\n"),
 		program_name);
 	exit(1);
 }
@@ -60,26 +97,171 @@ static errcode_t mark_localalloc_bits(ocfs2_filesys *ofs,
 	return 0;
 }
 
+/*
+ * Read the run of used inodes starting at bit first into the cache, so
+ * traverse_inode() finds them there.  It is only a hint; read errors
+ * are left for traverse_inode() to report.  Returns the bit after the
+ * run.
+ */
+static int prefetch_inodes(ocfs2_filesys *ofs, struct ocfs2_group_desc *grp,
+			   int bpc, int first, char *buf)
+{
+	int i, len = 1, max = COPY_RUN_BYTES / ofs->fs_blocksize;
+	uint64_t start;
+
+	start = ocfs2_get_block_from_group(ofs, grp, bpc, first);
+	for (i = first + 1; (i < grp->bg_bits) && (len < max); i++) {
+		if (!ocfs2_test_bit(i, grp->bg_bitmap) ||
+		    (ocfs2_get_block_from_group(ofs, grp, bpc, i) !=
+		     start + len))
+			break;
+		len++;
+	}
+
+	ocfs2_read_blocks(ofs, start, len, buf);
+
+	return i;
+}
+
 static errcode_t traverse_group_desc(ocfs2_filesys *ofs,
 				     struct ocfs2_group_desc *grp,
 				     int dump_type, int bpc)
 {
 	errcode_t ret = 0;
 	uint64_t blkno;
-	int i;
+	char *buf = NULL;
+	int i, fetched = grp->bg_bits;
+
+	/* Without a cache there is nowhere to prefetch to */
+	if ((dump_type == OCFS2_IMAGE_READ_INODE_YES) &&
+	    io_get_cache_size(ofs->fs_io) &&
+	    !ocfs2_malloc_blocks(ofs->fs_io,
+				 COPY_RUN_BYTES / ofs->fs_blocksize, &buf))
+		fetched = 0;
 
 	blkno = grp->bg_blkno;
 	for (i = 1; i < grp->bg_bits; i++) {
 		blkno = ocfs2_get_block_from_group(ofs, grp, bpc, i);
 		if ((dump_type == OCFS2_IMAGE_READ_INODE_YES) &&
-		    ocfs2_test_bit(i, grp->bg_bitmap))
+		    ocfs2_test_bit(i, grp->bg_bitmap)) {
+			if (i >= fetched)
+				fetched = prefetch_inodes(ofs, grp, bpc, i,
+							  buf);
 			ret = traverse_inode(ofs, blkno);
-		else
+		} else
 			ocfs2_image_mark_bitmap(ofs, blkno);
 	}
+
+	if (buf)
+		ocfs2_free(&buf);
 	return ret;
 }
 
+static errcode_t scan_queue_group(uint64_t blkno, int bpc)
+{
+	struct scan_job *job;
+	errcode_t ret;
+
+	ret = ocfs2_malloc0(sizeof(struct scan_job), &job);
+	if (ret)
+		return ret;
+	job->sj_blkno = blkno;
+	job->sj_bpc = bpc;
+
+	pthread_mutex_lock(&scan_pool->sp_lock);
+	if (scan_pool->sp_tail)
+		scan_pool->sp_tail->sj_next = job;
+	else
+		scan_pool->sp_head = job;
+	scan_pool->sp_tail = job;
+	pthread_cond_signal(&scan_pool->sp_cond);
+	pthread_mutex_unlock(&scan_pool->sp_lock);
+
+	return 0;
+}
+
+static errcode_t scan_group(ocfs2_filesys *ofs, struct scan_job *job,
+			    char *buf)
+{
+	errcode_t ret;
+
+	ret = ocfs2_read_group_desc(ofs, job->sj_blkno, buf);
+	if (ret) {
+		com_err(program_name, ret, "while reading group descriptor "
+			"%"PRIu64, job->sj_blkno);
+		return ret;
+	}
+
+	return traverse_group_desc(ofs, (struct ocfs2_group_desc *)buf,
+				   OCFS2_IMAGE_READ_INODE_YES, job->sj_bpc);
+}
+
+/* Once a thread has failed, the rest only empty the queue */
+static void *scan_worker(void *arg)
+{
+	struct scan_pool *sp = arg;
+	struct scan_job *job;
+	char *buf = NULL;
+	errcode_t ret;
+	int skip;
+
+	ret = ocfs2_malloc_block(sp->sp_ofs->fs_io, &buf);
+
+	pthread_mutex_lock(&sp->sp_lock);
+	if (ret && !sp->sp_ret)
+		sp->sp_ret = ret;
+	while (1) {
+		while (!sp->sp_head && sp->sp_busy)
+			pthread_cond_wait(&sp->sp_cond, &sp->sp_lock);
+		job = sp->sp_head;
+		if (!job)
+			break;
+
+		sp->sp_head = job->sj_next;
+		if (!sp->sp_head)
+			sp->sp_tail = NULL;
+		sp->sp_busy++;
+		skip = !!sp->sp_ret;
+		pthread_mutex_unlock(&sp->sp_lock);
+
+		ret = skip ? 0 : scan_group(sp->sp_ofs, job, buf);
+		ocfs2_free(&job);
+
+		pthread_mutex_lock(&sp->sp_lock);
+		sp->sp_busy--;
+		if (ret && !sp->sp_ret)
+			sp->sp_ret = ret;
+		if (!sp->sp_head && !sp->sp_busy)
+			pthread_cond_broadcast(&sp->sp_cond);
+	}
+	pthread_mutex_unlock(&sp->sp_lock);
+
+	if (buf)
+		ocfs2_free(&buf);
+	return NULL;
+}
+
+/* Run the queued groups on scan_threads threads */
+static errcode_t scan_run(struct scan_pool *sp)
+{
+	pthread_t threads[SCAN_MAX_THREADS];
+	int i, started;
+
+	for (started = 0; started < scan_threads; started++) {
+		if (pthread_create(&threads[started], NULL, scan_worker, sp))
+			break;
+	}
+
+	/* No threads at all just means no parallelism */
+	if (!started)
+		scan_worker(sp);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	return sp->sp_ret;
+}
+
 static errcode_t mark_dealloc_bits(ocfs2_filesys *ofs,
 				   struct ocfs2_truncate_log *tl)
 {
@@ -151,7 +333,12 @@ static errcode_t traverse_chains(ocfs2_filesys *ofs,
 				goto out;
 
 			grp = (struct ocfs2_group_desc *)buf;
-			if (dump_type) {
+			if (scan_pool &&
+			    (dump_type == OCFS2_IMAGE_READ_INODE_YES)) {
+				ret = scan_queue_group(blkno, cl->cl_bpc);
+				if (ret)
+					goto out;
+			} else if (dump_type) {
 				ret = traverse_group_desc(ofs, grp,
 						dump_type, cl->cl_bpc);
 				if (ret)
@@ -277,12 +464,11 @@ static errcode_t traverse_inode(ocfs2_filesys *ofs, uint64_t inode)
 			dump_type = OCFS2_IMAGE_READ_INODE_YES;
 
 	if (inode == ost->ost_glbl_inode_alloc) {
-		if (ost->ost_glbl_inode_traversed) {
+		/* With -j two threads could find it at once */
+		if (__sync_lock_test_and_set(&ost->ost_glbl_inode_traversed,
+					     1))
 			goto out;
-		} else {
-			dump_type = OCFS2_IMAGE_READ_INODE_YES;
-			ost->ost_glbl_inode_traversed = 1;
-		}
+		dump_type = OCFS2_IMAGE_READ_INODE_YES;
 	}
 
 	if ((di->i_flags & OCFS2_LOCAL_ALLOC_FL))
@@ -492,52 +678,379 @@ out:
 	return written;
 }
 
+/*
+ * The copy reads the blocks set in the image bitmap as runs of adjacent
+ * blocks, in disk order, and keeps COPY_RUNS of them in flight.  An
+ * image file (o2image -I) can't be read through io_vec, so its runs are
+ * read when they are due.
+ */
+struct copy_run {
+	uint64_t		cr_blkno;
+	int			cr_blocks;
+	char			*cr_buf;
+	struct io_vec_unit	cr_ivu;
+	int			cr_reading;
+};
+
+struct copy_ahead {
+	ocfs2_filesys		*ca_ofs;
+	struct copy_run		ca_runs[COPY_RUNS];
+	int			ca_head;
+	int			ca_queued;
+	int			ca_taken;	/* The head run was handed out */
+	int			ca_max;		/* Blocks in a run */
+	int			ca_async;
+	uint64_t		ca_next;	/* Where the next run starts */
+};
+
+/*
+ * Find the next run of set blocks at or after start.  Whole bitmap
+ * blocks of clear bits are skipped a byte at a time.  Returns the
+ * length of the run, or 0 if there are no more.
+ */
+static int image_next_run(ocfs2_filesys *ofs, uint64_t start, int max,
+			  uint64_t *blkno)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	uint64_t blk = start;
+	int bit, len;
+
+	while (blk < ofs->fs_blocks) {
+		bit = ocfs2_find_next_bit_set(
+			ost->ost_bmparr[blk / OCFS2_IMAGE_BITS_IN_BLOCK].arr_map,
+			OCFS2_IMAGE_BITS_IN_BLOCK,
+			blk % OCFS2_IMAGE_BITS_IN_BLOCK);
+		blk -= blk % OCFS2_IMAGE_BITS_IN_BLOCK;
+		if (bit < OCFS2_IMAGE_BITS_IN_BLOCK) {
+			blk += bit;
+			break;
+		}
+		blk += OCFS2_IMAGE_BITS_IN_BLOCK;
+	}
+	if (blk >= ofs->fs_blocks)
+		return 0;
+
+	for (len = 1; (len < max) && (blk + len < ofs->fs_blocks); len++) {
+		if (!ocfs2_image_test_bit(ofs, blk + len))
+			break;
+	}
+
+	*blkno = blk;
+	return len;
+}
+
+static void copy_queue_runs(struct copy_ahead *ca)
+{
+	struct copy_run *run;
+	int len;
+
+	while (ca->ca_queued < COPY_RUNS) {
+		len = image_next_run(ca->ca_ofs, ca->ca_next, ca->ca_max,
+				     &ca->ca_next);
+		if (!len)
+			break;
+
+		run = &ca->ca_runs[(ca->ca_head + ca->ca_queued) % COPY_RUNS];
+		run->cr_blkno = ca->ca_next;
+		run->cr_blocks = len;
+		run->cr_reading = 0;
+		if (ca->ca_async) {
+			run->cr_ivu.ivu_blkno = run->cr_blkno;
+			run->cr_ivu.ivu_buf = run->cr_buf;
+			run->cr_ivu.ivu_buflen = len * ca->ca_ofs->fs_blocksize;
+			if (!io_vec_submit(ca->ca_ofs->fs_io, &run->cr_ivu, 1))
+				run->cr_reading = 1;
+		}
+
+		ca->ca_next += len;
+		ca->ca_queued++;
+	}
+}
+
+/* The next run in disk order, read.  *ret_run is NULL at the end. */
+static errcode_t copy_next_run(struct copy_ahead *ca,
+			       struct copy_run **ret_run)
+{
+	struct copy_run *run;
+	errcode_t ret = 0;
+
+	if (ca->ca_taken) {
+		ca->ca_head = (ca->ca_head + 1) % COPY_RUNS;
+		ca->ca_queued--;
+		ca->ca_taken = 0;
+	}
+
+	copy_queue_runs(ca);
+
+	*ret_run = NULL;
+	if (!ca->ca_queued)
+		return 0;
+
+	run = &ca->ca_runs[ca->ca_head];
+	if (run->cr_reading) {
+		run->cr_reading = 0;
+		ret = io_vec_wait(ca->ca_ofs->fs_io, &run->cr_ivu);
+	} else
+		ret = ocfs2_read_blocks(ca->ca_ofs, run->cr_blkno,
+					run->cr_blocks, run->cr_buf);
+	if (ret) {
+		com_err(program_name, ret, "while reading blocks %"PRIu64
+			" to %"PRIu64, run->cr_blkno,
+			run->cr_blkno + run->cr_blocks - 1);
+		return ret;
+	}
+
+	ca->ca_taken = 1;
+	*ret_run = run;
+	return 0;
+}
+
+static void copy_free(struct copy_ahead *ca)
+{
+	struct copy_run *run;
+	int i;
+
+	/* The reads have to land before their buffers go away */
+	for (i = 0; i < ca->ca_queued; i++) {
+		run = &ca->ca_runs[(ca->ca_head + i) % COPY_RUNS];
+		if (run->cr_reading)
+			io_vec_wait(ca->ca_ofs->fs_io, &run->cr_ivu);
+	}
+
+	for (i = 0; i < COPY_RUNS; i++) {
+		if (ca->ca_runs[i].cr_buf)
+			ocfs2_free(&ca->ca_runs[i].cr_buf);
+	}
+}
+
+static errcode_t copy_init(struct copy_ahead *ca, ocfs2_filesys *ofs)
+{
+	errcode_t ret;
+	int i;
+
+	memset(ca, 0, sizeof(struct copy_ahead));
+	ca->ca_ofs = ofs;
+	ca->ca_max = COPY_RUN_BYTES / ofs->fs_blocksize;
+	ca->ca_async = !(ofs->fs_flags & OCFS2_FLAG_IMAGE_FILE);
+
+	for (i = 0; i < COPY_RUNS; i++) {
+		ret = ocfs2_malloc_blocks(ofs->fs_io, ca->ca_max,
+					  &ca->ca_runs[i].cr_buf);
+		if (ret) {
+			com_err(program_name, ret,
+				"while allocating I/O buffers");
+			copy_free(ca);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
 static errcode_t write_raw_image_file(ocfs2_filesys *ofs, int fd)
 {
-	char *blk_buf = NULL;
-	uint64_t blk = -1;
+	struct copy_ahead ca;
+	struct copy_run *run;
 	ssize_t count;
 	errcode_t ret;
 
-	ret = ocfs2_malloc_block(ofs->fs_io, &blk_buf);
+	ret = copy_init(&ca, ofs);
+	if (ret)
+		return ret;
+
+	while (1) {
+		ret = copy_next_run(&ca, &run);
+		if (ret || !run)
+			break;
+
+		count = raw_write(ofs, fd, run->cr_buf,
+				  run->cr_blocks * ofs->fs_blocksize,
+				  (loff_t)(run->cr_blkno * ofs->fs_blocksize));
+		if (count < 0) {
+			ret = OCFS2_ET_IO;
+			break;
+		}
+	}
+
+	copy_free(&ca);
+	return ret;
+}
+
+/* write() all of buf, which a pipe may take in pieces */
+static errcode_t write_all(int fd, char *buf, size_t count)
+{
+	ssize_t bytes;
+
+	while (count) {
+		bytes = write(fd, buf, count);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		buf += bytes;
+		count -= bytes;
+	}
+
+	return 0;
+}
+
+/* Compress and write one v2 chunk at *pos, recording it in ic */
+static errcode_t write_chunk(int fd, char *raw, uint32_t len, char *cbuf,
+			     struct ocfs2_image_chunk *ic, uint64_t *pos)
+{
+	errcode_t ret;
+	uint32_t clen;
+	uint16_t codec;
+
+	ret = ocfs2_image_compress(raw, len, cbuf, &clen, &codec);
+	if (ret) {
+		com_err(program_name, ret, "while compressing image chunk");
+		return ret;
+	}
+
+	ret = write_all(fd, cbuf, clen);
+	if (ret) {
+		com_err(program_name, ret, "while writing image chunk");
+		return ret;
+	}
+
+	ic->ic_offset = *pos;
+	ic->ic_len = clen;
+	ic->ic_codec = codec;
+	ic->ic_reserved = 0;
+	*pos += clen;
+
+	return 0;
+}
+
+/*
+ * The body of a v2 image.  The metadata blocks are gathered into chunks
+ * of OCFS2_IMAGE_CHUNK_BLOCKS, then the bitmap blocks are, and then the
+ * chunk index and the trailer are written.  Nothing needs a seek.
+ */
+static errcode_t write_image_chunks(ocfs2_filesys *ofs, int fd,
+				    uint64_t imgblks)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	struct ocfs2_image_chunk *chunks = NULL;
+	struct ocfs2_image_trailer trailer;
+	struct copy_ahead ca;
+	struct copy_run *run;
+	uint64_t nr_chunks, bmpchunks, pos, i, j, n, done, take;
+	uint32_t chunkblks = OCFS2_IMAGE_CHUNK_BLOCKS;
+	uint32_t chunksz = chunkblks * ocfs2_max((uint64_t)ofs->fs_blocksize,
+						 ost->ost_bmpblksz);
+	char *raw = NULL, *cbuf = NULL;
+	errcode_t ret;
+
+	ret = copy_init(&ca, ofs);
+	if (ret)
+		return ret;
+
+	nr_chunks = (imgblks + chunkblks - 1) / chunkblks;
+	bmpchunks = (ost->ost_bmpblks + chunkblks - 1) / chunkblks;
+
+	ret = ocfs2_malloc0((nr_chunks + bmpchunks) *
+			    sizeof(struct ocfs2_image_chunk), &chunks);
+	if (!ret)
+		ret = ocfs2_malloc_blocks(ofs->fs_io,
+					  chunksz / ofs->fs_blocksize, &raw);
+	if (!ret)
+		ret = ocfs2_malloc(chunksz, &cbuf);
 	if (ret) {
-		com_err(program_name, ret, "while allocating I/O buffer");
+		com_err(program_name, ret, "while allocating chunk buffers");
 		goto out;
 	}
 
-	while (++blk < ofs->fs_blocks) {
-		if (ocfs2_image_test_bit(ofs, blk)) {
-			ret = ocfs2_read_blocks(ofs, blk, 1, blk_buf);
-			if (ret) {
-				com_err(program_name, ret,
-					"while reading block %"PRIu64, blk);
-				break;
-			}
+	pos = ofs->fs_blocksize;
+	n = 0;
+	i = 0;
+	while (1) {
+		ret = copy_next_run(&ca, &run);
+		if (ret)
+			goto out;
+		if (!run)
+			break;
 
-			count = raw_write(ofs, fd, blk_buf,
-					  ofs->fs_blocksize,
-					  (loff_t)(blk * ofs->fs_blocksize));
-			if (count < 0) {
-				ret = OCFS2_ET_IO;
-				break;
-			}
+		/* A run can straddle chunks */
+		for (done = 0; done < run->cr_blocks; done += take) {
+			take = ocfs2_min(run->cr_blocks - done,
+					 (uint64_t)chunkblks - n);
+			memcpy(raw + (n * ofs->fs_blocksize),
+			       run->cr_buf + (done * ofs->fs_blocksize),
+			       take * ofs->fs_blocksize);
+			n += take;
+			if (n < chunkblks)
+				continue;
+
+			ret = write_chunk(fd, raw, n * ofs->fs_blocksize,
+					  cbuf, &chunks[i++], &pos);
+			if (ret)
+				goto out;
+			n = 0;
 		}
 	}
 
+	if (n) {
+		ret = write_chunk(fd, raw, n * ofs->fs_blocksize, cbuf,
+				  &chunks[i++], &pos);
+		if (ret)
+			goto out;
+	}
+
+	for (j = 0; j < bmpchunks; j++) {
+		for (n = 0; (n < chunkblks) &&
+		     ((j * chunkblks) + n < ost->ost_bmpblks); n++)
+			memcpy(raw + (n * ost->ost_bmpblksz),
+			       ost->ost_bmparr[(j * chunkblks) + n].arr_map,
+			       ost->ost_bmpblksz);
+
+		ret = write_chunk(fd, raw, n * ost->ost_bmpblksz, cbuf,
+				  &chunks[i++], &pos);
+		if (ret)
+			goto out;
+	}
+
+	trailer.it_magic = OCFS2_IMAGE_MAGIC;
+	trailer.it_reserved = 0;
+	trailer.it_index = pos;
+	trailer.it_chunks = nr_chunks;
+	trailer.it_bmpchunks = bmpchunks;
+
+	for (i = 0; i < nr_chunks + bmpchunks; i++)
+		ocfs2_image_swap_chunk(&chunks[i]);
+	ocfs2_image_swap_trailer(&trailer);
+
+	ret = write_all(fd, (char *)chunks,
+			(nr_chunks + bmpchunks) *
+			sizeof(struct ocfs2_image_chunk));
+	if (!ret)
+		ret = write_all(fd, (char *)&trailer, sizeof(trailer));
+	if (ret)
+		com_err(program_name, ret, "while writing the chunk index");
+
 out:
-	if (blk_buf)
-		ocfs2_free(&blk_buf);
+	if (chunks)
+		ocfs2_free(&chunks);
+	if (raw)
+		ocfs2_free(&raw);
+	if (cbuf)
+		ocfs2_free(&cbuf);
+	copy_free(&ca);
 	return ret;
 }
 
-static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
+static errcode_t write_image_file(ocfs2_filesys *ofs, int fd, int version)
 {
 	uint64_t supers[OCFS2_MAX_BACKUP_SUPERBLOCKS];
 	struct ocfs2_image_state *ost = ofs->ost;
 	struct ocfs2_image_hdr *hdr;
+	struct copy_ahead ca;
+	struct copy_run *run;
 	uint64_t i, blk;
 	errcode_t ret;
-	int bytes;
+	int bytes = 0;
 	char *buf;
 
 	ret = ocfs2_malloc_block(ofs->fs_io, &buf);
@@ -551,14 +1064,11 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 	memcpy(hdr->hdr_magic_desc, OCFS2_IMAGE_DESC,
 	       sizeof(OCFS2_IMAGE_DESC));
 
-	/* count metadata blocks that will be backedup */
-	blk = 0;
-	for (i = 0; i<ofs->fs_blocks; i++)
-		if (ocfs2_image_test_bit(ofs, i))
-			blk++;
+	/* metadata blocks that will be backedup, counted by scan_raw_disk() */
+	blk = ost->ost_imgblkcnt;
 
 	hdr->hdr_timestamp 	= time(0);
-	hdr->hdr_version 	= OCFS2_IMAGE_VERSION;
+	hdr->hdr_version 	= version;
 	hdr->hdr_fsblkcnt 	= ofs->fs_blocks;
 	hdr->hdr_fsblksz 	= ofs->fs_blocksize;
 	hdr->hdr_imgblkcnt	= blk;
@@ -569,6 +1079,8 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 	for (i = 0; i < hdr->hdr_superblkcnt; i++)
 		hdr->hdr_superblocks[i] = ocfs2_image_get_blockno(ofs,
 								  supers[i]);
+	if (version >= 2)
+		hdr->hdr_chunkblks = OCFS2_IMAGE_CHUNK_BLOCKS;
 
 	ocfs2_image_swap_header(hdr);
 	/* o2image header size is smaller than ofs->fs_blocksize */
@@ -583,24 +1095,33 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 		goto out;
 	}
 
+	if (version >= 2) {
+		ret = write_image_chunks(ofs, fd, blk);
+		goto out;
+	}
+
 	/* copy metadata blocks to image files */
-	for (blk = 0; blk < ofs->fs_blocks; blk++) {
-		if (ocfs2_image_test_bit(ofs, blk)) {
-			ret = ocfs2_read_blocks(ofs, blk, 1, buf);
-			if (ret) {
-				com_err(program_name, ret, "error occurred "
-					"during read block %"PRIu64"", blk);
-				goto out;
-			}
+	ret = copy_init(&ca, ofs);
+	if (ret)
+		goto out;
+	while (1) {
+		ret = copy_next_run(&ca, &run);
+		if (ret || !run)
+			break;
 
-			bytes = write(fd, buf, ofs->fs_blocksize);
-			if ((bytes == -1) || (bytes < ofs->fs_blocksize)) {
-				com_err(program_name, errno, "error writing "
-					"blk %"PRIu64"", blk);
-				goto out;
-			}
+		ret = write_all(fd, run->cr_buf,
+				run->cr_blocks * ofs->fs_blocksize);
+		if (ret) {
+			com_err(program_name, ret, "error writing blks "
+				"%"PRIu64" to %"PRIu64, run->cr_blkno,
+				run->cr_blkno + run->cr_blocks - 1);
+			break;
 		}
 	}
+	copy_free(&ca);
+	if (ret)
+		goto out;
+
 	/* write bitmap blocks at the end */
 	for(blk = 0; blk < ost->ost_bmpblks; blk++) {
 		bytes = write(fd, ost->ost_bmparr[blk].arr_map,
@@ -623,25 +1144,37 @@ out:
 static errcode_t scan_raw_disk(ocfs2_filesys *ofs)
 {
 	struct ocfs2_image_state *ost = ofs->ost;
-	uint64_t bits_set = 0;
+	struct scan_pool sp;
 	errcode_t ret;
-	int i, j;
+
+	if (scan_threads > 1) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sp_ofs = ofs;
+		pthread_mutex_init(&sp.sp_lock, NULL);
+		pthread_cond_init(&sp.sp_cond, NULL);
+		scan_pool = &sp;
+	}
 
 	/*
 	 * global inode alloc has list of all metadata inodes blocks.
-	 * traverse_inode recursively traverses each inode
+	 * traverse_inode recursively traverses each inode.  With -j,
+	 * this only queues the groups, and scan_run() walks them.
 	 */
 	ret = traverse_inode(ofs, ofs->ost->ost_glbl_inode_alloc);
+	if (scan_pool) {
+		/* The threads also empty the queue if that failed */
+		if (ret)
+			sp.sp_ret = ret;
+		ret = scan_run(&sp);
+		scan_pool = NULL;
+		pthread_cond_destroy(&sp.sp_cond);
+		pthread_mutex_destroy(&sp.sp_lock);
+	}
 	if (ret)
 		goto out;
 
-	/* update set_bit_cnt for future use */
-	for (i = 0; i < ost->ost_bmpblks; i++) {
-		ost->ost_bmparr[i].arr_set_bit_cnt = bits_set;
-		for (j = 0; j < (ost->ost_bmpblksz * 8); j++)
-			if (ocfs2_test_bit(j, ost->ost_bmparr[i].arr_map))
-				bits_set++;
-	}
+	/* update set_bit_cnt and the rank index for future use */
+	ret = ocfs2_image_count_bits(ofs, &ost->ost_imgblkcnt);
 
 out:
 	return ret;
@@ -649,7 +1182,6 @@ out:
 
 static int prompt_image_creation(ocfs2_filesys *ofs, int rawflg, char *filename)
 {
-	int i, n;
 	uint64_t free_spc;
 	struct statfs stat;
 	uint64_t img_size = 0;
@@ -659,15 +1191,9 @@ static int prompt_image_creation(ocfs2_filesys *ofs, int rawflg, char *filename)
 	statfs(dirname(filepath), &stat);
 	free_spc = stat.f_bsize * stat.f_bavail;
 
-	n = ofs->ost->ost_bmpblks - 1;
 	if (!rawflg)
 		img_size = ofs->ost->ost_bmpblks * ofs->ost->ost_bmpblksz;
-	img_size += ofs->ost->ost_bmparr[n].arr_set_bit_cnt *
-		ofs->fs_blocksize;
-
-	for (i = 0; i < (ofs->ost->ost_bmpblksz * 8); i++)
-		if (ocfs2_test_bit(i, ofs->ost->ost_bmparr[n].arr_map))
-			img_size += ofs->fs_blocksize;
+	img_size += ofs->ost->ost_imgblkcnt * ofs->fs_blocksize;
 
 	fprintf(stdout, "Image file expected to be %luK, "
 		"Available free space %luK. Continue ? (y/N): ",
@@ -690,7 +1216,9 @@ int main(int argc, char **argv)
 	int raw_flag      	= 0;
 	int install_flag  	= 0;
 	int interactive		= 0;
+	int version		= OCFS2_IMAGE_VERSION;
 	int fd            	= STDOUT_FILENO;
+	char *endptr;
 	int c;
 
 	if (argc && *argv)
@@ -699,8 +1227,20 @@ int main(int argc, char **argv)
 	initialize_ocfs_error_table();
 
 	optind = 0;
-	while((c = getopt(argc, argv, "irI")) != EOF) {
+	while((c = getopt(argc, argv, "irI1j:")) != EOF) {
 		switch (c) {
+		case 'j':
+			scan_threads = strtol(optarg, &endptr, 0);
+			if (*endptr || (scan_threads < 1) ||
+			    (scan_threads > SCAN_MAX_THREADS)) {
+				fprintf(stderr, "Invalid thread count: %s\n",
+					optarg);
+				usage();
+			}
+			break;
+		case '1':
+			version = 1;
+			break;
 		case 'r':
 			raw_flag++;
 			break;
@@ -749,8 +1289,8 @@ int main(int argc, char **argv)
 	 * OCFS2_FLAG_IMAGE_FILE flag is passed in
 	 */
 	ret = ocfs2_open(src_file,
-			 OCFS2_FLAG_RO|OCFS2_FLAG_NO_ECC_CHECKS|open_flags, 0,
-			 0, &ofs);
+			 OCFS2_FLAG_RO|OCFS2_FLAG_NO_ECC_CHECKS|
+			 OCFS2_FLAG_IO_URING|open_flags, 0, 0, &ofs);
 	if (ret) {
 		com_err(program_name, ret, "while trying to open \"%s\"",
 			src_file);
@@ -776,6 +1316,15 @@ int main(int argc, char **argv)
 			goto out;
 		}
 
+		/*
+		 * Room for the inodes each thread prefetches.  Without a
+		 * cache, the scan reads the inodes one at a time.
+		 */
+		io_init_cache_engine(ofs->fs_io,
+				     (scan_threads + 1) * 2 *
+				     (COPY_RUN_BYTES / ofs->fs_blocksize),
+				     IO_CACHE_ENGINE_HASH);
+
 		ret = scan_raw_disk(ofs);
 		if (ret) {
 			com_err(program_name, ret, "while scanning disk \"%s\"",
@@ -804,7 +1353,7 @@ int main(int argc, char **argv)
 	if (raw_flag || install_flag)
 		ret = write_raw_image_file(ofs, fd);
 	else
-		ret = write_image_file(ofs, fd);
+		ret = write_image_file(ofs, fd, version);
 
 	if (ret) {
 		com_err(program_name, ret, "while writing to image \"%s\"",
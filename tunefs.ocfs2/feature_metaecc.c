@@ -24,6 +24,7 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ocfs2-kernel/kernel-list.h"
 #include "ocfs2/kernel-rbtree.h"
@@ -52,13 +53,25 @@
  * For directory blocks, tunefs_prepare_dir_trailer() makes its own copies.
  * After we run tunefs_install_dir_trailer(), we'll have to copy the
  * changes back to our copy.
+ *
+ * The inode scan is split across threads by allocator chain.  Each
+ * thread fills its own context, and they are merged when the scan is
+ * done.
+ *
+ * Writing is also spread across threads.  e_prepare() swaps a copy of
+ * the block to disk order and says where its check lives.  The ECC is
+ * computed on that copy, and only blocks whose check changed are
+ * written.  Every block we hold matches what is on disk, so a block
+ * whose check is already right was written by an earlier run that was
+ * interrupted.  That makes the rewrite resumable.
  */
 struct block_to_ecc {
 	struct rb_node e_node;
 	uint64_t e_blkno;
 	struct ocfs2_dinode *e_di;
 	char *e_buf;
-	errcode_t (*e_write)(ocfs2_filesys *fs, struct block_to_ecc *block);
+	errcode_t (*e_prepare)(ocfs2_filesys *fs, struct block_to_ecc *block,
+			       char *buf, struct ocfs2_block_check **bc);
 };
 
 /*
@@ -156,10 +169,16 @@ static errcode_t block_insert(struct add_ecc_context *ctxt,
 	return ret;
 }
 
-static errcode_t dinode_write_func(ocfs2_filesys *fs,
-				   struct block_to_ecc *block)
+static errcode_t dinode_prepare_func(ocfs2_filesys *fs,
+				     struct block_to_ecc *block,
+				     char *buf, struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_inode(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)buf;
+
+	ocfs2_swap_inode_from_cpu(fs, di);
+	*bc = &di->i_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_dinode(ocfs2_filesys *fs,
@@ -180,7 +199,7 @@ static errcode_t block_insert_dinode(ocfs2_filesys *fs,
 	memcpy(block->e_buf, di, fs->fs_blocksize);
 	block->e_di = (struct ocfs2_dinode *)block->e_buf;
 	block->e_blkno = di->i_blkno;
-	block->e_write = dinode_write_func;
+	block->e_prepare = dinode_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -189,10 +208,16 @@ out:
 	return ret;
 }
 
-static errcode_t eb_write_func(ocfs2_filesys *fs,
-			       struct block_to_ecc *block)
+static errcode_t eb_prepare_func(ocfs2_filesys *fs,
+				 struct block_to_ecc *block,
+				 char *buf, struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_extent_block(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_extent_block *eb = (struct ocfs2_extent_block *)buf;
+
+	ocfs2_swap_extent_block_from_cpu(fs, eb);
+	*bc = &eb->h_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_eb(ocfs2_filesys *fs,
@@ -213,7 +238,7 @@ static errcode_t block_insert_eb(ocfs2_filesys *fs,
 
 	memcpy(block->e_buf, eb, fs->fs_blocksize);
 	block->e_blkno = eb->h_blkno;
-	block->e_write = eb_write_func;
+	block->e_prepare = eb_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -222,10 +247,16 @@ out:
 	return ret;
 }
 
-static errcode_t gd_write_func(ocfs2_filesys *fs,
-			       struct block_to_ecc *block)
+static errcode_t gd_prepare_func(ocfs2_filesys *fs,
+				 struct block_to_ecc *block,
+				 char *buf, struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_group_desc(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)buf;
+
+	ocfs2_swap_group_desc_from_cpu(fs, gd);
+	*bc = &gd->bg_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_gd(ocfs2_filesys *fs,
@@ -246,7 +277,7 @@ static errcode_t block_insert_gd(ocfs2_filesys *fs,
 
 	memcpy(block->e_buf, gd, fs->fs_blocksize);
 	block->e_blkno = gd->bg_blkno;
-	block->e_write = gd_write_func;
+	block->e_prepare = gd_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -255,11 +286,28 @@ out:
 	return ret;
 }
 
-static errcode_t dirblock_write_func(ocfs2_filesys *fs,
-				     struct block_to_ecc *block)
+/* The same swapping ocfs2_write_dir_block() does */
+static errcode_t dirblock_prepare_func(ocfs2_filesys *fs,
+				       struct block_to_ecc *block,
+				       char *buf, struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_dir_block(fs, block->e_di, block->e_blkno,
-				     block->e_buf);
+	errcode_t ret;
+	int end = fs->fs_blocksize;
+	struct ocfs2_dir_block_trailer *trailer;
+
+	if (ocfs2_dir_has_trailer(fs, block->e_di))
+		end = ocfs2_dir_trailer_blk_off(fs);
+
+	ret = ocfs2_swap_dir_entries_from_cpu(buf, end);
+	if (ret)
+		return ret;
+
+	trailer = ocfs2_dir_trailer_from_block(fs, buf);
+	if (ocfs2_dir_has_trailer(fs, block->e_di))
+		ocfs2_swap_dir_trailer(trailer);
+	*bc = &trailer->db_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
@@ -281,7 +329,7 @@ static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
 	memcpy(block->e_buf, buf, fs->fs_blocksize);
 	block->e_di = di;
 	block->e_blkno = blkno;
-	block->e_write = dirblock_write_func;
+	block->e_prepare = dirblock_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -341,6 +389,42 @@ static void empty_add_ecc_context(struct add_ecc_context *ctxt)
 	empty_ecc_blocks(ctxt);
 }
 
+static void init_add_ecc_context(struct add_ecc_context *ctxt)
+{
+	memset(ctxt, 0, sizeof(struct add_ecc_context));
+	INIT_LIST_HEAD(&ctxt->ae_dirs);
+	INIT_LIST_HEAD(&ctxt->ae_chains);
+	ctxt->ae_blocks = RB_ROOT;
+}
+
+/* Move everything one scan thread found into the main context */
+static void merge_add_ecc_context(struct add_ecc_context *ctxt,
+				  struct add_ecc_context *part)
+{
+	struct block_to_ecc *block;
+	struct rb_node *node;
+
+	while ((node = rb_first(&part->ae_blocks)) != NULL) {
+		block = rb_entry(node, struct block_to_ecc, e_node);
+		rb_erase(&block->e_node, &part->ae_blocks);
+		block_insert(ctxt, block);
+	}
+	part->ae_blockcount = 0;
+
+	list_splice(&part->ae_dirs, ctxt->ae_dirs.prev);
+	INIT_LIST_HEAD(&part->ae_dirs);
+	ctxt->ae_dircount += part->ae_dircount;
+	part->ae_dircount = 0;
+
+	list_splice(&part->ae_chains, ctxt->ae_chains.prev);
+	INIT_LIST_HEAD(&part->ae_chains);
+	ctxt->ae_chaincount += part->ae_chaincount;
+	part->ae_chaincount = 0;
+
+	ctxt->ae_clusters += part->ae_clusters;
+	part->ae_clusters = 0;
+}
+
 struct add_ecc_iterate {
 	struct add_ecc_context *ic_ctxt;
 	struct ocfs2_dinode *ic_di;
@@ -537,6 +621,8 @@ out:
 	return ret;
 }
 
+/* The scan threads share one progress display */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static errcode_t inode_iterate(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 			       void *user_data)
@@ -612,7 +698,9 @@ static errcode_t inode_iterate(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 	}
 
 out:
+	pthread_mutex_lock(&progress_lock);
 	tools_progress_step(ctxt->ae_prog, 1);
+	pthread_mutex_unlock(&progress_lock);
 
 	return ret;
 }
@@ -621,6 +709,9 @@ static errcode_t find_blocks(ocfs2_filesys *fs, struct add_ecc_context *ctxt)
 {
 	errcode_t ret;
 	uint32_t free_clusters = 0;
+	int i, nparts = tunefs_nr_threads();
+	struct add_ecc_context parts[TUNEFS_MAX_THREADS];
+	void *user_data[TUNEFS_MAX_THREADS];
 
 	ctxt->ae_prog = tools_progress_start("Scanning filesystem",
 					     "scanning", 0);
@@ -629,7 +720,19 @@ static errcode_t find_blocks(ocfs2_filesys *fs, struct add_ecc_context *ctxt)
 		goto bail;
 	}
 
-	ret = tunefs_foreach_inode(fs, inode_iterate, ctxt);
+	for (i = 0; i < nparts; i++) {
+		init_add_ecc_context(&parts[i]);
+		parts[i].ae_prog = ctxt->ae_prog;
+		user_data[i] = &parts[i];
+	}
+
+	verbosef(VL_APP, "Scanning inodes with %d threads\n", nparts);
+	ret = tunefs_foreach_inode_parallel(fs, nparts, inode_iterate,
+					    user_data);
+
+	/* Merge even on error, so that empty_add_ecc_context() frees it all */
+	for (i = 0; i < nparts; i++)
+		merge_add_ecc_context(ctxt, &parts[i]);
 	if (ret)
 		goto bail;
 	tools_progress_stop(ctxt->ae_prog);
@@ -698,34 +801,209 @@ static errcode_t install_trailers(ocfs2_filesys *fs,
 	return ret;
 }
 
+/*
+ * Blocks are checksummed ECC_BATCH_BLOCKS at a time.  The threads each
+ * take a slice of the batch, and then the blocks that changed are
+ * written in sorted runs.
+ */
+#define ECC_BATCH_BLOCKS	8192
+
+struct ecc_batch {
+	ocfs2_filesys *b_fs;
+	struct block_to_ecc **b_blocks;
+	char *b_changed;
+	char *b_buf;
+	int b_count;
+};
+
+struct ecc_slice {
+	pthread_t s_thread;
+	struct ecc_batch *s_batch;
+	int s_start;
+	int s_end;
+	errcode_t s_ret;
+};
+
+static errcode_t prepare_ecc_block(struct ecc_batch *batch, int i)
+{
+	errcode_t ret;
+	ocfs2_filesys *fs = batch->b_fs;
+	struct block_to_ecc *block = batch->b_blocks[i];
+	char *buf = batch->b_buf + ((size_t)i * fs->fs_blocksize);
+	struct ocfs2_block_check *bc, old;
+
+	if ((block->e_blkno < OCFS2_SUPER_BLOCK_BLKNO) ||
+	    (block->e_blkno > fs->fs_blocks))
+		return OCFS2_ET_BAD_BLKNO;
+
+	memcpy(buf, block->e_buf, fs->fs_blocksize);
+	ret = block->e_prepare(fs, block, buf, &bc);
+	if (ret)
+		return ret;
+
+	old = *bc;
+	ocfs2_compute_meta_ecc(fs, buf, bc);
+	batch->b_changed[i] = !!memcmp(&old, bc, sizeof(old));
+
+	return 0;
+}
+
+static void *prepare_ecc_slice(void *arg)
+{
+	struct ecc_slice *slice = arg;
+	int i;
+
+	for (i = slice->s_start; i < slice->s_end; i++) {
+		slice->s_ret = prepare_ecc_block(slice->s_batch, i);
+		if (slice->s_ret)
+			break;
+	}
+
+	return NULL;
+}
+
+/* The calling thread does the first slice itself */
+static errcode_t prepare_ecc_batch(struct ecc_batch *batch, int nthreads)
+{
+	errcode_t ret = 0;
+	int i, per;
+	struct ecc_slice slices[TUNEFS_MAX_THREADS];
+	int started[TUNEFS_MAX_THREADS];
+
+	per = (batch->b_count + nthreads - 1) / nthreads;
+	for (i = 0; i < nthreads; i++) {
+		slices[i].s_batch = batch;
+		slices[i].s_start = ocfs2_min(i * per, batch->b_count);
+		slices[i].s_end = ocfs2_min(slices[i].s_start + per,
+					    batch->b_count);
+		slices[i].s_ret = 0;
+		started[i] = 0;
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		if (slices[i].s_start == slices[i].s_end)
+			break;
+		if (pthread_create(&slices[i].s_thread, NULL,
+				   prepare_ecc_slice, &slices[i])) {
+			/* Do it ourselves */
+			prepare_ecc_slice(&slices[i]);
+			continue;
+		}
+		started[i] = 1;
+	}
+
+	prepare_ecc_slice(&slices[0]);
+
+	for (i = 0; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(slices[i].s_thread, NULL);
+		if (!ret)
+			ret = slices[i].s_ret;
+	}
+
+	return ret;
+}
+
+/* Write the changed blocks, as many at a time as sit together on disk */
+static errcode_t write_ecc_batch(struct ecc_batch *batch,
+				 uint64_t *written)
+{
+	errcode_t ret = 0;
+	ocfs2_filesys *fs = batch->b_fs;
+	int i, start;
+
+	for (i = 0; i < batch->b_count; ) {
+		if (!batch->b_changed[i]) {
+			i++;
+			continue;
+		}
+
+		start = i++;
+		while ((i < batch->b_count) && batch->b_changed[i] &&
+		       (batch->b_blocks[i]->e_blkno ==
+			batch->b_blocks[i - 1]->e_blkno + 1))
+			i++;
+
+		verbosef(VL_DEBUG, "Writing blocks %"PRIu64" to %"PRIu64"\n",
+			 batch->b_blocks[start]->e_blkno,
+			 batch->b_blocks[i - 1]->e_blkno);
+		ret = io_write_block(fs->fs_io,
+				     batch->b_blocks[start]->e_blkno,
+				     i - start,
+				     batch->b_buf +
+				     ((size_t)start * fs->fs_blocksize));
+		if (ret)
+			break;
+
+		fs->fs_flags |= OCFS2_FLAG_CHANGED;
+		*written += i - start;
+	}
+
+	return ret;
+}
+
 static errcode_t write_ecc_blocks(ocfs2_filesys *fs,
 				  struct add_ecc_context *ctxt)
 {
 	errcode_t ret = 0;
 	struct rb_node *n;
-	struct block_to_ecc *block;
 	struct tools_progress *prog;
+	struct ecc_batch batch = {
+		.b_fs = fs,
+	};
+	int nthreads = tunefs_nr_threads();
+	uint64_t written = 0;
+
+	if (!(fs->fs_flags & OCFS2_FLAG_RW))
+		return OCFS2_ET_RO_FILESYS;
+
+	ret = ocfs2_malloc_blocks(fs->fs_io, ECC_BATCH_BLOCKS, &batch.b_buf);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(struct block_to_ecc *) *
+				    ECC_BATCH_BLOCKS, &batch.b_blocks);
+	if (!ret)
+		ret = ocfs2_malloc0(ECC_BATCH_BLOCKS, &batch.b_changed);
+	if (ret)
+		goto out;
 
 	prog = tools_progress_start("Writing blocks", "ECC",
 				    ctxt->ae_blockcount);
-	if (!prog)
-		return TUNEFS_ET_NO_MEMORY;
+	if (!prog) {
+		ret = TUNEFS_ET_NO_MEMORY;
+		goto out;
+	}
 
 	n = rb_first(&ctxt->ae_blocks);
 	while (n) {
-		block = rb_entry(n, struct block_to_ecc, e_node);
-		verbosef(VL_DEBUG, "Writing block %"PRIu64"\n",
-			 block->e_blkno);
+		batch.b_count = 0;
+		while (n && (batch.b_count < ECC_BATCH_BLOCKS)) {
+			batch.b_blocks[batch.b_count++] =
+				rb_entry(n, struct block_to_ecc, e_node);
+			n = rb_next(n);
+		}
 
-		tools_progress_step(prog, 1);
-		ret = block->e_write(fs, block);
+		ret = prepare_ecc_batch(&batch, nthreads);
+		if (!ret)
+			ret = write_ecc_batch(&batch, &written);
 		if (ret)
 			break;
 
-		n = rb_next(n);
+		tools_progress_step(prog, batch.b_count);
 	}
 	tools_progress_stop(prog);
 
+	verbosef(VL_APP,
+		 "Wrote %"PRIu64" of %"PRIu64" blocks; the rest already "
+		 "had ECC\n", written, ctxt->ae_blockcount);
+
+out:
+	if (batch.b_changed)
+		ocfs2_free(&batch.b_changed);
+	if (batch.b_blocks)
+		ocfs2_free(&batch.b_blocks);
+	if (batch.b_buf)
+		ocfs2_free(&batch.b_buf);
+
 	return ret;
 }
 
@@ -755,10 +1033,7 @@ static int enable_metaecc(ocfs2_filesys *fs, int flags)
 		goto out;
 	}
 
-	memset(&ctxt, 0, sizeof(ctxt));
-	INIT_LIST_HEAD(&ctxt.ae_dirs);
-	INIT_LIST_HEAD(&ctxt.ae_chains);
-	ctxt.ae_blocks = RB_ROOT;
+	init_add_ecc_context(&ctxt);
 	ret = find_blocks(fs, &ctxt);
 	if (ret) {
 		if (ret == OCFS2_ET_NO_SPACE)
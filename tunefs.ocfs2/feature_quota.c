@@ -132,9 +132,11 @@ static errcode_t create_quota_files(ocfs2_filesys *fs, int type,
 		return ret;
 	}
 	if (type == USRQUOTA)
-		ret = ocfs2_compute_quota_usage(fs, hash, NULL);
+		ret = ocfs2_compute_quota_usage(fs, hash, NULL,
+						tunefs_nr_threads());
 	else
-		ret = ocfs2_compute_quota_usage(fs, NULL, hash);
+		ret = ocfs2_compute_quota_usage(fs, NULL, hash,
+						tunefs_nr_threads());
 	if (ret) {
 		tcom_err(ret, "while scanning filesystem to gather "
 			 "quota usage");
@@ -33,6 +33,7 @@
 #include <limits.h>
 #include <getopt.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
@@ -41,6 +42,9 @@
 
 #define WHOAMI "tunefs.ocfs2"
 
+/* How much we let a write-back cache hold before it must flush */
+#define TUNEFS_WRITEBACK_BYTES	(64 * 1024 * 1024)
+
 
 /*
  * Keeps track of how ocfs2ne sees the filesystem.  This structure is
@@ -595,6 +599,122 @@ out:
 	return ret;
 }
 
+/* One partition of tunefs_foreach_inode_parallel() */
+struct tunefs_inode_part {
+	pthread_t ip_thread;
+	int ip_started;
+	ocfs2_filesys *ip_fs;
+	ocfs2_inode_scan *ip_scan;
+	errcode_t (*ip_func)(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+			     void *user_data);
+	void *ip_user_data;
+	int *ip_stop;		/* Shared; set when any partition fails */
+	errcode_t ip_ret;
+};
+
+static void *tunefs_inode_part_thread(void *arg)
+{
+	struct tunefs_inode_part *ip = arg;
+	errcode_t ret;
+	uint64_t blkno;
+	char *buf = NULL;
+	struct ocfs2_dinode *di;
+
+	ret = ocfs2_malloc_block(ip->ip_fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	di = (struct ocfs2_dinode *)buf;
+	while (!__atomic_load_n(ip->ip_stop, __ATOMIC_RELAXED)) {
+		ret = ocfs2_get_next_inode(ip->ip_scan, &blkno, buf);
+		if (ret) {
+			verbosef(VL_LIB, "%s while getting next inode\n",
+				 error_message(ret));
+			break;
+		}
+		if (blkno == 0)
+			break;
+
+		if (tunefs_validate_inode(ip->ip_fs, di))
+			continue;
+
+		ret = ip->ip_func(ip->ip_fs, di, ip->ip_user_data);
+		if (ret)
+			break;
+	}
+
+out:
+	if (buf)
+		ocfs2_free(&buf);
+	if (ret)
+		__atomic_store_n(ip->ip_stop, 1, __ATOMIC_RELAXED);
+	ip->ip_ret = ret;
+
+	return NULL;
+}
+
+int tunefs_nr_threads(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nr < 1)
+		return 1;
+	if (nr > TUNEFS_MAX_THREADS)
+		return TUNEFS_MAX_THREADS;
+	return nr;
+}
+
+errcode_t tunefs_foreach_inode_parallel(ocfs2_filesys *fs, int nparts,
+					errcode_t (*func)(ocfs2_filesys *fs,
+							  struct ocfs2_dinode *di,
+							  void *user_data),
+					void **user_data)
+{
+	errcode_t ret;
+	int i, stop = 0;
+	ocfs2_inode_scan *scans[TUNEFS_MAX_THREADS];
+	struct tunefs_inode_part parts[TUNEFS_MAX_THREADS], *ip;
+
+	if ((nparts < 1) || (nparts > TUNEFS_MAX_THREADS))
+		return TUNEFS_ET_INTERNAL_FAILURE;
+
+	ret = ocfs2_open_inode_scan_partitioned(fs, nparts, scans);
+	if (ret) {
+		verbosef(VL_LIB, "%s while opening inode scan\n",
+			 error_message(ret));
+		return ret;
+	}
+
+	memset(parts, 0, sizeof(parts));
+	for (i = 0; i < nparts; i++) {
+		ip = &parts[i];
+		ip->ip_fs = fs;
+		ip->ip_scan = scans[i];
+		ip->ip_func = func;
+		ip->ip_user_data = user_data[i];
+		ip->ip_stop = &stop;
+		if (pthread_create(&ip->ip_thread, NULL,
+				   tunefs_inode_part_thread, ip)) {
+			ret = TUNEFS_ET_NO_MEMORY;
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		ip->ip_started = 1;
+	}
+
+	for (i = 0; i < nparts; i++) {
+		ip = &parts[i];
+		if (ip->ip_started) {
+			pthread_join(ip->ip_thread, NULL);
+			if (!ret)
+				ret = ip->ip_ret;
+		}
+		ocfs2_close_inode_scan(scans[i]);
+	}
+
+	return ret;
+}
+
 /* A dirblock we have to add a trailer to */
 struct tunefs_trailer_dirblock {
 	struct list_head db_list;
@@ -1863,7 +1983,7 @@ static void tunefs_close_online_descriptor(ocfs2_filesys *fs)
 }
 
 /*
- * If io_init_cache fails, we will go do the work without the
+ * If io_init_cache_engine fails, we will go do the work without the
  * io_cache, so there is no check for failure here.
  */
 static void tunefs_init_cache(ocfs2_filesys *fs)
@@ -1910,7 +2030,12 @@ static void tunefs_init_cache(ocfs2_filesys *fs)
 		verbosef(VL_LIB,
 			 "Asking for %"PRIu64" blocks of I/O cache\n",
 			 blocks_wanted);
-		err = io_init_cache(fs->fs_io, blocks_wanted);
+		/*
+		 * Some operations scan on several threads, so use the
+		 * engine built for concurrent readers.
+		 */
+		err = io_init_cache_engine(fs->fs_io, blocks_wanted,
+					   IO_CACHE_ENGINE_HASH);
 		if (!err) {
 			/*
 			 * We want to pin our cache; there's no point in
@@ -1934,6 +2059,25 @@ static void tunefs_init_cache(ocfs2_filesys *fs)
 
 		blocks_wanted >>= 1;
 	}
+
+	/*
+	 * Conversions write a great many single blocks, and usually
+	 * no two in a row.  A write-back cache lets them go to disk
+	 * sorted and merged.  The superblock writes in
+	 * tunefs_set_in_progress() and tunefs_clear_in_progress() are
+	 * barriers, so the in-progress flags still bracket the work on
+	 * disk.  Without the memory we just write through.
+	 */
+	if (io_get_cache_size(fs->fs_io) &&
+	    (tp->tp_open_flags & TUNEFS_FLAG_RW)) {
+		blocks_wanted = ocfs2_blocks_in_bytes(fs,
+						      TUNEFS_WRITEBACK_BYTES);
+		if (blocks_wanted > fs->fs_blocks)
+			blocks_wanted = fs->fs_blocks;
+		err = io_set_writeback(fs->fs_io, blocks_wanted);
+		verbosef(VL_LIB, "%s %"PRIu64" blocks of write-back\n",
+			 err ? "Could not get" : "Got", blocks_wanted);
+	}
 }
 
 static errcode_t tunefs_add_fs(ocfs2_filesys *fs, int flags)
@@ -2125,6 +2269,12 @@ errcode_t tunefs_close(ocfs2_filesys *fs)
 		verbosef(VL_LIB, "Closing device \"%s\"\n", fs->fs_devname);
 		tunefs_close_online_descriptor(fs);
 		err = tunefs_close_bitmap_check(fs);
+
+		/* Nothing may be left in the cache once we unlock */
+		tmp = io_flush(fs->fs_io);
+		if (!err)
+			err = tmp;
+
 		tmp = tunefs_unlock_filesystem(fs);
 		if (!err)
 			err = tmp;
@@ -257,6 +257,22 @@ errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
 						 void *user_data),
 			       void *user_data);
 
+/*
+ * The same, with the inode allocator chains split across nparts
+ * threads.  Thread i passes user_data[i] to func(), so each thread
+ * works on its own state.  The walk stops at the first error.
+ * tunefs_nr_threads() is how many threads are worth using, no more
+ * than TUNEFS_MAX_THREADS.
+ */
+#define TUNEFS_MAX_THREADS	16
+
+int tunefs_nr_threads(void);
+errcode_t tunefs_foreach_inode_parallel(ocfs2_filesys *fs, int nparts,
+					errcode_t (*func)(ocfs2_filesys *fs,
+							  struct ocfs2_dinode *di,
+							  void *user_data),
+					void **user_data);
+
 /* Functions used by the core program sources */
 
 /* Open and cloee a filesystem */